@@ -0,0 +1,55 @@
+/*
+  Interface to one compiled copy of the PCBConveyor2 firmware.
+
+  firmware_instance.cpp is compiled once per instance with a different
+  SIM_INSTANCE, which puts that copy's globals in a namespace of its own.
+  The constants the simulator needs from config.h are copied out here so
+  the rest of the simulator doesn't have to include the firmware.
+*/
+#ifndef CONVEYOR_FIRMWARE_H
+#define CONVEYOR_FIRMWARE_H
+
+#include <stdint.h>
+
+#define SIM_MAX_CONVEYORS   4     // Must match SIM_INSTANCES in the Makefile
+
+struct ConveyorFirmware
+{
+  void     (*setup)();
+  void     (*loop)();
+  uint16_t (*state)();            // Current state machine state
+
+  uint8_t  source_address;        // J1939 addresses from config.h
+  uint8_t  upstream_address;
+  uint8_t  downstream_address;
+
+  uint8_t  limit_pin;
+  uint8_t  ready_in_left_pin;
+  uint8_t  ready_in_right_pin;
+  uint8_t  ready_out_left_pin;
+  uint8_t  ready_out_right_pin;
+  uint8_t  ready_active_level;
+  uint8_t  first_sensor_address;
+
+  uint8_t  estop_pin;
+  uint8_t  estop_active_level;
+  uint32_t estop_response_limit_us;
+  uint16_t estop_state;           // STATE_ESTOP
+
+  float    steps_per_mm;
+  // The firmware's runtime parameters, so changes made with M510 are seen
+  const uint16_t* home_switch_offset;    // mm
+  const uint16_t* limit_backoff;         // steps
+  const uint16_t* minimum_speed;         // mm/min
+  const uint16_t* maximum_speed;
+  const uint16_t* pwm_at_min;
+  const uint16_t* pwm_at_max;
+  const uint16_t* trigger_height;        // mm
+};
+
+ConveyorFirmware simConveyorFirmware0();
+ConveyorFirmware simConveyorFirmware1();
+ConveyorFirmware simConveyorFirmware2();
+ConveyorFirmware simConveyorFirmware3();
+
+#endif
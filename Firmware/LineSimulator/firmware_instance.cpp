@@ -0,0 +1,70 @@
+/*
+  One copy of the PCBConveyor2 firmware, built for the host.
+
+  Compiled once for each SIM_INSTANCE. All of the sketch's globals end up in
+  namespace conveyor_firmware_<n>, so the copies don't share any state. The
+  Arduino shims are included first, at global scope, so the sketch's own
+  library includes find them already defined.
+*/
+#include "Arduino.h"
+#include "Stepper.h"
+#include "WiFi.h"
+#include "PubSubClient.h"
+#include "ESPmDNS.h"
+#include "WiFiUdp.h"
+#include "ArduinoOTA.h"
+#include "CAN.h"
+#include "Adafruit_VL53L0X.h"
+#include "Adafruit_MCP23X17.h"
+#include "Preferences.h"
+#include "ConveyorCore.h"
+
+#include "conveyor_firmware.h"
+
+#ifndef SIM_INSTANCE
+#error "SIM_INSTANCE must be defined"
+#endif
+
+#define SIM_CAT2(a, b)  a##b
+#define SIM_CAT(a, b)   SIM_CAT2(a, b)
+#define SIM_NAMESPACE   SIM_CAT(conveyor_firmware_, SIM_INSTANCE)
+#define SIM_FACTORY     SIM_CAT(simConveyorFirmware, SIM_INSTANCE)
+
+namespace SIM_NAMESPACE {
+#include "../PCBConveyor2/PCBConveyor2.ino"
+}
+
+ConveyorFirmware SIM_FACTORY()
+{
+  ConveyorFirmware firmware;
+  firmware.setup                = SIM_NAMESPACE::setup;
+  firmware.loop                 = SIM_NAMESPACE::loop;
+  firmware.state                = []() -> uint16_t { return SIM_NAMESPACE::g_state; };
+
+  firmware.source_address       = J1939_SOURCE_ADDRESS;
+  firmware.upstream_address     = J1939_UPSTREAM_ADDRESS;
+  firmware.downstream_address   = J1939_DOWNSTREAM_ADDRESS;
+
+  firmware.limit_pin            = LIMIT_SENSOR_Y_PIN;
+  firmware.ready_in_left_pin    = READY_IN_LEFT_PIN;
+  firmware.ready_in_right_pin   = READY_IN_RIGHT_PIN;
+  firmware.ready_out_left_pin   = READY_OUT_LEFT_PIN;
+  firmware.ready_out_right_pin  = READY_OUT_RIGHT_PIN;
+  firmware.ready_active_level   = READY_ACTIVE_LEVEL;
+  firmware.first_sensor_address = PCB_SENSOR_L_ADDR;
+
+  firmware.estop_pin            = ESTOP_PIN;
+  firmware.estop_active_level   = ESTOP_ACTIVE_LEVEL;
+  firmware.estop_response_limit_us = ESTOP_RESPONSE_LIMIT_US;
+  firmware.estop_state          = STATE_ESTOP;
+
+  firmware.steps_per_mm         = Y_STEPS_PER_METRE / 1000.0f;   // The real rail, whatever P21 says
+  firmware.home_switch_offset   = &SIM_NAMESPACE::g_params.home_switch_offset;
+  firmware.limit_backoff        = &SIM_NAMESPACE::g_params.limit_backoff;
+  firmware.minimum_speed        = &SIM_NAMESPACE::g_params.minimum_speed;
+  firmware.maximum_speed        = &SIM_NAMESPACE::g_params.maximum_speed;
+  firmware.pwm_at_min           = &SIM_NAMESPACE::g_params.pwm_at_min;
+  firmware.pwm_at_max           = &SIM_NAMESPACE::g_params.pwm_at_max;
+  firmware.trigger_height       = &SIM_NAMESPACE::g_params.trigger_height;
+  return firmware;
+}
@@ -0,0 +1,1466 @@
+/*
+  PCB production line simulator
+
+  Runs several copies of the PCBConveyor2 firmware in one process, wired up
+  as a production line with simple stand-in machines, and reports how the
+  line performs. Use it to try out speeds, dwell times and modes before
+  changing the real line.
+
+  Each conveyor runs the real firmware against simulated hardware: belt
+  motor, width axis, time of flight sensors, ready-in / ready-out and CAN.
+  Every firmware copy has its own clock, which only advances as fast as its
+  code would take on the ESP32 (sensor timing budgets, stepper moves,
+  delays), so a slow loop() shows up as a slow conveyor.
+
+  The stand-in machines are:
+    source   Produces a board every <interval> seconds and passes it on
+    pnp      Takes a board in, works on it for <cycle> seconds, passes it on
+    reflow   Takes a board at most every <cycle> seconds, belt always running
+
+  CAN frames between neighbours are routed as though each pair of machines
+  had a gateway between them: a conveyor's frames to J1939_DOWNSTREAM_ADDRESS
+  arrive at the next machine appearing to come from its
+  J1939_UPSTREAM_ADDRESS, and so on. That way every copy of the firmware can
+  keep the addresses from config.h.
+
+  On Linux the bus can also be mirrored to a SocketCAN interface, eg vcan0,
+  where each machine appears at address 0x90 + its position in the line.
+  Frames sent to one of those addresses from outside are delivered to that
+  conveyor, so commands can be injected with cansend.
+
+  Usage:
+    linesim [options]
+
+    --line "<spec>"          Machines from upstream to downstream, eg
+                             "source:interval=30 conveyor:mode=M56,speed=1500
+                              pnp:cycle=25 conveyor:mode=M56 reflow:cycle=40"
+    --duration <s>           Simulated time. Default 3600
+    --board-length <mm>      Default 160
+    --link smema|can|both    Handshaking between machines. Default both
+    --command <s>:<n>:<gcode> Send G-code to machine n at time s
+    --estop <s>:<n>:<source> Emergency stop conveyor n at time s, from its
+                             e-stop input, CAN, M112 on serial, M112 on
+                             serial right behind a G0, or M112 on MQTT.
+                             Reports the time until the outputs were off,
+                             and exits with 3 if a stop didn't latch with
+                             everything off, an input or CAN stop was slower
+                             than ESTOP_RESPONSE_LIMIT_US, or a serial stop
+                             slower than SIM_SERIAL_ESTOP_LIMIT_US
+    --vcan <interface>       Mirror the bus to a SocketCAN interface
+    --verbose                Show firmware serial output and board events
+
+  Machine options (key=value, separated by commas):
+    conveyor  mode=M55|M56|M57|M60|M61|none, speed=<mm/min>, dwell=<s>,
+              spacing=<mm>, home=0|1, length=<mm>, backlash=<steps>
+    source    interval=<s>, count=<boards>, speed=<mm/min>, length=<mm>
+    pnp       cycle=<s>, speed=<mm/min>, length=<mm>
+    reflow    cycle=<s>, speed=<mm/min>, length=<mm>
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#endif
+
+#include "conveyor_firmware.h"
+#include "sim_hardware.h"
+
+/*--------------------------- Constants -------------------------------------*/
+// Must match can_comms.h
+#define J1939_PGN_PROPRIETARY_A2   0x1EF00
+#define J1939_PRIORITY_DEFAULT     6
+#define CAN_CMD_READY_TO_RECEIVE   0x10
+#define CAN_CMD_BOARD_AVAILABLE    0x11
+#define CAN_CMD_BOARD_TRANSFERRED  0x12
+#define CAN_CMD_EMERGENCY_STOP     0x06
+#define PARAMETER_ESTOP_INPUT      18       // Must match parameters.h
+
+#define SIM_TICK_MS                   1     // Physics step
+#define SIM_LOOP_OVERHEAD_US        200     // loop() time not covered by modelled calls
+#define SIM_CAN_READY_REFRESH_MS    500     // How often stand-ins repeat ready-to-receive
+#define SIM_CAN_READY_TIMEOUT_MS   1500     // Same as HANDOFF_TIMEOUT
+#define SIM_LINE_BASE_ADDRESS      0x90     // Address of machine 0 on the mirrored bus
+#define SIM_SENSOR_INSET_MM          30     // Entrance and exit sensors from the belt ends
+#define SIM_RANGE_EMPTY_MM          120     // Reading with nothing over the sensor
+#define SIM_START_WIDTH_MM          200     // Width axis position at power on
+#define SIM_SERIAL_ESTOP_LIMIT_US 100000     // M112 on serial to outputs off. Polled, but not held up
+
+enum link_mode_t { LINK_SMEMA, LINK_CAN, LINK_BOTH };
+
+enum activity_t { ACTIVITY_BUSY, ACTIVITY_STARVED, ACTIVITY_BLOCKED, ACTIVITY_WAITING, ACTIVITY_COUNT };
+
+const char* const g_activity_names[ACTIVITY_COUNT] = { "busy", "starved", "blocked", "waiting" };
+
+/*--------------------------- Line ------------------------------------------*/
+struct Board
+{
+  uint32_t id;
+  double   lead;                 // Downstream edge, mm from the start of the line
+  double   length;
+  uint64_t created_ms;
+};
+
+class Machine;
+
+struct Link
+{
+  uint64_t pending_since_ms = 0;  // Board waiting and downstream ready since this time
+  bool     pending          = false;
+  uint32_t transfers        = 0;
+  uint32_t timed_transfers  = 0;
+  uint64_t latency_total_ms = 0;
+  uint64_t latency_max_ms   = 0;
+};
+
+struct Line
+{
+  std::vector<Machine*> machines;
+  std::vector<Link>     links;       // links[i] joins machines[i] and machines[i + 1]
+  std::vector<Board>    boards;
+  uint64_t now_ms           = 0;
+  link_mode_t link_mode     = LINK_BOTH;
+  double   board_length     = 160;
+  uint32_t next_board_id    = 1;
+  uint32_t boards_out       = 0;
+  uint64_t lead_time_total_ms = 0;
+  uint64_t first_out_ms     = 0;
+  uint64_t last_out_ms      = 0;
+  uint32_t collisions       = 0;
+  uint32_t can_frames       = 0;
+  bool     verbose          = false;
+  int      vcan_socket      = -1;
+};
+
+Line g_line;
+
+void lineEvent(const char* name, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void lineEvent(const char* name, const char* format, ...)
+{
+  if (!g_line.verbose)
+  {
+    return;
+  }
+  char text[200];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  printf("%10.3f %-12s %s\n", g_line.now_ms / 1000.0, name, text);
+}
+
+uint32_t j1939Id(uint32_t pgn, uint8_t destination_address, uint8_t source_address)
+{
+  uint32_t id = ((uint32_t)J1939_PRIORITY_DEFAULT << 26) | ((pgn & 0x3FFFF) << 8) | source_address;
+  if (((pgn >> 8) & 0xFF) < 240)
+  {
+    id = (id & ~0xFF00UL) | ((uint32_t)destination_address << 8);
+  }
+  return id;
+}
+
+void mirrorCanFrame(const SimCanFrame &frame, int from_index, int to_index)
+{
+  g_line.can_frames++;
+#ifdef __linux__
+  if (g_line.vcan_socket < 0)
+  {
+    return;
+  }
+  struct can_frame out;
+  memset(&out, 0, sizeof(out));
+  uint32_t id = (frame.id & ~0xFFUL) | (uint8_t)(SIM_LINE_BASE_ADDRESS + from_index);
+  if (((id >> 16) & 0xFF) < 240)
+  {
+    uint8_t destination = to_index < 0 ? 0xFF : (uint8_t)(SIM_LINE_BASE_ADDRESS + to_index);
+    id = (id & ~0xFF00UL) | ((uint32_t)destination << 8);
+  }
+  out.can_id  = id | CAN_EFF_FLAG;
+  out.can_dlc = frame.dlc;
+  memcpy(out.data, frame.data, frame.dlc);
+  if (write(g_line.vcan_socket, &out, sizeof(out)) < 0)
+  {
+    perror("vcan write");
+  }
+#endif
+}
+
+/*--------------------------- Machines --------------------------------------*/
+class Machine
+{
+  public:
+    std::string name;
+    std::string kind;
+    int      index   = 0;
+    double   start   = 0;               // mm from the start of the line
+    double   length  = 0;
+    double   speed   = 2000;            // Belt speed when running, mm/min
+    uint32_t boards_in  = 0;
+    uint32_t boards_out = 0;
+    uint64_t activity_ms[ACTIVITY_COUNT] = {};
+
+    virtual ~Machine() {}
+
+    double end() const { return start + length; }
+    Machine* upstream()   const { return index > 0 ? g_line.machines[index - 1] : nullptr; }
+    Machine* downstream() const { return index + 1 < (int)g_line.machines.size() ? g_line.machines[index + 1] : nullptr; }
+
+    // Belt speed in mm/s, positive towards the end of the line
+    virtual double beltSpeed() = 0;
+    // Actually able to take a board now
+    virtual bool readyToReceive() = 0;
+    // Ready as signalled to the upstream machine over the enabled links
+    virtual bool readySignalled() { return readyToReceive(); }
+    // Holding a finished board for the next machine
+    virtual bool boardWaiting() = 0;
+    virtual activity_t activity() = 0;
+    // Move the machine's own logic on to g_line.now_ms
+    virtual void step() {}
+    virtual void boardEntered(Board &board) {}
+    virtual void boardLeft(Board &board) {}
+    // A CAN frame from a neighbour
+    virtual void receiveCan(const SimCanFrame &frame, bool from_upstream) {}
+    virtual void configure(const std::string &key, double value) {}
+    virtual void begin() {}
+
+    bool downstreamReady()
+    {
+      Machine* next = downstream();
+      return next ? next->readySignalled() : true;
+    }
+
+    // Number of boards at least partly on this machine
+    int boardsOn()
+    {
+      int count = 0;
+      for (const Board &board : g_line.boards)
+      {
+        if (board.lead > start && board.lead - board.length < end())
+        {
+          count++;
+        }
+      }
+      return count;
+    }
+
+    Board* boardOn()
+    {
+      for (Board &board : g_line.boards)
+      {
+        if (board.lead > start && board.lead - board.length < end())
+        {
+          return &board;
+        }
+      }
+      return nullptr;
+    }
+};
+
+/*
+  Stand-in machines tell neighbouring conveyors about their state over CAN
+  the same way a conveyor would.
+*/
+class StandInMachine : public Machine
+{
+  public:
+    bool     m_can_ready_sent    = false;
+    uint64_t m_can_ready_sent_ms = 0;
+    bool     m_can_ready_seen    = false;   // Downstream conveyor's ready-to-receive over CAN
+    uint64_t m_can_ready_seen_ms = 0;
+
+    bool canEnabled() { return LINK_SMEMA != g_line.link_mode; }
+
+    void sendToNeighbour(Machine* neighbour, bool neighbour_is_downstream, const uint8_t* data, uint8_t length);
+
+    void sendHandoff(uint8_t command, uint32_t board_id, uint16_t length_mm)
+    {
+      uint8_t data[7] = { command, (uint8_t)board_id, (uint8_t)(board_id >> 8), (uint8_t)(board_id >> 16),
+                          (uint8_t)(board_id >> 24), (uint8_t)length_mm, (uint8_t)(length_mm >> 8) };
+      sendToNeighbour(downstream(), true, data, 7);
+    }
+
+    void refreshReadyToReceive()
+    {
+      bool ready = readyToReceive();
+      if (ready != m_can_ready_sent || g_line.now_ms - m_can_ready_sent_ms >= SIM_CAN_READY_REFRESH_MS)
+      {
+        uint8_t data[2] = { CAN_CMD_READY_TO_RECEIVE, ready };
+        sendToNeighbour(upstream(), false, data, 2);
+        m_can_ready_sent    = ready;
+        m_can_ready_sent_ms = g_line.now_ms;
+      }
+    }
+
+    void receiveCan(const SimCanFrame &frame, bool from_upstream) override
+    {
+      if (!from_upstream && frame.dlc >= 2 && CAN_CMD_READY_TO_RECEIVE == frame.data[0])
+      {
+        m_can_ready_seen    = frame.data[1];
+        m_can_ready_seen_ms = g_line.now_ms;
+      }
+    }
+
+    // Ready-to-receive from the downstream conveyor, if it sent one recently
+    bool canReadyFromDownstream()
+    {
+      return m_can_ready_seen && g_line.now_ms - m_can_ready_seen_ms <= SIM_CAN_READY_TIMEOUT_MS;
+    }
+};
+
+class SourceMachine : public StandInMachine
+{
+  public:
+    enum { EMPTY, HOLDING, EJECTING } m_state = EMPTY;
+    double   m_interval_s   = 30;
+    int      m_count        = -1;      // Boards to make, -1 for no limit
+    int      m_made         = 0;
+    int      m_pending      = 0;
+    uint64_t m_next_ms      = 0;
+    uint32_t m_board_id     = 0;
+
+    SourceMachine() { kind = "source"; length = 300; }
+
+    void configure(const std::string &key, double value) override
+    {
+      if ("interval" == key) m_interval_s = value;
+      if ("count"    == key) m_count      = (int)value;
+      if ("speed"    == key) speed        = value;
+      if ("length"   == key) length       = value;
+    }
+
+    void begin() override
+    {
+      if (length < g_line.board_length + 10)
+      {
+        length = g_line.board_length + 10;
+      }
+    }
+
+    double beltSpeed() override      { return EJECTING == m_state ? speed / 60.0 : 0; }
+    bool   readyToReceive() override { return false; }
+    bool   boardWaiting() override   { return HOLDING == m_state || EJECTING == m_state; }
+
+    activity_t activity() override
+    {
+      switch (m_state)
+      {
+        case EMPTY:   return ACTIVITY_STARVED;
+        case HOLDING: return downstreamReady() ? ACTIVITY_WAITING : ACTIVITY_BLOCKED;
+        default:      return ACTIVITY_BUSY;
+      }
+    }
+
+    void step() override
+    {
+      while (g_line.now_ms >= m_next_ms && (m_count < 0 || m_made < m_count))
+      {
+        m_pending++;
+        m_made++;
+        m_next_ms += (uint64_t)(m_interval_s * 1000);
+      }
+
+      if (EMPTY == m_state && m_pending > 0)
+      {
+        Board board;
+        board.id         = g_line.next_board_id++;
+        board.length     = g_line.board_length;
+        board.lead       = end();
+        board.created_ms = g_line.now_ms;
+        g_line.boards.push_back(board);
+        m_board_id = board.id;
+        m_pending--;
+        m_state = HOLDING;
+        lineEvent(name.c_str(), "board %u ready", board.id);
+        if (canEnabled())
+        {
+          sendHandoff(CAN_CMD_BOARD_AVAILABLE, board.id, (uint16_t)board.length);
+        }
+      }
+
+      if (HOLDING == m_state && downstreamReady())
+      {
+        m_state = EJECTING;
+      }
+    }
+
+    void boardLeft(Board &board) override
+    {
+      if (EJECTING == m_state && board.id == m_board_id)
+      {
+        m_state = EMPTY;
+        if (canEnabled())
+        {
+          sendHandoff(CAN_CMD_BOARD_TRANSFERRED, board.id, 0);
+        }
+      }
+    }
+
+    bool readySignalled() override { return false; }
+};
+
+class PnpMachine : public StandInMachine
+{
+  public:
+    enum { EMPTY, INTAKE, PROCESSING, DONE, EJECTING } m_state = EMPTY;
+    double   m_cycle_s     = 25;
+    uint64_t m_done_ms     = 0;
+    uint32_t m_board_id    = 0;
+
+    PnpMachine() { kind = "pnp"; length = 400; }
+
+    void configure(const std::string &key, double value) override
+    {
+      if ("cycle"  == key) m_cycle_s = value;
+      if ("speed"  == key) speed     = value;
+      if ("length" == key) length    = value;
+    }
+
+    double beltSpeed() override
+    {
+      return (EMPTY == m_state || INTAKE == m_state || EJECTING == m_state) ? speed / 60.0 : 0;
+    }
+    bool readyToReceive() override { return EMPTY == m_state; }
+    bool boardWaiting() override   { return DONE == m_state || EJECTING == m_state; }
+
+    activity_t activity() override
+    {
+      switch (m_state)
+      {
+        case EMPTY: return ACTIVITY_STARVED;
+        case DONE:  return downstreamReady() ? ACTIVITY_WAITING : ACTIVITY_BLOCKED;
+        default:    return ACTIVITY_BUSY;
+      }
+    }
+
+    void boardEntered(Board &board) override
+    {
+      if (EMPTY == m_state)
+      {
+        m_state    = INTAKE;
+        m_board_id = board.id;
+      } else {
+        lineEvent(name.c_str(), "board %u arrived while not ready", board.id);
+      }
+    }
+
+    void boardLeft(Board &board) override
+    {
+      if (board.id == m_board_id)
+      {
+        m_state = EMPTY;
+        if (canEnabled())
+        {
+          sendHandoff(CAN_CMD_BOARD_TRANSFERRED, board.id, 0);
+        }
+      }
+    }
+
+    void step() override
+    {
+      Board* board = nullptr;
+      for (Board &b : g_line.boards)
+      {
+        if (b.id == m_board_id)
+        {
+          board = &b;
+        }
+      }
+
+      if (INTAKE == m_state && board && board->lead - board->length / 2 >= start + length / 2)
+      {
+        m_state   = PROCESSING;
+        m_done_ms = g_line.now_ms + (uint64_t)(m_cycle_s * 1000);
+      }
+      if (PROCESSING == m_state && g_line.now_ms >= m_done_ms)
+      {
+        m_state = DONE;
+        lineEvent(name.c_str(), "board %u done", m_board_id);
+        if (canEnabled() && board)
+        {
+          sendHandoff(CAN_CMD_BOARD_AVAILABLE, board->id, (uint16_t)board->length);
+        }
+      }
+      if (DONE == m_state && downstreamReady())
+      {
+        m_state = EJECTING;
+      }
+      if (canEnabled())
+      {
+        refreshReadyToReceive();
+      }
+    }
+
+};
+
+class ReflowMachine : public StandInMachine
+{
+  public:
+    double   m_cycle_s        = 40;
+    uint64_t m_last_entry_ms  = 0;
+    bool     m_entered_any    = false;
+
+    ReflowMachine() { kind = "reflow"; length = 2000; speed = 700; }
+
+    void configure(const std::string &key, double value) override
+    {
+      if ("cycle"  == key) m_cycle_s = value;
+      if ("speed"  == key) speed     = value;
+      if ("length" == key) length    = value;
+    }
+
+    double beltSpeed() override { return speed / 60.0; }
+
+    bool readyToReceive() override
+    {
+      if (m_entered_any && g_line.now_ms - m_last_entry_ms < (uint64_t)(m_cycle_s * 1000))
+      {
+        return false;
+      }
+      // The last board must be all the way in
+      for (const Board &board : g_line.boards)
+      {
+        if (board.lead > start && board.lead - board.length < start)
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool boardWaiting() override { return false; }
+
+    activity_t activity() override
+    {
+      return boardsOn() > 0 ? ACTIVITY_BUSY : ACTIVITY_STARVED;
+    }
+
+    void boardEntered(Board &board) override
+    {
+      if (!readyToReceive())
+      {
+        lineEvent(name.c_str(), "board %u arrived while not ready", board.id);
+      }
+      m_last_entry_ms = g_line.now_ms;
+      m_entered_any   = true;
+    }
+
+    void step() override
+    {
+      if (canEnabled())
+      {
+        refreshReadyToReceive();
+      }
+    }
+
+};
+
+/*
+  A conveyor running the PCBConveyor2 firmware
+*/
+class ConveyorMachine : public Machine
+{
+  public:
+    ConveyorFirmware  m_firmware;
+    ConveyorHardware  m_hardware;
+    std::vector<std::string> m_startup_commands;
+    std::string m_mode       = "M56";
+    double   m_dwell_s       = 5;
+    double   m_spacing_mm    = 50;       // Gap for M60, pitch for M61
+    bool     m_home          = false;
+    bool     m_started       = false;
+    bool     m_can_ready     = false;    // Last ready-to-receive this conveyor sent upstream
+    uint64_t m_can_ready_ms  = 0;
+    double   m_sensor_position[SIM_SENSOR_COUNT];
+
+    // Emergency stop test, see --estop
+    std::string m_estop_source;
+    uint64_t m_estop_us      = 0;
+    bool     m_estop_mqtt_sent = false;
+
+    ConveyorMachine(const ConveyorFirmware &firmware, int instance)
+      : m_firmware(firmware)
+    {
+      kind   = "conveyor";
+      length = 500;
+      speed  = 1500;
+      m_hardware.instance = instance;
+    }
+
+    void configure(const std::string &key, double value) override
+    {
+      if ("speed"  == key) speed     = value;
+      if ("dwell"  == key) m_dwell_s = value;
+      if ("spacing" == key) m_spacing_mm = value;
+      if ("home"   == key) m_home    = value != 0;
+      if ("length" == key) length    = value;
+      if ("backlash" == key) m_hardware.y_backlash = (int32_t)value;
+    }
+
+    void begin() override
+    {
+      m_hardware.name                 = name;
+      m_hardware.echo_serial          = g_line.verbose;
+      m_hardware.limit_pin            = m_firmware.limit_pin;
+      m_hardware.first_sensor_address = m_firmware.first_sensor_address;
+      m_hardware.gpio_in[m_firmware.estop_pin] = !m_firmware.estop_active_level;
+      double limit_width = *m_firmware.home_switch_offset + *m_firmware.limit_backoff / m_firmware.steps_per_mm;
+      m_hardware.y_limit_steps = (int32_t)((limit_width - SIM_START_WIDTH_MM) * m_firmware.steps_per_mm);
+
+      m_sensor_position[0] = SIM_SENSOR_INSET_MM;
+      m_sensor_position[1] = length / 2;
+      m_sensor_position[2] = length - SIM_SENSOR_INSET_MM;
+
+      // begin() runs again once the line is laid out
+      m_startup_commands.clear();
+      if (m_home)
+      {
+        m_startup_commands.push_back("G28");
+      }
+      char command[40];
+      if ("M55" == m_mode || "M56" == m_mode)
+      {
+        snprintf(command, sizeof(command), "%s S%d", m_mode.c_str(), (int)speed);
+        m_startup_commands.push_back(command);
+      } else if ("M57" == m_mode) {
+        snprintf(command, sizeof(command), "M57 S%d P%d", (int)speed, (int)m_dwell_s);
+        m_startup_commands.push_back(command);
+      } else if ("M60" == m_mode || "M61" == m_mode) {
+        snprintf(command, sizeof(command), "%s S%d P%d", m_mode.c_str(), (int)speed, (int)m_spacing_mm);
+        m_startup_commands.push_back(command);
+      }
+    }
+
+    /*
+      Stop the conveyor at /at_us/ on its own clock. The input and CAN stops
+      are delivered at exactly that time, whatever the firmware is doing, as
+      their interrupts would be. M112 on serial arrives then too but waits
+      to be read, and serial-queued sends a G0 in the same write, so the
+      M112 is behind a line that can't run until any move is over. MQTT is
+      only delivered between passes of loop().
+      @return false for an unknown source
+    */
+    bool scheduleEmergencyStop(const std::string &source, uint64_t at_us)
+    {
+      if ("input" == source)
+      {
+        char command[40];
+        snprintf(command, sizeof(command), "M510 P%d S1", PARAMETER_ESTOP_INPUT);
+        m_startup_commands.insert(m_startup_commands.begin(), command);
+        m_hardware.gpio_changes.push_back({at_us, m_firmware.estop_pin, m_firmware.estop_active_level});
+      } else if ("can" == source) {
+        SimCanArrival arrival;
+        arrival.at_us     = at_us;
+        arrival.frame.id  = j1939Id(J1939_PGN_PROPRIETARY_A2, m_firmware.source_address, m_firmware.upstream_address);
+        arrival.frame.dlc = 8;
+        memset(arrival.frame.data, 0xFF, sizeof(arrival.frame.data));
+        arrival.frame.data[0] = CAN_CMD_EMERGENCY_STOP;
+        m_hardware.can_arrivals.push_back(arrival);
+      } else if ("serial" == source) {
+        m_hardware.serial_arrivals.push_back({at_us, "M112\n"});
+      } else if ("serial-queued" == source) {
+        m_hardware.serial_arrivals.push_back({at_us, "G0 Y150\nM112\n"});
+      } else if ("mqtt" != source) {
+        return false;
+      }
+      m_estop_source = source;
+      m_estop_us     = at_us;
+      return true;
+    }
+
+    /*
+      Report on the stop, if there was one
+      @return false if it didn't latch with the outputs off, or an interrupt
+              level stop took longer than the firmware allows
+    */
+    bool reportEmergencyStop()
+    {
+      if (m_estop_source.empty())
+      {
+        return true;
+      }
+      bool latched = m_firmware.estop_state == m_firmware.state();
+      bool off     = UINT64_MAX != m_hardware.outputs_off_since;
+      uint64_t response_us = off && m_hardware.outputs_off_since > m_estop_us ? m_hardware.outputs_off_since - m_estop_us : 0;
+      bool interrupt_level = "input" == m_estop_source || "can" == m_estop_source;
+      bool serial          = 0 == m_estop_source.compare(0, 6, "serial");
+      uint64_t limit_us    = interrupt_level ? m_firmware.estop_response_limit_us
+                             : serial ? SIM_SERIAL_ESTOP_LIMIT_US : UINT64_MAX;
+      bool passed = latched && off && response_us <= limit_us;
+
+      printf("  %-14s %-13s %8.3fs ", name.c_str(), m_estop_source.c_str(), m_estop_us / 1e6);
+      if (off)
+      {
+        printf("%9llu us", (unsigned long long)response_us);
+      } else {
+        printf("%12s", "outputs on");
+      }
+      printf("  %-10s %s\n", latched ? "latched" : "not latched",
+             passed ? "ok" : "FAIL");
+      return passed;
+    }
+
+    void sendCommand(const std::string &command)
+    {
+      for (char c : command)
+      {
+        m_hardware.serial_in.push_back(c);
+      }
+      m_hardware.serial_in.push_back('\n');
+    }
+
+    double beltSpeed() override
+    {
+      uint32_t right = m_hardware.ledc_duty[0];
+      uint32_t left  = m_hardware.ledc_duty[1];
+      uint32_t duty  = right > left ? right : left;
+      if (0 == duty)
+      {
+        return 0;
+      }
+      if (*m_firmware.pwm_at_max == *m_firmware.pwm_at_min)
+      {
+        return (right > left ? 1 : -1) * *m_firmware.maximum_speed / 60.0;
+      }
+      double mm_per_min = *m_firmware.minimum_speed + ((double)duty - *m_firmware.pwm_at_min)
+                          * (*m_firmware.maximum_speed - *m_firmware.minimum_speed)
+                          / (*m_firmware.pwm_at_max - *m_firmware.pwm_at_min);
+      if (mm_per_min < 0)
+      {
+        mm_per_min = 0;
+      }
+      return (right > left ? 1 : -1) * mm_per_min / 60.0;
+    }
+
+    bool readyToReceive() override
+    {
+      return wiredReadyOut() || canReadyOut();
+    }
+
+    bool readySignalled() override
+    {
+      bool ready = false;
+      if (LINK_CAN != g_line.link_mode)
+      {
+        ready = ready || wiredReadyOut();
+      }
+      if (LINK_SMEMA != g_line.link_mode)
+      {
+        ready = ready || canReadyOut();
+      }
+      return ready;
+    }
+
+    bool wiredReadyOut()
+    {
+      return m_firmware.ready_active_level == m_hardware.expander_out[m_firmware.ready_out_left_pin];
+    }
+
+    bool canReadyOut()
+    {
+      return m_can_ready && g_line.now_ms - m_can_ready_ms <= SIM_CAN_READY_TIMEOUT_MS;
+    }
+
+    // A board entirely on the conveyor, waiting to be sent on. In M56 the
+    // firmware holds it wherever it stopped until ready-in, so the handoff
+    // latency includes the run to the exit.
+    bool boardWaiting() override
+    {
+      for (const Board &board : g_line.boards)
+      {
+        if (board.lead - board.length >= start && board.lead <= end())
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    activity_t activity() override
+    {
+      if (0 == boardsOn())
+      {
+        return ACTIVITY_STARVED;
+      }
+      if (0 != beltSpeed())
+      {
+        return ACTIVITY_BUSY;
+      }
+      return downstreamReady() ? ACTIVITY_WAITING : ACTIVITY_BLOCKED;
+    }
+
+    void receiveCan(const SimCanFrame &frame, bool from_upstream) override
+    {
+      SimCanFrame local = frame;
+      uint8_t source    = from_upstream ? m_firmware.upstream_address : m_firmware.downstream_address;
+      local.id = (frame.id & ~0xFFFFUL) | ((uint32_t)m_firmware.source_address << 8) | source;
+      m_hardware.can_rx.push_back(local);
+    }
+
+    void updateInputs()
+    {
+      // Time of flight sensors
+      for (int i = 0; i < SIM_SENSOR_COUNT; i++)
+      {
+        double position = start + m_sensor_position[i];
+        bool covered = false;
+        for (const Board &board : g_line.boards)
+        {
+          if (position <= board.lead && position >= board.lead - board.length)
+          {
+            covered = true;
+          }
+        }
+        m_hardware.sensor_range_mm[i] = covered ? *m_firmware.trigger_height / 2
+                                                : SIM_RANGE_EMPTY_MM;
+      }
+
+      // Wired ready-in. Left means the upstream machine has a board for us.
+      uint8_t active   = m_firmware.ready_active_level;
+      uint8_t inactive = !active;
+      bool wired = LINK_CAN != g_line.link_mode;
+      Machine* previous = upstream();
+      Machine* next     = downstream();
+      m_hardware.expander_in[m_firmware.ready_in_left_pin] =
+        (wired && previous && previous->boardWaiting()) ? active : inactive;
+      m_hardware.expander_in[m_firmware.ready_in_right_pin] =
+        (wired && (!next || next->readyToReceive())) ? active : inactive;
+    }
+
+    void routeCanFrames()
+    {
+      for (const SimCanFrame &frame : m_hardware.can_tx)
+      {
+        uint8_t pdu_format  = (frame.id >> 16) & 0xFF;
+        uint8_t destination = pdu_format < 240 ? (frame.id >> 8) & 0xFF : 0xFF;
+
+        if (destination == m_firmware.upstream_address && frame.dlc >= 2
+            && CAN_CMD_READY_TO_RECEIVE == frame.data[0])
+        {
+          m_can_ready    = frame.data[1];
+          m_can_ready_ms = g_line.now_ms;
+        }
+
+        Machine* neighbour = nullptr;
+        bool neighbour_is_downstream = false;
+        if (destination == m_firmware.downstream_address)
+        {
+          neighbour = downstream();
+          neighbour_is_downstream = true;
+        } else if (destination == m_firmware.upstream_address) {
+          neighbour = upstream();
+        }
+
+        mirrorCanFrame(frame, index, neighbour ? neighbour->index : -1);
+        if (neighbour && LINK_SMEMA != g_line.link_mode)
+        {
+          neighbour->receiveCan(frame, neighbour_is_downstream);
+        }
+      }
+      m_hardware.can_tx.clear();
+    }
+
+    /*
+      Run the firmware until its clock catches up with the line
+    */
+    void step() override
+    {
+      simSelectHardware(&m_hardware);
+      uint64_t line_us = g_line.now_ms * 1000;
+
+      if (!m_started)
+      {
+        m_hardware.now_us = line_us;
+        m_firmware.setup();
+        for (const std::string &command : m_startup_commands)
+        {
+          sendCommand(command);
+        }
+        m_started = true;
+        routeCanFrames();
+      }
+
+      while (m_hardware.now_us <= line_us)
+      {
+        updateInputs();
+        simDeliverCanFrames();
+        if ("mqtt" == m_estop_source && !m_estop_mqtt_sent && m_hardware.now_us >= m_estop_us && m_hardware.mqtt_callback)
+        {
+          char topic[]   = "cmd";
+          char payload[] = "M112";
+          m_hardware.mqtt_callback(topic, (uint8_t*)payload, strlen(payload));
+          m_estop_mqtt_sent = true;
+        }
+        m_firmware.loop();
+        simAdvanceClock(SIM_LOOP_OVERHEAD_US);
+        routeCanFrames();
+        if (m_hardware.restart_requested)
+        {
+          lineEvent(name.c_str(), "firmware requested a restart, ignored");
+          m_hardware.restart_requested = false;
+        }
+      }
+      simSelectHardware(nullptr);
+    }
+};
+
+void StandInMachine::sendToNeighbour(Machine* neighbour, bool neighbour_is_downstream, const uint8_t* data, uint8_t length)
+{
+  if (!neighbour)
+  {
+    return;
+  }
+  SimCanFrame frame;
+  frame.id  = j1939Id(J1939_PGN_PROPRIETARY_A2, 0xFF, 0);
+  frame.dlc = 8;
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    frame.data[i] = i < length ? data[i] : 0xFF;
+  }
+  mirrorCanFrame(frame, index, neighbour->index);
+  neighbour->receiveCan(frame, neighbour_is_downstream);
+}
+
+/*--------------------------- Physics ---------------------------------------*/
+Machine* machineAt(double position)
+{
+  for (Machine* machine : g_line.machines)
+  {
+    if (position >= machine->start && position < machine->end())
+    {
+      return machine;
+    }
+  }
+  return nullptr;
+}
+
+void recordLinkTransfer(int link_index)
+{
+  Link &link = g_line.links[link_index];
+  link.transfers++;
+  if (link.pending)
+  {
+    uint64_t latency = g_line.now_ms - link.pending_since_ms;
+    link.timed_transfers++;
+    link.latency_total_ms += latency;
+    if (latency > link.latency_max_ms)
+    {
+      link.latency_max_ms = latency;
+    }
+    link.pending = false;
+  }
+}
+
+/*
+  Move every board along by one tick. A board is carried by the fastest belt
+  it is touching, and can't push into the board in front of it.
+*/
+void moveBoards(double dt_s)
+{
+  std::sort(g_line.boards.begin(), g_line.boards.end(),
+            [](const Board &a, const Board &b) { return a.lead > b.lead; });
+
+  double line_end = g_line.machines.back()->end();
+
+  for (size_t i = 0; i < g_line.boards.size(); i++)
+  {
+    Board &board = g_line.boards[i];
+    double trail = board.lead - board.length;
+    double velocity = 0;
+    for (Machine* machine : g_line.machines)
+    {
+      if (board.lead > machine->start && trail < machine->end())
+      {
+        double belt = machine->beltSpeed();
+        if (fabs(belt) > fabs(velocity))
+        {
+          velocity = belt;
+        }
+      }
+    }
+
+    double new_lead = board.lead + velocity * dt_s;
+    if (i > 0)
+    {
+      double limit = g_line.boards[i - 1].lead - g_line.boards[i - 1].length;
+      if (new_lead >= limit && board.lead < limit)
+      {
+        g_line.collisions++;
+        lineEvent("line", "board %u ran into board %u", board.id, g_line.boards[i - 1].id);
+      }
+      if (new_lead > limit)
+      {
+        new_lead = limit > board.lead ? limit : board.lead;
+      }
+    }
+
+    // Edges crossing into and out of machines
+    for (Machine* machine : g_line.machines)
+    {
+      if (board.lead <= machine->start && new_lead > machine->start)
+      {
+        machine->boards_in++;
+        if (machine->index > 0)
+        {
+          recordLinkTransfer(machine->index - 1);
+        }
+        lineEvent(machine->name.c_str(), "board %u in", board.id);
+        machine->boardEntered(board);
+      }
+      double new_trail = new_lead - board.length;
+      if (trail < machine->end() && new_trail >= machine->end())
+      {
+        machine->boards_out++;
+        Board moved = board;
+        moved.lead = new_lead;
+        lineEvent(machine->name.c_str(), "board %u out", board.id);
+        machine->boardLeft(moved);
+      }
+    }
+    board.lead = new_lead;
+  }
+
+  // Boards that have left the last machine
+  for (size_t i = 0; i < g_line.boards.size();)
+  {
+    Board &board = g_line.boards[i];
+    if (board.lead - board.length >= line_end)
+    {
+      g_line.boards_out++;
+      g_line.lead_time_total_ms += g_line.now_ms - board.created_ms;
+      if (0 == g_line.first_out_ms)
+      {
+        g_line.first_out_ms = g_line.now_ms;
+      }
+      g_line.last_out_ms = g_line.now_ms;
+      g_line.boards.erase(g_line.boards.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void updateAccounting()
+{
+  for (Machine* machine : g_line.machines)
+  {
+    machine->activity_ms[machine->activity()] += SIM_TICK_MS;
+  }
+
+  for (size_t i = 0; i < g_line.links.size(); i++)
+  {
+    Link &link = g_line.links[i];
+    bool waiting = g_line.machines[i]->boardWaiting() && g_line.machines[i + 1]->readyToReceive();
+    if (waiting && !link.pending)
+    {
+      link.pending          = true;
+      link.pending_since_ms = g_line.now_ms;
+    }
+    if (!waiting && link.pending && !g_line.machines[i]->boardWaiting())
+    {
+      link.pending = false;
+    }
+  }
+}
+
+/*--------------------------- SocketCAN -------------------------------------*/
+bool openVcan(const char* interface)
+{
+#ifdef __linux__
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd < 0)
+  {
+    perror("socket");
+    return false;
+  }
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+  if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+  {
+    perror(interface);
+    close(fd);
+    return false;
+  }
+  struct sockaddr_can address;
+  memset(&address, 0, sizeof(address));
+  address.can_family  = AF_CAN;
+  address.can_ifindex = ifr.ifr_ifindex;
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+  {
+    perror("bind");
+    close(fd);
+    return false;
+  }
+  int flags = 1;
+  ioctl(fd, FIONBIO, &flags);
+  g_line.vcan_socket = fd;
+  return true;
+#else
+  fprintf(stderr, "SocketCAN is only available on Linux\n");
+  return false;
+#endif
+}
+
+/*
+  Deliver frames sent from outside to the conveyor at the matching line address
+*/
+void readVcan()
+{
+#ifdef __linux__
+  if (g_line.vcan_socket < 0)
+  {
+    return;
+  }
+  struct can_frame in;
+  while (read(g_line.vcan_socket, &in, sizeof(in)) == sizeof(in))
+  {
+    if (!(in.can_id & CAN_EFF_FLAG))
+    {
+      continue;
+    }
+    uint32_t id = in.can_id & CAN_EFF_MASK;
+    if (((id >> 16) & 0xFF) >= 240)
+    {
+      continue;
+    }
+    int target = (int)((id >> 8) & 0xFF) - SIM_LINE_BASE_ADDRESS;
+    if (target < 0 || target >= (int)g_line.machines.size())
+    {
+      continue;
+    }
+    ConveyorMachine* conveyor = dynamic_cast<ConveyorMachine*>(g_line.machines[target]);
+    if (!conveyor)
+    {
+      continue;
+    }
+    SimCanFrame frame;
+    frame.id  = (id & ~0xFF00UL) | ((uint32_t)conveyor->m_firmware.source_address << 8);
+    frame.dlc = in.can_dlc;
+    memcpy(frame.data, in.data, in.can_dlc);
+    conveyor->m_hardware.can_rx.push_back(frame);
+  }
+#endif
+}
+
+/*--------------------------- Set up and report -----------------------------*/
+struct ScheduledCommand
+{
+  uint64_t    at_ms;
+  int         machine;
+  std::string command;
+};
+
+struct ScheduledStop
+{
+  double      at_s;
+  int         machine;
+  std::string source;
+};
+
+typedef ConveyorFirmware (*firmware_factory_t)();
+
+const firmware_factory_t g_firmware_factories[SIM_MAX_CONVEYORS] = {
+  simConveyorFirmware0, simConveyorFirmware1, simConveyorFirmware2, simConveyorFirmware3
+};
+
+bool buildLine(const std::string &spec)
+{
+  int conveyors = 0;
+  size_t position = 0;
+  while (position < spec.size())
+  {
+    size_t token_end = spec.find_first_of(" \t\n", position);
+    if (token_end == std::string::npos)
+    {
+      token_end = spec.size();
+    }
+    std::string token = spec.substr(position, token_end - position);
+    position = token_end + 1;
+    if (token.empty())
+    {
+      continue;
+    }
+
+    std::string kind = token.substr(0, token.find(':'));
+    std::string options = token.find(':') == std::string::npos ? "" : token.substr(token.find(':') + 1);
+
+    Machine* machine = nullptr;
+    if ("conveyor" == kind)
+    {
+      if (conveyors >= SIM_MAX_CONVEYORS)
+      {
+        fprintf(stderr, "At most %d conveyors can be simulated\n", SIM_MAX_CONVEYORS);
+        return false;
+      }
+      machine = new ConveyorMachine(g_firmware_factories[conveyors](), conveyors);
+      conveyors++;
+    } else if ("source" == kind) {
+      machine = new SourceMachine();
+    } else if ("pnp" == kind) {
+      machine = new PnpMachine();
+    } else if ("reflow" == kind) {
+      machine = new ReflowMachine();
+    } else {
+      fprintf(stderr, "Unknown machine type '%s'\n", kind.c_str());
+      return false;
+    }
+
+    machine->index = g_line.machines.size();
+    char name[16];
+    snprintf(name, sizeof(name), "%d:%s", machine->index, kind.c_str());
+    machine->name = name;
+
+    size_t option_position = 0;
+    while (option_position < options.size())
+    {
+      size_t option_end = options.find(',', option_position);
+      if (option_end == std::string::npos)
+      {
+        option_end = options.size();
+      }
+      std::string option = options.substr(option_position, option_end - option_position);
+      option_position = option_end + 1;
+      size_t equals = option.find('=');
+      if (equals == std::string::npos)
+      {
+        fprintf(stderr, "Bad option '%s' for %s\n", option.c_str(), name);
+        return false;
+      }
+      std::string key   = option.substr(0, equals);
+      std::string value = option.substr(equals + 1);
+      ConveyorMachine* conveyor = dynamic_cast<ConveyorMachine*>(machine);
+      if (conveyor && "mode" == key)
+      {
+        conveyor->m_mode = value;
+      } else {
+        machine->configure(key, atof(value.c_str()));
+      }
+    }
+    g_line.machines.push_back(machine);
+  }
+
+  if (g_line.machines.empty())
+  {
+    fprintf(stderr, "The line is empty\n");
+    return false;
+  }
+
+  double start = 0;
+  for (Machine* machine : g_line.machines)
+  {
+    machine->begin();
+    machine->start = start;
+    start += machine->length;
+  }
+  // Sensor positions depend on the final length
+  for (Machine* machine : g_line.machines)
+  {
+    machine->begin();
+  }
+  g_line.links.resize(g_line.machines.size() - 1);
+  return true;
+}
+
+void printReport(uint64_t duration_ms)
+{
+  double hours = duration_ms / 3600000.0;
+  printf("\nLine: %llu s simulated, board length %.0f mm, links %s\n",
+         (unsigned long long)(duration_ms / 1000), g_line.board_length,
+         LINK_SMEMA == g_line.link_mode ? "SMEMA" : (LINK_CAN == g_line.link_mode ? "CAN" : "SMEMA + CAN"));
+  printf("  Boards out:        %u\n", g_line.boards_out);
+  printf("  Throughput:        %.1f boards/hour\n", hours > 0 ? g_line.boards_out / hours : 0);
+  if (g_line.boards_out > 1)
+  {
+    double steady_hours = (g_line.last_out_ms - g_line.first_out_ms) / 3600000.0;
+    printf("  Steady state:      %.1f boards/hour after the first board\n",
+           steady_hours > 0 ? (g_line.boards_out - 1) / steady_hours : 0);
+  }
+  if (g_line.boards_out > 0)
+  {
+    printf("  Mean lead time:    %.1f s\n", g_line.lead_time_total_ms / 1000.0 / g_line.boards_out);
+  }
+  printf("  Collisions:        %u\n", g_line.collisions);
+  printf("  CAN frames:        %u\n", g_line.can_frames);
+
+  printf("\n  %-14s %6s %6s %8s %8s %8s %8s\n", "Machine", "In", "Out", "Busy", "Starved", "Blocked", "Waiting");
+  for (Machine* machine : g_line.machines)
+  {
+    printf("  %-14s %6u %6u", machine->name.c_str(), machine->boards_in, machine->boards_out);
+    for (int i = 0; i < ACTIVITY_COUNT; i++)
+    {
+      printf(" %7.1f%%", duration_ms ? 100.0 * machine->activity_ms[i] / duration_ms : 0);
+    }
+    printf("\n");
+  }
+  for (Machine* machine : g_line.machines)
+  {
+    // After homing the slack is taken up going narrower, so that's where the rail should rest
+    ConveyorMachine* conveyor = dynamic_cast<ConveyorMachine*>(machine);
+    if (conveyor && conveyor->m_hardware.y_backlash > 0)
+    {
+      printf("  %-14s rail resting %d steps out, %d steps of backlash\n", machine->name.c_str(),
+             conveyor->m_hardware.y_steps - conveyor->m_hardware.y_rail, conveyor->m_hardware.y_backlash);
+    }
+  }
+
+  printf("\n  %-24s %9s %12s %12s\n", "Handoff", "Transfers", "Mean latency", "Max latency");
+  for (size_t i = 0; i < g_line.links.size(); i++)
+  {
+    const Link &link = g_line.links[i];
+    char name[40];
+    snprintf(name, sizeof(name), "%s -> %s", g_line.machines[i]->name.c_str(), g_line.machines[i + 1]->name.c_str());
+    if (link.timed_transfers > 0)
+    {
+      printf("  %-24s %9u %11.2fs %11.2fs\n", name, link.transfers,
+             link.latency_total_ms / 1000.0 / link.timed_transfers, link.latency_max_ms / 1000.0);
+    } else {
+      printf("  %-24s %9u %12s %12s\n", name, link.transfers, "-", "-");
+    }
+  }
+  printf("\n  Waiting: holding a board for a machine that is ready for it.\n");
+  printf("  Handoff latency: from that point until the board reaches the next machine.\n");
+}
+
+void printUsage()
+{
+  printf("Usage: linesim [--line \"<spec>\"] [--duration <s>] [--board-length <mm>]\n"
+         "               [--link smema|can|both] [--command <s>:<n>:<gcode>]...\n"
+         "               [--estop <s>:<n>:input|can|serial|serial-queued|mqtt]...\n"
+         "               [--vcan <interface>] [--verbose]\n"
+         "See the top of line_simulator.cpp for details.\n");
+}
+
+int main(int argc, char** argv)
+{
+  std::string spec = "source:interval=30 conveyor:mode=M56 pnp:cycle=25 conveyor:mode=M56 reflow:cycle=40";
+  double duration_s = 3600;
+  const char* vcan_interface = nullptr;
+  std::vector<ScheduledCommand> commands;
+  std::vector<ScheduledStop> stops;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if ("--line" == arg && has_value) {
+      spec = argv[++i];
+    } else if ("--duration" == arg && has_value) {
+      duration_s = atof(argv[++i]);
+    } else if ("--board-length" == arg && has_value) {
+      g_line.board_length = atof(argv[++i]);
+    } else if ("--link" == arg && has_value) {
+      std::string mode = argv[++i];
+      g_line.link_mode = "smema" == mode ? LINK_SMEMA : ("can" == mode ? LINK_CAN : LINK_BOTH);
+    } else if ("--command" == arg && has_value) {
+      std::string value = argv[++i];
+      size_t first  = value.find(':');
+      size_t second = value.find(':', first + 1);
+      if (first == std::string::npos || second == std::string::npos)
+      {
+        fprintf(stderr, "Bad --command '%s'\n", value.c_str());
+        return 1;
+      }
+      ScheduledCommand command;
+      command.at_ms   = (uint64_t)(atof(value.substr(0, first).c_str()) * 1000);
+      command.machine = atoi(value.substr(first + 1, second - first - 1).c_str());
+      command.command = value.substr(second + 1);
+      commands.push_back(command);
+    } else if ("--estop" == arg && has_value) {
+      std::string value = argv[++i];
+      size_t first  = value.find(':');
+      size_t second = value.find(':', first + 1);
+      if (first == std::string::npos || second == std::string::npos)
+      {
+        fprintf(stderr, "Bad --estop '%s'\n", value.c_str());
+        return 1;
+      }
+      ScheduledStop stop;
+      stop.at_s    = atof(value.substr(0, first).c_str());
+      stop.machine = atoi(value.substr(first + 1, second - first - 1).c_str());
+      stop.source  = value.substr(second + 1);
+      stops.push_back(stop);
+    } else if ("--vcan" == arg && has_value) {
+      vcan_interface = argv[++i];
+    } else if ("--verbose" == arg) {
+      g_line.verbose = true;
+    } else {
+      printUsage();
+      return "--help" == arg ? 0 : 1;
+    }
+  }
+
+  if (!buildLine(spec))
+  {
+    return 1;
+  }
+  if (vcan_interface && !openVcan(vcan_interface))
+  {
+    return 1;
+  }
+  std::vector<ConveyorMachine*> stopped;
+  for (const ScheduledStop &stop : stops)
+  {
+    ConveyorMachine* conveyor = stop.machine >= 0 && stop.machine < (int)g_line.machines.size()
+                                ? dynamic_cast<ConveyorMachine*>(g_line.machines[stop.machine]) : nullptr;
+    if (!conveyor || !conveyor->scheduleEmergencyStop(stop.source, (uint64_t)(stop.at_s * 1e6)))
+    {
+      fprintf(stderr, "Bad --estop: machine %d isn't a conveyor or '%s' isn't a source\n", stop.machine, stop.source.c_str());
+      return 1;
+    }
+    stopped.push_back(conveyor);
+  }
+
+  uint64_t duration_ms = (uint64_t)(duration_s * 1000);
+  for (g_line.now_ms = 0; g_line.now_ms < duration_ms; g_line.now_ms += SIM_TICK_MS)
+  {
+    for (ScheduledCommand &command : commands)
+    {
+      if (command.at_ms == g_line.now_ms && command.machine >= 0 && command.machine < (int)g_line.machines.size())
+      {
+        ConveyorMachine* conveyor = dynamic_cast<ConveyorMachine*>(g_line.machines[command.machine]);
+        if (conveyor)
+        {
+          lineEvent(conveyor->name.c_str(), "command '%s'", command.command.c_str());
+          conveyor->sendCommand(command.command);
+        }
+      }
+    }
+    readVcan();
+    for (Machine* machine : g_line.machines)
+    {
+      machine->step();
+    }
+    moveBoards(SIM_TICK_MS / 1000.0);
+    updateAccounting();
+  }
+
+  printReport(duration_ms);
+
+  if (stopped.empty())
+  {
+    return 0;
+  }
+  bool passed = true;
+  printf("\n  %-14s %-13s %9s %12s  %s\n", "Emergency stop", "Source", "At", "Response", "State");
+  for (ConveyorMachine* conveyor : stopped)
+  {
+    passed = conveyor->reportEmergencyStop() && passed;
+  }
+  printf("\n  Response: from the stop arriving until the belt and stepper outputs were all off.\n"
+         "  Input and CAN stops must be within the firmware's ESTOP_RESPONSE_LIMIT_US,\n"
+         "  serial within SIM_SERIAL_ESTOP_LIMIT_US.\n");
+  return passed ? 0 : 3;
+}
@@ -0,0 +1,19 @@
+/*
+  Host build of the Adafruit MCP23X17 I/O expander library. Pins are the
+  simulated XSHUT lines and ready-in / ready-out connections.
+*/
+#ifndef SHIM_ADAFRUIT_MCP23X17_H
+#define SHIM_ADAFRUIT_MCP23X17_H
+
+#include "Arduino.h"
+
+class Adafruit_MCP23X17
+{
+  public:
+    bool    begin_I2C(uint8_t i2c_addr = 0x20, TwoWire* wire = &Wire) { return true; }
+    void    pinMode(uint8_t pin, uint8_t mode) {}
+    uint8_t digitalRead(uint8_t pin);
+    void    digitalWrite(uint8_t pin, uint8_t value);
+};
+
+#endif
@@ -0,0 +1,62 @@
+/*
+  Host build of the Adafruit VL53L0X library. Readings come from the
+  simulated belt. A single measurement takes the sensor's timing budget;
+  in continuous mode a new one is ready every period, and checking for it
+  or reading it only costs the I2C transfer.
+*/
+#ifndef SHIM_ADAFRUIT_VL53L0X_H
+#define SHIM_ADAFRUIT_VL53L0X_H
+
+#include "Arduino.h"
+
+typedef int8_t VL53L0X_Error;
+#define VL53L0X_ERROR_NONE 0
+
+typedef struct
+{
+  uint32_t TimeStamp;
+  uint32_t MeasurementTimeUsec;
+  uint16_t RangeMilliMeter;
+  uint16_t RangeDMaxMilliMeter;
+  uint32_t SignalRateRtnMegaCps;
+  uint32_t AmbientRateRtnMegaCps;
+  uint16_t EffectiveSpadRtnCount;
+  uint8_t  ZoneId;
+  uint8_t  RangeFractionalPart;
+  uint8_t  RangeStatus;
+} VL53L0X_RangingMeasurementData_t;
+
+class Adafruit_VL53L0X
+{
+  public:
+    typedef enum {
+      VL53L0X_SENSE_DEFAULT = 0,
+      VL53L0X_SENSE_LONG_RANGE,
+      VL53L0X_SENSE_HIGH_SPEED,
+      VL53L0X_SENSE_HIGH_ACCURACY
+    } VL53L0X_Sense_config_t;
+
+    bool begin(uint8_t i2c_addr = 0x29, bool debug = false, TwoWire* i2c = &Wire,
+               VL53L0X_Sense_config_t vl_config = VL53L0X_SENSE_DEFAULT);
+    VL53L0X_Error rangingTest(VL53L0X_RangingMeasurementData_t* data, bool debug = false)
+    {
+      return getSingleRangingMeasurement(data, debug);
+    }
+    VL53L0X_Error getSingleRangingMeasurement(VL53L0X_RangingMeasurementData_t* data, bool debug = false);
+    bool     startRangeContinuous(uint16_t period_ms = 50);
+    void     stopRangeContinuous();
+    bool     isRangeComplete();
+    uint16_t readRangeResult();
+    uint8_t  readRangeStatus() { return m_range_status; }
+    bool     setMeasurementTimingBudgetMicroSeconds(uint32_t budget_us);
+    uint32_t getMeasurementTimingBudgetMicroSeconds();
+    bool     configSensor(VL53L0X_Sense_config_t vl_config) { return true; }
+
+    VL53L0X_Error Status = VL53L0X_ERROR_NONE;
+
+  private:
+    int     m_index        = -1;   // Which simulated sensor, from the I2C address
+    uint8_t m_range_status = 0;    // Of the last readRangeResult()
+};
+
+#endif
@@ -0,0 +1,264 @@
+/*
+  Host build of the Arduino core, as much of it as the conveyor firmware uses.
+
+  Timing functions, pins and peripherals all act on the ConveyorHardware of the
+  firmware instance that is currently running (see sim_hardware.h), so several
+  copies of the firmware can share one process.
+*/
+#ifndef SHIM_ARDUINO_H
+#define SHIM_ARDUINO_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <functional>
+// Pulled in before min() and max() are defined, which would break them
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0x01
+#define OUTPUT        0x03
+#define INPUT_PULLUP  0x05
+#define RISING        0x01
+#define FALLING       0x02
+#define CHANGE        0x03
+#define DEC           10
+#define HEX           16
+
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+#define PROGMEM
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+/*--------------------------- String ----------------------------------------*/
+class String
+{
+  public:
+    String() {}
+    String(const char* value) : m_value(value ? value : "") {}
+    String(const std::string &value) : m_value(value) {}
+    String(char value) : m_value(1, value) {}
+    explicit String(int value) : m_value(std::to_string(value)) {}
+    explicit String(unsigned int value) : m_value(std::to_string(value)) {}
+    explicit String(long value) : m_value(std::to_string(value)) {}
+    explicit String(unsigned long value) : m_value(std::to_string(value)) {}
+
+    unsigned int length() const { return m_value.length(); }
+    const char*  c_str()  const { return m_value.c_str(); }
+    void reserve(unsigned int size) { m_value.reserve(size); }
+
+    int indexOf(char c, unsigned int from = 0) const { return find(m_value.find(c, from)); }
+    int indexOf(const char* s, unsigned int from = 0) const { return find(m_value.find(s, from)); }
+    int indexOf(const String &s, unsigned int from = 0) const { return find(m_value.find(s.m_value, from)); }
+
+    String substring(unsigned int from) const { return from > m_value.length() ? String() : String(m_value.substr(from)); }
+    String substring(unsigned int from, unsigned int to) const
+    {
+      if (from > to) { unsigned int temp = to; to = from; from = temp; }
+      if (from > m_value.length()) return String();
+      return String(m_value.substr(from, to - from));
+    }
+
+    void remove(unsigned int index) { if (index < m_value.length()) m_value.erase(index); }
+    void remove(unsigned int index, unsigned int count) { if (index < m_value.length()) m_value.erase(index, count); }
+    void trim()
+    {
+      size_t first = m_value.find_first_not_of(" \t\r\n");
+      size_t last  = m_value.find_last_not_of(" \t\r\n");
+      m_value = (first == std::string::npos) ? "" : m_value.substr(first, last - first + 1);
+    }
+    void toUpperCase() { for (char &c : m_value) c = toupper(c); }
+    bool startsWith(const char* prefix) const { return m_value.compare(0, strlen(prefix), prefix) == 0; }
+
+    long  toInt()   const { return atol(m_value.c_str()); }
+    float toFloat() const { return atof(m_value.c_str()); }
+    void  toCharArray(char* buffer, unsigned int size) const
+    {
+      if (size) { strncpy(buffer, m_value.c_str(), size - 1); buffer[size - 1] = '\0'; }
+    }
+
+    char operator[](unsigned int index) const { return index < m_value.length() ? m_value[index] : 0; }
+    bool operator==(const char* other) const { return m_value == other; }
+    bool operator==(const String &other) const { return m_value == other.m_value; }
+    String &operator+=(char c)               { m_value += c; return *this; }
+    String &operator+=(const char* s)        { m_value += s; return *this; }
+    String &operator+=(const String &s)      { m_value += s.m_value; return *this; }
+    String operator+(const String &s) const  { return String(m_value + s.m_value); }
+    String operator+(const char* s) const    { return String(m_value + s); }
+
+  private:
+    static int find(size_t position) { return position == std::string::npos ? -1 : (int)position; }
+    std::string m_value;
+};
+
+inline String operator+(const char* a, const String &b) { return String(a) + b; }
+
+/*--------------------------- Print / Stream --------------------------------*/
+class Print;
+
+class Printable
+{
+  public:
+    virtual ~Printable() {}
+    virtual size_t printTo(Print &out) const = 0;
+};
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size)
+    {
+      for (size_t i = 0; i < size; i++) write(buffer[i]);
+      return size;
+    }
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+
+    size_t print(const char* s)          { return write(s); }
+    size_t print(const String &s)        { return write(s.c_str()); }
+    size_t print(char c)                 { return write((uint8_t)c); }
+    size_t print(const Printable &p)     { return p.printTo(*this); }
+    size_t print(int n, int base = DEC)           { return printNumber((long)n, base); }
+    size_t print(unsigned int n, int base = DEC)  { return printNumber((unsigned long)n, base); }
+    size_t print(long n, int base = DEC)          { return printNumber(n, base); }
+    size_t print(unsigned long n, int base = DEC) { return printNumber(n, base); }
+    size_t print(unsigned char n, int base = DEC) { return printNumber((unsigned long)n, base); }
+    size_t print(double n, int digits = 2)
+    {
+      char buffer[32];
+      snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+      return write(buffer);
+    }
+
+    template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+    size_t println() { return write("\r\n"); }
+
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)))
+    {
+      char buffer[256];
+      va_list args;
+      va_start(args, format);
+      vsnprintf(buffer, sizeof(buffer), format, args);
+      va_end(args);
+      return write(buffer);
+    }
+
+    void flush() {}
+
+  private:
+    size_t printNumber(long n, int base)
+    {
+      if (base == DEC) { char b[24]; snprintf(b, sizeof(b), "%ld", n); return write(b); }
+      return printNumber((unsigned long)n, base);
+    }
+    size_t printNumber(unsigned long n, int base)
+    {
+      char b[24];
+      snprintf(b, sizeof(b), base == HEX ? "%lX" : "%lu", n);
+      return write(b);
+    }
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() { return -1; }
+};
+
+class HardwareSerial : public Stream
+{
+  public:
+    void   begin(unsigned long baud) {}
+    size_t write(uint8_t c) override;
+    using  Print::write;
+    int    available() override;
+    int    read() override;
+    int    availableForWrite() { return 128; }
+    operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+
+/*--------------------------- Timing and pins -------------------------------*/
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+int  digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode);
+void detachInterrupt(uint8_t pin);
+inline uint8_t digitalPinToInterrupt(uint8_t pin) { return pin; }
+void noInterrupts();
+void interrupts();
+
+double ledcSetup(uint8_t channel, double frequency, uint8_t resolution_bits);
+void   ledcAttachPin(uint8_t pin, uint8_t channel);
+void   ledcWrite(uint8_t channel, uint32_t duty);
+
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+/*--------------------------- FreeRTOS --------------------------------------*/
+// Background tasks are never run. Everything they do is networking, and
+// the simulator has no network.
+typedef void*    TaskHandle_t;
+typedef int      BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+#define pdPASS             1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+inline BaseType_t xTaskCreatePinnedToCore(void (*task)(void*), const char* name, uint32_t stack, void* parameter,
+                                          UBaseType_t priority, TaskHandle_t* handle, BaseType_t core)
+{
+  return pdPASS;
+}
+inline void vTaskDelay(TickType_t ticks) {}
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return (TaskHandle_t)1; }
+inline UBaseType_t  uxTaskGetStackHighWaterMark(TaskHandle_t task) { return 4096; }
+
+/*--------------------------- ESP32 -----------------------------------------*/
+class EspClass
+{
+  public:
+    uint64_t getEfuseMac();
+    uint8_t  getChipRevision() { return 3; }
+    void     restart();
+    uint32_t getFreeHeap()     { return 200000; }
+    uint32_t getMinFreeHeap()  { return 180000; }
+    uint32_t getMaxAllocHeap() { return 110000; }
+    uint32_t getHeapSize()     { return 300000; }
+};
+
+extern EspClass ESP;
+
+class TwoWire
+{
+  public:
+    bool begin(int sda = -1, int scl = -1, uint32_t frequency = 0) { return true; }
+    void setClock(uint32_t frequency) {}
+};
+
+extern TwoWire Wire;
+
+#endif
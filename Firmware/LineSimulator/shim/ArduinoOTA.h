@@ -0,0 +1,42 @@
+/*
+  Host build of ArduinoOTA. Updates never arrive.
+*/
+#ifndef SHIM_ARDUINOOTA_H
+#define SHIM_ARDUINOOTA_H
+
+#include "Arduino.h"
+
+#define U_FLASH   0
+#define U_SPIFFS  100
+
+typedef enum {
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+} ota_error_t;
+
+class ArduinoOTAClass
+{
+  public:
+    typedef std::function<void(void)> THandlerFunction;
+    typedef std::function<void(ota_error_t)> THandlerFunction_Error;
+    typedef std::function<void(unsigned int, unsigned int)> THandlerFunction_Progress;
+
+    ArduinoOTAClass &onStart(THandlerFunction fn)             { return *this; }
+    ArduinoOTAClass &onEnd(THandlerFunction fn)               { return *this; }
+    ArduinoOTAClass &onError(THandlerFunction_Error fn)       { return *this; }
+    ArduinoOTAClass &onProgress(THandlerFunction_Progress fn) { return *this; }
+    ArduinoOTAClass &setHostname(const char* hostname)        { return *this; }
+    ArduinoOTAClass &setRebootOnSuccess(bool reboot)          { return *this; }
+    ArduinoOTAClass &setMdnsEnabled(bool enabled)             { return *this; }
+    void begin() {}
+    void end() {}
+    void handle() {}
+    int  getCommand() { return U_FLASH; }
+};
+
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif
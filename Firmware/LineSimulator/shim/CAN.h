@@ -0,0 +1,41 @@
+/*
+  Host build of the arduino-CAN library (Sandeep Mistry). Frames go to the
+  simulator's virtual bus, and received frames are handed to the onReceive()
+  callback as the ESP32 interrupt handler would.
+*/
+#ifndef SHIM_CAN_H
+#define SHIM_CAN_H
+
+#include "Arduino.h"
+
+class CANClass : public Stream
+{
+  public:
+    int  begin(long baud_rate) { return 1; }
+    void end() {}
+
+    int  beginPacket(int id, int dlc = -1, bool rtr = false);
+    int  beginExtendedPacket(long id, int dlc = -1, bool rtr = false);
+    int  endPacket();
+    size_t write(uint8_t byte) override;
+    using  Print::write;
+
+    int  parsePacket() { return 0; }
+    long packetId();
+    bool packetExtended();
+    bool packetRtr() { return false; }
+    int  packetDlc();
+    int  available() override;
+    int  read() override;
+    int  peek() override;
+
+    void onReceive(void (*callback)(int));
+    int  filter(int id, int mask = 0x7ff) { return 1; }
+    int  filterExtended(long id, long mask = 0x1fffffff);
+    int  observe() { return 1; }
+    int  loopback() { return 1; }
+};
+
+extern CANClass CAN;
+
+#endif
@@ -0,0 +1,3 @@
+#ifndef SHIM_ESPMDNS_H
+#define SHIM_ESPMDNS_H
+#endif
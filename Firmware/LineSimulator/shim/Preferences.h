@@ -0,0 +1,26 @@
+/*
+  Host build of the ESP32 Preferences (NVS) library. Each firmware instance
+  has its own store in its ConveyorHardware, kept for the whole run.
+*/
+#ifndef SHIM_PREFERENCES_H
+#define SHIM_PREFERENCES_H
+
+#include "Arduino.h"
+
+class Preferences
+{
+  public:
+    bool   begin(const char* name, bool read_only = false, const char* partition = nullptr);
+    void   end() { m_namespace.clear(); }
+    bool   clear();
+    bool   remove(const char* key);
+    size_t putBytes(const char* key, const void* value, size_t length);
+    size_t getBytes(const char* key, void* buffer, size_t max_length);
+    size_t getBytesLength(const char* key);
+
+  private:
+    std::string m_namespace;
+    bool        m_read_only = false;
+};
+
+#endif
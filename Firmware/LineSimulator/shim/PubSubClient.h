@@ -0,0 +1,51 @@
+/*
+  Host build of PubSubClient. Never connects; published messages are passed
+  to the simulator so they can be shown with the firmware's serial output.
+*/
+#ifndef SHIM_PUBSUBCLIENT_H
+#define SHIM_PUBSUBCLIENT_H
+
+#include "Arduino.h"
+#include "WiFi.h"
+
+void simMqttPublish(const char* topic, const char* payload);
+void simMqttSetCallback(void (*callback)(char*, uint8_t*, unsigned int));
+
+class PubSubClient
+{
+  public:
+    typedef void (*callback_t)(char*, uint8_t*, unsigned int);
+
+    PubSubClient(WiFiClient &client) {}
+    PubSubClient &setServer(const char* host, uint16_t port) { return *this; }
+    PubSubClient &setCallback(callback_t callback)
+    {
+      m_callback = callback;
+      simMqttSetCallback(callback);
+      return *this;
+    }
+    bool setBufferSize(uint16_t size) { m_buffer_size = size; return true; }
+    uint16_t getBufferSize() { return m_buffer_size; }
+
+    bool connect(const char* id, const char* user, const char* pass) { return false; }
+    bool connect(const char* id, const char* user, const char* pass, const char* will_topic,
+                 uint8_t will_qos, bool will_retain, const char* will_message) { return false; }
+    bool connected() { return false; }
+    int  state() { return -2; }
+    bool loop() { return false; }
+    bool subscribe(const char* topic) { return false; }
+
+    bool publish(const char* topic, const char* payload) { simMqttPublish(topic, payload); return true; }
+    bool publish(const char* topic, const char* payload, bool retained) { simMqttPublish(topic, payload); return true; }
+    bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained)
+    {
+      simMqttPublish(topic, std::string((const char*)payload, length).c_str());
+      return true;
+    }
+
+  private:
+    callback_t m_callback    = nullptr;
+    uint16_t   m_buffer_size = 256;
+};
+
+#endif
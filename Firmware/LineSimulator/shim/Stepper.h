@@ -0,0 +1,27 @@
+/*
+  Host build of the Arduino Stepper library. Each step moves the simulated
+  width axis, drives the coil pins
+  and takes as long as it would on the real motor.
+*/
+#ifndef SHIM_STEPPER_H
+#define SHIM_STEPPER_H
+
+#include "Arduino.h"
+
+class Stepper
+{
+  public:
+    Stepper(int steps_per_revolution, int pin_1, int pin_2, int pin_3, int pin_4)
+      : m_steps_per_revolution(steps_per_revolution), m_pins{(uint8_t)pin_1, (uint8_t)pin_2, (uint8_t)pin_3, (uint8_t)pin_4} {}
+    void setSpeed(long rpm) { m_step_delay_us = 60L * 1000L * 1000L / m_steps_per_revolution / rpm; }
+    void step(int steps);
+
+  private:
+    int           m_steps_per_revolution;
+    uint8_t       m_pins[4];
+    int           m_step_number   = 0;
+    unsigned long m_step_delay_us = 0;
+    uint64_t      m_last_step_us  = 0;
+};
+
+#endif
@@ -0,0 +1,46 @@
+/*
+  Host build of the arduinoWebSockets server. There is no network, so no
+  client ever connects.
+*/
+#ifndef SHIM_WEBSOCKETSSERVER_H
+#define SHIM_WEBSOCKETSSERVER_H
+
+#include "Arduino.h"
+
+#define WEBSOCKETS_MAX_HEADER_SIZE    14
+#define WEBSOCKETS_SERVER_CLIENT_MAX   5
+
+typedef enum {
+  WStype_ERROR,
+  WStype_DISCONNECTED,
+  WStype_CONNECTED,
+  WStype_TEXT,
+  WStype_BIN,
+  WStype_FRAGMENT_TEXT_START,
+  WStype_FRAGMENT_BIN_START,
+  WStype_FRAGMENT,
+  WStype_FRAGMENT_FIN,
+  WStype_PING,
+  WStype_PONG
+} WStype_t;
+
+class WebSocketsServer
+{
+  public:
+    typedef std::function<void(uint8_t num, WStype_t type, uint8_t* payload, size_t length)> WebSocketServerEvent;
+
+    WebSocketsServer(uint16_t port) {}
+    void begin() {}
+    void close() {}
+    void loop() {}
+    void onEvent(WebSocketServerEvent callback) { m_callback = callback; }
+
+    bool sendTXT(uint8_t num, uint8_t* payload, size_t length = 0, bool header_to_payload = false) { return false; }
+    bool broadcastTXT(uint8_t* payload, size_t length = 0, bool header_to_payload = false) { return false; }
+    uint8_t connectedClients(bool ping = false) { return 0; }
+
+  private:
+    WebSocketServerEvent m_callback;
+};
+
+#endif
@@ -0,0 +1,52 @@
+/*
+  Host build of the ESP32 WiFi driver. There is no network, so the station
+  never connects.
+*/
+#ifndef SHIM_WIFI_H
+#define SHIM_WIFI_H
+
+#include "Arduino.h"
+
+#define WIFI_STA           1
+#define WL_IDLE_STATUS     0
+#define WL_CONNECTED       3
+#define WL_CONNECT_FAILED  4
+#define WL_DISCONNECTED    6
+
+class IPAddress : public Printable
+{
+  public:
+    String  toString() const { return String("0.0.0.0"); }
+    uint8_t operator[](int index) const { return 0; }
+    size_t printTo(Print &out) const override { return out.print(toString()); }
+};
+
+class WiFiClass
+{
+  public:
+    void      mode(int mode) {}
+    int       status() { return WL_DISCONNECTED; }
+    void      begin(const char* ssid, const char* password) {}
+    void      disconnect() {}
+    void      reconnect() {}
+    void      setAutoConnect(bool enable) {}
+    void      setAutoReconnect(bool enable) {}
+    void      setSleep(bool enable) {}
+    int       waitForConnectResult() { return WL_CONNECT_FAILED; }
+    IPAddress localIP() { return IPAddress(); }
+};
+
+extern WiFiClass WiFi;
+
+class WiFiClient : public Stream
+{
+  public:
+    size_t write(uint8_t c) override { return 1; }
+    using  Print::write;
+    int    available() override { return 0; }
+    int    read() override { return -1; }
+    bool   connected() { return false; }
+    void   stop() {}
+};
+
+#endif
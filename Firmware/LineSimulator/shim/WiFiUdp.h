@@ -0,0 +1,3 @@
+#ifndef SHIM_WIFIUDP_H
+#define SHIM_WIFIUDP_H
+#endif
@@ -0,0 +1,598 @@
+/*
+  Implementation of the Arduino shims on top of ConveyorHardware
+*/
+#include "Arduino.h"
+#include "Stepper.h"
+#include "WiFi.h"
+#include "PubSubClient.h"
+#include "ArduinoOTA.h"
+#include "CAN.h"
+#include "Adafruit_VL53L0X.h"
+#include "Adafruit_MCP23X17.h"
+#include "Preferences.h"
+#include "sim_hardware.h"
+
+#define SIM_DEFAULT_BUDGET_US   33000     // VL53L0X default timing budget
+#define SIM_I2C_READ_US           100     // Reading one sensor register at 400 kHz
+#define SIM_I2C_WRITE_US          100
+#define SIM_I2C_RESULT_US         400     // Reading a whole ranging result and clearing its flag
+#define SIM_CAN_FRAME_US          500     // Time to send one frame at 250kbit/s
+#define SIM_INTERRUPT_ENTRY_US      2     // From the event to the handler starting
+
+static ConveyorHardware* s_hardware = nullptr;
+
+HardwareSerial  Serial;
+EspClass        ESP;
+TwoWire         Wire;
+WiFiClass       WiFi;
+ArduinoOTAClass ArduinoOTA;
+CANClass        CAN;
+
+void simSelectHardware(ConveyorHardware* hardware) { s_hardware = hardware; }
+ConveyorHardware* simHardware() { return s_hardware; }
+
+static void deliverCanFrame(const SimCanFrame &frame);
+
+/*--------------------------- Interrupts ------------------------------------*/
+static bool s_in_interrupt = false;
+
+static void runInterrupt(void (*handler)())
+{
+  s_hardware->now_us += SIM_INTERRUPT_ENTRY_US;
+  s_in_interrupt = true;
+  handler();
+  s_in_interrupt = false;
+}
+
+static void setGpioInput(uint8_t pin, uint8_t value)
+{
+  if (pin >= SIM_GPIO_PINS)
+  {
+    return;
+  }
+  uint8_t previous = s_hardware->gpio_in[pin];
+  s_hardware->gpio_in[pin] = value;
+  int mode = s_hardware->gpio_handler_mode[pin];
+  bool rose = !previous && value;
+  bool fell = previous && !value;
+  if (s_hardware->gpio_handler[pin]
+      && ((rose && (RISING == mode || CHANGE == mode)) || (fell && (FALLING == mode || CHANGE == mode))))
+  {
+    runInterrupt(s_hardware->gpio_handler[pin]);
+  }
+}
+
+/**
+  Move the clock to /until/, stopping on the way to deliver each timed
+  arrival when it falls due. Nothing is delivered from inside a handler,
+  which can't be interrupted on the board either.
+*/
+static void advanceTo(uint64_t until)
+{
+  while (!s_in_interrupt)
+  {
+    uint64_t next = UINT64_MAX;
+    if (!s_hardware->gpio_changes.empty())
+    {
+      next = min(next, s_hardware->gpio_changes.front().at_us);
+    }
+    if (!s_hardware->can_arrivals.empty())
+    {
+      next = min(next, s_hardware->can_arrivals.front().at_us);
+    }
+    if (!s_hardware->serial_arrivals.empty())
+    {
+      next = min(next, s_hardware->serial_arrivals.front().at_us);
+    }
+    if (next > until)
+    {
+      break;
+    }
+    s_hardware->now_us = max(s_hardware->now_us, next);
+
+    if (!s_hardware->gpio_changes.empty() && s_hardware->gpio_changes.front().at_us == next)
+    {
+      SimInputChange change = s_hardware->gpio_changes.front();
+      s_hardware->gpio_changes.pop_front();
+      setGpioInput(change.index, change.value);
+    }
+    else if (!s_hardware->can_arrivals.empty() && s_hardware->can_arrivals.front().at_us == next)
+    {
+      SimCanFrame frame = s_hardware->can_arrivals.front().frame;
+      s_hardware->can_arrivals.pop_front();
+      deliverCanFrame(frame);
+    }
+    else
+    {
+      const std::string &text = s_hardware->serial_arrivals.front().text;
+      s_hardware->serial_in.insert(s_hardware->serial_in.end(), text.begin(), text.end());
+      s_hardware->serial_arrivals.pop_front();
+    }
+  }
+  s_hardware->now_us = max(s_hardware->now_us, until);
+}
+
+void simAdvanceClock(uint64_t us)
+{
+  advanceTo(s_hardware->now_us + us);
+}
+
+/**
+  Keep outputs_off_since up to date. Call after anything that drives the
+  belt or the stepper coils.
+*/
+static void updateOutputsOff()
+{
+  bool on = s_hardware->ledc_duty[0] || s_hardware->ledc_duty[1];
+  for (uint8_t pin : s_hardware->y_coil_pins)
+  {
+    on = on || s_hardware->gpio_out[pin];
+  }
+  if (on)
+  {
+    s_hardware->outputs_off_since = UINT64_MAX;
+  }
+  else if (UINT64_MAX == s_hardware->outputs_off_since)
+  {
+    s_hardware->outputs_off_since = s_hardware->now_us;
+  }
+}
+
+/*--------------------------- Serial ----------------------------------------*/
+size_t HardwareSerial::write(uint8_t c)
+{
+  if ('\r' == c)
+  {
+    return 1;
+  }
+  if ('\n' == c)
+  {
+    if (s_hardware->echo_serial)
+    {
+      ::printf("%10.3f %-12s %s\n", s_hardware->now_us / 1e6, s_hardware->name.c_str(), s_hardware->serial_line.c_str());
+    }
+    if (s_hardware->serial_capture)
+    {
+      s_hardware->serial_capture->push_back(s_hardware->serial_line);
+    }
+    s_hardware->serial_line.clear();
+    return 1;
+  }
+  s_hardware->serial_line += (char)c;
+  return 1;
+}
+
+int HardwareSerial::available()
+{
+  return s_hardware->serial_in.size();
+}
+
+int HardwareSerial::read()
+{
+  if (s_hardware->serial_in.empty())
+  {
+    return -1;
+  }
+  char c = s_hardware->serial_in.front();
+  s_hardware->serial_in.pop_front();
+  return (uint8_t)c;
+}
+
+void simMqttPublish(const char* topic, const char* payload)
+{
+  if (s_hardware->echo_serial)
+  {
+    printf("%10.3f %-12s mqtt %s: %s\n", s_hardware->now_us / 1e6, s_hardware->name.c_str(), topic, payload);
+  }
+}
+
+void simMqttSetCallback(void (*callback)(char*, uint8_t*, unsigned int))
+{
+  s_hardware->mqtt_callback = callback;
+}
+
+/*--------------------------- Timing and pins -------------------------------*/
+unsigned long millis()                 { return (unsigned long)(s_hardware->now_us / 1000); }
+unsigned long micros()                 { return (unsigned long)s_hardware->now_us; }
+void delay(unsigned long ms)           { simAdvanceClock((uint64_t)ms * 1000); }
+void delayMicroseconds(unsigned int us) { simAdvanceClock(us); }
+void yield() {}
+void noInterrupts() {}
+void interrupts() {}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (pin < SIM_GPIO_PINS)
+  {
+    s_hardware->gpio_out[pin] = value;
+    updateOutputsOff();
+  }
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode)
+{
+  if (pin < SIM_GPIO_PINS)
+  {
+    s_hardware->gpio_handler[pin]      = handler;
+    s_hardware->gpio_handler_mode[pin] = mode;
+  }
+}
+
+void detachInterrupt(uint8_t pin)
+{
+  if (pin < SIM_GPIO_PINS)
+  {
+    s_hardware->gpio_handler[pin] = nullptr;
+  }
+}
+
+int digitalRead(uint8_t pin)
+{
+  if (pin == s_hardware->limit_pin)
+  {
+    return s_hardware->y_rail >= s_hardware->y_limit_steps ? HIGH : LOW;
+  }
+  return pin < sizeof(s_hardware->gpio_in) ? s_hardware->gpio_in[pin] : LOW;
+}
+
+double ledcSetup(uint8_t channel, double frequency, uint8_t resolution_bits) { return frequency; }
+void   ledcAttachPin(uint8_t pin, uint8_t channel) {}
+
+void ledcWrite(uint8_t channel, uint32_t duty)
+{
+  if (channel < SIM_LEDC_CHANNELS)
+  {
+    s_hardware->ledc_duty[channel] = duty;
+    updateOutputsOff();
+  }
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+uint64_t EspClass::getEfuseMac()
+{
+  return 0x0000A4CF12000000ULL | s_hardware->instance;
+}
+
+void EspClass::restart()
+{
+  s_hardware->restart_requested = true;
+}
+
+/*--------------------------- Width axis ------------------------------------*/
+void Stepper::step(int steps)
+{
+  // Like the real library, each step waits until a full step delay has
+  // passed since the previous one, however that was spent, then drives
+  // the coils with the next of the four wire patterns and leaves them on
+  static const uint8_t patterns[4][4] = {{1, 0, 1, 0}, {0, 1, 1, 0}, {0, 1, 0, 1}, {1, 0, 0, 1}};
+  int direction = steps > 0 ? 1 : -1;
+  for (uint8_t coil = 0; coil < 4; coil++)
+  {
+    s_hardware->y_coil_pins[coil] = m_pins[coil];
+  }
+  for (int i = 0; i != steps; i += direction)
+  {
+    advanceTo(m_last_step_us + m_step_delay_us);
+    m_last_step_us = s_hardware->now_us;
+    m_step_number  = (m_step_number + direction + 4) % 4;
+    for (uint8_t coil = 0; coil < 4; coil++)
+    {
+      digitalWrite(m_pins[coil], patterns[m_step_number][coil]);
+    }
+    s_hardware->y_steps += direction;
+    s_hardware->step_count++;
+    // The rail only moves once the slack in the drive has been taken up
+    if (s_hardware->y_steps > s_hardware->y_rail + s_hardware->y_backlash)
+    {
+      s_hardware->y_rail = s_hardware->y_steps - s_hardware->y_backlash;
+    }
+    if (s_hardware->y_steps < s_hardware->y_rail)
+    {
+      s_hardware->y_rail = s_hardware->y_steps;
+    }
+  }
+}
+
+/*--------------------------- I/O expander ----------------------------------*/
+uint8_t Adafruit_MCP23X17::digitalRead(uint8_t pin)
+{
+  std::deque<SimInputChange> &changes = s_hardware->expander_changes;
+  while (!changes.empty() && changes.front().at_us <= s_hardware->now_us)
+  {
+    if (changes.front().index < SIM_EXPANDER_PINS)
+    {
+      s_hardware->expander_in[changes.front().index] = changes.front().value;
+    }
+    changes.pop_front();
+  }
+  return pin < SIM_EXPANDER_PINS ? s_hardware->expander_in[pin] : LOW;
+}
+
+void Adafruit_MCP23X17::digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (pin < SIM_EXPANDER_PINS)
+  {
+    s_hardware->expander_out[pin] = value;
+  }
+}
+
+/*--------------------------- Time of flight sensors ------------------------*/
+bool Adafruit_VL53L0X::begin(uint8_t i2c_addr, bool debug, TwoWire* i2c, VL53L0X_Sense_config_t vl_config)
+{
+  int index = i2c_addr - s_hardware->first_sensor_address;
+  if (index < 0 || index >= SIM_SENSOR_COUNT)
+  {
+    return false;
+  }
+  m_index = index;
+  s_hardware->sensor_started[index]   = true;
+  s_hardware->sensor_budget_us[index] = SIM_DEFAULT_BUDGET_US;
+  return true;
+}
+
+/**
+  Bring the simulated ranges up to now
+*/
+static void simUpdateSensorRanges()
+{
+  std::deque<SimInputChange> &changes = s_hardware->sensor_changes;
+  while (!changes.empty() && changes.front().at_us <= s_hardware->now_us)
+  {
+    if (changes.front().index < SIM_SENSOR_COUNT)
+    {
+      s_hardware->sensor_range_mm[changes.front().index] = changes.front().value;
+    }
+    changes.pop_front();
+  }
+}
+
+VL53L0X_Error Adafruit_VL53L0X::getSingleRangingMeasurement(VL53L0X_RangingMeasurementData_t* data, bool debug)
+{
+  memset(data, 0, sizeof(*data));
+  if (m_index < 0)
+  {
+    data->RangeStatus = 4;
+    return -1;
+  }
+  simAdvanceClock(s_hardware->sensor_budget_us[m_index]);
+  simUpdateSensorRanges();
+  data->RangeMilliMeter = s_hardware->sensor_range_mm[m_index];
+  data->MeasurementTimeUsec = s_hardware->sensor_budget_us[m_index];
+  return VL53L0X_ERROR_NONE;
+}
+
+bool Adafruit_VL53L0X::startRangeContinuous(uint16_t period_ms)
+{
+  if (m_index < 0)
+  {
+    return false;
+  }
+  simAdvanceClock(SIM_I2C_WRITE_US);
+  // The sensor can't range faster than its budget allows
+  uint32_t period_us = std::max<uint32_t>((uint32_t)period_ms * 1000, s_hardware->sensor_budget_us[m_index]);
+  s_hardware->sensor_period_us[m_index] = period_us;
+  s_hardware->sensor_ready_us[m_index]  = s_hardware->now_us + period_us;
+  return true;
+}
+
+void Adafruit_VL53L0X::stopRangeContinuous()
+{
+  if (m_index >= 0)
+  {
+    simAdvanceClock(SIM_I2C_WRITE_US);
+    s_hardware->sensor_period_us[m_index] = 0;
+  }
+}
+
+bool Adafruit_VL53L0X::isRangeComplete()
+{
+  if (m_index < 0 || 0 == s_hardware->sensor_period_us[m_index])
+  {
+    return false;
+  }
+  simAdvanceClock(SIM_I2C_READ_US);
+  return s_hardware->now_us >= s_hardware->sensor_ready_us[m_index];
+}
+
+uint16_t Adafruit_VL53L0X::readRangeResult()
+{
+  if (m_index < 0)
+  {
+    m_range_status = 4;
+    return 0xFFFF;
+  }
+  simAdvanceClock(SIM_I2C_RESULT_US);
+  simUpdateSensorRanges();
+  // Readings not collected in time are overwritten, so the next one is
+  // the first to finish after now
+  uint32_t period_us = s_hardware->sensor_period_us[m_index];
+  while (0 != period_us && s_hardware->sensor_ready_us[m_index] <= s_hardware->now_us)
+  {
+    s_hardware->sensor_ready_us[m_index] += period_us;
+  }
+  m_range_status = 0;
+  return s_hardware->sensor_range_mm[m_index];
+}
+
+bool Adafruit_VL53L0X::setMeasurementTimingBudgetMicroSeconds(uint32_t budget_us)
+{
+  if (m_index < 0 || budget_us < 20000)
+  {
+    return false;
+  }
+  s_hardware->sensor_budget_us[m_index] = budget_us;
+  return true;
+}
+
+uint32_t Adafruit_VL53L0X::getMeasurementTimingBudgetMicroSeconds()
+{
+  return m_index < 0 ? 0 : s_hardware->sensor_budget_us[m_index];
+}
+
+/*--------------------------- NVS -------------------------------------------*/
+bool Preferences::begin(const char* name, bool read_only, const char* partition)
+{
+  m_namespace = name;
+  m_read_only = read_only;
+  if (!read_only)
+  {
+    s_hardware->nvs[m_namespace];
+  }
+  return read_only ? s_hardware->nvs.count(m_namespace) > 0 : true;
+}
+
+bool Preferences::clear()
+{
+  if (m_namespace.empty() || m_read_only)
+  {
+    return false;
+  }
+  s_hardware->nvs[m_namespace].clear();
+  return true;
+}
+
+bool Preferences::remove(const char* key)
+{
+  if (m_namespace.empty() || m_read_only)
+  {
+    return false;
+  }
+  return s_hardware->nvs[m_namespace].erase(key) > 0;
+}
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t length)
+{
+  if (m_namespace.empty() || m_read_only)
+  {
+    return 0;
+  }
+  const uint8_t* bytes = (const uint8_t*)value;
+  s_hardware->nvs[m_namespace][key] = std::vector<uint8_t>(bytes, bytes + length);
+  return length;
+}
+
+size_t Preferences::getBytesLength(const char* key)
+{
+  if (m_namespace.empty() || !s_hardware->nvs.count(m_namespace) || !s_hardware->nvs[m_namespace].count(key))
+  {
+    return 0;
+  }
+  return s_hardware->nvs[m_namespace][key].size();
+}
+
+size_t Preferences::getBytes(const char* key, void* buffer, size_t max_length)
+{
+  size_t length = getBytesLength(key);
+  if (0 == length || length > max_length)
+  {
+    return 0;
+  }
+  memcpy(buffer, s_hardware->nvs[m_namespace][key].data(), length);
+  return length;
+}
+
+/*--------------------------- CAN -------------------------------------------*/
+int CANClass::beginPacket(int id, int dlc, bool rtr)
+{
+  // Standard frames aren't used on the J1939 bus
+  s_hardware->can_tx_frame.id  = 0xFFFFFFFF;
+  s_hardware->can_tx_frame.dlc = 0;
+  return 1;
+}
+
+int CANClass::beginExtendedPacket(long id, int dlc, bool rtr)
+{
+  s_hardware->can_tx_frame.id  = (uint32_t)id & 0x1FFFFFFF;
+  s_hardware->can_tx_frame.dlc = 0;
+  return 1;
+}
+
+size_t CANClass::write(uint8_t byte)
+{
+  SimCanFrame &frame = s_hardware->can_tx_frame;
+  if (frame.dlc >= 8)
+  {
+    return 0;
+  }
+  frame.data[frame.dlc++] = byte;
+  return 1;
+}
+
+int CANClass::endPacket()
+{
+  if (0xFFFFFFFF != s_hardware->can_tx_frame.id)
+  {
+    s_hardware->can_tx.push_back(s_hardware->can_tx_frame);
+  }
+  simAdvanceClock(SIM_CAN_FRAME_US);
+  return 1;
+}
+
+long CANClass::packetId()     { return s_hardware->can_rx_frame.id; }
+bool CANClass::packetExtended() { return true; }
+int  CANClass::packetDlc()    { return s_hardware->can_rx_frame.dlc; }
+
+int CANClass::available()
+{
+  return s_hardware->can_rx_frame.dlc - s_hardware->can_rx_position;
+}
+
+int CANClass::read()
+{
+  if (s_hardware->can_rx_position >= s_hardware->can_rx_frame.dlc)
+  {
+    return -1;
+  }
+  return s_hardware->can_rx_frame.data[s_hardware->can_rx_position++];
+}
+
+int CANClass::peek()
+{
+  if (s_hardware->can_rx_position >= s_hardware->can_rx_frame.dlc)
+  {
+    return -1;
+  }
+  return s_hardware->can_rx_frame.data[s_hardware->can_rx_position];
+}
+
+void CANClass::onReceive(void (*callback)(int))
+{
+  s_hardware->can_callback = callback;
+}
+
+int CANClass::filterExtended(long id, long mask)
+{
+  s_hardware->can_filter_id   = (uint32_t)id & 0x1FFFFFFF;
+  s_hardware->can_filter_mask = (uint32_t)mask & 0x1FFFFFFF;
+  return 1;
+}
+
+static void deliverCanFrame(const SimCanFrame &frame)
+{
+  if ((frame.id & s_hardware->can_filter_mask) != (s_hardware->can_filter_id & s_hardware->can_filter_mask))
+  {
+    return;
+  }
+  if (s_hardware->can_callback)
+  {
+    s_hardware->can_rx_frame    = frame;
+    s_hardware->can_rx_position = 0;
+    runInterrupt([]() { s_hardware->can_callback(s_hardware->can_rx_frame.dlc); });
+  }
+}
+
+void simDeliverCanFrames()
+{
+  while (!s_hardware->can_rx.empty())
+  {
+    SimCanFrame frame = s_hardware->can_rx.front();
+    s_hardware->can_rx.pop_front();
+    deliverCanFrame(frame);
+  }
+}
@@ -0,0 +1,152 @@
+/*
+  The simulated board behind one copy of the firmware.
+
+  The Arduino shims read and write the ConveyorHardware of whichever firmware
+  instance is running, selected by simSelectHardware(). The line simulator
+  fills in the inputs (sensor ranges, ready-in pins, limit switch) between
+  passes of loop() and reads back the outputs (motor PWM, ready-out pins,
+  CAN frames, serial output).
+*/
+#ifndef SIM_HARDWARE_H
+#define SIM_HARDWARE_H
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#define SIM_SENSOR_COUNT     3
+#define SIM_LEDC_CHANNELS    8
+#define SIM_EXPANDER_PINS   16
+#define SIM_GPIO_PINS       40
+
+struct SimCanFrame
+{
+  uint32_t id;
+  uint8_t  dlc;
+  uint8_t  data[8];
+};
+
+/*
+  An input that changes at a set time, for replaying a trace. The change
+  takes effect the first time the firmware reads the input at or after
+  at_us, so it lands in the same reading however the loop is timed.
+*/
+struct SimInputChange
+{
+  uint64_t at_us;
+  uint8_t  index;                           // Sensor or expander pin
+  uint16_t value;
+};
+
+/*
+  Inputs that arrive at interrupt level. They're delivered at exactly at_us
+  even in the middle of a delay, a step or a sensor read, so a pin's
+  interrupt handler or the CAN receive callback runs when it would on the
+  board rather than when loop() next comes round.
+*/
+struct SimCanArrival
+{
+  uint64_t    at_us;
+  SimCanFrame frame;
+};
+
+struct SimSerialArrival
+{
+  uint64_t    at_us;
+  std::string text;
+};
+
+struct ConveyorHardware
+{
+  std::string name;                         // Prefix for serial output
+  uint64_t    now_us          = 0;          // This instance's clock
+  uint8_t     instance        = 0;
+
+  // Conveyor motor
+  uint32_t    ledc_duty[SIM_LEDC_CHANNELS] = {};
+
+  // Width axis
+  int32_t     y_steps         = 0;          // Position of the stepper, + is wider
+  int32_t     y_rail          = 0;          // Position of the rail, in steps. Lags y_steps going wider
+  int32_t     y_backlash      = 0;          // Steps of slack in the drive
+  int32_t     y_limit_steps   = 0;          // Limit switch trips at or beyond this
+  uint8_t     limit_pin       = 0;
+  uint64_t    step_count      = 0;          // Total steps taken, to check for lost motion
+
+  // GPIO, indexed by pin number
+  uint8_t     gpio_in[SIM_GPIO_PINS]  = {};
+  uint8_t     gpio_out[SIM_GPIO_PINS] = {};
+  void      (*gpio_handler[SIM_GPIO_PINS])() = {};  // From attachInterrupt()
+  int         gpio_handler_mode[SIM_GPIO_PINS] = {};
+  uint8_t     y_coil_pins[4]  = {};         // Written by the stepper
+
+  // When the belt PWM and the stepper coils last all went off, or
+  // UINT64_MAX while any of them is on
+  uint64_t    outputs_off_since = 0;
+
+  // I/O expander
+  uint8_t     expander_out[SIM_EXPANDER_PINS] = {};
+  uint8_t     expander_in[SIM_EXPANDER_PINS]  = {};
+
+  // Time of flight sensors, indexed by I2C address - first_sensor_address
+  uint8_t     first_sensor_address = 0x30;
+  uint16_t    sensor_range_mm[SIM_SENSOR_COUNT]    = {};
+  uint32_t    sensor_budget_us[SIM_SENSOR_COUNT]   = {};
+  bool        sensor_started[SIM_SENSOR_COUNT]     = {};
+  uint32_t    sensor_period_us[SIM_SENSOR_COUNT]   = {};   // Continuous ranging, 0 when stopped
+  uint64_t    sensor_ready_us[SIM_SENSOR_COUNT]    = {};   // When the next continuous reading is ready
+
+  // Scheduled changes to the inputs above, in time order
+  std::deque<SimInputChange> sensor_changes;
+  std::deque<SimInputChange> expander_changes;
+  std::deque<SimInputChange> gpio_changes;  // Run the pin's interrupt handler on time
+
+  // Serial
+  std::deque<char> serial_in;
+  std::deque<SimSerialArrival> serial_arrivals;
+  std::string      serial_line;             // Output collected up to the next newline
+  bool             echo_serial = false;
+  std::vector<std::string>* serial_capture = nullptr;  // Output lines are kept here too if set
+
+  // CAN
+  std::vector<SimCanFrame> can_tx;          // Sent by the firmware since last drained
+  std::deque<SimCanFrame>  can_rx;          // Waiting to be delivered
+  std::deque<SimCanArrival> can_arrivals;   // Delivered on time, see above
+  SimCanFrame  can_tx_frame   = {};
+  SimCanFrame  can_rx_frame   = {};
+  uint8_t      can_rx_position = 0;
+  uint32_t     can_filter_id   = 0;
+  uint32_t     can_filter_mask = 0;         // 1 bits must match
+  void       (*can_callback)(int) = nullptr;
+
+  // MQTT
+  void       (*mqtt_callback)(char*, uint8_t*, unsigned int) = nullptr;
+
+  bool         restart_requested = false;
+
+  // NVS, keyed by namespace then key
+  std::map<std::string, std::map<std::string, std::vector<uint8_t>>> nvs;
+};
+
+/*
+  Point the Arduino shims at a firmware instance's hardware. Must be called
+  before running any of that instance's code.
+*/
+void simSelectHardware(ConveyorHardware* hardware);
+ConveyorHardware* simHardware();
+
+/*
+  Hand the waiting CAN frames to the firmware's receive callback, applying
+  its acceptance filter. Call with the instance's hardware selected.
+*/
+void simDeliverCanFrames();
+
+/*
+  Move the selected instance's clock on by /us/, delivering any of the
+  timed arrivals above that fall due on the way.
+*/
+void simAdvanceClock(uint64_t us);
+
+#endif
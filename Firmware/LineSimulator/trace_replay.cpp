@@ -0,0 +1,561 @@
+/*
+  Trace replay
+
+  Runs an input trace recorded on a conveyor back through the PCBConveyor2
+  firmware on the host, so a problem seen on the line can be stepped through
+  on a desk. See PCBConveyor2/trace.h for how to record one.
+
+  The replay starts the firmware with the settings saved in the trace, waits
+  for it to reach the state the trace started in, then feeds it the recorded
+  sensor readings, ready-in levels, command lines, MQTT batches and CAN
+  frames at the times they arrived. The replayed firmware traces itself as
+  it goes, and its state changes are compared with the recorded ones. A
+  replay that takes a different path through the state machine points at
+  something the trace doesn't capture, eg a timing race or a fault.
+
+  Usage:
+    tracereplay [options] <capture>
+
+    <capture>        Serial console output holding the TRACE: lines, or - for
+                     stdin. Other lines, eg log messages, are skipped. The
+                     first trace in the capture is replayed.
+    --match <text>   Only read lines containing <text>, eg a conveyor's name
+                     in linesim --verbose output
+    --tail <s>       Keep running after the last record. Default 5
+    --verbose        Show the firmware's serial output
+
+  Exits with 0 if the replay went through the same states, 2 if it didn't
+  and 1 if the capture couldn't be read.
+*/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "conveyor_firmware.h"
+#include "sim_hardware.h"
+
+/*--------------------------- Constants -------------------------------------*/
+// Must match trace.h
+#define TRACE_VERSION              2
+#define TRACE_START             0x01
+#define TRACE_NVS               0x02
+#define TRACE_SENSOR            0x10
+#define TRACE_READY_IN          0x20
+#define TRACE_SERIAL            0x30
+#define TRACE_MQTT              0x31
+#define TRACE_CAN               0x40
+#define TRACE_STATE             0x50
+#define TRACE_STOP              0x60
+
+// Must match PCBConveyor2.ino
+#define STATE_BEGIN                0
+#define STATE_IDLE                 1
+
+#define REPLAY_LOOP_OVERHEAD_US  200     // Same as SIM_LOOP_OVERHEAD_US in linesim
+#define REPLAY_SETUP_TIMEOUT_MS  120000  // Longest to wait for the starting state, eg while homing
+#define REPLAY_DRAIN_TIMEOUT_MS  5000    // Longest to wait for the replay's own trace to come out
+#define REPLAY_MQTT_TOPIC        "cmnd/replay/COMMAND"
+
+/*--------------------------- Trace decoding --------------------------------*/
+struct TraceRecord
+{
+  uint8_t  type;
+  uint32_t time_ms;                      // millis() on the conveyor
+  std::vector<uint8_t> data;             // Everything after the time
+
+  uint16_t u16(size_t at) const { return data[at] | (data[at + 1] << 8); }
+  uint32_t u32(size_t at) const { return u16(at) | ((uint32_t)u16(at + 2) << 16); }
+};
+
+enum decode_result_t { DECODE_COMPLETE, DECODE_TRUNCATED, DECODE_BAD };
+
+/**
+  Add the bytes from a "TRACE:<hex>" line, if /line/ has one, to /bytes/
+*/
+void addTraceLine(const std::string &line, std::vector<uint8_t> &bytes)
+{
+  size_t start = line.find("TRACE:");
+  if (std::string::npos == start)
+  {
+    return;
+  }
+  const char* hex = line.c_str() + start + 6;
+  while (isxdigit((unsigned char)hex[0]) && isxdigit((unsigned char)hex[1]))
+  {
+    char pair[3] = { hex[0], hex[1], '\0' };
+    bytes.push_back((uint8_t)strtoul(pair, nullptr, 16));
+    hex += 2;
+  }
+}
+
+/**
+  Split trace bytes into records, stopping at the first TRACE_STOP.
+  @return DECODE_TRUNCATED if the bytes ran out first, eg part way through a stream
+*/
+decode_result_t decodeTrace(const std::vector<uint8_t> &bytes, std::vector<TraceRecord> &records, std::string &error)
+{
+  records.clear();
+  size_t   position = 0;
+  uint32_t time_ms  = 0;
+  auto need = [&](size_t count) { return position + count <= bytes.size(); };
+
+  while (position < bytes.size())
+  {
+    TraceRecord record;
+    record.type = bytes[position++];
+    if (records.empty() && TRACE_START != record.type)
+    {
+      error = "trace doesn't begin with a start record";
+      return DECODE_BAD;
+    }
+
+    if (TRACE_START == record.type)
+    {
+      if (!records.empty())
+      {
+        error = "start record in the middle of a trace";
+        return DECODE_BAD;
+      }
+      if (!need(7))
+      {
+        return DECODE_TRUNCATED;
+      }
+      record.data.assign(bytes.begin() + position, bytes.begin() + position + 7);
+      position += 7;
+      time_ms = record.u32(0);
+      if (TRACE_VERSION != record.data[6])
+      {
+        error = "trace version " + std::to_string(record.data[6]) + ", expected " + std::to_string(TRACE_VERSION);
+        return DECODE_BAD;
+      }
+      record.time_ms = time_ms;
+      records.push_back(record);
+      continue;
+    }
+
+    uint32_t delta = 0;
+    uint8_t  shift = 0;
+    while (true)
+    {
+      if (!need(1))
+      {
+        return DECODE_TRUNCATED;
+      }
+      uint8_t value = bytes[position++];
+      delta |= (uint32_t)(value & 0x7F) << shift;
+      shift += 7;
+      if (0 == (value & 0x80))
+      {
+        break;
+      }
+    }
+    time_ms += delta;
+    record.time_ms = time_ms;
+
+    size_t length = 0;
+    uint8_t base  = record.type & 0xF0;
+    if (TRACE_NVS == record.type) {
+      // namespace NUL key NUL length bytes
+      size_t scan = position;
+      for (int strings = 0; strings < 2; strings++)
+      {
+        while (scan < bytes.size() && 0 != bytes[scan])
+        {
+          scan++;
+        }
+        scan++;
+      }
+      if (scan >= bytes.size())
+      {
+        return DECODE_TRUNCATED;
+      }
+      length = scan - position + 1 + bytes[scan];
+    } else if (TRACE_SENSOR == base) {
+      length = 2;
+    } else if (TRACE_READY_IN == base) {
+      length = 0;
+    } else if (TRACE_SERIAL == record.type || TRACE_MQTT == record.type) {
+      if (!need(2))
+      {
+        return DECODE_TRUNCATED;
+      }
+      length = 2 + (bytes[position] | (bytes[position + 1] << 8));
+    } else if (TRACE_CAN == base && (record.type & 0x0F) <= 8) {
+      length = 4 + (record.type & 0x0F);
+    } else if (TRACE_STATE == record.type || TRACE_STOP == record.type) {
+      length = 2;
+    } else {
+      char message[60];
+      snprintf(message, sizeof(message), "unknown record type 0x%02x at byte %zu", record.type, position);
+      error = message;
+      return DECODE_BAD;
+    }
+
+    if (!need(length))
+    {
+      return DECODE_TRUNCATED;
+    }
+    record.data.assign(bytes.begin() + position, bytes.begin() + position + length);
+    position += length;
+    records.push_back(record);
+    if (TRACE_STOP == record.type)
+    {
+      return DECODE_COMPLETE;
+    }
+  }
+  return records.empty() || TRACE_STOP != records.back().type ? DECODE_TRUNCATED : DECODE_COMPLETE;
+}
+
+struct StateChange
+{
+  uint32_t at_ms;                        // Since the start of the trace
+  uint16_t state;
+};
+
+std::vector<StateChange> stateChanges(const std::vector<TraceRecord> &records)
+{
+  std::vector<StateChange> changes;
+  for (const TraceRecord &record : records)
+  {
+    if (TRACE_STATE == record.type)
+    {
+      changes.push_back({ record.time_ms - records[0].time_ms, record.u16(0) });
+    }
+  }
+  return changes;
+}
+
+/*--------------------------- Replay ----------------------------------------*/
+struct Replay
+{
+  ConveyorFirmware firmware;
+  ConveyorHardware hardware;
+  std::vector<std::string> output;       // The firmware's serial output
+
+  /**
+    Run one pass of loop()
+  */
+  void step()
+  {
+    simDeliverCanFrames();
+    firmware.loop();
+    hardware.now_us += REPLAY_LOOP_OVERHEAD_US;
+    hardware.can_tx.clear();
+    hardware.restart_requested = false;
+  }
+
+  uint64_t nowMs()
+  {
+    return hardware.now_us / 1000;
+  }
+
+  void sendLine(const std::string &line)
+  {
+    for (char c : line)
+    {
+      hardware.serial_in.push_back(c);
+    }
+    hardware.serial_in.push_back('\n');
+  }
+
+  /**
+    Decode the replay's own trace from its serial output so far
+  */
+  decode_result_t ownTrace(std::vector<TraceRecord> &records)
+  {
+    std::vector<uint8_t> bytes;
+    for (const std::string &line : output)
+    {
+      addTraceLine(line, bytes);
+    }
+    std::string error;
+    return decodeTrace(bytes, records, error);
+  }
+};
+
+void printUsage()
+{
+  printf("Usage: tracereplay [--match <text>] [--tail <s>] [--verbose] <capture>|-\n"
+         "See the top of trace_replay.cpp for details.\n");
+}
+
+int main(int argc, char** argv)
+{
+  const char* capture_path = nullptr;
+  const char* match        = nullptr;
+  double      tail_s       = 5;
+  bool        verbose      = false;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if ("--match" == arg && has_value) {
+      match = argv[++i];
+    } else if ("--tail" == arg && has_value) {
+      tail_s = atof(argv[++i]);
+    } else if ("--verbose" == arg) {
+      verbose = true;
+    } else if (!capture_path && ("-" == arg || '-' != arg[0])) {
+      capture_path = argv[i];
+    } else {
+      printUsage();
+      return "--help" == arg ? 0 : 1;
+    }
+  }
+  if (!capture_path)
+  {
+    printUsage();
+    return 1;
+  }
+
+  // Read the capture
+  FILE* capture = strcmp(capture_path, "-") ? fopen(capture_path, "r") : stdin;
+  if (!capture)
+  {
+    fprintf(stderr, "Can't open %s\n", capture_path);
+    return 1;
+  }
+  std::vector<uint8_t> bytes;
+  char line[1024];
+  while (fgets(line, sizeof(line), capture))
+  {
+    if (!match || strstr(line, match))
+    {
+      addTraceLine(line, bytes);
+    }
+  }
+  if (stdin != capture)
+  {
+    fclose(capture);
+  }
+
+  std::vector<TraceRecord> recorded;
+  std::string error;
+  decode_result_t decoded = decodeTrace(bytes, recorded, error);
+  if (DECODE_BAD == decoded || recorded.empty())
+  {
+    fprintf(stderr, "%s: %s\n", capture_path, recorded.empty() && error.empty() ? "no trace found" : error.c_str());
+    return 1;
+  }
+  if (DECODE_TRUNCATED == decoded)
+  {
+    fprintf(stderr, "Warning: trace ends without a stop record, replaying what there is\n");
+  } else if (0 != recorded.back().u16(0)) {
+    fprintf(stderr, "Warning: %u records were dropped while recording, the replay may go its own way\n",
+            recorded.back().u16(0));
+  }
+
+  uint16_t start_state = recorded[0].u16(4);
+  if (STATE_BEGIN != start_state && STATE_IDLE != start_state)
+  {
+    fprintf(stderr, "Warning: trace started in state %u rather than idle, the replay can only start there if setup() gets it there\n",
+            start_state);
+  }
+
+  // Set up the hardware as the trace found it
+  Replay replay;
+  replay.firmware = simConveyorFirmware0();
+  ConveyorHardware &hardware = replay.hardware;
+  hardware.name                 = "replay";
+  hardware.echo_serial          = verbose;
+  hardware.serial_capture       = &replay.output;
+  hardware.limit_pin            = replay.firmware.limit_pin;
+  hardware.first_sensor_address = replay.firmware.first_sensor_address;
+
+  unsigned counts[7] = {};                // nvs, sensor, ready-in, serial, mqtt, can, state
+  bool  sensor_set[SIM_SENSOR_COUNT] = {};
+  bool  ready_in_set = false;
+  int32_t start_steps = 0;
+  uint8_t active     = replay.firmware.ready_active_level;
+  for (const TraceRecord &record : recorded)
+  {
+    uint8_t base = record.type & 0xF0;
+    if (TRACE_NVS == record.type)
+    {
+      const char* name_space = (const char*)record.data.data();
+      const char* key        = name_space + strlen(name_space) + 1;
+      size_t      at         = key + strlen(key) + 1 - name_space;
+      uint8_t     length     = record.data[at];
+      hardware.nvs[name_space][key].assign(record.data.begin() + at + 1, record.data.begin() + at + 1 + length);
+      if (0 == strcmp(name_space, "position") && length >= sizeof(int32_t))
+      {
+        memcpy(&start_steps, &record.data[at + 1], sizeof(int32_t));
+      }
+      counts[0]++;
+    } else if (TRACE_SENSOR == base) {
+      uint8_t index = record.type & 0x0F;
+      if (index < SIM_SENSOR_COUNT && !sensor_set[index])
+      {
+        hardware.sensor_range_mm[index] = record.u16(0);
+        sensor_set[index] = true;
+      }
+      counts[1]++;
+    } else if (TRACE_READY_IN == base) {
+      if (!ready_in_set)
+      {
+        hardware.expander_in[replay.firmware.ready_in_left_pin]  = (record.type & 0x01) ? active : !active;
+        hardware.expander_in[replay.firmware.ready_in_right_pin] = (record.type & 0x02) ? active : !active;
+        ready_in_set = true;
+      }
+      counts[2]++;
+    } else if (TRACE_SERIAL == record.type) {
+      counts[3]++;
+    } else if (TRACE_MQTT == record.type) {
+      counts[4]++;
+    } else if (TRACE_CAN == base) {
+      counts[5]++;
+    } else if (TRACE_STATE == record.type) {
+      counts[6]++;
+    }
+  }
+
+  // The rail is wherever the trace says it was, so a restored position agrees with the limit switch
+  hardware.y_limit_steps = (int32_t)lround(*replay.firmware.home_switch_offset * replay.firmware.steps_per_mm)
+                           + *replay.firmware.limit_backoff - start_steps;
+
+  auto wall_start = std::chrono::steady_clock::now();
+
+  // Power on and wait for the state the trace started in
+  simSelectHardware(&hardware);
+  replay.firmware.setup();
+  while (replay.firmware.state() != start_state && replay.nowMs() < REPLAY_SETUP_TIMEOUT_MS)
+  {
+    replay.step();
+  }
+  if (replay.firmware.state() != start_state)
+  {
+    fprintf(stderr, "Firmware didn't reach state %u after setup, it's in %u\n", start_state, replay.firmware.state());
+    return 2;
+  }
+
+  // Have the replay trace itself, and line the recorded times up with its start
+  replay.sendLine("M550 S2");
+  std::vector<TraceRecord> replayed;
+  uint64_t give_up_ms = replay.nowMs() + REPLAY_DRAIN_TIMEOUT_MS;
+  while (replay.ownTrace(replayed) != DECODE_BAD && replayed.empty() && replay.nowMs() < give_up_ms)
+  {
+    replay.step();
+  }
+  if (replayed.empty())
+  {
+    fprintf(stderr, "Firmware didn't start its own trace\n");
+    return 1;
+  }
+  int64_t offset_us = ((int64_t)replayed[0].time_ms - recorded[0].time_ms) * 1000;
+  auto replayUs = [&](const TraceRecord &record) { return (uint64_t)(record.time_ms * 1000LL + offset_us); };
+
+  std::vector<const TraceRecord*> events;  // Delivered from the replay loop
+  for (const TraceRecord &record : recorded)
+  {
+    uint64_t at_us = replayUs(record);
+    uint8_t  base  = record.type & 0xF0;
+    if (TRACE_SENSOR == base && (record.type & 0x0F) < SIM_SENSOR_COUNT) {
+      hardware.sensor_changes.push_back({ at_us, (uint8_t)(record.type & 0x0F), record.u16(0) });
+    } else if (TRACE_READY_IN == base) {
+      hardware.expander_changes.push_back({ at_us, replay.firmware.ready_in_left_pin,
+                                            (uint16_t)((record.type & 0x01) ? active : !active) });
+      hardware.expander_changes.push_back({ at_us, replay.firmware.ready_in_right_pin,
+                                            (uint16_t)((record.type & 0x02) ? active : !active) });
+    } else if (TRACE_SERIAL == record.type || TRACE_MQTT == record.type || TRACE_CAN == base) {
+      events.push_back(&record);
+    }
+  }
+
+  // Replay
+  uint64_t end_us = replayUs(recorded.back()) + (uint64_t)(tail_s * 1e6);
+  size_t next_event = 0;
+  unsigned mqtt_skipped = 0;
+  while (hardware.now_us <= end_us)
+  {
+    while (next_event < events.size() && replayUs(*events[next_event]) <= hardware.now_us)
+    {
+      const TraceRecord &record = *events[next_event++];
+      if (TRACE_SERIAL == record.type)
+      {
+        replay.sendLine(std::string(record.data.begin() + 2, record.data.end()));
+      } else if (TRACE_MQTT == record.type) {
+        if (!hardware.mqtt_callback)
+        {
+          mqtt_skipped++;
+          continue;
+        }
+        std::vector<uint8_t> payload(record.data.begin() + 2, record.data.end());
+        char topic[] = REPLAY_MQTT_TOPIC;
+        hardware.mqtt_callback(topic, payload.data(), payload.size());
+      } else {
+        SimCanFrame frame;
+        frame.id  = record.u32(0);
+        frame.dlc = record.type & 0x0F;
+        memcpy(frame.data, &record.data[4], frame.dlc);
+        hardware.can_rx.push_back(frame);
+      }
+    }
+    replay.step();
+  }
+
+  // Stop the replay's trace and let the rest of it out
+  replay.sendLine("M550 S0");
+  give_up_ms = replay.nowMs() + REPLAY_DRAIN_TIMEOUT_MS;
+  while (replay.ownTrace(replayed) == DECODE_TRUNCATED && replay.nowMs() < give_up_ms)
+  {
+    replay.step();
+  }
+  simSelectHardware(nullptr);
+  double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+  // Compare the state changes
+  std::vector<StateChange> expected = stateChanges(recorded);
+  std::vector<StateChange> actual   = stateChanges(replayed);
+  size_t   matched  = 0;
+  uint32_t max_skew = 0;
+  while (matched < expected.size() && matched < actual.size()
+         && expected[matched].state == actual[matched].state)
+  {
+    uint32_t skew = expected[matched].at_ms > actual[matched].at_ms ? expected[matched].at_ms - actual[matched].at_ms
+                                                                    : actual[matched].at_ms - expected[matched].at_ms;
+    max_skew = skew > max_skew ? skew : max_skew;
+    matched++;
+  }
+  // Anything the replay did after the recording stopped doesn't count
+  uint32_t recorded_ms = recorded.back().time_ms - recorded[0].time_ms;
+  size_t   compared    = actual.size();
+  while (compared > matched && actual[compared - 1].at_ms > recorded_ms)
+  {
+    compared--;
+  }
+  bool same = matched == expected.size() && matched == compared;
+
+  printf("Trace:  %zu records over %.1f s from state %u\n", recorded.size(), recorded_ms / 1000.0, start_state);
+  printf("        %u settings, %u sensor, %u ready-in, %u serial, %u MQTT, %u CAN, %u state changes\n",
+         counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6]);
+  if (mqtt_skipped)
+  {
+    printf("        %u MQTT batches skipped, the firmware has no MQTT callback\n", mqtt_skipped);
+  }
+  printf("Replay: %zu of %zu state changes matched, timing within %u ms\n", matched, expected.size(), max_skew);
+  if (!same)
+  {
+    if (matched < expected.size())
+    {
+      printf("        expected state %u at %.3f s, ", expected[matched].state, expected[matched].at_ms / 1000.0);
+    } else {
+      printf("        expected no more state changes, ");
+    }
+    if (matched < actual.size())
+    {
+      printf("replay went to %u at %.3f s\n", actual[matched].state, actual[matched].at_ms / 1000.0);
+    } else {
+      printf("replay stayed in %u\n", matched > 0 ? actual[matched - 1].state : start_state);
+    }
+  }
+  printf("Ran %.1f s of trace in %.2f s, %.0fx real time\n", recorded_ms / 1000.0, wall_s,
+         wall_s > 0 ? recorded_ms / 1000.0 / wall_s : 0);
+
+  return same ? 0 : 2;
+}
@@ -1,8 +1,6 @@
 #ifndef H_GCODE
 #define H_GCODE
 
-String g_input_buffer = "";
-
 #define GCODE_HOME              28
 #define GCODE_MOVE               0
 #define MCODE_SPINDLE_RIGHT     03
@@ -11,40 +9,19 @@ String g_input_buffer = "";
 
 
 /*
-  Look for character /code/ in the inputBuffer and read the float that immediately follows it.
-  @return the value found.  If nothing is found, /default_value/ is returned.
-  @input code the character to look for.
-  @input defaultVal the return value if /code/ is not found.
-*/
-float parseGCodeParameter(char code, float default_value) {
-  int code_position = g_input_buffer.indexOf(code);
-  if (code_position != -1)  // The code has been found in the buffer.
-  {
-    // Find the end of the number (separated by " " (space))
-    int delimiter_position = g_input_buffer.indexOf(" ", code_position + 1);
-    float parsed_value = g_input_buffer.substring(code_position + 1, delimiter_position).toFloat();
-    return parsed_value;
-  } else {
-    return default_value;
-  }
-}
-
-
-/*
-
+  Parse and carry out one line of G-code. Anything after a ';' is a comment.
 */
-void processGCodeMessage()
+void processGCodeMessage(const char* line)
 {
   uint8_t valid_command_found = false;
   int8_t  command_code = -1;
 
-  // Strip comments
-  g_input_buffer.remove(g_input_buffer.indexOf(";"));
-  g_input_buffer.trim();
+  conveyor_core::GCodeWords words;
+  words.parse(line);
 
   /*-- Check for G-code messages --*/
   // Extract the command, default -1 if not found
-  command_code = parseGCodeParameter('G', -1);
+  command_code = words.value('G', -1);
 
   switch (command_code)
   {
@@ -52,15 +29,17 @@ void processGCodeMessage()
       {
         valid_command_found = true;
         Serial.println("Homing start");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Homing start");
-#endif
+        if (features_t::mqtt)
+        {
+          client.publish(g_mqtt_tele_topic, "Homing start");
+        }
         homeYAxis();
         g_homed = true;
         Serial.println("Homing complete");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Homing complete");
-#endif
+        if (features_t::mqtt)
+        {
+          client.publish(g_mqtt_tele_topic, "Homing complete");
+        }
         break;
       }
 
@@ -77,16 +56,17 @@ void processGCodeMessage()
         }
 
         // Extract the requested position from the GCODE message.
-        float requested_y_position = parseGCodeParameter('Y', 0);
+        float requested_y_position = words.value('Y', 0);
         if (requested_y_position > MAXIMUM_CONVEYOR_POSITION)
         {
           Serial.print("Can't move to greater than ");
           Serial.print(MAXIMUM_CONVEYOR_POSITION);
           Serial.println("mm");
-#if ENABLE_MQTT
-          sprintf(g_mqtt_message_buffer, "Can't move to greater than %i mm", MAXIMUM_CONVEYOR_POSITION);
-          client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
-#endif
+          if (features_t::mqtt)
+          {
+            sprintf(g_mqtt_message_buffer, "Can't move to greater than %i mm", MAXIMUM_CONVEYOR_POSITION);
+            client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+          }
           break;
         }
 
@@ -95,10 +75,11 @@ void processGCodeMessage()
           Serial.print("Can't move to smaller than ");
           Serial.print(MINIMUM_CONVEYOR_POSITION);
           Serial.println("mm");
-#if ENABLE_MQTT
-          sprintf(g_mqtt_message_buffer, "Can't move to less than %i mm", MINIMUM_CONVEYOR_POSITION);
-          client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
-#endif
+          if (features_t::mqtt)
+          {
+            sprintf(g_mqtt_message_buffer, "Can't move to less than %i mm", MINIMUM_CONVEYOR_POSITION);
+            client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+          }
           break;
         }
 
@@ -118,11 +99,12 @@ void processGCodeMessage()
         Serial.print("Steps to move: ");
         Serial.println(movement_steps);
 
-#if ENABLE_MQTT
-        sprintf(g_mqtt_message_buffer, "Current: %.2f, Requested: %.2f, Delta: %.2f, Steps: %i",
-                g_current_y_position, requested_y_position, y_position_delta, movement_steps);
-        client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
-#endif
+        if (features_t::mqtt)
+        {
+          sprintf(g_mqtt_message_buffer, "Current: %.2f, Requested: %.2f, Delta: %.2f, Steps: %i",
+                  g_current_y_position, requested_y_position, y_position_delta, movement_steps);
+          client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+        }
 
         yAxisStepper.step(movement_steps);
         g_current_y_position = requested_y_position;
@@ -132,7 +114,7 @@ void processGCodeMessage()
 
   /*-- Check for M-code messages --*/
   // Extract the command, default -1 if not found
-  command_code = parseGCodeParameter('M', -1);
+  command_code = words.value('M', -1);
 
   switch (command_code)
   {
@@ -141,12 +123,13 @@ void processGCodeMessage()
         valid_command_found = true;
         g_y_direction = STOP;
         // Extract the requested speed from the GCODE message.
-        uint16_t requested_speed = parseGCodeParameter('S', -1);
+        uint16_t requested_speed = words.value('S', -1);
         setRequestedSpeed(requested_speed);
         Serial.println("Conveyor stop");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Conveyor stop");
-#endif
+        if (features_t::mqtt)
+        {
+          client.publish(g_mqtt_tele_topic, "Conveyor stop");
+        }
         break;
       }
 
@@ -155,12 +138,13 @@ void processGCodeMessage()
         valid_command_found = true;
         g_y_direction       = RIGHT;
         // Extract the requested speed from the GCODE message.
-        uint16_t requested_speed = parseGCodeParameter('S', -1);
+        uint16_t requested_speed = words.value('S', -1);
         setRequestedSpeed(requested_speed);
         Serial.println("Conveyor right");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Conveyor right");
-#endif
+        if (features_t::mqtt)
+        {
+          client.publish(g_mqtt_tele_topic, "Conveyor right");
+        }
         break;
       }
 
@@ -169,12 +153,13 @@ void processGCodeMessage()
         valid_command_found = true;
         g_y_direction       = LEFT;
         // Extract the requested speed from the GCODE message.
-        uint16_t requested_speed = parseGCodeParameter('S', -1);
+        uint16_t requested_speed = words.value('S', -1);
         setRequestedSpeed(requested_speed);
         Serial.println("Conveyor left");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Conveyor left");
-#endif
+        if (features_t::mqtt)
+        {
+          client.publish(g_mqtt_tele_topic, "Conveyor left");
+        }
         break;
       }
   }
@@ -182,9 +167,10 @@ void processGCodeMessage()
   if (!valid_command_found)
   {
     Serial.println("Unknown or empty command ignored");
-#if ENABLE_MQTT
-    client.publish(g_mqtt_tele_topic, "Unknown or empty command ignored");
-#endif
+    if (features_t::mqtt)
+    {
+      client.publish(g_mqtt_tele_topic, "Unknown or empty command ignored");
+    }
   }
 }
 
@@ -5,7 +5,9 @@
 
   Controlled using GCODE. Understands these codes:
 
-  "G28" does a Y-axis homing sequence. Arguments are ignored.
+  "G28" does a Y-axis homing sequence.
+  "G28 O" homes only if the saved width isn't known.
+  "G28 V" homes, checks the steps against the saved width, then goes back to it. See position.h
   "G0 Y<distance>" move the Y axis to the defined mm width.
 
   "M03 S<speed>"           Set the direction as clockwise (left to right) (default).
@@ -26,10 +28,40 @@
   "M57 S<speed> P<dwell>"  Unload at a timed interval
   "M58 S<speed>"           Load and unload when ready-in/out                **NOT YET IMPLEMENTED**
   "M59 S<speed> P<dwell>"  Load when ready-in/out, unload at timed interval **NOT YET IMPLEMENTED**
+  "M60 S<speed> P<gap>"    Unload when ready-in/out, <gap> mm between boards
+  "M61 S<speed> P<pitch>"  Unload when ready-in/out, <pitch> mm between leading edges
 
-  The <speed> argument is in mm/minute. Range is 600 - 2200mm/min.
+  "M112"                   Emergency stop, latched until M999. See estop.h
+  "M999"                   Clear an emergency stop
 
-  The <dwell> argument is in seconds.
+  "M500"                   Save the runtime parameters to NVS. See parameters.h
+  "M501"                   Load the saved parameters
+  "M502"                   Go back to the default parameters
+  "M503"                   Report the parameters as M510 commands
+  "M510 P<n> S<value>"     Set parameter <n> to <value>
+
+  "M520 R<n> "<name>" Y<width> S<speed> U<mode>"  Store recipe <n>. See recipes.h for the other arguments
+  "M521 R<n>"              Change over to recipe <n>, or M521 "<name>"
+  "M522"                   Report the stored recipes as M520 commands
+  "M523 R<n>"              Delete recipe <n>
+
+  "M530"                   Calibrate the sensors against the empty belt. See pcb_sensors.h
+  "M530 S<mm>"             Set the sensor offsets from a target <mm> away
+  "M531"                   Report the sensor calibration and timing budget
+  "M540"                   Report the lengths, gaps and velocities of the last boards. See measurement.h
+  "M550 S<0|1|2>"          Record an input trace: 0 stop, 1 into RAM, 2 streamed. See trace.h
+  "M551"                   Stop recording and write out the trace
+  "M560"                   Report free heap and spare stack. See memory.h
+  "M570"                   Report this shift's production figures. See oee.h
+  "M571"                   Report this shift and start the next one
+
+  The <speed> argument is in mm/minute. Range is the minimum_speed and
+  maximum_speed parameters (M510 P1 and P2), 600 - 2200mm/min by default.
+
+  The <dwell> argument is in seconds. <gap> and <pitch> are up to MAXIMUM_SPACING mm.
+
+  "M55"-"M61" ... F<0|1>  Flow direction for this job: 0 left to right, 1 right to left. See flow.h
+  "M510 P19 S<0|1>"        Default flow direction, used when F isn't given
 
   NOTE: There is no way to set the speed of the conveyor without giving
   left / right / stop as well. Perhaps add a config value for speed. Allan
@@ -84,7 +116,6 @@
     - After rebooting, it won't respond to serial comms.
 
   TO DO:
-    - PANIC stop!
     - Power to stepper through NC pins of limit switch at front position to prevent close collisions
     - Select pins for:
       - Read "s88 automation standard"
@@ -104,12 +135,22 @@
 #include <ESPmDNS.h>                  // For OTA
 #include <WiFiUdp.h>                  // For OTA
 #include <ArduinoOTA.h>               // For OTA
+#if ENABLE_WEBSOCKET
+#include <WebSocketsServer.h>         // By Markus Sattler, for the local endpoint
+#endif
 #if ENABLE_LCD
 #include <Arduino_GFX_Library.h>      // SPI LCD
 #endif
 #include <CAN.h>                      // By Sandeep Mistry
 #include "Adafruit_VL53L0X.h"         // For ToF board sensors
 #include <Adafruit_MCP23X17.h>        // For ToF sensors and in/out connections
+#include <Preferences.h>              // For saved parameters in NVS
+#include <ConveyorCore.h>             // Parser, speed mapping and framing shared with the other variants
+#ifdef ARDUINO_ARCH_ESP32
+#include <soc/ledc_struct.h>          // Register access for the emergency stop
+#include <soc/gpio_struct.h>
+#include <esp_ota_ops.h>              // Staging and rolling back OTA updates
+#endif
 
 /*--------------------------- Global Variables ------------------------------*/
 #define  STOP   0
@@ -122,6 +163,7 @@
 #define  STATE_BEGIN       0
 #define  STATE_IDLE        1
 #define  STATE_ERROR       2
+#define  STATE_ESTOP       3     // Emergency stop, latched until M999
 #define  STATE_STOPPED    10
 #define  STATE_CONSTANT   11
 
@@ -140,6 +182,8 @@
 #define  STATE_UNLOAD_RIRO_REACHED_END  562
 #define  STATE_UNLOAD_RIRO_CLEARED_END  563
 #define  STATE_UNLOAD_RIRO_RUNON        564
+#define  STATE_UNLOAD_RIRO_PRESTART     565   // Moving to the exit before ready-in, see prestart.h
+#define  STATE_UNLOAD_RIRO_HOLD         566   // At the exit, waiting for ready-in
 
 // M57 S<speed> P<interval>: Unload boards at timed intervals. This assumes boards are
 // already sitting on the conveyor. Ignores ready-in/out.
@@ -149,29 +193,44 @@
 #define  STATE_UNLOAD_TIMED_CLEARED_END 573
 #define  STATE_UNLOAD_TIMED_PAUSE       574
 
+// Unload at a constant gap or pitch (M60, M61)
+// Boards are held at the exit until the one before is far enough ahead
+#define  STATE_UNLOAD_SPACED_BEGIN       600
+#define  STATE_UNLOAD_SPACED_MOVING      601
+#define  STATE_UNLOAD_SPACED_REACHED_END 602
+#define  STATE_UNLOAD_SPACED_CLEARED_END 603
+#define  STATE_UNLOAD_SPACED_HOLD        604
+
 #define  OUT_OF_RANGE           4     // TOF sensors return 4 when out of range
 
 uint8_t  g_homed              = false;
 uint16_t g_state              = STATE_BEGIN;
 uint32_t g_last_state_change  = 0;    // timestamp of last state change
 uint32_t step_count           = 0;
-float    g_current_y_position = 0.0;
+int32_t  g_y_steps            = 0;    // Rail position, steps from zero width. See position.h
 
 uint8_t  g_x_direction        = STOP; //
+uint8_t  g_flow_direction     = RIGHT;  // Belt direction that moves boards downstream, see flow.h
 uint16_t g_x_requested_speed  = 0;    // mm/min
 uint16_t g_x_actual_speed     = 0;    // mm/min
 int16_t  g_requested_pause    = 0;    // Seconds. -1 indicates not set or invalid
+uint16_t g_requested_spacing  = 0;    // mm, gap for M60 or pitch for M61
+bool     g_spacing_pitch      = false;  // Spacing is leading edge to leading edge (M61)
+uint32_t g_spacing_lead       = 0;    // millis() the last board's leading edge left
+uint32_t g_spacing_tail       = 0;    // millis() its trailing edge left
 
-#define  MAX_SERIAL_INPUT             50
+#define  MAX_SERIAL_INPUT             96  // Longer serial lines are rejected, not run
+#define  SERIAL_PENDING_SIZE         256  // Serial read during a move, run once it's over
 
 // Wifi
-#define  WIFI_CONNECT_INTERVAL       500   // Wait 500ms intervals for wifi connection
-#define  WIFI_CONNECT_MAX_ATTEMPTS    10   // Number of attempts/intervals to wait
+#define  WIFI_RETRY_INTERVAL       30000   // ms to wait for WiFi before starting again
+#define  MQTT_RETRY_INTERVAL        5000   // ms between attempts to connect to the broker
 
 // MQTT
 char g_mqtt_message_buffer[150];      // General purpose buffer for MQTT messages
 char g_mqtt_command_topic[50];        // MQTT topic for receiving commands
 char g_mqtt_tele_topic[50];           // MQTT topic for telemetry
+char g_mqtt_result_topic[50];         // MQTT topic for command results
 
 // LCD
 uint16_t g_lcd_width       = 0;
@@ -190,28 +249,57 @@ uint8_t  g_exit_sensor_count = 0;
 // Ready-in / Ready-out handshaking
 bool     g_ready_in_left   = false;
 bool     g_ready_in_right  = false;
+bool     g_ready_in_downstream = false;   // Whichever side is downstream, or CAN
 
 
 // General
 char g_device_id[23];                 // Unique ID from ESP chip ID
+typedef conveyor_core::Features<ENABLE_WIFI, ENABLE_MQTT> features_t;
 
 // State machine variables
 uint32_t g_runon_began      = 0;      // ms since runon began
 
 /*--------------------------- Function Signatures ---------------------------*/
+bool mqttPublish(const char* topic, const char* payload);
+void publishWebSocket(const char* topic, const char* payload);
+void process_state_machine();
 void initialise_pcb_sensors();
 void debug_sensor_values();
 void perform_state_transition(uint16_t g_state);
-
-/*--------------------------- Macros ----------------------------------------*/
-
-#if STATE_DEBUGGING
-#define STATE_DEBUG_PRINT(x) Serial.print(x)
-#define STATE_DEBUG_PRINTLN(x) Serial.println(x)
-#else
-#define STATE_DEBUG_PRINT(x)
-#define STATE_DEBUG_PRINTLN(x)
-#endif
+struct can_frame_t;
+void handleHandoffMessage(const can_frame_t &frame, uint8_t source_address);
+struct gcode_command_t;
+bool defineRecipe(const gcode_command_t &command);
+bool startChangeover(const gcode_command_t &command);
+bool deleteRecipe(const gcode_command_t &command);
+void reportRecipes();
+bool changeoverActive();
+bool calibrateSensors(float reference);
+void reportSensors();
+void reportMeasurements();
+bool spacingReached();
+bool entranceClearBy(uint16_t distance);
+bool startTrace(uint8_t mode);
+void stopTrace();
+void dumpTrace();
+void traceSensor(uint8_t index, uint16_t range);
+void traceReadyIn(bool left, bool right);
+void traceSerialLine(const char* line);
+void traceMqttBatch(const char* payload, uint16_t length);
+void traceCanFrame(uint32_t id, uint8_t dlc, const uint8_t* data);
+void traceState(uint16_t state);
+void pollSerialEmergencyStop();
+uint8_t entranceSensorIndex();
+uint8_t exitSensorIndex();
+uint8_t downstreamDirection();
+uint8_t upstreamAddress();
+uint8_t downstreamAddress();
+bool setCommandFlowDirection(int16_t f_value);
+void reportOee();
+bool prestartDue();
+void prestartTravelBegan();
+void prestartTravelEnded();
+void resetOee();
 
 /*--------------------------- Instantiate Global Objects --------------------*/
 Stepper yAxisStepper(steps_per_revolution, PIN_Y_IN1, PIN_Y_IN3, PIN_Y_IN2, PIN_Y_IN4);
@@ -225,20 +313,42 @@ Adafruit_VL53L0X pcb_sensor_r = Adafruit_VL53L0X();
 WiFiClient esp_client;
 PubSubClient client(esp_client);
 #endif
+#if ENABLE_WEBSOCKET
+WebSocketsServer g_websocket(WEBSOCKET_PORT);
+#endif
 
 #if ENABLE_LCD
-Arduino_DataBus *bus = new Arduino_ESP32SPI(21 /* DC */, 15 /* CS */, 14 /* SCK */, 13 /* MOSI */, -1 /* MISO */);
+Arduino_DataBus *bus = new Arduino_ESP32SPIDMA(21 /* DC */, 15 /* CS */, 14 /* SCK */, 13 /* MOSI */, -1 /* MISO */);
 Arduino_GFX *gfx = new Arduino_ST7796(bus, 22 /* RST */, 3 /* rotation */);
 #endif
 
 /*--------------------------- Program ---------------------------------------*/
 /* Resources */
+#include "logging.h"
+#include "memory.h"
+#include "parameters.h"
+#include "position.h"
+#include "estop.h"
 #include "motors.h"
+#include "jobs.h"
 #include "gcode.h"
 #include "mqtt_comms.h"
+#include "network.h"
 #include "serial_comms.h"
 #include "can_comms.h"
+#include "can_handoff.h"
+#include "recipes.h"
 #include "pcb_sensors.h"
+#include "measurement.h"
+#include "flow.h"
+#include "oee.h"
+#include "prestart.h"
+#include "ota.h"
+#include "websocket.h"
+#include "trace.h"
+#if ENABLE_LCD
+#include "display.h"
+#endif
 #include "riro.h"
 
 /*
@@ -248,7 +358,13 @@ void setup()
 {
   Serial.begin(SERIAL_BAUD_RATE);
 
+  loadParameters();
+  checkOtaTrial();
+  loadRecipes();
+  loadSensorCalibration();
+
   pinMode(LIMIT_SENSOR_Y_PIN,  INPUT );
+  restorePosition();
 
   // #define CONV_MAX_SPEED  2200 // mm/minute
   // M03 S2200
@@ -260,9 +376,8 @@ void setup()
   ledcAttachPin(PIN_X_IN1,          0);  // Pin, channel
   ledcAttachPin(PIN_X_IN2,          1);  // Pin, channel
 
-  g_input_buffer.reserve(MAX_SERIAL_INPUT);
-  yAxisStepper.setSpeed(13);  // RPM. Experiment with setting this higher.
-
+  yAxisStepper.setSpeed(Y_AXIS_SPEED);
+  initialiseEmergencyStop();
 
 #if ENABLE_LCD
   pinMode(TFT_BL_PIN,          OUTPUT);
@@ -288,8 +403,6 @@ void setup()
   gfx->println("");
 #endif
 
-  WiFi.mode(WIFI_STA);
-
   // We need a unique device ID for our MQTT client connection
   uint64_t chip_id = ESP.getEfuseMac(); // The chip ID is essentially its MAC address (length 6 bytes)
   uint16_t chip = (uint16_t)(chip_id >> 32);
@@ -298,13 +411,19 @@ void setup()
   Serial.println(g_device_id);
 
   // Set up MQTT topics
-  sprintf(g_mqtt_command_topic, "cmnd/%s/COMMAND",  g_device_id);  // For receiving commands
-  sprintf(g_mqtt_tele_topic,    "tele/%s/TELE",     g_device_id);  // For telemetry
+  snprintf(g_mqtt_command_topic, sizeof(g_mqtt_command_topic), "cmnd/%s/COMMAND", g_device_id);  // For receiving commands
+  snprintf(g_mqtt_tele_topic,    sizeof(g_mqtt_tele_topic),    "tele/%s/TELE",    g_device_id);  // For telemetry
+  snprintf(g_mqtt_result_topic,  sizeof(g_mqtt_result_topic),  "stat/%s/RESULT",  g_device_id);  // For command results
+  snprintf(g_mqtt_job_topic,     sizeof(g_mqtt_job_topic),     "stat/%s/JOB",     g_device_id);  // For job events
+  snprintf(g_mqtt_config_topic,  sizeof(g_mqtt_config_topic),  "stat/%s/CONFIG",  g_device_id);  // For parameter reports
 
   // Report the MQTT topics to the serial console
   Serial.println("MQTT topics:");
   Serial.println(g_mqtt_command_topic);     // For receiving commands
   Serial.println(g_mqtt_tele_topic);        // For telemetry
+  Serial.println(g_mqtt_result_topic);      // For command results
+  Serial.println(g_mqtt_job_topic);         // For job events
+  Serial.println(g_mqtt_config_topic);      // For parameter reports
 
 #if ENABLE_LCD
   // Report the MQTT topics to the LCD
@@ -330,6 +449,7 @@ void setup()
     mcp23017.digitalWrite(PCB_SENSOR_L_XSHUT, LOW);
     mcp23017.digitalWrite(PCB_SENSOR_M_XSHUT, LOW);
     mcp23017.digitalWrite(PCB_SENSOR_R_XSHUT, LOW);
+    initialise_riro();
   } else {
     Serial.println("MCP23017 failed to initialise");
   }
@@ -337,73 +457,10 @@ void setup()
   // Set up PCB sensors
   initialise_pcb_sensors();
 
-  // Connect to WiFi
-  if (initWifi()) {
-    Serial.println("Wifi [CONNECTED]");
-    Serial.println(WiFi.localIP());
-    while (WiFi.waitForConnectResult() != WL_CONNECTED) {
-      Serial.println("Connection Failed! Rebooting...");
-      delay(1000);
-      ESP.restart();
-    }
-    // Port defaults to 3232
-    // ArduinoOTA.setPort(3232);
-
-    // Hostname defaults to esp3232-[MAC]
-    // ArduinoOTA.setHostname("myesp32");
-
-    // No authentication by default
-    // ArduinoOTA.setPassword("admin");
-
-    // Password can be set with it's md5 value as well
-    // MD5(admin) = 21232f297a57a5a743894a0e4a801fc3
-    // ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
-    ArduinoOTA.onStart([]()
-    {
-      String type;
-      if (ArduinoOTA.getCommand() == U_FLASH)
-        type = "sketch";
-      else // U_SPIFFS
-        type = "filesystem";
-
-      // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
-      Serial.println("Start updating " + type);
-    })
-    .onEnd([]() {
-      Serial.println("\nEnd");
-    })
-    .onProgress([](unsigned int progress, unsigned int total) {
-      Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
-    })
-    .onError([](ota_error_t error) {
-      Serial.printf("Error[%u]: ", error);
-      if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
-      else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
-      else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
-      else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
-      else if (error == OTA_END_ERROR) Serial.println("End Failed");
-    });
-
-    ArduinoOTA.begin();
-#if ENABLE_LCD
-    gfx->setTextColor(WHITE);
-    gfx->print(" IP Address: ");
-    gfx->setTextColor(GREEN);
-    gfx->println(WiFi.localIP());
-#endif
-  } else {
-    Serial.println("Wifi [FAILED]");
-#if ENABLE_LCD
-    gfx->setTextColor(WHITE);
-    gfx->print(" IP Address: ");
-    gfx->setTextColor(RED);
-    gfx->println("FAILED");
-#endif
-  }
-
   /* Set up the MQTT client */
   client.setServer(mqtt_broker, 1883);
   client.setCallback(callback);
+  client.setBufferSize(MQTT_BUFFER_SIZE);
 
   /* Set up the CAN interface */
   if (ESP.getChipRevision() >= 2)
@@ -414,6 +471,7 @@ void setup()
     } else {
       Serial.print("CAN 2 initialised at ");
       Serial.println(CAN_BUS_SPEED);
+      startCANReceive();
     }
   } else {
     if (!CAN.begin(250E3))
@@ -422,8 +480,19 @@ void setup()
     } else {
       Serial.print("CAN initialised at ");
       Serial.println(250E3);
+      startCANReceive();
     }
   }
+
+  watchTaskStack("loop", xTaskGetCurrentTaskHandle());
+
+  // WiFi, MQTT and OTA come up in the background
+  startNetwork();
+
+#if ENABLE_LCD
+  // The banner stays up until the dashboard takes over
+  startDisplay();
+#endif
 }
 
 /*
@@ -431,23 +500,30 @@ void setup()
 */
 void loop()
 {
-#if ENABLE_WIFI
-  if (WiFi.status() == WL_CONNECTED)
-  {
-    if (!client.connected()) {
-      reconnectMqtt();
-    }
-  }
-  client.loop();  // Process any outstanding MQTT messages
-  ArduinoOTA.handle();
-#endif
+  serviceEmergencyStop();
+  serviceNetwork();
   listenToSerialStream();
-  //readCANMessages();
+  serviceWebSocket();
+  readCANMessages();
+  serviceFlowDirection();
   setConveyorMotorSpeed();
   read_pcb_sensors();
+  serviceMeasurement();
+  updateHandoff();
   //debug_sensor_values();
   process_state_machine();
+  serviceChangeover();
+  serviceYAxis();
   check_ready_in();
+  servicePrestart();
+  serviceOee();
+#if ENABLE_LCD
+  updateDisplay();
+#endif
+  serviceLog();
+  serviceTrace();
+  serviceMemory();
+  serviceOta();
 }
 
 void process_state_machine()
@@ -462,14 +538,18 @@ void process_state_machine()
       g_x_direction = STOP;
       break;
 
+    case STATE_ESTOP:  // 3
+      g_x_direction = STOP;
+      break;
+
     case STATE_ERROR:
-      Serial.println("ERROR STATE");
+      LOG_ERROR(LOG_STATE_ERROR);
       g_x_direction = STOP;
       break;
 
     /* UNLOAD_NOW block */
     case STATE_UNLOAD_NOW_BEGIN:  //
-      g_x_direction = RIGHT;
+      g_x_direction = downstreamDirection();
       setConveyorMotorSpeed();
       perform_state_transition(STATE_UNLOAD_NOW_MOVING);
       break;
@@ -480,7 +560,7 @@ void process_state_machine()
       {
         perform_state_transition(STATE_UNLOAD_NOW_REACHED_END);
       }
-      if (millis() > g_last_state_change + (UNLOAD_TIMEOUT * 1000))
+      if (millis() > g_last_state_change + (g_params.unload_timeout * 1000UL))
       {
         g_x_direction = STOP;
         perform_state_transition(STATE_IDLE);
@@ -489,16 +569,10 @@ void process_state_machine()
 
     case STATE_UNLOAD_NOW_REACHED_END:  //
       // Check exit sensor
-      if (UNTRIPPED == g_exit_sensor)
+      if (exitSensorSettled(UNTRIPPED))
       {
-        g_exit_sensor_count++;
-        if (g_exit_sensor_count > SENSOR_DEBOUNCE_COUNT)
-        {
-          g_exit_sensor_count = 0;
-          perform_state_transition(STATE_UNLOAD_NOW_CLEARED_END);
-        }
-      } else {
-        g_exit_sensor_count = 0;
+        handoffBoardTransferred();
+        perform_state_transition(STATE_UNLOAD_NOW_CLEARED_END);
       }
       break;
 
@@ -510,7 +584,7 @@ void process_state_machine()
 
     case STATE_UNLOAD_NOW_RUNON:  //
       // Check the runon timer
-      if (millis() > g_runon_began + RUNON_TIME)
+      if (millis() > g_runon_began + g_params.runon_time)
       {
         g_x_direction = STOP;
         perform_state_transition(STATE_IDLE);
@@ -521,39 +595,67 @@ void process_state_machine()
     /* UNLOAD_RIRO block */
     case STATE_UNLOAD_RIRO_BEGIN:  //
       //g_x_direction = STOP;
-      if (g_ready_in_right)
+      // Wait for a board as well as ready-in, otherwise an empty belt runs
+      // until UNLOAD_TIMEOUT and drops out of the mode
+      if (g_board_count > 0 && (g_ready_in_downstream || prestartDue()))
       {
-        perform_state_transition(STATE_UNLOAD_RIRO_MOVING);
+        prestartTravelBegan();
+        perform_state_transition(g_ready_in_downstream ? STATE_UNLOAD_RIRO_MOVING : STATE_UNLOAD_RIRO_PRESTART);
       }
       break;
 
     case STATE_UNLOAD_RIRO_MOVING:  //
-      g_x_direction = RIGHT;
+      g_x_direction = downstreamDirection();
       setConveyorMotorSpeed();
       // Check exit sensor
       if (TRIPPED == g_exit_sensor)
       {
+        prestartTravelEnded();
         perform_state_transition(STATE_UNLOAD_RIRO_REACHED_END);
       }
-      if (millis() > g_last_state_change + (UNLOAD_TIMEOUT * 1000))
+      if (millis() > g_last_state_change + (g_params.unload_timeout * 1000UL))
       {
         g_x_direction = STOP;
         perform_state_transition(STATE_IDLE);
       }
       break;
 
+    // Moving towards the exit before ready-in, see prestart.h
+    case STATE_UNLOAD_RIRO_PRESTART:  //
+      g_x_direction = downstreamDirection();
+      setConveyorMotorSpeed();
+      if (g_ready_in_downstream)
+      {
+        perform_state_transition(STATE_UNLOAD_RIRO_MOVING);
+      } else if (TRIPPED == g_exit_sensor) {
+        prestartTravelEnded();
+        g_x_direction = STOP;
+        setConveyorMotorSpeed();
+        LOG_DEBUG(LOG_PRESTART_HOLD);
+        perform_state_transition(STATE_UNLOAD_RIRO_HOLD);
+      }
+      if (millis() > g_last_state_change + (g_params.unload_timeout * 1000UL))
+      {
+        g_x_direction = STOP;
+        perform_state_transition(STATE_IDLE);
+      }
+      break;
+
+    // Board waiting at the exit for ready-in
+    case STATE_UNLOAD_RIRO_HOLD:  //
+      g_x_direction = STOP;
+      if (g_ready_in_downstream)
+      {
+        perform_state_transition(STATE_UNLOAD_RIRO_MOVING);
+      }
+      break;
+
     case STATE_UNLOAD_RIRO_REACHED_END:  //
       // Check exit sensor
-      if (UNTRIPPED == g_exit_sensor)
+      if (exitSensorSettled(UNTRIPPED))
       {
-        g_exit_sensor_count++;
-        if (g_exit_sensor_count > SENSOR_DEBOUNCE_COUNT)
-        {
-          g_exit_sensor_count = 0;
-          perform_state_transition(STATE_UNLOAD_RIRO_CLEARED_END);
-        }
-      } else {
-        g_exit_sensor_count = 0;
+        handoffBoardTransferred();
+        perform_state_transition(STATE_UNLOAD_RIRO_CLEARED_END);
       }
       break;
 
@@ -565,7 +667,7 @@ void process_state_machine()
 
     case STATE_UNLOAD_RIRO_RUNON:  //
       // Check the runon timer
-      if (millis() > g_runon_began + RUNON_TIME)
+      if (millis() > g_runon_began + g_params.runon_time)
       {
         g_x_direction = STOP;
         perform_state_transition(STATE_UNLOAD_RIRO_BEGIN);
@@ -575,7 +677,7 @@ void process_state_machine()
 
     /* UNLOAD_TIMED block */
     case STATE_UNLOAD_TIMED_BEGIN:  //
-      g_x_direction = RIGHT;
+      g_x_direction = downstreamDirection();
       setConveyorMotorSpeed();
       perform_state_transition(STATE_UNLOAD_TIMED_MOVING);
       break;
@@ -586,7 +688,7 @@ void process_state_machine()
       {
         perform_state_transition(STATE_UNLOAD_TIMED_REACHED_END);
       }
-      if (millis() > g_last_state_change + (UNLOAD_TIMEOUT * 1000))
+      if (millis() > g_last_state_change + (g_params.unload_timeout * 1000UL))
       {
         g_x_direction = STOP;
         perform_state_transition(STATE_IDLE);
@@ -595,35 +697,22 @@ void process_state_machine()
 
     case STATE_UNLOAD_TIMED_REACHED_END:  //
       // Check exit sensor
-      if (UNTRIPPED == g_exit_sensor)
+      if (exitSensorSettled(UNTRIPPED))
       {
-        g_exit_sensor_count++;
-        if (g_exit_sensor_count > SENSOR_DEBOUNCE_COUNT)
-        {
-          g_exit_sensor_count = 0;
-          perform_state_transition(STATE_UNLOAD_TIMED_CLEARED_END);
-        }
-      } else {
-        g_exit_sensor_count = 0;
+        handoffBoardTransferred();
+        perform_state_transition(STATE_UNLOAD_TIMED_CLEARED_END);
       }
       break;
 
     // Board has been unloaded, waiting for the next board to arrive at the exit
     case STATE_UNLOAD_TIMED_CLEARED_END:  //
       // Check exit sensor
-      if (TRIPPED == g_exit_sensor)
+      if (exitSensorSettled(TRIPPED))
       {
-        g_exit_sensor_count++;
-        if (g_exit_sensor_count > SENSOR_DEBOUNCE_COUNT)
-        {
-          g_exit_sensor_count = 0;
-          perform_state_transition(STATE_UNLOAD_TIMED_PAUSE);
-          Serial.println("Leaving");
-        }
-      } else {
-        g_exit_sensor_count = 0;
+        perform_state_transition(STATE_UNLOAD_TIMED_PAUSE);
+        LOG_DEBUG(LOG_TIMED_LEAVING);
       }
-      if (millis() > g_last_state_change + (UNLOAD_TIMEOUT * 1000))
+      if (millis() > g_last_state_change + (g_params.unload_timeout * 1000UL))
       {
         g_x_direction = STOP;
         perform_state_transition(STATE_IDLE);
@@ -635,11 +724,81 @@ void process_state_machine()
       // Check the pause timer
       if (millis() > g_last_state_change + (g_requested_pause * 1000))
       {
-        Serial.println("Leaving 2");
+        LOG_DEBUG(LOG_TIMED_RESUMING);
         perform_state_transition(STATE_UNLOAD_TIMED_BEGIN);
       }
       break;
 
+    /* UNLOAD_SPACED block */
+    case STATE_UNLOAD_SPACED_BEGIN:  //
+      g_x_direction = downstreamDirection();
+      setConveyorMotorSpeed();
+      perform_state_transition(STATE_UNLOAD_SPACED_MOVING);
+      break;
+
+    // Nothing ahead of the first board, so it only waits for downstream
+    case STATE_UNLOAD_SPACED_MOVING:  //
+      if (TRIPPED == g_exit_sensor)
+      {
+        if (g_ready_in_downstream)
+        {
+          g_spacing_lead = g_sensor_edges[EXIT_SENSOR].rise;
+          perform_state_transition(STATE_UNLOAD_SPACED_REACHED_END);
+        } else {
+          g_x_direction = STOP;
+          setConveyorMotorSpeed();
+          perform_state_transition(STATE_UNLOAD_SPACED_HOLD);
+        }
+      }
+      if (millis() > g_last_state_change + (g_params.unload_timeout * 1000UL))
+      {
+        g_x_direction = STOP;
+        perform_state_transition(STATE_IDLE);
+      }
+      break;
+
+    case STATE_UNLOAD_SPACED_REACHED_END:  //
+      // Check exit sensor
+      if (exitSensorSettled(UNTRIPPED))
+      {
+        g_spacing_tail = g_sensor_edges[EXIT_SENSOR].fall;
+        handoffBoardTransferred();
+        perform_state_transition(STATE_UNLOAD_SPACED_CLEARED_END);
+      }
+      break;
+
+    // Board has been unloaded, the next one is held at the exit if it's too close
+    case STATE_UNLOAD_SPACED_CLEARED_END:  //
+      if (TRIPPED == g_exit_sensor)
+      {
+        if (spacingReached() && g_ready_in_downstream)
+        {
+          g_spacing_lead = g_sensor_edges[EXIT_SENSOR].rise;
+          perform_state_transition(STATE_UNLOAD_SPACED_REACHED_END);
+        } else {
+          g_x_direction = STOP;
+          setConveyorMotorSpeed();
+          perform_state_transition(STATE_UNLOAD_SPACED_HOLD);
+        }
+      }
+      if (millis() > g_last_state_change + (g_params.unload_timeout * 1000UL))
+      {
+        g_x_direction = STOP;
+        perform_state_transition(STATE_IDLE);
+      }
+      break;
+
+    case STATE_UNLOAD_SPACED_HOLD:  //
+      if (spacingReached() && g_ready_in_downstream)
+      {
+        LOG_DEBUG(LOG_SPACED_RELEASE);
+        g_spacing_lead = millis();
+        g_x_direction  = downstreamDirection();
+        setConveyorMotorSpeed();
+        perform_state_transition(STATE_UNLOAD_SPACED_REACHED_END);
+      }
+      break;
+
     /* Catchall */
     default:
       perform_state_transition(STATE_ERROR);
@@ -650,49 +809,14 @@ void process_state_machine()
 
 void perform_state_transition(uint16_t new_state)
 {
-  STATE_DEBUG_PRINT  ("sm: [");
-  STATE_DEBUG_PRINT  (g_state);
-  STATE_DEBUG_PRINT  (" -> ");
-  STATE_DEBUG_PRINT  (new_state);
-  STATE_DEBUG_PRINT("] @ ");
-  STATE_DEBUG_PRINT(millis());
-  STATE_DEBUG_PRINT(", delta ");
-  STATE_DEBUG_PRINTLN(millis() - g_last_state_change);
+#if STATE_DEBUGGING
+  LOG_DEBUG(LOG_STATE_TRANSITION, g_state, new_state, millis(), millis() - g_last_state_change);
+#endif
 
+  updateJob(g_state, new_state);
+  updateOee(new_state);
+  traceState(new_state);
+  publishWebSocketState(new_state);
   g_state = new_state;
   g_last_state_change = millis();
 }
-
-
-/**
-  Connect to Wifi. Returns false if it can't connect.
-*/
-bool initWifi() {
-  // Clean up any old auto-connections
-  if (WiFi.status() == WL_CONNECTED) {
-    WiFi.disconnect();
-  }
-  WiFi.setAutoConnect(false);
-
-  // RETURN: No SSID, so no wifi!
-  if (sizeof(ssid) == 1) {
-    return false;
-  }
-
-  // Connect to wifi
-  WiFi.begin(ssid, password);
-
-  // Wait for connection set amount of intervals
-  int num_attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && num_attempts <= WIFI_CONNECT_MAX_ATTEMPTS)
-  {
-    delay(WIFI_CONNECT_INTERVAL);
-    num_attempts++;
-  }
-
-  if (WiFi.status() != WL_CONNECTED) {
-    return false;
-  } else {
-    return true;
-  }
-}
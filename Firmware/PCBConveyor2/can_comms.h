@@ -1,39 +1,562 @@
 #ifndef H_CAN_COMMS
 #define H_CAN_COMMS
 
+/*
+  CAN bus communications using J1939 framing
+
+  Frames are received by an interrupt handler and pushed into a queue, so
+  nothing is lost while loop() is busy. readCANMessages() then drains the
+  queue from the main loop.
+
+  The controller's acceptance filter only passes extended frames whose
+  destination address (the PS field of a PDU1 PGN) is J1939_SOURCE_ADDRESS,
+  so broadcast traffic such as status messages from other machines never
+  reaches the CPU.
+
+  Commands are sent to the conveyor as ASCII G-code in Proprietary A
+  (PGN 0xEF00) messages. Commands of up to 8 bytes fit in a single frame.
+  Longer ones use the J1939 transport protocol (RTS/CTS): the sender opens a
+  session with TP.CM RTS, the conveyor clears packets with CTS, the data
+  arrives in TP.DT frames and the conveyor confirms with End of Message Ack.
+  Missing or out-of-order packets are requested again with a new CTS.
+
+  The common operations also have a compact binary form, sent as Proprietary
+  A2 (PGN 0x1EF00) messages to the conveyor. Byte 0 selects the command and
+  the rest are little-endian parameters, decoded straight into a command
+  without going through the text parser:
+
+    0x01 Set speed      [1] direction 0=stop 1=right 2=left, [2-3] mm/min    (M03/M04/M05)
+    0x02 Unload         [1] mode 0=now 1=ready-in 2=timed, [2-3] mm/min,
+                        [4-5] dwell seconds                                  (M55/M56/M57)
+    0x03 Move width     [1-2] width in 0.1mm                                 (G0 Y)
+    0x04 Home                                                                (G28)
+    0x05 Status request
+    0x06 Emergency stop                                                      (M112)
+    0x10-0x12           Board handoff between neighbours, see can_handoff.h
+
+  Status is broadcast as Proprietary B (PGN 0xFF10) every CAN_STATUS_INTERVAL
+  ms and in reply to a status request:
+
+    [0-1] state, [2] flags, [3-4] requested speed mm/min,
+    [5-6] width in 0.1mm, [7] rolling counter
+
+  The emergency stop is acted on in the receive interrupt, before the frame
+  is queued, so it doesn't wait for loop(). See estop.h.
+
+  Flags: bit 0 homed, bit 1 entrance, bit 2 middle, bit 3 exit sensor
+  tripped, bit 4 ready-in left, bit 5 ready-in right, bits 6-7 direction
+  0=stop 1=right 2=left.
+*/
+
+#define J1939_PRIORITY_DEFAULT       6
+#define J1939_GLOBAL_ADDRESS      0xFF
+
+#define J1939_PGN_PROPRIETARY_A   0xEF00   // Peer-to-peer, used for G-code commands
+#define J1939_PGN_TP_CM           0xEC00   // Transport protocol connection management
+#define J1939_PGN_TP_DT           0xEB00   // Transport protocol data transfer
+#define J1939_PGN_PROPRIETARY_A2 0x1EF00   // Peer-to-peer, used for binary commands
+#define J1939_PGN_CONVEYOR_STATUS 0xFF10   // Proprietary B broadcast
+
+#define CAN_CMD_SET_SPEED         0x01
+#define CAN_CMD_UNLOAD            0x02
+#define CAN_CMD_MOVE_WIDTH        0x03
+#define CAN_CMD_HOME              0x04
+#define CAN_CMD_STATUS_REQUEST    0x05
+#define CAN_CMD_EMERGENCY_STOP    0x06
+#define CAN_CMD_READY_TO_RECEIVE  0x10     // Board handoff, see can_handoff.h
+#define CAN_CMD_BOARD_AVAILABLE   0x11
+#define CAN_CMD_BOARD_TRANSFERRED 0x12
+
+#define CAN_DIRECTION_STOP           0
+#define CAN_DIRECTION_RIGHT          1
+#define CAN_DIRECTION_LEFT           2
+
+#define CAN_UNLOAD_NOW               0
+#define CAN_UNLOAD_READY_IN          1
+#define CAN_UNLOAD_TIMED             2
+
+#define J1939_TP_CM_RTS             16
+#define J1939_TP_CM_CTS             17
+#define J1939_TP_CM_EOM_ACK         19
+#define J1939_TP_CM_BAM             32
+#define J1939_TP_CM_ABORT          255
+
+#define J1939_TP_ABORT_BUSY          1     // Already in a session
+#define J1939_TP_ABORT_RESOURCES     2     // Message too big, or its size and packet count don't match
+#define J1939_TP_ABORT_TIMEOUT       3
+
+#define J1939_TP_BYTES_PER_PACKET    7
+#define J1939_TP_TIMEOUT_T2       1250     // ms to wait for data after sending CTS
+#define J1939_TP_PACKETS_PER_CTS     8     // Packets we clear at a time
+
+struct can_frame_t
+{
+  uint32_t id;
+  uint8_t  dlc;
+  uint8_t  data[8];
+  uint32_t received_us;          // micros() when it was copied out of the controller
+};
+
+can_frame_t       g_can_rx_queue[CAN_RX_QUEUE_SIZE];
+volatile uint16_t g_can_rx_head     = 0;   // Written by the ISR only
+volatile uint16_t g_can_rx_tail     = 0;   // Written by readCANMessages() only
+volatile uint32_t g_can_rx_overflow = 0;   // Frames lost because the queue was full
+
+// Transport protocol receive session. Only one at a time.
+struct j1939_tp_session_t
+{
+  bool     active;
+  uint8_t  source_address;
+  uint16_t total_size;
+  uint8_t  total_packets;
+  uint8_t  max_per_cts;                    // From the sender's RTS, 0 or 0xFF for no limit
+  uint8_t  next_sequence;                  // Next packet we expect
+  uint8_t  cts_last_sequence;              // Last packet cleared by the current CTS
+  bool     resend_requested;               // Already asked again after a lost packet in this window
+  uint32_t last_activity;                  // millis() of last CTS or DT
+  uint8_t  data[J1939_TP_MAX_SIZE];
+};
+
+j1939_tp_session_t g_tp_session;
+
+uint32_t g_can_last_status   = 0;          // millis() of last status broadcast
+uint8_t  g_can_status_counter = 0;
+
 /**
-   Process incoming CAN frames
+  @return true if /frame/ is a binary emergency stop addressed to us
 */
-void readCANMessages()
+bool isEmergencyStopFrame(const can_frame_t &frame)
+{
+  return frame.dlc >= 1 && CAN_CMD_EMERGENCY_STOP == frame.data[0]
+         && 1 == conveyor_core::j1939DataPage(frame.id)
+         && (J1939_PGN_PROPRIETARY_A2 >> 8 & 0xFF) == conveyor_core::j1939PduFormat(frame.id)
+         && J1939_SOURCE_ADDRESS == conveyor_core::j1939PduSpecific(frame.id);
+}
+
+/**
+  Called from the CAN interrupt for each received frame. Copies it into the
+  queue and returns as quickly as possible. An emergency stop is carried
+  out here and then, even if the queue is full.
+*/
+void onCANReceive(int packet_size)
 {
-  uint8_t packet_size = CAN.parsePacket();
-  if (packet_size)
+  uint32_t received_us = micros();
+  if (!CAN.packetExtended() || CAN.packetRtr())
   {
-    uint16_t j1939_source_address = CAN.packetId() & 0xFF; // Not being used yet!
+    return;
+  }
+
+  can_frame_t frame;
+  frame.id          = CAN.packetId();
+  frame.dlc         = 0;
+  frame.received_us = received_us;
+  while (CAN.available() && frame.dlc < 8)
+  {
+    frame.data[frame.dlc++] = (uint8_t)CAN.read();
+  }
+  if (isEmergencyStopFrame(frame))
+  {
+    emergencyStop(ESTOP_SOURCE_CAN, frame.received_us);
+  }
+
+  uint16_t head = g_can_rx_head;
+  uint16_t next = (head + 1) & (CAN_RX_QUEUE_SIZE - 1);
+  if (next == g_can_rx_tail)
+  {
+    g_can_rx_overflow++;
+    return;
+  }
+  g_can_rx_queue[head] = frame;
+  g_can_rx_head = next;
+}
 
-    char can_payload[8];
-    g_input_buffer = "";
-    while (CAN.available())
+/**
+  Configure the acceptance filter and start interrupt-driven receive. Call
+  after CAN.begin() has succeeded.
+*/
+void startCANReceive()
+{
+#if CAN_HARDWARE_FILTER
+  // Match frames with PF 0xE0-0xEF whose PS field is our address. That
+  // covers every PGN we handle (Proprietary A, TP.CM and TP.DT) and keeps
+  // out PDU2 broadcasts, where PS is a group extension rather than an
+  // address. Priority and DP are don't-care.
+  uint32_t filter_id   = 0x00E00000 | ((uint32_t)J1939_SOURCE_ADDRESS << 8);
+  uint32_t filter_mask = 0x00F0FF00;
+  CAN.filterExtended(filter_id, filter_mask);
+#endif
+  g_tp_session.active = false;
+  CAN.onReceive(onCANReceive);
+}
+
+/**
+  Send a single frame. Pads to 8 bytes with 0xFF as J1939 requires.
+*/
+void sendJ1939Frame(uint32_t pgn, uint8_t destination_address, const uint8_t* data, uint8_t length)
+{
+  CAN.beginExtendedPacket(conveyor_core::j1939Id(J1939_PRIORITY_DEFAULT, pgn, destination_address, J1939_SOURCE_ADDRESS));
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    CAN.write(i < length ? data[i] : 0xFF);
+  }
+  CAN.endPacket();
+}
+
+/**
+  Send a TP.CM message back to the sender of the current session
+*/
+void sendTPControl(uint8_t destination_address, uint8_t control, uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4)
+{
+  uint8_t data[8];
+  data[0] = control;
+  data[1] = b1;
+  data[2] = b2;
+  data[3] = b3;
+  data[4] = b4;
+  data[5] = J1939_PGN_PROPRIETARY_A & 0xFF;
+  data[6] = (J1939_PGN_PROPRIETARY_A >> 8) & 0xFF;
+  data[7] = (J1939_PGN_PROPRIETARY_A >> 16) & 0xFF;
+  sendJ1939Frame(J1939_PGN_TP_CM, destination_address, data, 8);
+}
+
+void sendTPAbort(uint8_t destination_address, uint8_t reason)
+{
+  sendTPControl(destination_address, J1939_TP_CM_ABORT, reason, 0xFF, 0xFF, 0xFF);
+}
+
+/**
+  Clear the next block of packets for the sender
+*/
+void sendTPClearToSend()
+{
+  uint8_t remaining = g_tp_session.total_packets - g_tp_session.next_sequence + 1;
+  uint8_t count     = remaining;
+  if (0 != g_tp_session.max_per_cts && count > g_tp_session.max_per_cts)
+  {
+    count = g_tp_session.max_per_cts;
+  }
+  if (count > J1939_TP_PACKETS_PER_CTS)
+  {
+    count = J1939_TP_PACKETS_PER_CTS;
+  }
+  g_tp_session.cts_last_sequence = g_tp_session.next_sequence + count - 1;
+  g_tp_session.resend_requested  = false;
+  g_tp_session.last_activity     = millis();
+  sendTPControl(g_tp_session.source_address, J1939_TP_CM_CTS, count, g_tp_session.next_sequence, 0xFF, 0xFF);
+}
+
+/**
+  Hand a complete command to the G-code parser. /received_us/ is when its
+  last frame arrived.
+*/
+void processCANCommand(const uint8_t* data, uint16_t length, uint8_t source_address, uint32_t received_us)
+{
+  char line[J1939_TP_MAX_SIZE + 1];
+  uint16_t line_length = 0;
+  while (line_length < length && line_length < J1939_TP_MAX_SIZE)
+  {
+    // Senders pad short messages with NUL or 0xFF
+    if (0x00 == data[line_length] || 0xFF == data[line_length])
     {
-      g_input_buffer += (char)CAN.read();
+      break;
     }
-
+    line[line_length] = (char)data[line_length];
+    line_length++;
+  }
+  line[line_length] = '\0';
 #if CAN_DEBUGGING
-    Serial.println();
-    Serial.print("Source: 0x");
-    Serial.println(j1939_source_address, HEX);
+  LOG_DEBUG(LOG_CAN_MESSAGE, source_address, line);
+#endif
+  g_command_received_us = received_us;
+  processGCodeMessage(line);
+}
+
+/**
+  Broadcast the conveyor status PGN
+*/
+void sendCANStatus()
+{
+  uint8_t flags = 0;
+  if (g_homed)                       flags |= 0x01;
+  if (TRIPPED == g_entrance_sensor)  flags |= 0x02;
+  if (TRIPPED == g_middle_sensor)    flags |= 0x04;
+  if (TRIPPED == g_exit_sensor)      flags |= 0x08;
+  if (g_ready_in_left)               flags |= 0x10;
+  if (g_ready_in_right)              flags |= 0x20;
+  if (RIGHT == g_x_direction)        flags |= (CAN_DIRECTION_RIGHT << 6);
+  if (LEFT  == g_x_direction)        flags |= (CAN_DIRECTION_LEFT  << 6);
+
+  uint16_t width = (uint16_t)(yPosition() * 10);
+
+  uint8_t data[8];
+  data[0] = g_state & 0xFF;
+  data[1] = g_state >> 8;
+  data[2] = flags;
+  data[3] = g_x_requested_speed & 0xFF;
+  data[4] = g_x_requested_speed >> 8;
+  data[5] = width & 0xFF;
+  data[6] = width >> 8;
+  data[7] = g_can_status_counter++;
+  sendJ1939Frame(J1939_PGN_CONVEYOR_STATUS, J1939_GLOBAL_ADDRESS, data, 8);
+  g_can_last_status = millis();
+}
+
+/**
+  @return the bytes a binary command needs, selector included, or 0 if
+  /selector/ isn't one we know
+*/
+uint8_t canBinaryCommandLength(uint8_t selector)
+{
+  switch (selector)
+  {
+    case CAN_CMD_SET_SPEED:          return 4;
+    case CAN_CMD_UNLOAD:             return 6;
+    case CAN_CMD_MOVE_WIDTH:         return 3;
+    case CAN_CMD_HOME:               return 1;
+    case CAN_CMD_STATUS_REQUEST:     return 1;
+    case CAN_CMD_EMERGENCY_STOP:     return 1;
+    case CAN_CMD_READY_TO_RECEIVE:   return 2;
+    case CAN_CMD_BOARD_AVAILABLE:    return 7;
+    case CAN_CMD_BOARD_TRANSFERRED:  return 5;
+  }
+  return 0;
+}
+
+/**
+  Decode a binary command frame into a command and carry it out. Frames
+  that are too short for their command, or that we don't understand, are
+  dropped: bytes past the DLC aren't valid data.
+*/
+void processCANBinaryCommand(const can_frame_t &frame, uint8_t source_address)
+{
+  uint8_t needed = frame.dlc < 1 ? 0 : canBinaryCommandLength(frame.data[0]);
+  if (0 == needed || frame.dlc < needed)
+  {
+    LOG_WARN(LOG_CAN_BAD_COMMAND, source_address, frame.dlc < 1 ? 0 : frame.data[0], frame.dlc);
+    return;
+  }
+
+  gcode_command_t command;
+  uint16_t word_1 = frame.data[1] | ((uint16_t)frame.data[2] << 8);
+  uint16_t word_2 = frame.data[2] | ((uint16_t)frame.data[3] << 8);
+  uint16_t word_4 = frame.data[4] | ((uint16_t)frame.data[5] << 8);
+
+  switch (frame.data[0])
+  {
+    case CAN_CMD_SET_SPEED:
+      switch (frame.data[1])
+      {
+        case CAN_DIRECTION_STOP:  command.m_code = MCODE_SPINDLE_STOP;  break;
+        case CAN_DIRECTION_RIGHT: command.m_code = MCODE_SPINDLE_RIGHT; break;
+        case CAN_DIRECTION_LEFT:  command.m_code = MCODE_SPINDLE_LEFT;  break;
+        default:
+          LOG_WARN(LOG_CAN_BAD_COMMAND, source_address, frame.data[0], frame.dlc);
+          return;
+      }
+      command.s_value = word_2;
+      break;
+
+    case CAN_CMD_UNLOAD:
+      switch (frame.data[1])
+      {
+        case CAN_UNLOAD_NOW:      command.m_code = MCODE_UNLOAD_NOW;    break;
+        case CAN_UNLOAD_READY_IN: command.m_code = MCODE_UNLOAD;        break;
+        case CAN_UNLOAD_TIMED:    command.m_code = MCODE_UNLOAD_TIMED;  break;
+        default:
+          LOG_WARN(LOG_CAN_BAD_COMMAND, source_address, frame.data[0], frame.dlc);
+          return;
+      }
+      command.s_value = word_2;
+      command.p_value = word_4;
+      break;
 
-    Serial.print("B:>");
-    Serial.print(g_input_buffer);
-    Serial.println("<");
+    case CAN_CMD_MOVE_WIDTH:
+      command.g_code  = GCODE_MOVE;
+      command.y_value = word_1 / 10.0;
+      break;
+
+    case CAN_CMD_HOME:
+      command.g_code  = GCODE_HOME;
+      break;
+
+    case CAN_CMD_STATUS_REQUEST:
+      sendCANStatus();
+      return;
+
+    case CAN_CMD_EMERGENCY_STOP:
+      serviceEmergencyStop();   // Already stopped by onCANReceive()
+      return;
+
+    case CAN_CMD_READY_TO_RECEIVE:
+    case CAN_CMD_BOARD_AVAILABLE:
+    case CAN_CMD_BOARD_TRANSFERRED:
+      handleHandoffMessage(frame, source_address);
+      return;
+  }
+
+#if CAN_DEBUGGING
+  LOG_DEBUG(LOG_CAN_BINARY_COMMAND, source_address, frame.data[0]);
 #endif
-    // Sanity check the message?
-    // Temporary filter to remove T-Rex MCM status messages
-    if (j1939_source_address != 0x80)
+  executeGCodeCommand(command);
+}
+
+void handleTPConnectionManagement(const can_frame_t &frame, uint8_t source_address)
+{
+  uint8_t  control = frame.data[0];
+  uint32_t pgn     = frame.data[5] | ((uint32_t)frame.data[6] << 8) | ((uint32_t)frame.data[7] << 16);
+
+  if (J1939_TP_CM_RTS == control)
+  {
+    if (pgn != J1939_PGN_PROPRIETARY_A)
+    {
+      return;
+    }
+    if (g_tp_session.active && g_tp_session.source_address != source_address)
+    {
+      sendTPAbort(source_address, J1939_TP_ABORT_BUSY);
+      return;
+    }
+    uint16_t total_size    = frame.data[1] | ((uint16_t)frame.data[2] << 8);
+    uint8_t  total_packets = frame.data[3];
+    // Fewer packets than the size needs would leave the end of the buffer
+    // from an earlier session in the command
+    if (total_size > J1939_TP_MAX_SIZE || 0 == total_packets
+        || total_packets != (total_size + J1939_TP_BYTES_PER_PACKET - 1) / J1939_TP_BYTES_PER_PACKET)
+    {
+      LOG_WARN(LOG_CAN_TP_ABORT, source_address, J1939_TP_ABORT_RESOURCES);
+      sendTPAbort(source_address, J1939_TP_ABORT_RESOURCES);
+      return;
+    }
+    // A repeated RTS from the same sender restarts its session
+    g_tp_session.active         = true;
+    g_tp_session.source_address = source_address;
+    g_tp_session.total_size     = total_size;
+    g_tp_session.total_packets  = total_packets;
+    g_tp_session.max_per_cts    = frame.data[4];
+    g_tp_session.next_sequence  = 1;
+    LOG_DEBUG(LOG_CAN_TP_START, source_address, total_size);
+    sendTPClearToSend();
+  }
+
+  if (J1939_TP_CM_ABORT == control)
+  {
+    if (g_tp_session.active && g_tp_session.source_address == source_address)
     {
-      processGCodeMessage();
+      g_tp_session.active = false;
+      LOG_WARN(LOG_CAN_TP_ABORT, source_address, frame.data[1]);
     }
   }
 }
 
+void handleTPDataTransfer(const can_frame_t &frame, uint8_t source_address)
+{
+  if (!g_tp_session.active || g_tp_session.source_address != source_address)
+  {
+    return;
+  }
+
+  uint8_t sequence = frame.data[0];
+  if (sequence != g_tp_session.next_sequence)
+  {
+    // Lost or repeated packet. Ask again from where we got to, once: the
+    // rest of the window is still coming and would only ask again too
+    if (sequence > g_tp_session.next_sequence && !g_tp_session.resend_requested)
+    {
+      sendTPClearToSend();
+      g_tp_session.resend_requested = true;
+    }
+    return;
+  }
+
+  uint16_t offset = (uint16_t)(sequence - 1) * J1939_TP_BYTES_PER_PACKET;
+  for (uint8_t i = 0; i < J1939_TP_BYTES_PER_PACKET && offset + i < g_tp_session.total_size; i++)
+  {
+    g_tp_session.data[offset + i] = frame.data[i + 1];
+  }
+  g_tp_session.next_sequence++;
+  g_tp_session.last_activity    = millis();
+  g_tp_session.resend_requested = false;   // The new window has started
+
+  if (g_tp_session.next_sequence > g_tp_session.total_packets)
+  {
+    g_tp_session.active = false;
+    sendTPControl(source_address, J1939_TP_CM_EOM_ACK, g_tp_session.total_size & 0xFF,
+                  g_tp_session.total_size >> 8, g_tp_session.total_packets, 0xFF);
+    processCANCommand(g_tp_session.data, g_tp_session.total_size, source_address, frame.received_us);
+  } else if (sequence == g_tp_session.cts_last_sequence) {
+    sendTPClearToSend();
+  }
+}
+
+/**
+  Process incoming CAN frames
+*/
+void readCANMessages()
+{
+  if (g_can_rx_overflow > 0)
+  {
+    LOG_WARN(LOG_CAN_OVERFLOW, g_can_rx_overflow);
+    g_can_rx_overflow = 0;
+  }
+
+  while (g_can_rx_tail != g_can_rx_head)
+  {
+    const can_frame_t &frame = g_can_rx_queue[g_can_rx_tail];
+    traceCanFrame(frame.id, frame.dlc, frame.data);
+
+    uint8_t data_page           = conveyor_core::j1939DataPage(frame.id);
+    uint8_t pdu_format          = conveyor_core::j1939PduFormat(frame.id);
+    uint8_t destination_address = conveyor_core::j1939PduSpecific(frame.id);
+    uint8_t source_address      = conveyor_core::j1939SourceAddress(frame.id);
+
+    // Only peer-to-peer messages addressed to us. The hardware filter
+    // already does this unless CAN_HARDWARE_FILTER is off.
+    if (pdu_format < 240 && J1939_SOURCE_ADDRESS == destination_address && 1 == data_page)
+    {
+      if ((J1939_PGN_PROPRIETARY_A2 >> 8 & 0xFF) == pdu_format)
+      {
+        processCANBinaryCommand(frame, source_address);
+      }
+    } else if (pdu_format < 240 && J1939_SOURCE_ADDRESS == destination_address) {
+      switch (pdu_format)
+      {
+        case (J1939_PGN_PROPRIETARY_A >> 8):
+          processCANCommand(frame.data, frame.dlc, source_address, frame.received_us);
+          break;
+
+        case (J1939_PGN_TP_CM >> 8):
+          if (8 == frame.dlc)
+          {
+            handleTPConnectionManagement(frame, source_address);
+          }
+          break;
+
+        case (J1939_PGN_TP_DT >> 8):
+          if (8 == frame.dlc)
+          {
+            handleTPDataTransfer(frame, source_address);
+          }
+          break;
+      }
+    }
+
+    g_can_rx_tail = (g_can_rx_tail + 1) & (CAN_RX_QUEUE_SIZE - 1);
+  }
+
+#if CAN_STATUS_INTERVAL
+  if (millis() - g_can_last_status > CAN_STATUS_INTERVAL)
+  {
+    sendCANStatus();
+  }
+#endif
+
+  // Give up on a sender that has gone quiet
+  if (g_tp_session.active && millis() - g_tp_session.last_activity > J1939_TP_TIMEOUT_T2)
+  {
+    g_tp_session.active = false;
+    LOG_WARN(LOG_CAN_TP_ABORT, g_tp_session.source_address, J1939_TP_ABORT_TIMEOUT);
+    sendTPAbort(g_tp_session.source_address, J1939_TP_ABORT_TIMEOUT);
+  }
+}
+
 #endif H_CAN_COMMS
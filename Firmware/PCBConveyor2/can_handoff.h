@@ -0,0 +1,222 @@
+#ifndef H_CAN_HANDOFF
+#define H_CAN_HANDOFF
+
+/*
+  Board handoff over CAN
+
+  Neighbouring machines coordinate board transfers with binary Proprietary A2
+  messages (see can_comms.h), addressed to each other using
+  J1939_UPSTREAM_ADDRESS and J1939_DOWNSTREAM_ADDRESS, which swap over when
+  boards flow right to left (see flow.h). This can run alongside
+  the wired SMEMA signals or replace them, selected by HANDOFF_SMEMA and
+  HANDOFF_CAN in config.h.
+
+    0x10 Ready to receive   [1] 1=ready 0=not ready                 downstream -> upstream
+    0x11 Board available    [1-4] board ID, [5-6] length mm         upstream -> downstream
+    0x12 Board transferred  [1-4] board ID                          upstream -> downstream
+
+  Ready to receive is sent as soon as it changes and repeated every
+  HANDOFF_REFRESH_INTERVAL ms. If the downstream machine stops repeating it
+  for HANDOFF_TIMEOUT ms we treat it as not ready.
+
+  Board available is sent as soon as a board is on the conveyor, so the
+  downstream machine can get ready before the board arrives. The board ID
+  and length given by the upstream machine are passed along the line.
+  Boards that arrive without an announcement get an ID made from our
+  address and a counter. Unknown lengths are sent as 0xFFFF.
+*/
+
+#define HANDOFF_LENGTH_UNKNOWN    0xFFFF
+#define HANDOFF_MAX_BOARDS           4     // Boards tracked on the conveyor at once
+
+struct handoff_board_t
+{
+  uint32_t id;
+  uint16_t length;                         // mm
+  bool     announced;                      // Board available sent downstream
+};
+
+handoff_board_t g_board_queue[HANDOFF_MAX_BOARDS];   // Boards on the conveyor, oldest first
+uint8_t         g_board_count             = 0;
+uint16_t        g_board_id_counter        = 0;
+
+handoff_board_t g_incoming_board;                     // Announced by upstream, not arrived yet
+bool            g_incoming_board_valid    = false;
+
+bool            g_can_ready_in_downstream = false;    // Downstream is ready to receive
+uint32_t        g_can_ready_in_received   = 0;        // millis() of last message from downstream
+bool            g_ready_to_receive        = false;    // What we last told upstream
+uint32_t        g_ready_to_receive_sent   = 0;
+bool            g_last_entrance_sensor    = UNTRIPPED;
+
+void sendHandoffMessage(uint8_t destination_address, uint8_t command, uint32_t board_id, uint16_t length)
+{
+  uint8_t data[7];
+  data[0] = command;
+  data[1] = board_id & 0xFF;
+  data[2] = (board_id >> 8) & 0xFF;
+  data[3] = (board_id >> 16) & 0xFF;
+  data[4] = (board_id >> 24) & 0xFF;
+  data[5] = length & 0xFF;
+  data[6] = length >> 8;
+  sendJ1939Frame(J1939_PGN_PROPRIETARY_A2, destination_address, data, 7);
+}
+
+void sendReadyToReceive(bool ready)
+{
+  uint8_t data[2];
+  data[0] = CAN_CMD_READY_TO_RECEIVE;
+  data[1] = ready;
+  sendJ1939Frame(J1939_PGN_PROPRIETARY_A2, upstreamAddress(), data, 2);
+  g_ready_to_receive_sent = millis();
+}
+
+/**
+  Add a board to the back of the queue
+*/
+void handoffBoardArrived(uint32_t board_id, uint16_t length)
+{
+  if (g_board_count >= HANDOFF_MAX_BOARDS)
+  {
+    LOG_WARN(LOG_HANDOFF_QUEUE_FULL, board_id);
+    return;
+  }
+  g_board_queue[g_board_count].id        = board_id;
+  g_board_queue[g_board_count].length    = length;
+  g_board_queue[g_board_count].announced = false;
+  g_board_count++;
+}
+
+uint32_t handoffNewBoardId()
+{
+  return ((uint32_t)J1939_SOURCE_ADDRESS << 24) | ++g_board_id_counter;
+}
+
+/**
+  Called when the first board on the conveyor has cleared the exit sensor
+*/
+void handoffBoardTransferred()
+{
+  uint32_t board_id = 0;
+  if (g_board_count > 0)
+  {
+    board_id = g_board_queue[0].id;
+    for (uint8_t i = 1; i < g_board_count; i++)
+    {
+      g_board_queue[i - 1] = g_board_queue[i];
+    }
+    g_board_count--;
+  }
+  LOG_DEBUG(LOG_HANDOFF_TRANSFERRED, board_id);
+#if HANDOFF_CAN
+  sendHandoffMessage(downstreamAddress(), CAN_CMD_BOARD_TRANSFERRED, board_id, 0);
+#endif
+}
+
+/**
+  True when we can take a board from upstream: the belt is empty and we're
+  in a mode that moves boards on to the next machine.
+*/
+bool conveyorReadyToReceive()
+{
+  if (TRIPPED == g_entrance_sensor || TRIPPED == g_middle_sensor || TRIPPED == g_exit_sensor)
+  {
+    return false;
+  }
+  if (changeoverActive() || yAxisMoving())
+  {
+    return false;   // Nothing comes in until the rail is at the new width
+  }
+  if (STOP != g_x_direction && g_board_count > 0 && !entranceClearBy(HANDOFF_ENTRY_GAP))
+  {
+    return false;   // The upstream belt may be faster, don't push the next board into this one
+  }
+  return (STATE_UNLOAD_RIRO_BEGIN == g_state || STATE_UNLOAD_TIMED_CLEARED_END == g_state
+          || STATE_UNLOAD_SPACED_MOVING == g_state || STATE_UNLOAD_SPACED_CLEARED_END == g_state);
+}
+
+/**
+  Handle a handoff message from a neighbouring machine
+*/
+void handleHandoffMessage(const can_frame_t &frame, uint8_t source_address)
+{
+  uint32_t board_id = frame.data[1] | ((uint32_t)frame.data[2] << 8)
+                      | ((uint32_t)frame.data[3] << 16) | ((uint32_t)frame.data[4] << 24);
+
+  switch (frame.data[0])
+  {
+    case CAN_CMD_READY_TO_RECEIVE:
+      if (downstreamAddress() == source_address)
+      {
+        g_can_ready_in_downstream = frame.data[1];
+        g_can_ready_in_received   = millis();
+      }
+      break;
+
+    case CAN_CMD_BOARD_AVAILABLE:
+      if (upstreamAddress() == source_address)
+      {
+        g_incoming_board.id        = board_id;
+        g_incoming_board.length    = frame.data[5] | ((uint16_t)frame.data[6] << 8);
+        g_incoming_board.announced = false;
+        g_incoming_board_valid     = true;
+        LOG_DEBUG(LOG_HANDOFF_AVAILABLE, board_id);
+      }
+      break;
+
+    case CAN_CMD_BOARD_TRANSFERRED:
+      // The board itself is picked up by our entrance sensor
+      break;
+  }
+}
+
+/**
+  Track boards arriving and keep our neighbours informed. Call once per
+  pass of loop(), after the sensors have been read.
+*/
+void updateHandoff()
+{
+  // A board has arrived at the entrance
+  if (TRIPPED == g_entrance_sensor && UNTRIPPED == g_last_entrance_sensor)
+  {
+    if (g_incoming_board_valid)
+    {
+      handoffBoardArrived(g_incoming_board.id, g_incoming_board.length);
+      g_incoming_board_valid = false;
+    } else {
+      handoffBoardArrived(handoffNewBoardId(), HANDOFF_LENGTH_UNKNOWN);
+    }
+  }
+  g_last_entrance_sensor = g_entrance_sensor;
+
+  // A board we didn't see arrive, eg placed by hand or present at boot
+  if (0 == g_board_count && (TRIPPED == g_middle_sensor || TRIPPED == g_exit_sensor))
+  {
+    handoffBoardArrived(handoffNewBoardId(), HANDOFF_LENGTH_UNKNOWN);
+  }
+
+#if HANDOFF_CAN
+  if (g_board_count > 0 && !g_board_queue[0].announced)
+  {
+    sendHandoffMessage(downstreamAddress(), CAN_CMD_BOARD_AVAILABLE,
+                       g_board_queue[0].id, g_board_queue[0].length);
+    g_board_queue[0].announced = true;
+  }
+
+  bool ready = conveyorReadyToReceive();
+  if (ready != g_ready_to_receive || millis() - g_ready_to_receive_sent > HANDOFF_REFRESH_INTERVAL)
+  {
+    g_ready_to_receive = ready;
+    sendReadyToReceive(ready);
+  }
+
+  if (g_can_ready_in_downstream && millis() - g_can_ready_in_received > HANDOFF_TIMEOUT)
+  {
+    g_can_ready_in_downstream = false;
+  }
+#else
+  g_ready_to_receive = conveyorReadyToReceive();
+#endif
+}
+
+#endif H_CAN_HANDOFF
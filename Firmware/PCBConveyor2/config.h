@@ -2,7 +2,13 @@
 #define  ENABLE_WIFI               true
 #define  ENABLE_MQTT               true
 #define  ENABLE_LCD               false
+// WARNING: the WebSocket endpoint has no authentication. Anyone on the network
+// can run any command, M999 and width moves included. Only turn it on for a
+// network you trust
+#define  ENABLE_WEBSOCKET         false  // Local command and telemetry endpoint, see websocket.h. Needs ENABLE_WIFI
 
+// Defaults for the values below and a few others marked "runtime parameter".
+// They can be changed and saved without a rebuild, see parameters.h
 #define  LIMIT_BACKOFF              100  // Steps, make it mm later
 #define  HOME_SWITCH_OFFSET         297  // mm from 0 width to the homed position
 #define  MINIMUM_CONVEYOR_POSITION   45  // Never go smaller than this
@@ -13,13 +19,20 @@
 #define  RUNON_TIME                   0  // ms. Runtime after unload sensor cleared.
 #define  LOAD_TIMEOUT                30  // Seconds. Stop if nothing appears within this time.
 #define  UNLOAD_TIMEOUT              30  // Seconds. Stop if nothing gets to the exit within this time.
+#define  MAXIMUM_SPACING            2000  // mm. Longest gap or pitch M60 and M61 accept
+#define  PRESTART                  true  // M56 starts boards for the exit before ready-in is due, see prestart.h
 // Note: UNLOAD_TIMEOUT may be the wrong way of thinking about this, because the speed
 // of the conveyor can vary. It probably needs to know how long it is, and then know
 // how fast it's running so it can work out how long it needs to run.
 
+#define  RECIPE_COUNT                 8  // Product recipes stored on the device, see recipes.h
+#define  RECIPE_NAME_LENGTH          15
+#define  CHANGEOVER_TIMEOUT         120  // Seconds. Give up on a changeover if no old board leaves for this long
+
 #define  BACKLIGHT_LEVEL_HIGH        70
 #define  BACKLIGHT_LEVEL_LOW         20
 
+#define  LOG_LEVEL        LOG_LEVEL_INFO  // NONE, ERROR, WARN, INFO or DEBUG. Lower levels are compiled out
 #define  SERIAL_DEBUGGING         false
 #define  CAN_DEBUGGING            false
 #define  STATE_DEBUGGING           true
@@ -33,17 +46,24 @@
 //const char* mqtt_username          = "YOUR USER";
 //const char* mqtt_password          = "YOUR PASS";
 //const char* status_topic           = "events";        // MQTT topic to report startup
+#define  MQTT_BUFFER_SIZE         1024  // Bytes. Largest command batch we can receive
+#define  MQTT_MAX_LINE_LENGTH       96  // Longer command lines are rejected, not run
+#define  MQTT_RESULT_SIZE          256  // Bytes. Longer results are cut short
+
+/* WebSocket */
+#define  WEBSOCKET_PORT             81  // ws://<device>:81/
 
 /* Serial */
 #define  SERIAL_BAUD_RATE        115200  // Speed for USB serial console
+#define  TRACE_BUFFER_SIZE         8192  // Bytes of RAM for input traces, see trace.h. Must be a power of 2
 
 /* ----------------- Hardware-specific config ---------------------- */
 /* X axis drive motors */
 #define  MOTOR_PWM_FREQUENCY   5000  // Base frequency for PWM
 #define  PIN_X_IN1               32
 #define  PIN_X_IN2               33
-#define  MOTOR_PWM_AT_MIN       200
-#define  MOTOR_PWM_AT_MAX      1023
+#define  MOTOR_PWM_AT_MIN       200   // Runtime parameter
+#define  MOTOR_PWM_AT_MAX      1023   // Runtime parameter
 
 /* Y axis stepper motor */
 #define  PIN_Y_IN1               27 //12 //19
@@ -52,17 +72,36 @@
 #define  PIN_Y_IN4               25 //17
 const int steps_per_revolution = 2048;  // change this to fit the number of steps per revolution
 //const int steps_per_revolution = 1024;  // change this to fit the number of steps per revolution
-const float steps_per_mm       = 39.47;
+#define  Y_STEPS_PER_METRE     39470  // Runtime parameter. 39.47 steps per mm
+#define  Y_BACKLASH                0   // Steps. Runtime parameter. Taken up by finishing every move going narrower
+#define  Y_AXIS_SPEED             13   // RPM. Experiment with setting this higher.
 
 /* Y axis limit sensor */
 #define  LIMIT_SENSOR_Y_PIN       35 //16  // 
 
+/* Direction of flow, see flow.h */
+#define  FLOW_DIRECTION           0   // Runtime parameter. 0 boards flow left to right, 1 right to left
+
+/* Emergency stop, see estop.h */
+#define  ESTOP_INPUT          false   // Runtime parameter. An e-stop loop is wired to ESTOP_PIN
+#define  ESTOP_PIN               34   // Input only, so the loop needs an external pull-up
+#define  ESTOP_ACTIVE_LEVEL    HIGH   // Normally closed to ground, so a broken wire stops too
+#define  ESTOP_RESPONSE_LIMIT_US 500  // Input or CAN trigger to outputs off. Longer is logged as an error
+
 /* LCD */
 #define  TFT_BL_PIN               23
 
 /* PCB sensors */
-#define  PCB_TRIGGER_HEIGHT       45    // Anything detected lower than this means a PCB is present at the sensor
-#define  SENSOR_DEBOUNCE_COUNT    10    // Consecutive untriggered reads for board to be considered absent
+#define  PCB_TRIGGER_HEIGHT       45    // Runtime parameter. Anything detected lower than this means a PCB is present at the sensor
+#define  SENSOR_DEBOUNCE_COUNT    10    // Runtime parameter. Consecutive untriggered reads for board to be considered absent
+#define  SENSOR_BUDGET_MIN        20    // ms. Runtime parameter. Shortest VL53L0X timing budget, used at high belt speed
+#define  SENSOR_BUDGET_MAX        66    // ms. Runtime parameter. Longest, used at low speed and with the belt stopped
+#define  SENSOR_SAMPLE_SPACING     2    // mm. Runtime parameter. Belt travel between two readings of the same sensor
+#define  SENSOR_CALIBRATION_SAMPLES  16 // Readings per sensor for M530
+#define  SENSOR_CALIBRATION_MARGIN   10 // mm. Smallest gap between a sensor's empty belt reading and its threshold
+#define  SENSOR_PITCH            220    // mm. Runtime parameter. Between neighbouring sensors, for board measurement
+#define  MEASURE_LENGTH_TOLERANCE  10   // mm. Measured board length this far off the announced length is logged
+#define  MEASURE_MINIMUM_GAP       10   // mm. Shorter gaps between boards are logged
 #define  PCB_SENSOR_L_ADDR      0x30
 #define  PCB_SENSOR_M_ADDR      0x31
 #define  PCB_SENSOR_R_ADDR      0x32
@@ -80,9 +119,14 @@ const float steps_per_mm       = 39.47;
 
 /* CAN bus */
 #define  CAN_BUS_SPEED           250E3
+#define  CAN_HARDWARE_FILTER      true   // Only accept frames addressed to J1939_SOURCE_ADDRESS
+#define  CAN_RX_QUEUE_SIZE          32   // Frames. Must be a power of 2
+#define  J1939_TP_MAX_SIZE         255   // Bytes. Longest command accepted by transport protocol
+#define  CAN_STATUS_INTERVAL      1000   // ms between status broadcasts. 0 to disable
 #define  J1939_UPSTREAM_ADDRESS   0xF0   // Range for PnP: 0x80-8F, 0xF0-F1 (0xF0-F1 are reserved)
 #define  J1939_SOURCE_ADDRESS     0x90   // Range for conveyors: 0x90-9F
 #define  J1939_DOWNSTREAM_ADDRESS 0x80   // Range for PnP: 0x80-8F, 0xF0-F1 (0xF0-F1 are reserved)
+                                         // Up and downstream are for left to right flow, see flow.h
 
 
 //#define  CAN_RX_PIN                4
@@ -98,3 +142,11 @@ const float steps_per_mm       = 39.47;
 #define  READY_OUT_LEFT_PIN       GPA5
 #define  READY_IN_RIGHT_PIN       GPA6
 #define  READY_OUT_RIGHT_PIN      GPA7
+#define  READY_ACTIVE_LEVEL       HIGH
+
+/* Board handoff */
+#define  HANDOFF_SMEMA            true   // Use the wired ready-in / ready-out signals
+#define  HANDOFF_CAN              true   // Use CAN handoff messages with neighbouring machines
+#define  HANDOFF_REFRESH_INTERVAL  500   // ms between repeats of our ready-to-receive state
+#define  HANDOFF_TIMEOUT          1500   // ms. Downstream ready-to-receive goes stale after this
+#define  HANDOFF_ENTRY_GAP         100   // mm. With the belt running, the last board must be this far in before we take another
@@ -0,0 +1,331 @@
+#ifndef H_DISPLAY
+#define H_DISPLAY
+
+/*
+  LCD status dashboard
+
+  A low priority task on core 0 keeps the LCD up to date, so drawing
+  never takes time from loop() on core 1. loop() only copies the values
+  shown into g_display_snapshot every DISPLAY_INTERVAL ms, which takes a
+  microsecond or two under a spinlock.
+
+  The task compares the snapshot with what's already on the screen and
+  only redraws the rows that changed. Each row is drawn into a small
+  off-screen canvas and sent to the LCD in one go, so there's no
+  flicker, and the SPI bus uses DMA so the CPU isn't copying pixels.
+
+    State     State machine state, and the unload mode
+    Speed     Requested and measured belt speed, and direction
+    Width     Rail width, or "not homed"
+    Sensors   Range of each board sensor, red while a board is there
+    Boards    Boards on the conveyor
+    Job       Active job and boards it has unloaded
+    Faults    Anything that needs attention
+    Network   IP address and MQTT connection
+*/
+
+#define DISPLAY_TASK_STACK      4096
+#define DISPLAY_TASK_PRIORITY      1     // Lowest above idle, on the same core as the network task
+#define DISPLAY_TASK_CORE          0     // loop() runs on core 1
+#define DISPLAY_INTERVAL          50     // ms between refreshes
+
+#define DISPLAY_LABEL_X            8
+#define DISPLAY_VALUE_X          120
+#define DISPLAY_VALUE_WIDTH      352     // px, 29 characters at text size 2
+#define DISPLAY_ROW_HEIGHT        16     // px at text size 2
+#define DISPLAY_TOP               48     // px, below the title
+#define DISPLAY_ROW_PITCH         32
+
+#define DISPLAY_FAULT_ERROR     0x01     // State machine in STATE_ERROR
+#define DISPLAY_FAULT_NOT_HOMED 0x02     // Rail position unknown
+#define DISPLAY_FAULT_NETWORK   0x04     // WiFi or MQTT down
+#define DISPLAY_FAULT_ESTOP     0x08     // Emergency stop latched
+
+enum display_row_t
+{
+  ROW_STATE, ROW_SPEED, ROW_WIDTH, ROW_SENSORS, ROW_BOARDS, ROW_JOB, ROW_FAULTS, ROW_NETWORK, ROW_COUNT
+};
+
+const char* const g_display_labels[ROW_COUNT] =
+{
+  "State", "Speed", "Width", "Sensors", "Boards", "Job", "Faults", "Network"
+};
+
+struct display_snapshot_t
+{
+  uint16_t state;
+  uint8_t  direction;
+  uint16_t speed;                       // mm/min, requested
+  uint16_t velocity;                    // mm/min, measured
+  float    width;                       // mm
+  bool     homed;
+  bool     rail_moving;
+  uint16_t range[SENSOR_COUNT];         // mm
+  bool     tripped[SENSOR_COUNT];
+  uint8_t  boards;
+  uint32_t job;
+  uint16_t job_boards;
+  uint8_t  faults;
+  uint32_t ip;
+  bool     mqtt;
+};
+
+display_snapshot_t g_display_snapshot;            // Written by loop(), read by the task
+portMUX_TYPE       g_display_mux       = portMUX_INITIALIZER_UNLOCKED;
+uint32_t           g_display_updated   = 0;       // millis() of the last snapshot
+bool               g_display_running   = false;
+Arduino_Canvas*    g_display_canvas    = NULL;    // One row, off screen
+
+/**
+  @return a short name for state machine state /state/
+*/
+const char* displayStateName(uint16_t state)
+{
+  switch (state)
+  {
+    case STATE_BEGIN:   return "Starting";
+    case STATE_IDLE:    return "Idle";
+    case STATE_ERROR:   return "Error";
+    case STATE_ESTOP:   return "EMERGENCY STOP";
+    case STATE_STOPPED: return "Stopped";
+  }
+  switch (state / 10)
+  {
+    case 55: return "M55 unload now";
+    case 56: return "M56 unload";
+    case 57: return "M57 timed";
+    case 60: return g_spacing_pitch ? "M61 pitch" : "M60 gap";
+  }
+  return "Unknown";
+}
+
+/**
+  Copy what the dashboard shows. Call once per pass of loop().
+*/
+void updateDisplay()
+{
+  if (!g_display_running || millis() - g_display_updated < DISPLAY_INTERVAL)
+  {
+    return;
+  }
+  g_display_updated = millis();
+
+  display_snapshot_t now;
+  now.state       = g_state;
+  now.direction   = g_x_direction;
+  now.speed       = g_x_requested_speed;
+  now.velocity    = g_run_velocity;
+  now.width       = yPosition();
+  now.homed       = g_homed;
+  now.rail_moving = yAxisMoving();
+  now.range[0]    = g_pcb_sensor_l_reading.RangeMilliMeter;
+  now.range[1]    = g_pcb_sensor_m_reading.RangeMilliMeter;
+  now.range[2]    = g_pcb_sensor_r_reading.RangeMilliMeter;
+  now.tripped[entranceSensorIndex()] = TRIPPED == g_entrance_sensor;   // Left to right, like range
+  now.tripped[1]  = TRIPPED == g_middle_sensor;
+  now.tripped[exitSensorIndex()]     = TRIPPED == g_exit_sensor;
+  now.boards      = g_board_count;
+  now.job         = g_job.id;
+  now.job_boards  = g_job.boards;
+  now.mqtt        = g_mqtt_connected;
+  now.ip          = 0;
+#if ENABLE_WIFI
+  if (g_wifi_connected)
+  {
+    now.ip = (uint32_t)WiFi.localIP();
+  }
+#endif
+  now.faults      = 0;
+  if (STATE_ERROR == g_state)            now.faults |= DISPLAY_FAULT_ERROR;
+  if (!g_homed)                          now.faults |= DISPLAY_FAULT_NOT_HOMED;
+  if (emergencyStopped())                now.faults |= DISPLAY_FAULT_ESTOP;
+  if (!g_wifi_connected || !g_mqtt_connected)
+  {
+    now.faults |= DISPLAY_FAULT_NETWORK;
+  }
+
+  portENTER_CRITICAL(&g_display_mux);
+  g_display_snapshot = now;
+  portEXIT_CRITICAL(&g_display_mux);
+}
+
+/**
+  Start drawing a row into the canvas
+*/
+void beginRow(uint16_t colour)
+{
+  g_display_canvas->fillScreen(BLACK);
+  g_display_canvas->setCursor(0, 0);
+  g_display_canvas->setTextColor(colour);
+}
+
+/**
+  Send the canvas to row /row/ of the LCD
+*/
+void endRow(uint8_t row)
+{
+  gfx->draw16bitRGBBitmap(DISPLAY_VALUE_X, DISPLAY_TOP + row * DISPLAY_ROW_PITCH,
+                          g_display_canvas->getFramebuffer(), DISPLAY_VALUE_WIDTH, DISPLAY_ROW_HEIGHT);
+}
+
+/**
+  Redraw every row that differs between /shown/ and /now/, or all of them
+*/
+void drawDashboard(const display_snapshot_t &shown, const display_snapshot_t &now, bool all)
+{
+  char text[32];
+
+  if (all || now.state != shown.state)
+  {
+    beginRow(STATE_ERROR == now.state || STATE_ESTOP == now.state ? RED : WHITE);
+    snprintf(text, sizeof(text), "%s (%u)", displayStateName(now.state), now.state);
+    g_display_canvas->print(text);
+    endRow(ROW_STATE);
+  }
+
+  if (all || now.speed != shown.speed || now.velocity != shown.velocity || now.direction != shown.direction)
+  {
+    const char* arrow = RIGHT == now.direction ? ">>" : (LEFT == now.direction ? "<<" : "--");
+    beginRow(STOP == now.direction ? DARKGREY : GREEN);
+    snprintf(text, sizeof(text), "%s %u mm/min, actual %u", arrow, now.speed, now.velocity);
+    g_display_canvas->print(text);
+    endRow(ROW_SPEED);
+  }
+
+  if (all || now.width != shown.width || now.homed != shown.homed || now.rail_moving != shown.rail_moving)
+  {
+    beginRow(now.homed ? WHITE : YELLOW);
+    if (now.homed)
+    {
+      snprintf(text, sizeof(text), "%.1f mm%s", now.width, now.rail_moving ? ", moving" : "");
+    } else {
+      snprintf(text, sizeof(text), "Not homed");
+    }
+    g_display_canvas->print(text);
+    endRow(ROW_WIDTH);
+  }
+
+  if (all || 0 != memcmp(now.range, shown.range, sizeof(now.range))
+      || 0 != memcmp(now.tripped, shown.tripped, sizeof(now.tripped)))
+  {
+    beginRow(WHITE);
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++)
+    {
+      g_display_canvas->setTextColor(now.tripped[i] ? RED : WHITE);
+      snprintf(text, sizeof(text), "%c%5u  ", "LMR"[i], now.range[i]);
+      g_display_canvas->print(text);
+    }
+    endRow(ROW_SENSORS);
+  }
+
+  if (all || now.boards != shown.boards)
+  {
+    beginRow(WHITE);
+    snprintf(text, sizeof(text), "%u on the conveyor", now.boards);
+    g_display_canvas->print(text);
+    endRow(ROW_BOARDS);
+  }
+
+  if (all || now.job != shown.job || now.job_boards != shown.job_boards)
+  {
+    beginRow(JOB_NONE == now.job ? DARKGREY : WHITE);
+    if (JOB_NONE == now.job)
+    {
+      snprintf(text, sizeof(text), "None");
+    } else {
+      snprintf(text, sizeof(text), "%lu, %u unloaded", (unsigned long)now.job, now.job_boards);
+    }
+    g_display_canvas->print(text);
+    endRow(ROW_JOB);
+  }
+
+  if (all || now.faults != shown.faults)
+  {
+    beginRow(0 == now.faults ? GREEN : RED);
+    if (0 == now.faults)
+    {
+      g_display_canvas->print("None");
+    }
+    if (now.faults & DISPLAY_FAULT_ERROR)     g_display_canvas->print("Error ");
+    if (now.faults & DISPLAY_FAULT_NOT_HOMED) g_display_canvas->print("Not homed ");
+    if (now.faults & DISPLAY_FAULT_NETWORK)   g_display_canvas->print("Network ");
+    if (now.faults & DISPLAY_FAULT_ESTOP)     g_display_canvas->print("E-stop ");
+    endRow(ROW_FAULTS);
+  }
+
+  if (all || now.ip != shown.ip || now.mqtt != shown.mqtt)
+  {
+    beginRow(now.mqtt ? GREEN : YELLOW);
+    if (0 == now.ip)
+    {
+      snprintf(text, sizeof(text), "No WiFi");
+    } else {
+      snprintf(text, sizeof(text), "%u.%u.%u.%u %s", now.ip & 0xFF, (now.ip >> 8) & 0xFF,
+               (now.ip >> 16) & 0xFF, now.ip >> 24, now.mqtt ? "MQTT" : "no MQTT");
+    }
+    g_display_canvas->print(text);
+    endRow(ROW_NETWORK);
+  }
+}
+
+/**
+  Keep the dashboard up to date. Runs forever in its own task.
+*/
+void displayTask(void* parameter)
+{
+  display_snapshot_t shown;
+  display_snapshot_t now;
+
+  gfx->fillScreen(BLACK);
+  gfx->setTextSize(2);
+  gfx->setTextColor(BLUE);
+  gfx->setCursor(DISPLAY_LABEL_X, 8);
+  gfx->print("PCB Conveyor v");
+  gfx->print(VERSION);
+  gfx->print("  ");
+  gfx->print(g_device_id);
+  gfx->setTextColor(DARKGREY);
+  for (uint8_t row = 0; row < ROW_COUNT; row++)
+  {
+    gfx->setCursor(DISPLAY_LABEL_X, DISPLAY_TOP + row * DISPLAY_ROW_PITCH);
+    gfx->print(g_display_labels[row]);
+  }
+
+  bool all = true;
+  for (;;)
+  {
+    portENTER_CRITICAL(&g_display_mux);
+    now = g_display_snapshot;
+    portEXIT_CRITICAL(&g_display_mux);
+
+    drawDashboard(shown, now, all);
+    shown = now;
+    all   = false;
+    vTaskDelay(pdMS_TO_TICKS(DISPLAY_INTERVAL));
+  }
+}
+
+/**
+  Start the dashboard task. Call at the end of setup(), after the banner.
+*/
+void startDisplay()
+{
+  g_display_canvas = new Arduino_Canvas(DISPLAY_VALUE_WIDTH, DISPLAY_ROW_HEIGHT, gfx);
+  if (!g_display_canvas->begin(GFX_SKIP_OUTPUT_BEGIN))
+  {
+    LOG_WARN(LOG_DISPLAY_FAILED);
+    return;
+  }
+  g_display_canvas->setTextSize(2);
+  g_display_canvas->setTextWrap(false);
+
+  g_display_running = true;
+  g_display_updated = millis() - DISPLAY_INTERVAL;
+  updateDisplay();                      // So the first frame isn't blank
+  TaskHandle_t task = NULL;
+  xTaskCreatePinnedToCore(displayTask, "display", DISPLAY_TASK_STACK, NULL,
+                          DISPLAY_TASK_PRIORITY, &task, DISPLAY_TASK_CORE);
+  watchTaskStack("display", task);
+}
+
+#endif H_DISPLAY
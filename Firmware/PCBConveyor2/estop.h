@@ -0,0 +1,206 @@
+#ifndef H_ESTOP
+#define H_ESTOP
+
+/*
+  Emergency stop
+
+  Any of these stops the belt and the width axis at once, and latches the
+  conveyor in STATE_ESTOP:
+
+    M112              From serial, MQTT or CAN G-code
+    CAN binary 0x06   Acted on in the CAN receive interrupt, see can_comms.h
+    ESTOP_PIN         With the estop_input parameter set (M510 P18 S1).
+                      Acted on in the pin's interrupt
+
+  emergencyStop() only writes registers. It clears the output enables of both
+  belt LEDC channels, the same as ledcWrite(channel, 0) does, and sets the
+  four stepper coil pins low through the GPIO clear register, so it's safe
+  in an interrupt and takes a few microseconds.
+
+  The pin and CAN interrupts themselves aren't allocated with
+  ESP_INTR_FLAG_IRAM (attachInterrupt() and the CAN library don't), so
+  while flash is being written they're held off until it's finished, and
+  the belt PWM carries on meanwhile. Writing an NVS entry (M500, M520, the
+  saved rail position, sensor calibration) holds them for up to a few ms.
+  If NVS has to erase a 4 KB sector to make room, or an OTA upload erases
+  the next sector of the app partition, that's typically 45 ms and up to
+  about 400 ms at the flash chip's worst case. That delay comes before the
+  handler's first instruction, so it isn't in the logged response time.
+
+  The time from the trigger to the outputs being off is measured with
+  micros() and logged. Each source takes its timestamp as early as it can
+  and passes it in: the input at the top of its interrupt, CAN when the
+  frame is copied out of the controller, M112 when its line arrived. So
+  the time for M112 includes waiting for loop() to run it, and only the
+  input and CAN, which never wait for loop(), are logged as an error if
+  they're over ESTOP_RESPONSE_LIMIT_US. The interrupt latency before the
+  first instruction of a handler, including any flash write above, isn't
+  counted.
+
+  The width axis takes its steps one at a time and checks for a stop before
+  each one (see stepYAxis()), so a stop during G28 or G0 isn't undone by the
+  next step. A step already being written when the interrupt lands is cut
+  again as soon as it's out. M112 on serial is picked up during blocking
+  moves too, between steps. MQTT isn't read until the move is finished, so
+  use the input or CAN for anything safety related.
+
+  Once stopped, everything except M112, M999 and the reports is rejected
+  until:
+
+    M999    Clear the stop and go to idle. Refused while the input is still
+            active. The belt stays stopped and the rail stays where it is.
+            A G0 stopped part way knows where the rail got to, an
+            interrupted G28 leaves it not homed.
+*/
+
+#define ESTOP_SOURCE_NONE       0
+#define ESTOP_SOURCE_COMMAND    1     // M112
+#define ESTOP_SOURCE_CAN        2     // Binary CAN message
+#define ESTOP_SOURCE_INPUT      3     // ESTOP_PIN
+
+#define ESTOP_Y_COIL_MASK  ((1UL << PIN_Y_IN1) | (1UL << PIN_Y_IN2) | (1UL << PIN_Y_IN3) | (1UL << PIN_Y_IN4))
+
+static_assert(PIN_Y_IN1 < 32 && PIN_Y_IN2 < 32 && PIN_Y_IN3 < 32 && PIN_Y_IN4 < 32,
+              "The stepper coils are cut with one write to GPIO.out_w1tc, which covers pins 0-31");
+
+volatile bool     g_estop_latched     = false;
+volatile uint8_t  g_estop_source      = ESTOP_SOURCE_NONE;
+volatile uint32_t g_estop_response_us = 0;    // Trigger to outputs off
+uint32_t          g_command_received_us = 0;  // micros() the G-code being run arrived, for M112
+
+bool emergencyStopped()
+{
+  return g_estop_latched;
+}
+
+const char* estopSourceName(uint8_t source)
+{
+  switch (source)
+  {
+    case ESTOP_SOURCE_COMMAND: return "M112";
+    case ESTOP_SOURCE_CAN:     return "CAN";
+    case ESTOP_SOURCE_INPUT:   return "input";
+  }
+  return "unknown";
+}
+
+/**
+  Turn off the belt motor and the stepper coils
+*/
+void IRAM_ATTR cutMotorOutputs()
+{
+#ifdef ARDUINO_ARCH_ESP32
+  // Belt channels 0 and 1 are in the high speed group. With the output
+  // disabled the pin sits at idle_lv whatever the duty is.
+  for (uint8_t channel = 0; channel < 2; channel++)
+  {
+    LEDC.channel_group[0].channel[channel].conf0.idle_lv    = 0;
+    LEDC.channel_group[0].channel[channel].conf0.sig_out_en = 0;
+  }
+  GPIO.out_w1tc = ESTOP_Y_COIL_MASK;
+#else
+  // Host build, where the registers don't exist
+  ledcWrite(0, 0);
+  ledcWrite(1, 0);
+  digitalWrite(PIN_Y_IN1, LOW);
+  digitalWrite(PIN_Y_IN2, LOW);
+  digitalWrite(PIN_Y_IN3, LOW);
+  digitalWrite(PIN_Y_IN4, LOW);
+#endif
+}
+
+/**
+  Stop everything and latch. Safe to call from an interrupt, and again
+  while already stopped. /triggered/ is micros() when the source first saw
+  the stop.
+*/
+void IRAM_ATTR emergencyStop(uint8_t source, uint32_t triggered)
+{
+  cutMotorOutputs();
+  if (!g_estop_latched)
+  {
+    g_estop_response_us = micros() - triggered;
+    g_estop_source      = source;
+    g_estop_latched     = true;
+  }
+}
+
+void IRAM_ATTR onEstopInput()
+{
+  uint32_t triggered = micros();
+  if (g_params.estop_input)
+  {
+    emergencyStop(ESTOP_SOURCE_INPUT, triggered);
+  }
+}
+
+bool estopInputActive()
+{
+  return g_params.estop_input && ESTOP_ACTIVE_LEVEL == digitalRead(ESTOP_PIN);
+}
+
+/**
+  Watch the e-stop input. The interrupt is always attached, so setting the
+  estop_input parameter takes effect straight away. Call from setup() once
+  the parameters are loaded and the motor pins are set up.
+*/
+void initialiseEmergencyStop()
+{
+  pinMode(ESTOP_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(ESTOP_PIN), onEstopInput, HIGH == ESTOP_ACTIVE_LEVEL ? RISING : FALLING);
+  if (estopInputActive())
+  {
+    emergencyStop(ESTOP_SOURCE_INPUT, micros());
+  }
+}
+
+/**
+  Do the parts of a stop that aren't safe in an interrupt: the state
+  change, the log and the MQTT message. Call at the top of loop(), and
+  straight after emergencyStop() outside an interrupt.
+*/
+void serviceEmergencyStop()
+{
+  if (!g_estop_latched || STATE_ESTOP == g_state)
+  {
+    return;
+  }
+  g_x_direction       = STOP;
+  g_x_requested_speed = 0;
+  perform_state_transition(STATE_ESTOP);
+
+  LOG_ERROR(LOG_ESTOP, estopSourceName(g_estop_source), g_estop_response_us);
+  if (ESTOP_SOURCE_COMMAND != g_estop_source && g_estop_response_us > ESTOP_RESPONSE_LIMIT_US)
+  {
+    LOG_ERROR(LOG_ESTOP_SLOW, ESTOP_RESPONSE_LIMIT_US);
+  }
+  if (features_t::mqtt)
+  {
+    mqttPublish(g_mqtt_tele_topic, "Emergency stop");
+  }
+}
+
+/**
+  Clear the stop for M999
+  @return false if the e-stop input is still active
+*/
+bool clearEmergencyStop()
+{
+  if (!g_estop_latched)
+  {
+    return true;
+  }
+  if (estopInputActive())
+  {
+    LOG_WARN(LOG_ESTOP_INPUT_ACTIVE);
+    return false;
+  }
+  serviceEmergencyStop();
+  g_estop_latched = false;
+  g_estop_source  = ESTOP_SOURCE_NONE;
+  perform_state_transition(STATE_IDLE);
+  LOG_INFO(LOG_ESTOP_CLEARED);
+  return true;
+}
+
+#endif H_ESTOP
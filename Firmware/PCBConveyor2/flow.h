@@ -0,0 +1,115 @@
+#ifndef H_FLOW
+#define H_FLOW
+
+/*
+  Direction of flow
+
+  Boards flow left to right unless the flow_direction parameter says
+  otherwise (M510 P19 S1), so the same conveyor can run in a right to left
+  line or shuttle boards back. A mode command can pick the direction for
+  its own job with F, eg "M56 S1500 F1"; once the job ends and the
+  conveyor is idle it goes back to the parameter.
+
+    F0   Left to right: enter at the left sensor, leave past the right one
+    F1   Right to left: enter at the right sensor, leave past the left one
+
+  Everything downstream of the sensors works in terms of entrance, middle
+  and exit, and upstream and downstream, so only the mapping here changes:
+
+    - g_entrance_sensor and g_exit_sensor, and their edges and read times,
+      come from the sensor at the upstream or downstream end
+    - ready-in is read from the downstream side and ready-out is driven on
+      the upstream side (riro.h)
+    - J1939_UPSTREAM_ADDRESS and J1939_DOWNSTREAM_ADDRESS are the
+      neighbours for left to right flow. They swap for right to left
+
+  M03 and M04 still mean right and left, whichever way the boards flow.
+*/
+
+#define FLOW_LEFT_TO_RIGHT   0
+#define FLOW_RIGHT_TO_LEFT   1
+
+/**
+  @return the belt direction that moves boards downstream, RIGHT or LEFT
+*/
+uint8_t downstreamDirection()
+{
+  return g_flow_direction;
+}
+
+/**
+  @return the index of the sensor at the upstream end, in g_pcb_sensors order
+*/
+uint8_t entranceSensorIndex()
+{
+  return RIGHT == g_flow_direction ? 0 : SENSOR_COUNT - 1;
+}
+
+uint8_t exitSensorIndex()
+{
+  return SENSOR_COUNT - 1 - entranceSensorIndex();
+}
+
+uint8_t upstreamAddress()
+{
+  return RIGHT == g_flow_direction ? J1939_UPSTREAM_ADDRESS : J1939_DOWNSTREAM_ADDRESS;
+}
+
+uint8_t downstreamAddress()
+{
+  return RIGHT == g_flow_direction ? J1939_DOWNSTREAM_ADDRESS : J1939_UPSTREAM_ADDRESS;
+}
+
+/**
+  Change the direction boards flow in. The entrance and exit sensors swap
+  over, along with what's known about them, so a board already on the belt
+  isn't seen arriving again at the new entrance.
+*/
+void setFlowDirection(uint8_t flow)
+{
+  uint8_t direction = FLOW_RIGHT_TO_LEFT == flow ? LEFT : RIGHT;
+  if (direction == g_flow_direction)
+  {
+    return;
+  }
+  g_flow_direction = direction;
+
+  bool entrance          = g_entrance_sensor;
+  g_entrance_sensor      = g_exit_sensor;
+  g_exit_sensor          = entrance;
+  g_last_entrance_sensor = g_entrance_sensor;
+  g_exit_sensor_count    = 0;
+  swapSensorRoles();
+
+  LOG_INFO(LOG_FLOW_DIRECTION, RIGHT == direction ? "left to right" : "right to left");
+}
+
+/**
+  Set the direction for a mode command: its F if it has one, otherwise the
+  flow_direction parameter
+  @return false if F isn't 0 or 1
+*/
+bool setCommandFlowDirection(int16_t f_value)
+{
+  if (f_value > FLOW_RIGHT_TO_LEFT)
+  {
+    LOG_WARN(LOG_FLOW_INVALID, f_value);
+    return false;
+  }
+  setFlowDirection(f_value < 0 ? g_params.flow_direction : f_value);
+  return true;
+}
+
+/**
+  Follow the flow_direction parameter while idle. Call once per pass of
+  loop().
+*/
+void serviceFlowDirection()
+{
+  if (STATE_IDLE == g_state || STATE_BEGIN == g_state)
+  {
+    setFlowDirection(g_params.flow_direction);
+  }
+}
+
+#endif H_FLOW
@@ -1,10 +1,11 @@
 #ifndef H_GCODE
 #define H_GCODE
 
-String g_input_buffer = "";
-
 #define GCODE_HOME               28
 #define GCODE_MOVE                0
+#define HOME_FULL                 0   // G28
+#define HOME_IF_NEEDED            1   // G28 O, skip if the saved position was restored
+#define HOME_VERIFY               2   // G28 V, check the position against the switch
 #define MCODE_SPINDLE_RIGHT      03
 #define MCODE_SPINDLE_LEFT       04
 #define MCODE_SPINDLE_STOP       05
@@ -19,6 +20,47 @@ String g_input_buffer = "";
 #define MCODE_UNLOAD_TIMED       57   // Unload at a timed interval
 #define MCODE_BUFFER             58   // Load and unload when ready-in/out
 #define MCODE_BUFFER_TIMED       59   // Load when ready-in/out, unload at timed interval
+#define MCODE_UNLOAD_GAP         60   // Unload with a constant gap between boards
+#define MCODE_UNLOAD_PITCH       61   // Unload with a constant pitch between leading edges
+#define MCODE_EMERGENCY_STOP    112   // Stop everything and latch, see estop.h
+#define MCODE_SAVE_PARAMETERS   500   // Save parameters to NVS
+#define MCODE_LOAD_PARAMETERS   501   // Load parameters from NVS
+#define MCODE_RESET_PARAMETERS  502   // Go back to the default parameters
+#define MCODE_REPORT_PARAMETERS 503   // Report parameters
+#define MCODE_SET_PARAMETER     510   // Set parameter P<n> to S<value>
+#define MCODE_DEFINE_RECIPE     520   // Store a product recipe
+#define MCODE_CHANGEOVER        521   // Change over to a stored recipe
+#define MCODE_REPORT_RECIPES    522   // Report stored recipes
+#define MCODE_DELETE_RECIPE     523   // Delete a stored recipe
+#define MCODE_CALIBRATE_SENSORS 530   // Calibrate the board sensors on an empty belt
+#define MCODE_REPORT_SENSORS    531   // Report sensor calibration
+#define MCODE_REPORT_BOARDS     540   // Report board measurements
+#define MCODE_TRACE             550   // Record an input trace: S0 stop, S1 to RAM, S2 streamed
+#define MCODE_DUMP_TRACE        551   // Stop and write out the recorded trace
+#define MCODE_REPORT_MEMORY     560   // Report free heap and spare stack, see memory.h
+#define MCODE_REPORT_OEE        570   // Report production figures for this shift, see oee.h
+#define MCODE_NEW_SHIFT         571   // Report this shift and start the next one
+#define MCODE_CLEAR_STOP        999   // Clear an emergency stop
+
+/*
+  A single command, either parsed from G-code text or decoded from a binary
+  message. Anything not given is -1, except Y which defaults to 0.
+*/
+struct gcode_command_t
+{
+  int16_t g_code  = -1;
+  int16_t m_code  = -1;
+  float   s_value = -1;   // Speed, mm/min
+  float   p_value = -1;   // Dwell, seconds. Gap or pitch for M60 and M61, mm
+  float   y_value =  0;   // Width, mm
+  uint8_t home_mode = HOME_FULL;   // G28 only
+  int16_t r_value = -1;   // Recipe number
+  int16_t u_value = -1;   // Unload mode of a recipe, 55, 56 or 57
+  float   d_value = -1;   // Debounce count of a recipe
+  float   t_value = -1;   // Trigger height of a recipe
+  int16_t f_value = -1;   // Flow direction of a mode command, see flow.h
+  char    name[RECIPE_NAME_LENGTH + 1] = "";   // Recipe name, given in double quotes
+};
 
 //"M50 S800" LOAD the conveyor and stop it in the middle
 //"M52 S800" LOAD the conveyor and stop it at the end
@@ -27,146 +69,203 @@ String g_input_buffer = "";
 //"M56 S800 P5" UNLOAD boards with 5 seconds pause (dwell time) between them
 
 /*
-  Look for character /code/ in the inputBuffer and read the float that immediately follows it.
-  @return the value found.  If nothing is found, /default_value/ is returned.
-  @input code the character to look for.
-  @input defaultVal the return value if /code/ is not found.
-  TODO: Make parser handle compressed messages with no delimiter
+  Parse one line of G-code into a command. Codes and parameters that aren't
+  present are left at their defaults. See conveyor_core::GCodeWords for the
+  syntax: comments after ';', a name in double quotes, and words with or
+  without spaces between them.
 */
-float parseGCodeParameter(char code, float default_value) {
-  int8_t code_position = g_input_buffer.indexOf(code);
-  if (code_position != -1)  // The code has been found in the buffer.
+void parseGCodeCommand(const char* line, gcode_command_t &command)
+{
+  conveyor_core::GCodeWords words;
+  words.parse(line);
+  words.quoted(command.name, sizeof(command.name));
+
+  command.g_code  = words.value('G', -1);
+  command.m_code  = words.value('M', -1);
+  command.s_value = words.value('S', -1);
+  command.p_value = words.value('P', -1);
+  command.y_value = words.value('Y', 0);
+  command.r_value = words.value('R', -1);
+  command.u_value = words.value('U', -1);
+  command.d_value = words.value('D', -1);
+  command.t_value = words.value('T', -1);
+  command.f_value = words.value('F', -1);
+  if (words.has('O'))
   {
-    // Find the end of the number (separated by " " (space))
-    int8_t delimiter_position = g_input_buffer.indexOf(" ", code_position + 1);
-    float parsed_value = g_input_buffer.substring(code_position + 1, delimiter_position).toFloat();
-    return parsed_value;
-  } else {
-    return default_value;
+    command.home_mode = HOME_IF_NEEDED;
+  } else if (words.has('V')) {
+    command.home_mode = HOME_VERIFY;
   }
 }
 
+/*
+  What happened to a command
+*/
+enum gcode_result_t
+{
+  GCODE_OK,                     // Recognised and carried out
+  GCODE_UNKNOWN,                // No G- or M-code we know
+  GCODE_REJECTED                // Recognised but not allowed, eg a move before homing
+};
 
 /*
+  The commands still taken while an emergency stop is latched: the stop
+  itself, clearing it, and the ones that only report
+*/
+bool allowedWhileStopped(const gcode_command_t &command)
+{
+  if (-1 != command.g_code)
+  {
+    return false;
+  }
+  switch (command.m_code)
+  {
+    case MCODE_EMERGENCY_STOP:
+    case MCODE_CLEAR_STOP:
+    case MCODE_REPORT_PARAMETERS:
+    case MCODE_REPORT_RECIPES:
+    case MCODE_REPORT_SENSORS:
+    case MCODE_REPORT_BOARDS:
+    case MCODE_TRACE:
+    case MCODE_DUMP_TRACE:
+    case MCODE_REPORT_MEMORY:
+    case MCODE_REPORT_OEE:
+    case MCODE_NEW_SHIFT:
+      return true;
+  }
+  return false;
+}
 
+/*
+  Carry out a parsed command. Commands can come from the G-code parser or be
+  decoded directly from a binary message.
 */
-void processGCodeMessage()
+gcode_result_t executeGCodeCommand(const gcode_command_t &command)
 {
   uint8_t valid_command_found = false;
-  int8_t  command_code = -1;
-  Serial.print("Processing: ");
-  Serial.println(g_input_buffer);
+  bool    rejected            = false;
 
-  // Strip comments
-  g_input_buffer.remove(g_input_buffer.indexOf(";"));
-  g_input_buffer.trim();
+  if (emergencyStopped() && !allowedWhileStopped(command))
+  {
+    LOG_WARN(LOG_ESTOP_LATCHED);
+    return GCODE_REJECTED;
+  }
 
   /*-- Check for G-code messages --*/
-  // Extract the command, default -1 if not found
-  command_code = parseGCodeParameter('G', -1);
-
-  switch (command_code)
+  switch (command.g_code)
   {
     case GCODE_HOME:
       {
         valid_command_found = true;
-        Serial.println("Homing start");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Homing start");
-#endif
-        homeYAxis();
-        g_homed = true;
-        Serial.println("Homing complete");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Homing complete");
-#endif
+        if (yAxisMoving())
+        {
+          LOG_WARN(LOG_RAIL_BUSY);
+          rejected = true;
+          break;
+        }
+        if (HOME_IF_NEEDED == command.home_mode && g_homed)
+        {
+          LOG_INFO(LOG_HOMING_SKIPPED, yPosition());
+          break;
+        }
+        if (HOME_VERIFY == command.home_mode && !g_homed)
+        {
+          LOG_WARN(LOG_NOT_HOMED);
+          rejected = true;
+          break;
+        }
+        LOG_INFO(LOG_HOMING_START);
+        if (features_t::mqtt)
+        {
+          mqttPublish(g_mqtt_tele_topic, "Homing start");
+        }
+        if (HOME_VERIFY == command.home_mode)
+        {
+          // Out of tolerance is reported as a failure, but the position has been corrected
+          rejected = !verifyYHome();
+        } else {
+          homeYAxis();
+        }
+        if (emergencyStopped())
+        {
+          rejected = true;
+          break;
+        }
+        LOG_INFO(LOG_HOMING_COMPLETE);
+        if (features_t::mqtt)
+        {
+          mqttPublish(g_mqtt_tele_topic, "Homing complete");
+        }
         break;
       }
 
     case GCODE_MOVE:
       {
         valid_command_found = true;
-        Serial.println("GCODE move!");
+        LOG_DEBUG(LOG_GCODE_MOVE);
         // Don't move unless we've already been homed.
         if (false == g_homed)
         {
-          Serial.println("Home the device first using command 'G28'");
-          client.publish(g_mqtt_tele_topic, "Home the device first using command 'G28'");
+          LOG_WARN(LOG_NOT_HOMED);
+          rejected = true;
+          mqttPublish(g_mqtt_tele_topic, "Home the device first using command 'G28'");
+          break;
+        }
+        if (yAxisMoving())
+        {
+          LOG_WARN(LOG_RAIL_BUSY);
+          rejected = true;
           break;
         }
 
         // Extract the requested position from the GCODE message.
-        float requested_y_position = parseGCodeParameter('Y', 0);
-        if (requested_y_position > MAXIMUM_CONVEYOR_POSITION)
+        float requested_y_position = command.y_value;
+        if (requested_y_position > g_params.maximum_position)
         {
-          Serial.print("Can't move to greater than ");
-          Serial.print(MAXIMUM_CONVEYOR_POSITION);
-          Serial.println("mm");
-#if ENABLE_MQTT
-          sprintf(g_mqtt_message_buffer, "Can't move to greater than %i mm", MAXIMUM_CONVEYOR_POSITION);
-          client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
-#endif
+          LOG_WARN(LOG_MOVE_TOO_WIDE, g_params.maximum_position);
+          rejected = true;
+          if (features_t::mqtt)
+          {
+            snprintf(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer), "Can't move to greater than %i mm", g_params.maximum_position);
+            mqttPublish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+          }
           break;
         }
 
-        if (requested_y_position < MINIMUM_CONVEYOR_POSITION)
+        if (requested_y_position < g_params.minimum_position)
         {
-          Serial.print("Can't move to smaller than ");
-          Serial.print(MINIMUM_CONVEYOR_POSITION);
-          Serial.println("mm");
-#if ENABLE_MQTT
-          sprintf(g_mqtt_message_buffer, "Can't move to less than %i mm", MINIMUM_CONVEYOR_POSITION);
-          client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
-#endif
+          LOG_WARN(LOG_MOVE_TOO_NARROW, g_params.minimum_position);
+          rejected = true;
+          if (features_t::mqtt)
+          {
+            snprintf(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer), "Can't move to less than %i mm", g_params.minimum_position);
+            mqttPublish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+          }
           break;
         }
 
         // The requested position is within spec, so continue.
-        Serial.print("Current position: ");
-        Serial.println(g_current_y_position);
-        Serial.print("Desired position: ");
-        Serial.println(requested_y_position);
-
-        float y_position_delta = requested_y_position - g_current_y_position;
-        Serial.print("Position delta: ");
-        Serial.println(y_position_delta);
-
-        // This is where to convert desired mm to steps
-        int32_t movement_steps = (int)(y_position_delta * steps_per_mm);
-
-        Serial.print("Steps to move: ");
-        Serial.println(movement_steps);
-
-#if ENABLE_MQTT
-        sprintf(g_mqtt_message_buffer, "Current: %.2f, Requested: %.2f, Delta: %.2f, Steps: %i",
-                g_current_y_position, requested_y_position, y_position_delta, movement_steps);
-        client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
-#endif
-
-        yAxisStepper.step(movement_steps);
-        g_current_y_position = requested_y_position;
+        moveYAxis(requested_y_position);
+        rejected = emergencyStopped();
         break;
       }
   }
 
   /*-- Check for M-code messages --*/
-  // Extract the command, default -1 if not found
-  command_code = parseGCodeParameter('M', -1);
-  Serial.println(command_code);
+  LOG_DEBUG(LOG_COMMAND_CODE, command.m_code);
 
-  switch (command_code)
+  switch (command.m_code)
   {
     case MCODE_SPINDLE_STOP:
       {
         valid_command_found = true;
         g_x_direction = STOP;
-        // Extract the requested speed from the GCODE message.
-        uint16_t requested_speed = parseGCodeParameter('S', -1);
-        setRequestedSpeed(requested_speed);
-        Serial.println("Conveyor stop");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Conveyor stop");
-#endif
+        setRequestedSpeed(command.s_value);
+        LOG_INFO(LOG_CONVEYOR_STOP);
+        if (features_t::mqtt)
+        {
+          mqttPublish(g_mqtt_tele_topic, "Conveyor stop");
+        }
         break;
       }
 
@@ -174,13 +273,12 @@ void processGCodeMessage()
       {
         valid_command_found = true;
         g_x_direction       = RIGHT;
-        // Extract the requested speed from the GCODE message.
-        uint16_t requested_speed = parseGCodeParameter('S', -1);
-        setRequestedSpeed(requested_speed);
-        Serial.println("Conveyor right");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Conveyor right");
-#endif
+        setRequestedSpeed(command.s_value);
+        LOG_INFO(LOG_CONVEYOR_RIGHT);
+        if (features_t::mqtt)
+        {
+          mqttPublish(g_mqtt_tele_topic, "Conveyor right");
+        }
         break;
       }
 
@@ -188,43 +286,203 @@ void processGCodeMessage()
       {
         valid_command_found = true;
         g_x_direction       = LEFT;
-        // Extract the requested speed from the GCODE message.
-        uint16_t requested_speed = parseGCodeParameter('S', -1);
-        setRequestedSpeed(requested_speed);
-        Serial.println("Conveyor left");
-#if ENABLE_MQTT
-        client.publish(g_mqtt_tele_topic, "Conveyor left");
-#endif
+        setRequestedSpeed(command.s_value);
+        LOG_INFO(LOG_CONVEYOR_LEFT);
+        if (features_t::mqtt)
+        {
+          mqttPublish(g_mqtt_tele_topic, "Conveyor left");
+        }
         break;
       }
 
     case MCODE_UNLOAD_NOW:
       valid_command_found = true;
-      setRequestedSpeed(parseGCodeParameter('S', -1));
+      if (!setCommandFlowDirection(command.f_value))
+      {
+        rejected = true;
+        break;
+      }
+      setRequestedSpeed(command.s_value);
+      jobAccepted(command.m_code);
       perform_state_transition(STATE_UNLOAD_NOW_BEGIN);
       break;
 
     case MCODE_UNLOAD:
       valid_command_found = true;
-      setRequestedSpeed(parseGCodeParameter('S', -1));
+      if (!setCommandFlowDirection(command.f_value))
+      {
+        rejected = true;
+        break;
+      }
+      setRequestedSpeed(command.s_value);
+      jobAccepted(command.m_code);
       perform_state_transition(STATE_UNLOAD_RIRO_BEGIN);
       break;
 
     case MCODE_UNLOAD_TIMED:
       valid_command_found = true;
-      setRequestedSpeed(parseGCodeParameter('S', -1));
-      g_requested_pause = parseGCodeParameter('P', -1);
+      if (!setCommandFlowDirection(command.f_value))
+      {
+        rejected = true;
+        break;
+      }
+      setRequestedSpeed(command.s_value);
+      g_requested_pause = command.p_value;
+      jobAccepted(command.m_code);
       perform_state_transition(STATE_UNLOAD_TIMED_BEGIN);
       break;
+
+    case MCODE_UNLOAD_GAP:
+    case MCODE_UNLOAD_PITCH:
+      valid_command_found = true;
+      if (command.p_value < 0)
+      {
+        rejected = true;
+        LOG_WARN(LOG_SPACING_MISSING);
+        break;
+      }
+      if (command.p_value > MAXIMUM_SPACING)
+      {
+        rejected = true;
+        LOG_WARN(LOG_SPACING_TOO_LONG, MAXIMUM_SPACING);
+        break;
+      }
+      if (!setCommandFlowDirection(command.f_value))
+      {
+        rejected = true;
+        break;
+      }
+      setRequestedSpeed(command.s_value);
+      g_requested_spacing = (uint16_t)lroundf(command.p_value);
+      g_spacing_pitch     = MCODE_UNLOAD_PITCH == command.m_code;
+      jobAccepted(command.m_code);
+      perform_state_transition(STATE_UNLOAD_SPACED_BEGIN);
+      break;
+
+    case MCODE_EMERGENCY_STOP:
+      valid_command_found = true;
+      emergencyStop(ESTOP_SOURCE_COMMAND, g_command_received_us);
+      serviceEmergencyStop();
+      break;
+
+    case MCODE_CLEAR_STOP:
+      valid_command_found = true;
+      rejected = !clearEmergencyStop();
+      break;
+
+    case MCODE_SAVE_PARAMETERS:
+      valid_command_found = true;
+      rejected = !saveParameters();
+      break;
+
+    case MCODE_LOAD_PARAMETERS:
+      valid_command_found = true;
+      loadParameters();
+      break;
+
+    case MCODE_RESET_PARAMETERS:
+      valid_command_found = true;
+      g_params = g_param_defaults;
+      break;
+
+    case MCODE_REPORT_PARAMETERS:
+      valid_command_found = true;
+      reportParameters();
+      break;
+
+    case MCODE_SET_PARAMETER:
+      valid_command_found = true;
+      rejected = !setParameter((int16_t)command.p_value, command.s_value);
+      break;
+
+    case MCODE_DEFINE_RECIPE:
+      valid_command_found = true;
+      rejected = !defineRecipe(command);
+      break;
+
+    case MCODE_CHANGEOVER:
+      valid_command_found = true;
+      rejected = !startChangeover(command);
+      break;
+
+    case MCODE_REPORT_RECIPES:
+      valid_command_found = true;
+      reportRecipes();
+      break;
+
+    case MCODE_DELETE_RECIPE:
+      valid_command_found = true;
+      rejected = !deleteRecipe(command);
+      break;
+
+    case MCODE_CALIBRATE_SENSORS:
+      valid_command_found = true;
+      rejected = !calibrateSensors(command.s_value);
+      break;
+
+    case MCODE_REPORT_SENSORS:
+      valid_command_found = true;
+      reportSensors();
+      break;
+
+    case MCODE_REPORT_BOARDS:
+      valid_command_found = true;
+      reportMeasurements();
+      break;
+
+    case MCODE_REPORT_MEMORY:
+      valid_command_found = true;
+      reportMemory();
+      break;
+
+    case MCODE_REPORT_OEE:
+      valid_command_found = true;
+      reportOee();
+      break;
+
+    case MCODE_NEW_SHIFT:
+      valid_command_found = true;
+      resetOee();
+      break;
+
+    case MCODE_TRACE:
+      valid_command_found = true;
+      if (command.s_value <= 0)
+      {
+        stopTrace();
+      } else {
+        rejected = !startTrace(command.s_value);
+      }
+      break;
+
+    case MCODE_DUMP_TRACE:
+      valid_command_found = true;
+      dumpTrace();
+      break;
   }
 
   if (!valid_command_found)
   {
-    Serial.println("Unknown or empty command ignored");
-#if ENABLE_MQTT
-    client.publish(g_mqtt_tele_topic, "Unknown or empty command ignored");
-#endif
+    LOG_WARN(LOG_UNKNOWN_COMMAND);
+    if (features_t::mqtt)
+    {
+      mqttPublish(g_mqtt_tele_topic, "Unknown or empty command ignored");
+    }
+    return GCODE_UNKNOWN;
   }
+  return rejected ? GCODE_REJECTED : GCODE_OK;
+}
+
+/*
+  Parse and carry out one line of G-code
+*/
+gcode_result_t processGCodeMessage(const char* line)
+{
+  gcode_command_t command;
+  LOG_INFO(LOG_PROCESSING, line);
+
+  parseGCodeCommand(line, command);
+  return executeGCodeCommand(command);
 }
 
 #endif H_GCODE
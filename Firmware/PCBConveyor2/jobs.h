@@ -0,0 +1,140 @@
+#ifndef H_JOBS
+#define H_JOBS
+
+/*
+  Job tracking
+
+  The unload commands (M55, M56, M57, M60, M61) only switch the state machine into a
+  new mode, so they return long before anything has happened. Each one is
+  given a job ID, and what happens to the job afterwards is published to
+  the job topic so the line controller doesn't have to poll:
+
+    job=12 event=accepted code=M55 t=81234 elapsed=0 boards=0
+
+    accepted   The command was accepted and the job ID assigned
+    started    The belt started moving for this job
+    unloaded   A board cleared the exit sensor (M56, M57, M60 and M61
+               keep going)
+    completed  M55 has unloaded its board and stopped
+    timeout    Nothing reached the exit within UNLOAD_TIMEOUT, now idle
+    aborted    Replaced by another unload command, or the state machine
+               went to STATE_ERROR or STATE_ESTOP
+
+  t is millis() when the event happened and elapsed is ms since the job
+  was accepted. Only one job is active at a time. Other commands finish
+  before they return, so the command result is all they need.
+
+  A recipe changeover (M521, see recipes.h) is a job too. It passes through
+  STATE_IDLE on the way, so it's ended by the changeover code rather than
+  by the state machine going idle.
+*/
+
+#define JOB_NONE                 0
+
+struct job_t
+{
+  uint32_t id;
+  int16_t  m_code;
+  uint32_t accepted_at;          // millis()
+  bool     started;
+  uint16_t boards;               // Boards unloaded so far
+  bool     changeover;           // Ended by serviceChangeover(), not by going idle
+};
+
+job_t    g_job                 = { JOB_NONE, -1, 0, false, 0, false };
+uint32_t g_job_counter         = 0;
+uint32_t g_last_accepted_job   = JOB_NONE;   // Set when a command creates a job
+char     g_mqtt_job_topic[50];               // MQTT topic for job events
+
+void publishJobEvent(const char* event)
+{
+  uint32_t now = millis();
+  LOG_INFO(LOG_JOB_EVENT, g_job.id, event);
+  if (features_t::mqtt)
+  {
+    snprintf(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer),
+             "job=%lu event=%s code=M%d t=%lu elapsed=%lu boards=%u",
+             (unsigned long)g_job.id, event, g_job.m_code, (unsigned long)now,
+             (unsigned long)(now - g_job.accepted_at), g_job.boards);
+    mqttPublish(g_mqtt_job_topic, g_mqtt_message_buffer);
+  }
+}
+
+void endJob(const char* event)
+{
+  publishJobEvent(event);
+  g_job.id = JOB_NONE;
+}
+
+/**
+  Start a new job for an unload command. Any job still running is aborted.
+*/
+void jobAccepted(int16_t m_code)
+{
+  if (JOB_NONE != g_job.id)
+  {
+    endJob("aborted");
+  }
+  g_job.id          = ++g_job_counter;
+  g_job.m_code      = m_code;
+  g_job.accepted_at = millis();
+  g_job.started     = false;
+  g_job.boards      = 0;
+  g_job.changeover  = false;
+  g_last_accepted_job = g_job.id;
+  publishJobEvent("accepted");
+}
+
+/**
+  Follow the active job through the state machine. Called on every state
+  transition, before g_state changes.
+*/
+void updateJob(uint16_t old_state, uint16_t new_state)
+{
+  if (JOB_NONE == g_job.id)
+  {
+    return;
+  }
+
+  switch (new_state)
+  {
+    case STATE_UNLOAD_NOW_MOVING:
+    case STATE_UNLOAD_RIRO_MOVING:
+    case STATE_UNLOAD_RIRO_PRESTART:
+    case STATE_UNLOAD_TIMED_MOVING:
+    case STATE_UNLOAD_SPACED_MOVING:
+      if (!g_job.started)
+      {
+        g_job.started = true;
+        publishJobEvent("started");
+      }
+      break;
+
+    case STATE_UNLOAD_NOW_CLEARED_END:
+    case STATE_UNLOAD_RIRO_CLEARED_END:
+    case STATE_UNLOAD_TIMED_CLEARED_END:
+    case STATE_UNLOAD_SPACED_CLEARED_END:
+      g_job.boards++;
+      if (STATE_UNLOAD_NOW_CLEARED_END != new_state)
+      {
+        publishJobEvent("unloaded");
+      }
+      break;
+
+    case STATE_IDLE:
+      if (g_job.changeover)
+      {
+        break;
+      }
+      // The only way back to idle other than a timeout is M55 finishing
+      endJob(STATE_UNLOAD_NOW_RUNON == old_state ? "completed" : "timeout");
+      break;
+
+    case STATE_ERROR:
+    case STATE_ESTOP:
+      endJob("aborted");
+      break;
+  }
+}
+
+#endif H_JOBS
@@ -0,0 +1,441 @@
+#ifndef H_LOGGING
+#define H_LOGGING
+
+/*
+  Deferred logging
+
+  Log calls in the control loop don't touch the serial port. They store a
+  message ID, a timestamp and up to LOG_MAX_ARGS arguments into a ring buffer,
+  which takes a few microseconds. The text is only formatted and written out
+  by serviceLog(), which is called once per pass of loop() and never writes
+  more than the UART can accept without blocking.
+
+  Messages are filtered at compile time by LOG_LEVEL in config.h, so disabled
+  levels cost nothing at all.
+
+  Usage:
+    LOG_INFO(LOG_SPEED_SET, requested_speed);
+
+  Every message has an entry in LOG_MESSAGES below. The conversions in the
+  format string decide how each argument is stored:
+    %d %i         signed integer
+    %u %x %X %c   unsigned integer
+    %f %g         float (any precision, eg "%.2f")
+    %s            string, copied into the record (one per message, up to
+                  LOG_TEXT_LENGTH - 1 characters)
+
+  The buffer has one producer and one consumer, both running in the Arduino
+  loop task, so no locking is needed. Don't log from an ISR.
+*/
+
+#define LOG_LEVEL_NONE     0
+#define LOG_LEVEL_ERROR    1
+#define LOG_LEVEL_WARN     2
+#define LOG_LEVEL_INFO     3
+#define LOG_LEVEL_DEBUG    4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL          LOG_LEVEL_INFO
+#endif
+
+#define LOG_BUFFER_SIZE   64    // Records. Must be a power of 2
+#define LOG_MAX_ARGS       4
+#define LOG_TEXT_LENGTH   24    // Bytes for the copied %s argument
+#define LOG_LINE_LENGTH  128    // Longest formatted line
+#define LOG_BUSY_RECORDS   1    // Records formatted per loop while a board is moving
+
+/*
+  Message table. Add new messages here, not inline in the code.
+*/
+#define LOG_MESSAGES(X) \
+  X(LOG_DROPPED,              "Log overflow, %u messages dropped") \
+  X(LOG_PROCESSING,           "Processing: %s") \
+  X(LOG_COMMAND_CODE,         "Command code: %d") \
+  X(LOG_UNKNOWN_COMMAND,      "Unknown or empty command ignored") \
+  X(LOG_HOMING_START,         "Homing start") \
+  X(LOG_HOMING_COMPLETE,      "Homing complete") \
+  X(LOG_HOMING_SKIPPED,       "Already homed, width %.2f mm") \
+  X(LOG_HOME_VERIFIED,        "Home verified, %d steps out") \
+  X(LOG_HOME_MISMATCH,        "Rail was %d steps out, position corrected") \
+  X(LOG_POSITION_RESTORED,    "Saved width %.2f mm restored, no need to home") \
+  X(LOG_POSITION_LOST,        "Power was lost during a move, home with G28") \
+  X(LOG_POSITION_INVALID,     "Saved width %.2f mm doesn't make sense, home with G28") \
+  X(LOG_POSITION_NONE,        "No saved width, home with G28") \
+  X(LOG_GCODE_MOVE,           "GCODE move!") \
+  X(LOG_NOT_HOMED,            "Home the device first using command 'G28'") \
+  X(LOG_MOVE_TOO_WIDE,        "Can't move to greater than %d mm") \
+  X(LOG_MOVE_TOO_NARROW,      "Can't move to smaller than %d mm") \
+  X(LOG_MOVE_PLAN,            "Current: %.2f, Requested: %.2f, Delta: %.2f, Steps: %d") \
+  X(LOG_MOVE_COMPLETE,        "Rail at %.2f mm") \
+  X(LOG_RAIL_BUSY,            "Rail is still moving, try again when it stops") \
+  X(LOG_CONVEYOR_STOP,        "Conveyor stop") \
+  X(LOG_CONVEYOR_RIGHT,       "Conveyor right") \
+  X(LOG_CONVEYOR_LEFT,        "Conveyor left") \
+  X(LOG_SPEED_SET,            "Setting to %u") \
+  X(LOG_SPEED_INVALID,        "Speed %g out of range, stopping") \
+  X(LOG_STATE_TRANSITION,     "sm: [%u -> %u] @ %u, delta %u") \
+  X(LOG_STATE_ERROR,          "ERROR STATE") \
+  X(LOG_TIMED_LEAVING,        "Leaving") \
+  X(LOG_TIMED_RESUMING,       "Leaving 2") \
+  X(LOG_MQTT_MESSAGE,         "Message arrived [%s]") \
+  X(LOG_MQTT_CONNECTED,       "MQTT connected to %s") \
+  X(LOG_MQTT_LOST,            "MQTT connection lost, retrying in the background") \
+  X(LOG_WIFI_CONNECTED,       "WiFi connected, IP %u.%u.%u.%u") \
+  X(LOG_WIFI_LOST,            "WiFi connection lost, retrying in the background") \
+  X(LOG_WIFI_DISABLED,        "No WiFi SSID set, running without a network") \
+  X(LOG_WEBSOCKET_STARTED,    "WebSocket server listening on port %u") \
+  X(LOG_WEBSOCKET_CONNECTED,  "WebSocket client %u connected, %u open") \
+  X(LOG_WEBSOCKET_CLOSED,     "WebSocket client %u disconnected, %u open") \
+  X(LOG_JOB_EVENT,            "Job %u %s") \
+  X(LOG_PARAMETER,            "M510 P%u S%g ; %s") \
+  X(LOG_PARAMETER_UNKNOWN,    "No parameter %d") \
+  X(LOG_PARAMETER_RANGE,      "Parameter %u must be from %g to %g") \
+  X(LOG_PARAMETER_CONFLICT,   "Parameter %u would put a minimum above its maximum, not changed") \
+  X(LOG_PARAMETERS_SAVED,     "Parameters saved, ok=%u") \
+  X(LOG_PARAMETERS_LOADED,    "%u saved parameters loaded") \
+  X(LOG_PARAMETERS_INVALID,   "Saved parameters don't make sense together, using defaults") \
+  X(LOG_RECIPE,               "Recipe %u: %.2f mm, %u mm/min, %s") \
+  X(LOG_RECIPES_LOADED,       "%u saved recipes loaded") \
+  X(LOG_RECIPE_NUMBER,        "No recipe %d, use 1 to %u") \
+  X(LOG_RECIPE_INVALID,       "Recipe %d not changed, bad %s") \
+  X(LOG_RECIPE_NOT_SAVED,     "Recipe %u couldn't be saved") \
+  X(LOG_RECIPE_SAVED,         "Recipe %u saved as %s") \
+  X(LOG_RECIPE_DELETED,       "Recipe %u deleted") \
+  X(LOG_RECIPE_NOT_FOUND,     "No recipe %d") \
+  X(LOG_CHANGEOVER_START,     "Changing over to recipe %u, %s") \
+  X(LOG_CHANGEOVER_COMPLETE,  "Changeover to recipe %u done in %u ms") \
+  X(LOG_CHANGEOVER_TIMEOUT,   "Changeover to recipe %u stopped, boards didn't clear") \
+  X(LOG_CHANGEOVER_CANCELLED, "Changeover to recipe %u cancelled") \
+  X(LOG_SENSOR_INIT,          "Initialised %s PCB sensor") \
+  X(LOG_SENSOR_INIT_FAILED,   "Failed to initialise %s PCB sensor") \
+  X(LOG_SENSOR_VALUES,        "Sensors 1: %u  2: %u  3: %u mm") \
+  X(LOG_SENSOR_BUDGET,        "Sensor timing budget %u ms") \
+  X(LOG_SENSOR_CALIBRATION,   "Sensor %u: baseline %u mm, offset %d mm, threshold %u mm") \
+  X(LOG_SENSOR_CALIBRATION_BUSY, "Can't calibrate sensors unless the belt is empty and stopped") \
+  X(LOG_SENSOR_CALIBRATION_UNUSABLE, "Sensor %u baseline %u mm is within %u mm of the sensor, calibration rejected") \
+  X(LOG_SENSOR_CALIBRATION_NOT_SAVED, "Sensor calibration couldn't be saved") \
+  X(LOG_SENSOR_CALIBRATION_LOADED, "Saved sensor calibration loaded") \
+  X(LOG_BOARD_MEASURED,       "Board %u: length %u mm, gap %u mm, velocity %u mm/min") \
+  X(LOG_BOARD_AVERAGES,       "Average: length %u mm, gap %u mm, velocity %u mm/min") \
+  X(LOG_BOARD_LENGTH_MISMATCH, "Board %u measured %u mm long, expected %u mm") \
+  X(LOG_BOARD_GAP_SHORT,      "Board %u only %u mm behind the last one") \
+  X(LOG_SPACING_MISSING,      "Gap or pitch needed, eg P50") \
+  X(LOG_SPACING_TOO_LONG,     "Gap or pitch can't be more than %u mm") \
+  X(LOG_SPACED_RELEASE,       "Releasing next board") \
+  X(LOG_DISPLAY_FAILED,       "Not enough memory for the LCD dashboard") \
+  X(LOG_TRACE_STARTED,        "Trace %s") \
+  X(LOG_TRACE_STOPPED,        "Trace stopped: %u records, %u bytes waiting, %u dropped") \
+  X(LOG_TRACE_FULL,           "Trace buffer full") \
+  X(LOG_ESTOP,                "EMERGENCY STOP from %s, outputs off in %u us") \
+  X(LOG_ESTOP_SLOW,           "Emergency stop took longer than %u us") \
+  X(LOG_ESTOP_LATCHED,        "Emergency stop latched, send M999 to clear it") \
+  X(LOG_ESTOP_INPUT_ACTIVE,   "Emergency stop input still active, not cleared") \
+  X(LOG_ESTOP_CLEARED,        "Emergency stop cleared") \
+  X(LOG_HOMING_STOPPED,       "Homing stopped, home again with G28") \
+  X(LOG_BACKLASH_CUT_SHORT,   "Only %d of %u backlash steps fit before the limit, the rail may stop short") \
+  X(LOG_MEMORY,               "Heap %u free, %u at least, largest block %u") \
+  X(LOG_TASK_STACK,           "Task %s: %u bytes of stack spare at least") \
+  X(LOG_STACK_LOW,            "Task %s down to %u bytes of spare stack") \
+  X(LOG_OTA_START,            "OTA update of the %s started") \
+  X(LOG_OTA_PROGRESS,         "OTA update %u%%") \
+  X(LOG_OTA_END,              "OTA update finished") \
+  X(LOG_OTA_ERROR,            "OTA update failed: %s") \
+  X(LOG_OTA_STAGED,           "New firmware staged, restarting once the conveyor is idle and empty") \
+  X(LOG_OTA_RESTART,          "Restarting into the %s firmware") \
+  X(LOG_OTA_TRIAL,            "New firmware on trial, boot %u") \
+  X(LOG_OTA_ACCEPTED,         "New firmware passed its health check") \
+  X(LOG_OTA_ROLLBACK,         "New firmware %s, going back to the previous firmware") \
+  X(LOG_FLOW_DIRECTION,       "Boards flow %s") \
+  X(LOG_FLOW_INVALID,         "Flow direction F%d isn't 0 or 1") \
+  X(LOG_OEE_REPORT,           "Shift %u: %u boards, %u s starved, %u s blocked") \
+  X(LOG_OEE_SHIFT,            "Shift %u started") \
+  X(LOG_PRESTART,             "Starting early, ready-in expected in %u ms") \
+  X(LOG_PRESTART_HOLD,        "Holding board at the exit for ready-in") \
+  X(LOG_PRESTART_LEARNT,      "Downstream cycle %u ms, travel to the exit %u ms") \
+  X(LOG_SERIAL_TOO_LONG,      "Serial line longer than %u characters ignored") \
+  X(LOG_SERIAL_DROPPED,       "Serial input during a move overflowed, %u characters dropped") \
+  X(LOG_CAN_MESSAGE,          "CAN from 0x%x: %s") \
+  X(LOG_CAN_BINARY_COMMAND,   "CAN from 0x%x: binary command 0x%x") \
+  X(LOG_CAN_BAD_COMMAND,      "CAN from 0x%x: binary command 0x%x dropped, unknown or too short (%u bytes)") \
+  X(LOG_HANDOFF_AVAILABLE,    "Upstream board %u available") \
+  X(LOG_HANDOFF_TRANSFERRED,  "Board %u transferred downstream") \
+  X(LOG_HANDOFF_QUEUE_FULL,   "Too many boards on conveyor, board %u not tracked") \
+  X(LOG_HANDOFF_QUEUE_CLEARED, "Belt is clear, forgot %u boards that left unseen") \
+  X(LOG_CAN_OVERFLOW,         "CAN receive queue overflow, %u frames dropped") \
+  X(LOG_CAN_TP_START,         "CAN TP session from 0x%x, %u bytes") \
+  X(LOG_CAN_TP_ABORT,         "CAN TP session with 0x%x aborted, reason %u")
+
+#define LOG_ENUM_ENTRY(id, format)   id,
+#define LOG_FORMAT_ENTRY(id, format) format,
+
+enum log_message_id : uint16_t { LOG_MESSAGES(LOG_ENUM_ENTRY) LOG_MESSAGE_COUNT };
+const char* const g_log_formats[] = { LOG_MESSAGES(LOG_FORMAT_ENTRY) };
+
+#undef LOG_ENUM_ENTRY
+#undef LOG_FORMAT_ENTRY
+
+union log_arg_t
+{
+  int32_t  i;
+  uint32_t u;
+  float    f;
+};
+
+struct log_record_t
+{
+  uint32_t  timestamp;                  // millis() when logged
+  uint16_t  message_id;
+  uint8_t   level;
+  uint8_t   arg_count;
+  log_arg_t args[LOG_MAX_ARGS];
+  char      text[LOG_TEXT_LENGTH];
+};
+
+log_record_t      g_log_buffer[LOG_BUFFER_SIZE];
+volatile uint16_t g_log_head          = 0;   // Next slot to write. Only changed by the producer
+volatile uint16_t g_log_tail          = 0;   // Next slot to read. Only changed by the consumer
+uint32_t          g_log_dropped       = 0;   // Records lost because the buffer was full
+
+char              g_log_line[LOG_LINE_LENGTH];
+uint16_t          g_log_line_length   = 0;   // Formatted line waiting to go out
+uint16_t          g_log_line_sent     = 0;   // How much of it has been written
+
+const char g_log_level_tags[] = { ' ', 'E', 'W', 'I', 'D' };
+
+/*
+  Argument packing. Overloads pick the storage from the argument type. These
+  use the fundamental types because int32_t / uint32_t alias different ones
+  depending on the toolchain version.
+*/
+inline void logPackArg(log_record_t &record, int value)            { record.args[record.arg_count++].i = value; }
+inline void logPackArg(log_record_t &record, long value)           { record.args[record.arg_count++].i = value; }
+inline void logPackArg(log_record_t &record, short value)          { record.args[record.arg_count++].i = value; }
+inline void logPackArg(log_record_t &record, signed char value)    { record.args[record.arg_count++].i = value; }
+inline void logPackArg(log_record_t &record, unsigned int value)   { record.args[record.arg_count++].u = value; }
+inline void logPackArg(log_record_t &record, unsigned long value)  { record.args[record.arg_count++].u = value; }
+inline void logPackArg(log_record_t &record, unsigned short value) { record.args[record.arg_count++].u = value; }
+inline void logPackArg(log_record_t &record, unsigned char value)  { record.args[record.arg_count++].u = value; }
+inline void logPackArg(log_record_t &record, bool value)           { record.args[record.arg_count++].u = value; }
+inline void logPackArg(log_record_t &record, float value)          { record.args[record.arg_count++].f = value; }
+inline void logPackArg(log_record_t &record, double value)         { record.args[record.arg_count++].f = (float)value; }
+
+inline void logPackArg(log_record_t &record, const char* value)
+{
+  uint8_t length = 0;
+  while (length < LOG_TEXT_LENGTH - 1 && '\0' != value[length])
+  {
+    record.text[length] = value[length];
+    length++;
+  }
+  record.text[length] = '\0';
+}
+
+inline void logPackArg(log_record_t &record, char* value)         { logPackArg(record, (const char*)value); }
+
+inline void logPackArgs(log_record_t &record) {}
+
+template <typename T, typename... Rest>
+inline void logPackArgs(log_record_t &record, T first, Rest... rest)
+{
+  if (record.arg_count < LOG_MAX_ARGS)
+  {
+    logPackArg(record, first);
+  }
+  logPackArgs(record, rest...);
+}
+
+/*
+  Queue a message. Called through the LOG_* macros, never directly.
+*/
+template <typename... Args>
+void logWrite(uint8_t level, log_message_id message_id, Args... args)
+{
+  uint16_t head = g_log_head;
+  uint16_t next = (head + 1) & (LOG_BUFFER_SIZE - 1);
+  if (next == g_log_tail)
+  {
+    g_log_dropped++;
+    return;
+  }
+
+  log_record_t &record = g_log_buffer[head];
+  record.timestamp  = millis();
+  record.message_id = message_id;
+  record.level      = level;
+  record.arg_count  = 0;
+  record.text[0]    = '\0';
+  logPackArgs(record, args...);
+
+  g_log_head = next;
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(id, ...)  logWrite(LOG_LEVEL_ERROR, id, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(id, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(id, ...)   logWrite(LOG_LEVEL_WARN,  id, ##__VA_ARGS__)
+#else
+#define LOG_WARN(id, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(id, ...)   logWrite(LOG_LEVEL_INFO,  id, ##__VA_ARGS__)
+#else
+#define LOG_INFO(id, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(id, ...)  logWrite(LOG_LEVEL_DEBUG, id, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(id, ...)
+#endif
+
+/*
+  Expand a record into g_log_line. Each conversion in the format string is
+  handed to snprintf on its own with the argument type it asks for.
+*/
+uint16_t formatLogRecord(const log_record_t &record, char* line, uint16_t line_size)
+{
+  const char* format = g_log_formats[record.message_id];
+  uint8_t  arg_index = 0;
+  int      length    = snprintf(line, line_size, "[%lu] %c ", (unsigned long)record.timestamp,
+                                g_log_level_tags[record.level]);
+
+  while (*format && length < line_size - 1)
+  {
+    if (*format != '%')
+    {
+      line[length++] = *format++;
+      continue;
+    }
+
+    // Copy a single conversion spec, eg "%.2f"
+    char spec[8];
+    uint8_t spec_length = 0;
+    spec[spec_length++] = *format++;
+    while (*format && spec_length < sizeof(spec) - 2 && !strchr("diuxXcfgs%", *format))
+    {
+      spec[spec_length++] = *format++;
+    }
+    char conversion = *format;
+    if (conversion)
+    {
+      spec[spec_length++] = *format++;
+    }
+    spec[spec_length] = '\0';
+
+    int written = 0;
+    uint16_t space = line_size - length;
+    switch (conversion)
+    {
+      case '%':
+        written = snprintf(line + length, space, "%%");
+        break;
+      case 's':
+        written = snprintf(line + length, space, spec, record.text);
+        break;
+      case 'f':
+      case 'g':
+        written = snprintf(line + length, space, spec,
+                           arg_index < record.arg_count ? (double)record.args[arg_index].f : 0.0);
+        arg_index++;
+        break;
+      case 'd':
+      case 'i':
+        written = snprintf(line + length, space, spec,
+                           arg_index < record.arg_count ? (int)record.args[arg_index].i : 0);
+        arg_index++;
+        break;
+      default:
+        written = snprintf(line + length, space, spec,
+                           arg_index < record.arg_count ? (unsigned int)record.args[arg_index].u : 0u);
+        arg_index++;
+        break;
+    }
+    if (written > 0)
+    {
+      length += written;
+    }
+  }
+
+  if (length > line_size - 2)
+  {
+    length = line_size - 2;
+  }
+  line[length++] = '\n';
+  line[length]   = '\0';
+  return length;
+}
+
+/*
+  True when nothing on the belt depends on loop timing, so the log can be
+  drained as fast as the UART accepts it.
+*/
+bool logSystemIdle()
+{
+  return (STATE_BEGIN == g_state || STATE_IDLE == g_state || STATE_STOPPED == g_state
+          || STATE_ESTOP == g_state);
+}
+
+/*
+  Write out queued log messages without ever blocking on the UART. Call once
+  per pass of loop().
+*/
+void serviceLog()
+{
+  uint8_t records_left = logSystemIdle() ? LOG_BUFFER_SIZE : LOG_BUSY_RECORDS;
+
+  while (true)
+  {
+    // Finish sending the current line first
+    if (g_log_line_sent < g_log_line_length)
+    {
+      int space = Serial.availableForWrite();
+      if (space <= 0)
+      {
+        return;
+      }
+      uint16_t chunk = g_log_line_length - g_log_line_sent;
+      if (chunk > space)
+      {
+        chunk = space;
+      }
+      Serial.write((const uint8_t*)g_log_line + g_log_line_sent, chunk);
+      g_log_line_sent += chunk;
+      continue;
+    }
+
+    if (0 == records_left)
+    {
+      return;
+    }
+
+    if (g_log_dropped > 0)
+    {
+      log_record_t dropped_record;
+      dropped_record.timestamp  = millis();
+      dropped_record.message_id = LOG_DROPPED;
+      dropped_record.level      = LOG_LEVEL_WARN;
+      dropped_record.arg_count  = 1;
+      dropped_record.args[0].u  = g_log_dropped;
+      dropped_record.text[0]    = '\0';
+      g_log_dropped = 0;
+      g_log_line_length = formatLogRecord(dropped_record, g_log_line, LOG_LINE_LENGTH);
+    } else {
+      uint16_t tail = g_log_tail;
+      if (tail == g_log_head)
+      {
+        return;
+      }
+      g_log_line_length = formatLogRecord(g_log_buffer[tail], g_log_line, LOG_LINE_LENGTH);
+      g_log_tail = (tail + 1) & (LOG_BUFFER_SIZE - 1);
+    }
+    g_log_line_sent = 0;
+    records_left--;
+  }
+}
+
+#endif H_LOGGING
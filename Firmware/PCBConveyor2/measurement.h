@@ -0,0 +1,423 @@
+#ifndef H_MEASUREMENT
+#define H_MEASUREMENT
+
+/*
+  Board measurement
+
+  read_pcb_sensors() notes the time of every new reading. When a sensor changes
+  state, the edge is put halfway between that reading and the one before,
+  so it's within half a sensor cycle of when the board edge really passed.
+  A sensor only counts as clear after g_params.debounce_count clear readings
+  in a row, the same as the state machine, so a flicker doesn't split a
+  board in two.
+
+  For each board:
+
+    velocity  The middle to exit sensor distance, g_params.sensor_pitch,
+              divided by the time the leading edge took between them. What
+              the belt really did, not what it was asked to do. mm/min
+    length    Velocity times the time the middle sensor was covered. mm
+    gap       Velocity times the time from the board before clearing the
+              middle sensor to this one reaching it. mm
+
+  Length and gap are timed at the middle sensor because a board passing the
+  entrance or exit sensor is partly on the neighbouring machine's belt,
+  which may run at a different speed.
+
+  A time only counts if our belt ran at the same speed the whole time.
+  Boards that stop on the conveyor (M51, M53, a downstream machine that
+  isn't ready) use the velocity of an earlier board in the same run, and
+  anything that still can't be measured is reported as 0.
+
+  When the board clears the exit sensor the result is logged and published
+  to the telemetry topic:
+
+    board=2415919105 length=160 gap=85 velocity=1497 speed=1500 t=81234
+
+  A board more than MEASURE_LENGTH_TOLERANCE mm off the length the upstream
+  machine announced is logged as a warning, and so is a gap shorter than
+  MEASURE_MINIMUM_GAP. Overlapping boards show up as one long board.
+
+    M540      Report the last MEASURE_HISTORY boards and the averages
+*/
+
+#define MEASURE_HISTORY            8     // Boards kept for M540
+#define MEASURE_UNKNOWN            0
+
+struct sensor_edges_t
+{
+  bool     covered;              // Debounced
+  uint8_t  clear_count;          // Clear readings in a row while covered
+  uint32_t last_read;            // millis() of the reading before this one
+  uint32_t rise;                 // millis() of the first covered reading
+  uint32_t fall;                 // millis() of the first clear reading
+};
+
+struct board_timing_t            // A board seen by the middle sensor, not yet gone
+{
+  uint32_t rise;                 // millis() of the edges at the middle sensor
+  uint32_t fall;                 // 0 until it clears the middle sensor
+  uint32_t gap;                  // ms after the board before, 0 if unknown
+  uint16_t velocity;             // mm/min, MEASURE_UNKNOWN until it reaches the exit sensor
+};
+
+struct board_measurement_t
+{
+  uint32_t board_id;
+  uint32_t at;                   // millis() when it cleared the exit sensor
+  uint16_t length;               // mm
+  uint16_t gap;                  // mm
+  uint16_t velocity;             // mm/min
+  uint16_t speed;                // mm/min, what the belt was asked for
+};
+
+sensor_edges_t      g_sensor_edges[SENSOR_COUNT];
+board_timing_t      g_board_timing[HANDOFF_MAX_BOARDS];   // Oldest first
+uint8_t             g_board_timing_count  = 0;
+uint8_t             g_boards_at_exit      = 0;     // Of those, reached the exit sensor
+board_measurement_t g_measurements[MEASURE_HISTORY];
+uint8_t             g_measurement_count   = 0;     // Up to MEASURE_HISTORY
+uint8_t             g_measurement_next    = 0;     // Ring index for the next one
+
+uint32_t g_run_start          = 0;                 // millis() the belt last started or changed speed
+uint8_t  g_run_direction      = STOP;
+uint16_t g_run_speed          = 0;
+uint16_t g_run_velocity       = MEASURE_UNKNOWN;   // Last velocity measured in this run
+uint16_t g_known_velocity     = MEASURE_UNKNOWN;   // Last velocity measured in any run...
+uint16_t g_known_speed        = 0;                 // ...and the speed the belt was asked for then
+uint32_t g_belt_clear_since   = 0;                 // millis() since no sensor has seen a board with the belt running
+
+/**
+  @return true if the belt ran at one speed the whole time since /since/
+*/
+bool beltRanSince(uint32_t since)
+{
+  return STOP != g_run_direction && (int32_t)(since - g_run_start) >= 0;
+}
+
+/**
+  @return our best idea of the belt velocity in mm/min: measured in this
+  run, else measured earlier at the same speed, else the speed asked for
+*/
+uint16_t beltVelocity()
+{
+  if (MEASURE_UNKNOWN != g_run_velocity)
+  {
+    return g_run_velocity;
+  }
+  if (MEASURE_UNKNOWN != g_known_velocity && g_known_speed == g_x_requested_speed)
+  {
+    return g_known_velocity;
+  }
+  return g_x_requested_speed;
+}
+
+/**
+  M60 and M61: has the last board got far enough ahead for the next one
+  to go? The next machine is assumed to run at our belt velocity, so the
+  gap or pitch becomes a time from the last board's trailing or leading
+  edge leaving the exit sensor.
+*/
+bool spacingReached()
+{
+  uint16_t velocity = beltVelocity();
+  if (0 == velocity)
+  {
+    return true;
+  }
+  uint32_t since = g_spacing_pitch ? g_spacing_lead : g_spacing_tail;
+  return millis() - since >= (uint32_t)g_requested_spacing * 60000UL / velocity;
+}
+
+/**
+  @return mm the belt moves in /ms/ at /velocity/ mm/min, UINT16_MAX if
+  that's further than a uint16_t holds
+*/
+uint16_t measureDistance(uint16_t velocity, uint32_t ms)
+{
+  uint64_t distance = (uint64_t)velocity * ms / 60000ULL;
+  return distance > UINT16_MAX ? UINT16_MAX : (uint16_t)distance;
+}
+
+/**
+  @return true if the last board has moved at least /distance/ mm past the
+  entrance sensor
+*/
+bool entranceClearBy(uint16_t distance)
+{
+  const sensor_edges_t &entrance = g_sensor_edges[ENTRANCE_SENSOR];
+  return !entrance.covered && measureDistance(beltVelocity(), millis() - entrance.fall) >= distance;
+}
+
+void recordMeasurement(const board_measurement_t &measurement)
+{
+  g_measurements[g_measurement_next] = measurement;
+  g_measurement_next = (g_measurement_next + 1) % MEASURE_HISTORY;
+  if (g_measurement_count < MEASURE_HISTORY)
+  {
+    g_measurement_count++;
+  }
+
+  LOG_INFO(LOG_BOARD_MEASURED, measurement.board_id, measurement.length, measurement.gap, measurement.velocity);
+  if (features_t::mqtt)
+  {
+    snprintf(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer),
+             "board=%lu length=%u gap=%u velocity=%u speed=%u t=%lu",
+             (unsigned long)measurement.board_id, measurement.length, measurement.gap,
+             measurement.velocity, measurement.speed, (unsigned long)measurement.at);
+    mqttPublish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+  }
+}
+
+/**
+  A leading edge reached the middle sensor at /at/
+*/
+void middleSensorCovered(uint32_t at)
+{
+  if (g_board_timing_count >= HANDOFF_MAX_BOARDS)
+  {
+    return;                      // Lost track, forgotten when the belt is empty
+  }
+  board_timing_t &timing = g_board_timing[g_board_timing_count++];
+  uint32_t last_fall = g_sensor_edges[MIDDLE_SENSOR].fall;
+  timing.rise     = at;
+  timing.fall     = 0;
+  timing.gap      = (0 != last_fall && beltRanSince(last_fall)) ? at - last_fall : 0;
+  timing.velocity = MEASURE_UNKNOWN;
+}
+
+/**
+  A leading edge reached the exit sensor at /at/
+*/
+void exitSensorCovered(uint32_t at)
+{
+  if (g_boards_at_exit >= g_board_timing_count)
+  {
+    return;                      // Not seen by the middle sensor
+  }
+  board_timing_t &timing = g_board_timing[g_boards_at_exit++];
+  if (at != timing.rise && beltRanSince(timing.rise))
+  {
+    g_run_velocity   = (uint32_t)g_params.sensor_pitch * 60000UL / (at - timing.rise);
+    timing.velocity  = g_run_velocity;
+    g_known_velocity = g_run_velocity;
+    g_known_speed    = g_run_speed;
+  }
+}
+
+/**
+  The first board cleared the exit sensor at /at/
+*/
+void exitSensorCleared(uint32_t at)
+{
+  board_measurement_t measurement = { 0, at, MEASURE_UNKNOWN, MEASURE_UNKNOWN, MEASURE_UNKNOWN, g_run_speed };
+  uint16_t expected = HANDOFF_LENGTH_UNKNOWN;
+
+  // Still the first board on the conveyor, the state machine hasn't seen it go yet
+  if (g_board_count > 0)
+  {
+    measurement.board_id = g_board_queue[0].id;
+    expected             = g_board_queue[0].length;
+  }
+
+  if (g_boards_at_exit > 0)
+  {
+    board_timing_t timing = g_board_timing[0];
+    for (uint8_t i = 1; i < g_board_timing_count; i++)
+    {
+      g_board_timing[i - 1] = g_board_timing[i];
+    }
+    g_board_timing_count--;
+    g_boards_at_exit--;
+
+    measurement.velocity = timing.velocity;
+    if (MEASURE_UNKNOWN == measurement.velocity && beltRanSince(timing.rise))
+    {
+      measurement.velocity = g_run_velocity;
+    }
+    if (0 != timing.fall)
+    {
+      measurement.length = measureDistance(measurement.velocity, timing.fall - timing.rise);
+    }
+    measurement.gap = measureDistance(measurement.velocity, timing.gap);
+  }
+
+  if (MEASURE_UNKNOWN != measurement.length && HANDOFF_LENGTH_UNKNOWN != expected
+      && abs((int32_t)measurement.length - (int32_t)expected) > MEASURE_LENGTH_TOLERANCE)
+  {
+    LOG_WARN(LOG_BOARD_LENGTH_MISMATCH, measurement.board_id, measurement.length, expected);
+  }
+  if (MEASURE_UNKNOWN != measurement.gap && measurement.gap < MEASURE_MINIMUM_GAP)
+  {
+    LOG_WARN(LOG_BOARD_GAP_SHORT, measurement.board_id, measurement.gap);
+  }
+  recordMeasurement(measurement);
+}
+
+/**
+  Forget boards that left without an unload state seeing them go: run off
+  the end under M03/M04, lifted off by hand, or gone during an error. The
+  queue is emptied once no sensor has seen a board for a board length of
+  belt travel, or the sensor pitch if that's longer, as nothing on the
+  belt could get that far between sensors unseen. Stopped in an idle
+  state it's emptied straight away. A board left between the sensors is
+  picked up again when it trips one.
+*/
+void reconcileBoardQueue()
+{
+  if (TRIPPED == g_entrance_sensor || TRIPPED == g_middle_sensor || TRIPPED == g_exit_sensor
+      || 0 == g_board_count)
+  {
+    g_belt_clear_since = millis();
+    return;
+  }
+
+  bool clear;
+  if (STOP == g_x_direction)
+  {
+    g_belt_clear_since = millis();
+    clear = STATE_BEGIN == g_state || STATE_IDLE == g_state || STATE_ERROR == g_state;
+  } else {
+    uint16_t distance = g_params.sensor_pitch;
+    if (HANDOFF_LENGTH_UNKNOWN != g_board_queue[0].length && g_board_queue[0].length > distance)
+    {
+      distance = g_board_queue[0].length;
+    }
+    clear = measureDistance(beltVelocity(), millis() - g_belt_clear_since) >= distance;
+  }
+  if (clear)
+  {
+    LOG_INFO(LOG_HANDOFF_QUEUE_CLEARED, g_board_count);
+    g_board_count = 0;
+  }
+}
+
+/**
+  Find the edges in the latest sensor readings. Call after read_pcb_sensors().
+*/
+void serviceMeasurement()
+{
+  // Any stop or change of speed starts a new run
+  if (g_x_direction != g_run_direction || g_x_requested_speed != g_run_speed)
+  {
+    g_run_direction = g_x_direction;
+    g_run_speed     = g_x_requested_speed;
+    g_run_start     = millis();
+    g_run_velocity  = MEASURE_UNKNOWN;
+  }
+
+  const uint8_t states[SENSOR_COUNT] = { g_entrance_sensor, g_middle_sensor, g_exit_sensor };
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    if (!g_sensor_fresh[i])
+    {
+      continue;                  // Same reading as last pass
+    }
+    sensor_edges_t &edges = g_sensor_edges[i];
+    uint32_t now  = g_sensor_read_at[i];
+    uint32_t edge = edges.last_read + (now - edges.last_read) / 2;
+    edges.last_read = now;
+
+    if (TRIPPED == states[i])
+    {
+      edges.clear_count = 0;
+      if (!edges.covered)
+      {
+        edges.covered = true;
+        edges.rise    = edge;
+        if (MIDDLE_SENSOR == i) middleSensorCovered(edge);
+        if (EXIT_SENSOR == i)   exitSensorCovered(edge);
+      }
+    } else if (edges.covered) {
+      if (0 == edges.clear_count)
+      {
+        edges.fall = edge;
+      }
+      if (++edges.clear_count > g_params.debounce_count)
+      {
+        edges.covered     = false;
+        edges.clear_count = 0;
+        if (MIDDLE_SENSOR == i && g_board_timing_count > 0 && beltRanSince(g_board_timing[g_board_timing_count - 1].rise))
+        {
+          g_board_timing[g_board_timing_count - 1].fall = edges.fall;
+        }
+        if (EXIT_SENSOR == i) exitSensorCleared(edges.fall);
+      }
+    }
+  }
+
+  reconcileBoardQueue();
+
+  // Nothing on the belt, so nothing left to match
+  if (0 == g_board_count && !g_sensor_edges[MIDDLE_SENSOR].covered && !g_sensor_edges[EXIT_SENSOR].covered)
+  {
+    g_board_timing_count = 0;
+    g_boards_at_exit     = 0;
+  }
+}
+
+/**
+  The entrance and exit sensors have swapped ends, see setFlowDirection().
+  Their edges go with them. Boards part way through being timed can't be
+  matched up any more, so they're dropped.
+*/
+void swapSensorRoles()
+{
+  sensor_edges_t entrance           = g_sensor_edges[ENTRANCE_SENSOR];
+  g_sensor_edges[ENTRANCE_SENSOR]   = g_sensor_edges[EXIT_SENSOR];
+  g_sensor_edges[EXIT_SENSOR]       = entrance;
+  g_board_timing_count = 0;
+  g_boards_at_exit     = 0;
+}
+
+/**
+  Report the last boards measured, and their averages
+*/
+void reportMeasurements()
+{
+  uint32_t total_length   = 0;
+  uint32_t total_gap      = 0;
+  uint32_t total_velocity = 0;
+  uint8_t  lengths = 0, gaps = 0, velocities = 0;
+  size_t   length  = 0;
+
+  g_param_report[0] = '\0';     // Shared with the parameter report
+  for (uint8_t n = 0; n < g_measurement_count; n++)
+  {
+    // Oldest first
+    uint8_t index = (g_measurement_next + MEASURE_HISTORY - g_measurement_count + n) % MEASURE_HISTORY;
+    const board_measurement_t &measurement = g_measurements[index];
+    LOG_INFO(LOG_BOARD_MEASURED, measurement.board_id, measurement.length, measurement.gap, measurement.velocity);
+
+    if (MEASURE_UNKNOWN != measurement.length)   { total_length   += measurement.length;   lengths++;    }
+    if (MEASURE_UNKNOWN != measurement.gap)      { total_gap      += measurement.gap;      gaps++;       }
+    if (MEASURE_UNKNOWN != measurement.velocity) { total_velocity += measurement.velocity; velocities++; }
+
+    if (length < sizeof(g_param_report))
+    {
+      int written = snprintf(&g_param_report[length], sizeof(g_param_report) - length,
+                             "board=%lu length=%u gap=%u velocity=%u speed=%u t=%lu\n",
+                             (unsigned long)measurement.board_id, measurement.length, measurement.gap,
+                             measurement.velocity, measurement.speed, (unsigned long)measurement.at);
+      length += written > 0 ? written : 0;
+    }
+  }
+
+  uint16_t mean_length   = lengths    ? total_length   / lengths    : MEASURE_UNKNOWN;
+  uint16_t mean_gap      = gaps       ? total_gap      / gaps       : MEASURE_UNKNOWN;
+  uint16_t mean_velocity = velocities ? total_velocity / velocities : MEASURE_UNKNOWN;
+  LOG_INFO(LOG_BOARD_AVERAGES, mean_length, mean_gap, mean_velocity);
+  if (length < sizeof(g_param_report))
+  {
+    snprintf(&g_param_report[length], sizeof(g_param_report) - length,
+             "boards=%u length=%u gap=%u velocity=%u\n",
+             g_measurement_count, mean_length, mean_gap, mean_velocity);
+  }
+
+  if (features_t::mqtt)
+  {
+    mqttPublish(g_mqtt_tele_topic, g_param_report);
+  }
+}
+
+#endif H_MEASUREMENT
@@ -0,0 +1,119 @@
+#ifndef H_MEMORY
+#define H_MEMORY
+
+/*
+  Memory health
+
+  Nothing is allocated from the heap once setup() is done: every buffer is
+  a fixed size global and every formatted write is bounded. That leaves
+  the libraries, mostly WiFi and MQTT. To show the heap stays flat over
+  weeks of uptime, these are reported every MEMORY_REPORT_INTERVAL and on
+  M560:
+
+    heap    Free heap now, in bytes
+    min     The least free heap there has been since boot
+    block   The largest block that could be allocated. Much less than heap
+            means it's fragmented
+    <task>  The least stack that task has had spare since it started
+
+  The report goes to the telemetry topic as one line, eg
+
+    heap=182344 min=176020 block=110580 loop=5312 network=1688
+
+  Each task is logged once if its spare stack gets below MEMORY_STACK_WARN.
+*/
+
+#define MEMORY_REPORT_INTERVAL   60000   // ms
+#define MEMORY_STACK_WARN          512   // bytes
+#define MEMORY_MAX_TASKS             4
+
+struct watched_task_t
+{
+  const char*  name;
+  TaskHandle_t handle;
+  bool         warned;
+};
+
+watched_task_t g_watched_tasks[MEMORY_MAX_TASKS];
+uint8_t        g_watched_task_count = 0;
+uint32_t       g_memory_reported    = 0;
+
+/**
+  Include a task's stack in the report. /name/ must stay valid, eg a
+  string literal.
+*/
+void watchTaskStack(const char* name, TaskHandle_t handle)
+{
+  if (NULL == handle || g_watched_task_count >= MEMORY_MAX_TASKS)
+  {
+    return;
+  }
+  g_watched_tasks[g_watched_task_count].name   = name;
+  g_watched_tasks[g_watched_task_count].handle = handle;
+  g_watched_tasks[g_watched_task_count].warned = false;
+  g_watched_task_count++;
+}
+
+/**
+  Write the one line report into /buffer/
+*/
+void formatMemoryReport(char* buffer, size_t size)
+{
+  int length = snprintf(buffer, size, "heap=%lu min=%lu block=%lu", (unsigned long)ESP.getFreeHeap(),
+                        (unsigned long)ESP.getMinFreeHeap(), (unsigned long)ESP.getMaxAllocHeap());
+  for (uint8_t n = 0; n < g_watched_task_count && length > 0 && (size_t)length < size; n++)
+  {
+    // ESP-IDF counts stack in bytes, not words
+    length += snprintf(&buffer[length], size - length, " %s=%u", g_watched_tasks[n].name,
+                       (unsigned)uxTaskGetStackHighWaterMark(g_watched_tasks[n].handle));
+  }
+}
+
+/**
+  Log the memory figures and publish the report, for M560
+*/
+void reportMemory()
+{
+  LOG_INFO(LOG_MEMORY, (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+           (unsigned long)ESP.getMaxAllocHeap());
+  for (uint8_t n = 0; n < g_watched_task_count; n++)
+  {
+    LOG_INFO(LOG_TASK_STACK, g_watched_tasks[n].name, (unsigned)uxTaskGetStackHighWaterMark(g_watched_tasks[n].handle));
+  }
+  if (features_t::mqtt)
+  {
+    formatMemoryReport(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer));
+    mqttPublish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+  }
+}
+
+/**
+  Check the stacks and publish the report now and then. Call once per pass
+  of loop(). The stack check walks each stack, so it isn't done every pass.
+*/
+void serviceMemory()
+{
+  if (millis() - g_memory_reported < MEMORY_REPORT_INTERVAL)
+  {
+    return;
+  }
+  g_memory_reported = millis();
+
+  for (uint8_t n = 0; n < g_watched_task_count; n++)
+  {
+    watched_task_t &task = g_watched_tasks[n];
+    unsigned spare = uxTaskGetStackHighWaterMark(task.handle);
+    if (!task.warned && spare < MEMORY_STACK_WARN)
+    {
+      task.warned = true;
+      LOG_WARN(LOG_STACK_LOW, task.name, spare);
+    }
+  }
+  if (features_t::mqtt)
+  {
+    formatMemoryReport(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer));
+    mqttPublish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+  }
+}
+
+#endif H_MEMORY
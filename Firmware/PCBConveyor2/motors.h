@@ -1,38 +1,264 @@
 #ifndef H_MOTORS
 #define H_MOTORS
 
+#define  Y_STEP_INTERVAL   (60UL * 1000UL * 1000UL / steps_per_revolution / Y_AXIS_SPEED)  // us
+
+uint32_t g_y_last_step       = 0;       // micros() of the last step taken
+
+/*
+   Take /steps/ steps, negative to go narrower. Each step waits out its own
+   interval first, so Stepper::step() never does, and an emergency stop
+   ends the move before the next step rather than after the whole move.
+   Serial is checked for M112 while waiting. Every step is counted into
+   g_y_steps.
+   Returns the steps actually taken.
+*/
+int32_t stepYAxis(int32_t steps)
+{
+  int32_t direction = steps > 0 ? 1 : -1;
+  int32_t taken     = 0;
+  while (taken != steps)
+  {
+    pollSerialEmergencyStop();
+    uint32_t since_last = micros() - g_y_last_step;
+    if (since_last < Y_STEP_INTERVAL)
+    {
+      delayMicroseconds(Y_STEP_INTERVAL - since_last);
+    }
+    if (emergencyStopped())
+    {
+      break;
+    }
+    yAxisStepper.step(direction);
+    g_y_last_step = micros();
+    g_y_steps += direction;
+    taken     += direction;
+  }
+  if (emergencyStopped())
+  {
+    // The interrupt may have landed while that last step was being written
+    cutMotorOutputs();
+  }
+  return taken;
+}
+
 /*
    Move the Y axis until the limit switch is tripped, then back off
 */
 void homeYAxis()
 {
+  beginYMove();
+
   // Move towards the back until the limit is tripped
   step_count = 0;
-  while (digitalRead(LIMIT_SENSOR_Y_PIN) == LOW)
+  while (digitalRead(LIMIT_SENSOR_Y_PIN) == LOW && !emergencyStopped())
   {
-    yAxisStepper.step(1);
+    stepYAxis(1);
     step_count++;
   }
   delay(50); // Just to reduce the shock of changing direction
 
   // Move off the limit switch
-  yAxisStepper.step(-LIMIT_BACKOFF);
+  stepYAxis(-g_params.limit_backoff);
 
-  g_current_y_position = HOME_SWITCH_OFFSET;
+  if (emergencyStopped())
+  {
+    // Somewhere short of the switch. The saved position stays marked as
+    // moving, so it isn't trusted after a restart either.
+    g_homed = false;
+    LOG_WARN(LOG_HOMING_STOPPED);
+    return;
+  }
+  g_y_steps = mmToYSteps(g_params.home_switch_offset);
+  g_homed = true;
+  endYMove();
 }
 
-void setRequestedSpeed(uint16_t requested_speed)
+/*
+   Backlash. Homing finishes going narrower, backing off the switch, so
+   every move does too: with the backlash parameter (M510 P22) set, a move
+   that goes wider carries on that many steps past its target and comes
+   back. The slack in the drive is then always taken up the same way and
+   the rail stops where the steps say it is.
+
+   The overshoot is cut short at the max_width parameter, and at the homed
+   position, which is the limit switch less the backoff, so it never runs
+   the rail into the switch. A target closer than the backlash to either
+   can't take up all the slack, and may stop a few steps short.
+
+   Returns the step a move to /target/ turns round at, or /target/ if it
+   doesn't need to.
+*/
+int32_t yTurnPoint(int32_t target)
+{
+  if (0 == g_params.y_backlash || target <= g_y_steps)
+  {
+    return target;
+  }
+  int32_t turn  = target + g_params.y_backlash;
+  int32_t limit = min(mmToYSteps(g_params.maximum_position), mmToYSteps(g_params.home_switch_offset));
+  if (turn > limit)
+  {
+    turn = limit > target ? limit : target;
+    LOG_WARN(LOG_BACKLASH_CUT_SHORT, turn - target, g_params.y_backlash);
+  }
+  return turn;
+}
+
+/*
+   Move the Y axis to /requested_y_position/ mm. The caller checks the range.
+*/
+void moveYAxis(float requested_y_position)
+{
+  int32_t target         = mmToYSteps(requested_y_position);
+  int32_t turn           = yTurnPoint(target);
+  int32_t movement_steps = target - g_y_steps;
+  float   current        = yPosition();
+
+  LOG_INFO(LOG_MOVE_PLAN, current, requested_y_position, requested_y_position - current, movement_steps);
+
+  if (features_t::mqtt)
+  {
+    snprintf(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer), "Current: %.2f, Requested: %.2f, Delta: %.2f, Steps: %i",
+             current, requested_y_position, requested_y_position - current, movement_steps);
+    mqttPublish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+  }
+
+  beginYMove();
+  stepYAxis(turn - g_y_steps);
+  if (!emergencyStopped())
+  {
+    stepYAxis(target - g_y_steps);
+  }
+  endYMove();   // Stopped part way or not, g_y_steps is where the rail is
+}
+
+/*
+   Moves that don't block. startYMove() sets the target and serviceYAxis()
+   takes one step per pass of loop(), once Y_STEP_INTERVAL has gone by
+   since the last, so loop() never waits for the rail and the belt and
+   sensors keep running while it moves. A pass that takes longer than the
+   interval slows the rail down rather than holding anything up.
+   G0 and G28 still block, and are refused while one of these moves is
+   going.
+*/
+bool     g_y_moving          = false;
+int32_t  g_y_target_steps    = 0;   // Where the move ends
+int32_t  g_y_turn_steps      = 0;   // Where the current leg ends, past the target to take up backlash
+
+bool yAxisMoving()
+{
+  return g_y_moving;
+}
+
+/*
+   Take up to /steps/ of the current move, towards the target
+*/
+void stepYMove(uint32_t steps)
 {
-  if ((requested_speed >= MINIMUM_SPEED && requested_speed <= MAXIMUM_SPEED)
-      || 0 == requested_speed)
+  int32_t to_go = g_y_turn_steps - g_y_steps;
+  if ((uint32_t)abs(to_go) > steps)
+  {
+    to_go = to_go > 0 ? (int32_t)steps : -(int32_t)steps;
+  }
+  stepYAxis(to_go);
+
+  if (emergencyStopped())
+  {
+    // Stopped part way. The steps taken are counted, so the position is known
+    g_y_moving = false;
+    endYMove();
+    return;
+  }
+  if (g_y_steps != g_y_turn_steps)
+  {
+    return;
+  }
+  if (g_y_turn_steps != g_y_target_steps)
+  {
+    g_y_turn_steps = g_y_target_steps;   // Come back to the target
+    return;
+  }
+  g_y_moving = false;
+  endYMove();
+  LOG_INFO(LOG_MOVE_COMPLETE, yPosition());
+}
+
+void startYMove(float requested_y_position)
+{
+  float current    = yPosition();
+  g_y_target_steps = mmToYSteps(requested_y_position);
+  g_y_turn_steps   = yTurnPoint(g_y_target_steps);
+  g_y_last_step    = micros();
+  LOG_INFO(LOG_MOVE_PLAN, current, requested_y_position, requested_y_position - current, g_y_target_steps - g_y_steps);
+
+  beginYMove();
+  g_y_moving = true;
+  stepYMove(0);   // Finished already if it's a move to where the rail is
+}
+
+/*
+   Take the next step if it's due. Call once per pass of loop().
+*/
+void serviceYAxis()
+{
+  if (g_y_moving && micros() - g_y_last_step >= Y_STEP_INTERVAL)
+  {
+    stepYMove(1);   // Due, so stepYAxis() doesn't wait
+  }
+}
+
+/*
+   Home from a known position and check that the switch tripped where we
+   expected it to, then go back to the same width. Returns false if the
+   rail was more than HOME_VERIFY_TOLERANCE steps out. Either way the
+   position is right afterwards.
+*/
+bool verifyYHome()
+{
+  int32_t y_steps  = g_y_steps;
+  int32_t expected = mmToYSteps(g_params.home_switch_offset) - y_steps + g_params.limit_backoff;
+
+  homeYAxis();
+  if (!g_homed)
+  {
+    return false;   // Emergency stop
+  }
+  int32_t error = (int32_t)step_count - expected;
+  bool    ok    = abs(error) <= HOME_VERIFY_TOLERANCE;
+  if (ok)
+  {
+    LOG_INFO(LOG_HOME_VERIFIED, error);
+  } else {
+    LOG_WARN(LOG_HOME_MISMATCH, error);
+  }
+
+  if (y_steps != g_y_steps)
+  {
+    moveYAxis(yStepsToMm(y_steps));
+  }
+  return ok;
+}
+
+/*
+   Set the belt speed in mm/min. A command with no S word passes -1, which
+   sets the speed to 0 without a warning.
+*/
+void setRequestedSpeed(float requested_speed)
+{
+  if (requested_speed < 0)
+  {
+    g_x_requested_speed = 0;   // No speed given
+    return;
+  }
+  if (requested_speed <= UINT16_MAX
+      && conveyor_core::speedAllowed((uint16_t)requested_speed, g_params.minimum_speed, g_params.maximum_speed))
   {
     // Set global speed
-    g_x_requested_speed = requested_speed;
-    Serial.print("Setting to ");
-    Serial.println(requested_speed);
-    Serial.print("Setting to ");
-    Serial.println(g_x_requested_speed);
+    g_x_requested_speed = (uint16_t)requested_speed;
+    LOG_DEBUG(LOG_SPEED_SET, g_x_requested_speed);
   } else {
+    LOG_WARN(LOG_SPEED_INVALID, requested_speed);
     g_x_requested_speed = 0;
   }
 }
@@ -42,9 +268,13 @@ void setRequestedSpeed(uint16_t requested_speed)
 */
 void setConveyorMotorSpeed()
 {
-  uint16_t motor_pwm = 0;
-  motor_pwm = map(g_x_requested_speed, MINIMUM_SPEED, MAXIMUM_SPEED, MOTOR_PWM_AT_MIN, MOTOR_PWM_AT_MAX);
-  motor_pwm = constrain(motor_pwm, MOTOR_PWM_AT_MIN, MOTOR_PWM_AT_MAX);
+  if (emergencyStopped())
+  {
+    return;   // Outputs were cut by emergencyStop() and stay that way
+  }
+
+  uint16_t motor_pwm = conveyor_core::speedToPwm(g_x_requested_speed, g_params.minimum_speed, g_params.maximum_speed,
+                                                 g_params.pwm_at_min, g_params.pwm_at_max);
 
   if (STOP == g_x_direction)
   {
@@ -1,60 +1,167 @@
 #ifndef H_MQTT_COMMS
 #define H_MQTT_COMMS
 
+/*
+  The MQTT client is shared with the network task (network.h). While
+  g_mqtt_connected is false only the network task uses it, to connect. Once
+  connected it belongs to loop(), so always publish with mqttPublish(),
+  which drops messages while we're offline. Everything published is also
+  sent to any WebSocket clients, broker or not (see websocket.h).
+*/
+volatile bool g_mqtt_connected = false;
+
+bool mqttPublish(const char* topic, const char* payload)
+{
+  publishWebSocket(topic, payload);
+#if ENABLE_MQTT
+  if (g_mqtt_connected)
+  {
+    return client.publish(topic, payload);
+  }
+#endif
+  return false;
+}
+
 /**
-  Reconnect to MQTT broker, and publish a notification to the status topic
+  Make one attempt to connect to the MQTT broker, and publish a notification
+  to the telemetry topic. Only called from the network task.
 */
+bool connectMqtt()
+{
+#if ENABLE_WIFI
+  char message[80];   // Not g_mqtt_message_buffer, loop() may be using it
 
-void reconnectMqtt()
+  if (client.connect(g_device_id, mqtt_username, mqtt_password))
+  {
+    // Once connected, publish an announcement
+    snprintf(message, sizeof(message), "Device %s starting up, version %s", g_device_id, VERSION);
+    client.publish(g_mqtt_tele_topic, message);
+    // Resubscribe
+    client.subscribe(g_mqtt_command_topic);
+    return true;
+  }
+#endif
+  return false;
+}
+
+/**
+  Process incoming MQTT messages. If the connection has gone, hand the
+  client back to the network task to reconnect.
+*/
+void serviceMqtt()
 {
 #if ENABLE_WIFI
-  char mqtt_client_id[23];
-  sprintf(mqtt_client_id, "%s", g_device_id);
-  Serial.print("MQTT client id: ");
-  Serial.println(mqtt_client_id);
-
-  // Loop until we're reconnected
-  while (!client.connected()) {
-    Serial.print("Attempting MQTT connection to ");
-    Serial.print(mqtt_broker);
-    Serial.print(" as ");
-    Serial.print(mqtt_client_id);
-    Serial.print("... ");
-    // Attempt to connect
-    if (client.connect(mqtt_client_id, mqtt_username, mqtt_password)) {
-      Serial.println("connected");
-      // Once connected, publish an announcement
-      sprintf(g_mqtt_message_buffer, "Device %s starting up, version %s", mqtt_client_id, VERSION);
-      client.publish(g_mqtt_tele_topic, g_mqtt_message_buffer);
-      // Resubscribe
-      client.subscribe(g_mqtt_command_topic);
-    } else {
-      Serial.print("failed, rc=");
-      Serial.print(client.state());
-      Serial.println(" try again in 5 seconds");
-      // Wait 5 seconds before retrying
-      delay(5000);
-    }
+  if (g_mqtt_connected && !client.loop())
+  {
+    g_mqtt_connected = false;
   }
 #endif
 }
 
 
+/*
+  Command batches
+
+  The command topic takes one or more lines of G-code separated by newlines,
+  so a whole changeover can be sent in a single publish. Lines are run in
+  order, then one result listing every line is published to the result
+  topic, eg:
+
+    3 lines, 1 failed: 1 OK, 2 OK job=7, 3 UNKNOWN
+
+    OK        Recognised and run
+    UNKNOWN   Not a G- or M-code we know
+    REJECTED  Recognised but not carried out, eg a move before homing or a
+              parameter out of range
+    TOO_LONG  Longer than MQTT_MAX_LINE_LENGTH, not run
+
+  Lines that start a job (see jobs.h) give its ID after the result.
+  Blank lines and lines that are only a comment are skipped and not counted.
+  The payload doesn't need to be NUL-terminated. WebSocket clients send
+  batches the same way, see websocket.h.
+*/
+char g_mqtt_batch_buffer[MQTT_BUFFER_SIZE + 1];
+char g_mqtt_result_buffer[MQTT_RESULT_SIZE];
+
+/**
+  Run a batch of G-code lines and write the result into
+  g_mqtt_result_buffer. Payloads longer than MQTT_BUFFER_SIZE are cut short.
+*/
+void runCommandBatch(const uint8_t* payload, unsigned int length)
+{
+  g_command_received_us = micros();
+  // The payload sits in the client's own buffer, which is overwritten as soon
+  // as a command publishes anything, so work from a copy
+  if (length > MQTT_BUFFER_SIZE)
+  {
+    length = MQTT_BUFFER_SIZE;
+  }
+  memcpy(g_mqtt_batch_buffer, payload, length);
+  g_mqtt_batch_buffer[length] = '\0';
+  traceMqttBatch(g_mqtt_batch_buffer, length);
+
+  uint16_t line_count   = 0;
+  uint16_t failed_count = 0;
+  char     line_results[MQTT_RESULT_SIZE];
+  size_t   results_length = 0;
+  line_results[0] = '\0';
+
+  conveyor_core::forEachLine(g_mqtt_batch_buffer, length, [&](char* line)
+  {
+    line_count++;
+    g_last_accepted_job = JOB_NONE;
+    const char* result = "OK";
+    if (strlen(line) > MQTT_MAX_LINE_LENGTH)
+    {
+      result = "TOO_LONG";
+    } else {
+      switch (processGCodeMessage(line))
+      {
+        case GCODE_UNKNOWN:  result = "UNKNOWN";  break;
+        case GCODE_REJECTED: result = "REJECTED"; break;
+        default:                                  break;
+      }
+    }
+    if (0 != strcmp(result, "OK"))
+    {
+      failed_count++;
+    }
+
+    if (results_length < sizeof(line_results))
+    {
+      int written = snprintf(&line_results[results_length], sizeof(line_results) - results_length,
+                             "%s%u %s", line_count > 1 ? ", " : " ", line_count, result);
+      results_length += written > 0 ? written : 0;
+    }
+    if (JOB_NONE != g_last_accepted_job && results_length < sizeof(line_results))
+    {
+      int written = snprintf(&line_results[results_length], sizeof(line_results) - results_length,
+                             " job=%lu", (unsigned long)g_last_accepted_job);
+      results_length += written > 0 ? written : 0;
+    }
+  });
+
+  int written = snprintf(g_mqtt_result_buffer, sizeof(g_mqtt_result_buffer), "%u lines, %u failed:%s",
+                         line_count, failed_count, line_results);
+  if (written >= (int)sizeof(g_mqtt_result_buffer) || results_length >= sizeof(line_results))
+  {
+    // Show that the list was cut short
+    strcpy(&g_mqtt_result_buffer[sizeof(g_mqtt_result_buffer) - 4], "...");
+  }
+}
+
 /**
   This callback is invoked when an MQTT message is received.
 */
 void callback(char* topic, byte* message, unsigned int length)
 {
-  Serial.print("Message arrived [");
-  Serial.print(topic);
-  Serial.print("] ");
-  for (int i = 0; i < length; i++) {
-    Serial.print((char)message[i]);
-  }
-  Serial.println();
+  LOG_DEBUG(LOG_MQTT_MESSAGE, topic);
 
-  g_input_buffer = (char *)message;
-  processGCodeMessage();
+  runCommandBatch(message, length);
+  if (features_t::mqtt)
+  {
+    mqttPublish(g_mqtt_result_topic, g_mqtt_result_buffer);
+  }
 }
 
 #endif H_MQTT_COMMS
@@ -0,0 +1,179 @@
+#ifndef H_NETWORK
+#define H_NETWORK
+
+/*
+  Background networking
+
+  WiFi, MQTT and OTA are brought up by a low priority task on the other
+  core, so the conveyor is working within a few hundred ms of power on
+  whether or not the network is there. If WiFi or the broker goes away
+  the task keeps retrying in the background. Nothing waits for it and
+  nothing restarts.
+
+  The task also runs OTA, so an upload is received and written to flash
+  without holding up loop(). See ota.h for when it's put to use.
+
+  The task never logs, because the log only has one producer (loop()), and
+  it only touches the MQTT client while g_mqtt_connected is false. The OTA
+  callbacks leave what happened in the g_ota_* flags for serviceOta().
+  serviceNetwork() in loop() does the rest: incoming MQTT messages and
+  reporting when the connection state changes.
+*/
+
+#define NETWORK_TASK_STACK      4096
+#define NETWORK_TASK_PRIORITY      1
+#define NETWORK_TASK_CORE          0     // loop() runs on core 1
+#define NETWORK_TASK_INTERVAL    100     // ms between checks
+
+volatile bool g_wifi_connected = false;
+volatile bool g_ota_started    = false;
+
+// Set by the OTA callbacks in the network task, reported by serviceOta()
+volatile bool    g_ota_receiving = false;
+volatile bool    g_ota_sketch    = true;    // The upload is firmware, not the filesystem
+volatile uint8_t g_ota_progress  = 0;       // %
+volatile bool    g_ota_received  = false;   // An upload finished and was verified
+volatile int8_t  g_ota_error     = -1;      // ota_error_t of the last failed upload
+
+void setupOta()
+{
+  // Port defaults to 3232
+  // ArduinoOTA.setPort(3232);
+
+  // Hostname defaults to esp3232-[MAC]
+  // ArduinoOTA.setHostname("myesp32");
+
+  // No authentication by default
+  // ArduinoOTA.setPassword("admin");
+
+  // Password can be set with it's md5 value as well
+  // MD5(admin) = 21232f297a57a5a743894a0e4a801fc3
+  // ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
+
+  // Nothing restarts when an upload finishes. ota.h waits for a safe point
+  ArduinoOTA.setRebootOnSuccess(false);
+
+  // The callbacks run in the network task, so they only set flags
+  ArduinoOTA.onStart([]()
+  {
+    // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
+    g_ota_sketch    = U_FLASH == ArduinoOTA.getCommand();
+    g_ota_progress  = 0;
+    g_ota_receiving = true;
+  })
+  .onEnd([]() {
+    g_ota_receiving = false;
+    g_ota_received  = true;
+  })
+  .onProgress([](unsigned int progress, unsigned int total) {
+    g_ota_progress = total ? (uint8_t)((uint64_t)progress * 100 / total) : 0;
+  })
+  .onError([](ota_error_t error) {
+    g_ota_receiving = false;
+    g_ota_error     = error;
+  });
+
+  ArduinoOTA.begin();
+}
+
+/**
+  Keep WiFi and MQTT connected. Runs forever in its own task.
+*/
+void networkTask(void* parameter)
+{
+  uint32_t wifi_attempt = millis();
+  uint32_t mqtt_attempt = millis() - MQTT_RETRY_INTERVAL;   // Try straight away
+
+  WiFi.begin(ssid, password);
+
+  for (;;)
+  {
+    if (WL_CONNECTED == WiFi.status())
+    {
+      g_wifi_connected = true;
+      if (!g_ota_started)
+      {
+        setupOta();
+        g_ota_started = true;
+      }
+      // Blocks this task, not loop(), for the whole of an upload
+      ArduinoOTA.handle();
+#if ENABLE_MQTT
+      if (!g_mqtt_connected && millis() - mqtt_attempt >= MQTT_RETRY_INTERVAL)
+      {
+        mqtt_attempt = millis();
+        if (connectMqtt())
+        {
+          g_mqtt_connected = true;   // loop() owns the client from here
+        }
+      }
+#endif
+    } else {
+      g_wifi_connected = false;
+      if (millis() - wifi_attempt >= WIFI_RETRY_INTERVAL)
+      {
+        wifi_attempt = millis();
+        WiFi.disconnect();
+        WiFi.begin(ssid, password);
+      }
+    }
+    vTaskDelay(pdMS_TO_TICKS(NETWORK_TASK_INTERVAL));
+  }
+}
+
+/**
+  Start the network task. Returns straight away.
+*/
+void startNetwork()
+{
+#if ENABLE_WIFI
+  if (0 == strlen(ssid))
+  {
+    LOG_WARN(LOG_WIFI_DISABLED);
+    return;
+  }
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoConnect(false);
+  TaskHandle_t task = NULL;
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK, NULL,
+                          NETWORK_TASK_PRIORITY, &task, NETWORK_TASK_CORE);
+  watchTaskStack("network", task);
+#endif
+}
+
+/**
+  Handle MQTT and report connection changes. Call once per pass of loop().
+*/
+void serviceNetwork()
+{
+#if ENABLE_WIFI
+  static bool wifi_reported = false;
+  static bool mqtt_reported = false;
+
+  if (g_wifi_connected != wifi_reported)
+  {
+    wifi_reported = g_wifi_connected;
+    if (wifi_reported)
+    {
+      IPAddress ip = WiFi.localIP();
+      LOG_INFO(LOG_WIFI_CONNECTED, ip[0], ip[1], ip[2], ip[3]);
+    } else {
+      LOG_WARN(LOG_WIFI_LOST);
+    }
+  }
+
+  serviceMqtt();
+  if (g_mqtt_connected != mqtt_reported)
+  {
+    mqtt_reported = g_mqtt_connected;
+    if (mqtt_reported)
+    {
+      LOG_INFO(LOG_MQTT_CONNECTED, mqtt_broker);
+    } else {
+      LOG_WARN(LOG_MQTT_LOST);
+    }
+  }
+#endif
+}
+
+#endif H_NETWORK
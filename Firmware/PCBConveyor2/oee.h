@@ -0,0 +1,220 @@
+#ifndef H_OEE
+#define H_OEE
+
+/*
+  Production accounting
+
+  Every millisecond since the shift started is put in one of these, so
+  they add up to the length of the shift:
+
+    busy     A board is being moved, or held for its gap or timed pause
+    starved  In an unload mode with no board on the belt to send
+    blocked  Holding a board because the downstream machine isn't ready
+    fault    STATE_ERROR or STATE_ESTOP
+    idle     Not in an unload mode, eg waiting for a command
+
+  A conveyor that's mostly starved is waiting on the machine before it, one
+  that's mostly blocked is waiting on the machine after it. Following that
+  along the line finds the bottleneck.
+
+  The time is added up as it goes, from the state transitions and from the
+  board count and ready-in, never by looking back over a log. Boards are
+  counted as they clear the exit sensor. The cycle time is the average time
+  from one board leaving to the next, over boards that left without an idle
+  or fault period in between.
+
+  The figures are published to the telemetry topic every OEE_REPORT_INTERVAL
+  and on M570, as one line, eg
+
+    shift=3 elapsed=3600 boards=412 bph=412 busy=2710 starved=655 blocked=182 fault=0 idle=53 cycle=6540
+
+  elapsed and the times are in seconds, bph is boards per hour over the
+  whole shift and cycle is in ms. M571 publishes the figures one last time
+  and starts the next shift from zero.
+*/
+
+#define OEE_REPORT_INTERVAL   300000   // ms
+
+#define OEE_BUSY           0
+#define OEE_STARVED        1
+#define OEE_BLOCKED        2
+#define OEE_FAULT          3
+#define OEE_IDLE           4
+#define OEE_CATEGORY_COUNT 5
+
+struct oee_t
+{
+  uint32_t shift;
+  uint32_t started_at;                  // millis() the shift started
+  uint64_t time[OEE_CATEGORY_COUNT];    // ms in each category
+  uint8_t  category;                    // What the time since /since/ is going to
+  uint32_t since;                       // millis() of the last update
+  uint32_t boards;                      // Boards that cleared the exit
+  uint32_t cycle_total;                 // ms, summed over cycle_count cycles
+  uint32_t cycle_count;
+  uint32_t last_board_at;               // millis(), or 0 after idle or a fault
+};
+
+oee_t    g_oee          = { 1, 0, { 0 }, OEE_IDLE, 0, 0, 0, 0, 0 };
+uint32_t g_oee_reported = 0;
+
+/**
+  Which category the time in /state/ belongs to, as things stand now
+*/
+uint8_t oeeCategory(uint16_t state)
+{
+  switch (state)
+  {
+    case STATE_ERROR:
+    case STATE_ESTOP:
+      return OEE_FAULT;
+
+    case STATE_UNLOAD_RIRO_BEGIN:
+      if (0 == g_board_count)
+      {
+        return OEE_STARVED;
+      }
+      return g_ready_in_downstream ? OEE_BUSY : OEE_BLOCKED;
+
+    case STATE_UNLOAD_RIRO_HOLD:
+    case STATE_UNLOAD_SPACED_HOLD:
+      // Held for the gap counts as busy, only the wait for ready-in is blocked
+      return g_ready_in_downstream ? OEE_BUSY : OEE_BLOCKED;
+
+    // The belt runs waiting for a board to reach the exit
+    case STATE_UNLOAD_NOW_MOVING:
+    case STATE_UNLOAD_RIRO_MOVING:
+    case STATE_UNLOAD_TIMED_MOVING:
+    case STATE_UNLOAD_TIMED_CLEARED_END:
+    case STATE_UNLOAD_SPACED_MOVING:
+    case STATE_UNLOAD_SPACED_CLEARED_END:
+      return 0 == g_board_count ? OEE_STARVED : OEE_BUSY;
+
+    case STATE_UNLOAD_NOW_BEGIN:
+    case STATE_UNLOAD_NOW_REACHED_END:
+    case STATE_UNLOAD_NOW_CLEARED_END:
+    case STATE_UNLOAD_NOW_RUNON:
+    case STATE_UNLOAD_RIRO_REACHED_END:
+    case STATE_UNLOAD_RIRO_CLEARED_END:
+    case STATE_UNLOAD_RIRO_RUNON:
+    case STATE_UNLOAD_RIRO_PRESTART:
+    case STATE_UNLOAD_TIMED_BEGIN:
+    case STATE_UNLOAD_TIMED_REACHED_END:
+    case STATE_UNLOAD_TIMED_PAUSE:
+    case STATE_UNLOAD_SPACED_BEGIN:
+    case STATE_UNLOAD_SPACED_REACHED_END:
+      return OEE_BUSY;
+  }
+  return OEE_IDLE;
+}
+
+/**
+  Add the time since the last update to the current category, then carry
+  on with /category/
+*/
+void accountOee(uint8_t category)
+{
+  uint32_t now = millis();
+  g_oee.time[g_oee.category] += now - g_oee.since;
+  g_oee.since    = now;
+  g_oee.category = category;
+  if (OEE_IDLE == category || OEE_FAULT == category)
+  {
+    g_oee.last_board_at = 0;
+  }
+}
+
+/**
+  Count boards and move the time on to the new state's category. Called on
+  every state transition, before g_state changes.
+*/
+void updateOee(uint16_t new_state)
+{
+  switch (new_state)
+  {
+    case STATE_UNLOAD_NOW_CLEARED_END:
+    case STATE_UNLOAD_RIRO_CLEARED_END:
+    case STATE_UNLOAD_TIMED_CLEARED_END:
+    case STATE_UNLOAD_SPACED_CLEARED_END:
+    {
+      uint32_t now = millis();
+      g_oee.boards++;
+      if (0 != g_oee.last_board_at)
+      {
+        g_oee.cycle_total += now - g_oee.last_board_at;
+        g_oee.cycle_count++;
+      }
+      g_oee.last_board_at = 0 == now ? 1 : now;
+      break;
+    }
+  }
+  accountOee(oeeCategory(new_state));
+}
+
+/**
+  Write the one line report into /buffer/
+*/
+void formatOeeReport(char* buffer, size_t size)
+{
+  accountOee(g_oee.category);
+  uint32_t elapsed = millis() - g_oee.started_at;
+  unsigned long boards_per_hour = 0;
+  if (elapsed > 0)
+  {
+    boards_per_hour = (unsigned long)((uint64_t)g_oee.boards * 3600000ULL / elapsed);
+  }
+  snprintf(buffer, size,
+           "shift=%lu elapsed=%lu boards=%lu bph=%lu busy=%lu starved=%lu blocked=%lu fault=%lu idle=%lu cycle=%lu",
+           (unsigned long)g_oee.shift, (unsigned long)(elapsed / 1000), (unsigned long)g_oee.boards,
+           boards_per_hour, (unsigned long)(g_oee.time[OEE_BUSY] / 1000),
+           (unsigned long)(g_oee.time[OEE_STARVED] / 1000), (unsigned long)(g_oee.time[OEE_BLOCKED] / 1000),
+           (unsigned long)(g_oee.time[OEE_FAULT] / 1000), (unsigned long)(g_oee.time[OEE_IDLE] / 1000),
+           (unsigned long)(g_oee.cycle_count ? g_oee.cycle_total / g_oee.cycle_count : 0));
+}
+
+/**
+  Log the figures and publish the report, for M570
+*/
+void reportOee()
+{
+  formatOeeReport(g_mqtt_message_buffer, sizeof(g_mqtt_message_buffer));
+  LOG_INFO(LOG_OEE_REPORT, g_oee.shift, g_oee.boards, (unsigned long)(g_oee.time[OEE_STARVED] / 1000),
+           (unsigned long)(g_oee.time[OEE_BLOCKED] / 1000));
+  if (features_t::mqtt)
+  {
+    mqttPublish(g_mqtt_tele_topic, g_mqtt_message_buffer);
+  }
+  g_oee_reported = millis();
+}
+
+/**
+  Report the shift that's ending and start the next one from zero, for M571
+*/
+void resetOee()
+{
+  reportOee();
+  uint32_t now = millis();
+  uint8_t category = oeeCategory(g_state);
+  g_oee = { g_oee.shift + 1, now, { 0 }, category, now, 0, 0, 0, 0 };
+  LOG_INFO(LOG_OEE_SHIFT, g_oee.shift);
+}
+
+/**
+  Follow changes that don't come with a state transition, ie a board
+  arriving or ready-in changing, and publish the report now and then. Call
+  once per pass of loop(), after check_ready_in().
+*/
+void serviceOee()
+{
+  uint8_t category = oeeCategory(g_state);
+  if (category != g_oee.category)
+  {
+    accountOee(category);
+  }
+  if (millis() - g_oee_reported >= OEE_REPORT_INTERVAL)
+  {
+    reportOee();
+  }
+}
+
+#endif H_OEE
@@ -0,0 +1,242 @@
+#ifndef H_OTA
+#define H_OTA
+
+/*
+  Staged OTA updates
+
+  Uploads are received by the network task (network.h), at low priority on
+  the other core, and written into the app partition that isn't running.
+  loop() carries on handling boards the whole time. Writing flash pauses
+  both cores for a few ms per page and erasing each 4 KB sector for
+  typically 45 ms, up to about 400 ms. The belt PWM is hardware and keeps
+  running, but the e-stop input and CAN interrupts wait for the flash, so
+  a stop during an upload can be that late. See estop.h.
+
+  A finished upload isn't booted straight away. It's staged, and the
+  restart waits for a safe point: idle, belt stopped, rail still, no
+  boards on the conveyor, no job or changeover running and no emergency
+  stop. Until then the old firmware keeps running.
+
+  The first boots of the new firmware are a trial. It has to stay up for
+  OTA_HEALTH_PERIOD, out of STATE_ERROR and back on WiFi (and the broker,
+  with ENABLE_MQTT) so it can still be updated. If that hasn't happened
+  within OTA_HEALTH_TIMEOUT, or it restarts more than OTA_TRIAL_BOOTS
+  times first, eg by crashing, the previous firmware is booted again. That
+  restart waits for a safe point too, unless it's straight after boot.
+
+  The trial is kept in NVS, so it works whatever the bootloader does. Where
+  the bootloader has app rollback enabled the firmware is also marked valid
+  or invalid, so it agrees.
+*/
+
+#define OTA_NAMESPACE          "ota"       // NVS namespace
+#define OTA_TRIAL_KEY          "trial"     // Boots of new firmware so far, 0 once it's accepted
+#define OTA_TRIAL_BOOTS            3
+#define OTA_HEALTH_PERIOD      30000       // ms
+#define OTA_HEALTH_TIMEOUT    300000       // ms
+#define OTA_RESTART_DELAY        500       // ms to let the log and MQTT go out first
+
+#ifdef ARDUINO_ARCH_ESP32
+// The core marks new firmware valid as it boots unless this says not to.
+// healthCheckOta() does it instead.
+extern "C" bool verifyRollbackLater()
+{
+  return true;
+}
+#endif
+
+bool        g_ota_staged     = false;   // New firmware is waiting for a safe point
+bool        g_ota_trial      = false;   // This is new firmware on trial
+const char* g_ota_rollback   = NULL;    // Why we're going back, waiting for a safe point
+uint32_t    g_ota_restart_at = 0;       // millis() to restart at, 0 if not restarting
+
+void setOtaTrial(uint8_t boots)
+{
+  if (g_preferences.begin(OTA_NAMESPACE, false))
+  {
+    g_preferences.putBytes(OTA_TRIAL_KEY, &boots, sizeof(boots));
+    g_preferences.end();
+  }
+}
+
+/**
+  True when restarting won't disturb anything
+*/
+bool otaSafeToRestart()
+{
+  return (STATE_IDLE == g_state || STATE_BEGIN == g_state)
+      && STOP == g_x_direction && 0 == g_board_count
+      && !yAxisMoving() && !changeoverActive() && JOB_NONE == g_job.id
+      && !emergencyStopped() && !g_ota_receiving;
+}
+
+/**
+  Boot the previous firmware again. Doesn't return.
+*/
+void rollBackOta()
+{
+  setOtaTrial(0);
+#ifdef ARDUINO_ARCH_ESP32
+  // With two OTA partitions the next one to update is the one we came from
+  const esp_partition_t* previous = esp_ota_get_next_update_partition(NULL);
+  if (NULL != previous)
+  {
+    esp_ota_set_boot_partition(previous);
+  }
+  esp_ota_mark_app_invalid_rollback_and_reboot();   // Only returns if the bootloader can't roll back
+#endif
+  ESP.restart();
+}
+
+/**
+  Count this boot if the firmware is on trial. Call from setup() once the
+  parameters are loaded, before anything else that might crash.
+*/
+void checkOtaTrial()
+{
+  uint8_t boots = 0;
+  if (g_preferences.begin(OTA_NAMESPACE, true))
+  {
+    if (sizeof(boots) != g_preferences.getBytes(OTA_TRIAL_KEY, &boots, sizeof(boots)))
+    {
+      boots = 0;
+    }
+    g_preferences.end();
+  }
+  if (0 == boots)
+  {
+#ifdef ARDUINO_ARCH_ESP32
+    // Not ours to judge, eg flashed over USB, so don't leave it pending
+    esp_ota_mark_app_valid_cancel_rollback();
+#endif
+    return;
+  }
+  if (boots > OTA_TRIAL_BOOTS)
+  {
+    LOG_ERROR(LOG_OTA_ROLLBACK, "kept restarting");
+    serviceLog();
+    rollBackOta();
+  }
+  setOtaTrial(boots + 1);
+  g_ota_trial = true;
+  LOG_WARN(LOG_OTA_TRIAL, boots);
+}
+
+/**
+  Accept or reject firmware that's on trial
+*/
+void healthCheckOta()
+{
+  if (!g_ota_trial || NULL != g_ota_rollback)
+  {
+    return;
+  }
+  bool network = !features_t::wifi || 0 == strlen(ssid)
+              || (g_wifi_connected && (!features_t::mqtt || g_mqtt_connected));
+  if (millis() >= OTA_HEALTH_PERIOD && network && STATE_ERROR != g_state)
+  {
+    g_ota_trial = false;
+    setOtaTrial(g_ota_staged ? 1 : 0);   // Newer firmware may have arrived during the trial
+#ifdef ARDUINO_ARCH_ESP32
+    esp_ota_mark_app_valid_cancel_rollback();
+#endif
+    LOG_INFO(LOG_OTA_ACCEPTED);
+  } else if (millis() >= OTA_HEALTH_TIMEOUT) {
+    g_ota_rollback = network ? "stuck in STATE_ERROR" : "couldn't get back on the network";
+    LOG_ERROR(LOG_OTA_ROLLBACK, g_ota_rollback);
+  }
+}
+
+/**
+  Report what the network task's OTA has been doing
+*/
+void reportOtaProgress()
+{
+  static bool    receiving = false;
+  static uint8_t reported  = 0;
+
+  if (g_ota_receiving && !receiving)
+  {
+    reported = 0;
+    LOG_INFO(LOG_OTA_START, g_ota_sketch ? "sketch" : "filesystem");
+  }
+  receiving = g_ota_receiving;
+  if (receiving && g_ota_progress / 10 != reported / 10)
+  {
+    // Every 10% is plenty, and doesn't fill the log
+    reported = g_ota_progress;
+    LOG_INFO(LOG_OTA_PROGRESS, reported);
+  }
+
+  if (g_ota_error >= 0)
+  {
+    const char* reason = "unknown";
+    if (g_ota_error == OTA_AUTH_ERROR) reason = "auth";
+    else if (g_ota_error == OTA_BEGIN_ERROR) reason = "begin";
+    else if (g_ota_error == OTA_CONNECT_ERROR) reason = "connect";
+    else if (g_ota_error == OTA_RECEIVE_ERROR) reason = "receive";
+    else if (g_ota_error == OTA_END_ERROR) reason = "end";
+    g_ota_error = -1;
+    LOG_ERROR(LOG_OTA_ERROR, reason);
+  }
+
+  if (g_ota_received)
+  {
+    g_ota_received = false;
+    LOG_INFO(LOG_OTA_END);
+    if (g_ota_sketch)
+    {
+      // Boots into the new firmware next time whatever happens, so the trial starts now
+      g_ota_staged = true;
+      setOtaTrial(1);
+      LOG_INFO(LOG_OTA_STAGED);
+      if (features_t::mqtt)
+      {
+        mqttPublish(g_mqtt_tele_topic, "Firmware update staged");
+      }
+    }
+  }
+}
+
+/**
+  Report OTA progress, run the health check and restart into new or old
+  firmware once it's safe. Call once per pass of loop().
+*/
+void serviceOta()
+{
+#if ENABLE_WIFI
+  reportOtaProgress();
+  healthCheckOta();
+
+  if (0 != g_ota_restart_at)
+  {
+    if (!otaSafeToRestart())
+    {
+      g_ota_restart_at = 0;   // Something started in the meantime, wait for the next safe point
+    } else if ((int32_t)(millis() - g_ota_restart_at) >= 0) {
+      if (!g_ota_staged)
+      {
+        rollBackOta();
+      }
+      ESP.restart();
+    }
+    return;
+  }
+  if ((g_ota_staged || NULL != g_ota_rollback) && otaSafeToRestart())
+  {
+    // Newer firmware that's staged is booted rather than going back
+    LOG_INFO(LOG_OTA_RESTART, g_ota_staged ? "new" : "previous");
+    if (features_t::mqtt)
+    {
+      mqttPublish(g_mqtt_tele_topic, "Restarting for firmware update");
+    }
+    g_ota_restart_at = millis() + OTA_RESTART_DELAY;
+    if (0 == g_ota_restart_at)
+    {
+      g_ota_restart_at = 1;
+    }
+  }
+#endif
+}
+
+#endif H_OTA
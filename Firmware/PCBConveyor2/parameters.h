@@ -0,0 +1,246 @@
+#ifndef H_PARAMETERS
+#define H_PARAMETERS
+
+/*
+  Runtime parameters
+
+  Tuning values that used to need a rebuild can be changed while the
+  conveyor is running, and saved to NVS so they survive a restart. The
+  #defines in config.h are the defaults.
+
+  The code reads them straight from g_params, eg g_params.trigger_height,
+  so using a parameter costs the same as using a global variable. NVS is
+  only touched by M500, M501 and at boot.
+
+    M500                Save all parameters to NVS
+    M501                Load the saved parameters (also done at boot)
+    M502                Go back to the defaults from config.h. M500 to keep them
+    M503                Report all parameters, to serial and stat/<id>/CONFIG
+    M510 P<n> S<value>  Set parameter n
+
+  The M503 report is a list of M510 commands, so it can be sent back as an
+  MQTT command batch to copy settings to another conveyor.
+
+  Each parameter has a fixed number for M510 and a fixed NVS key. Never
+  reuse either for something else. To add a parameter, add a line to
+  PARAMETERS below and use g_params.<name> in the code.
+
+  Values outside the range are rejected, as are changes that would leave
+  a minimum above its maximum.
+*/
+
+#define PARAMETERS(X) \
+  /*  name            number  NVS key        type      default                     min      max */ \
+  X(minimum_speed,        1,  "min_speed",   uint16_t, MINIMUM_SPEED,                1,   10000) \
+  X(maximum_speed,        2,  "max_speed",   uint16_t, MAXIMUM_SPEED,                1,   10000) \
+  X(pwm_at_min,           3,  "pwm_min",     uint16_t, MOTOR_PWM_AT_MIN,             0,    1023) \
+  X(pwm_at_max,           4,  "pwm_max",     uint16_t, MOTOR_PWM_AT_MAX,             0,    1023) \
+  X(trigger_height,       5,  "trigger",     uint16_t, PCB_TRIGGER_HEIGHT,           1,    1000) \
+  X(debounce_count,       6,  "debounce",    uint8_t,  SENSOR_DEBOUNCE_COUNT,        0,     100) \
+  X(runon_time,           7,  "runon",       uint16_t, RUNON_TIME,                   0,   10000) \
+  X(load_timeout,         8,  "load_tmo",    uint16_t, LOAD_TIMEOUT,                 1,    3600) \
+  X(unload_timeout,       9,  "unload_tmo",  uint16_t, UNLOAD_TIMEOUT,               1,    3600) \
+  X(home_switch_offset,  10,  "home_offset", uint16_t, HOME_SWITCH_OFFSET,           0,    1000) \
+  X(minimum_position,    11,  "min_width",   uint16_t, MINIMUM_CONVEYOR_POSITION,    0,    1000) \
+  X(maximum_position,    12,  "max_width",   uint16_t, MAXIMUM_CONVEYOR_POSITION,    0,    1000) \
+  X(limit_backoff,       13,  "backoff",     uint16_t, LIMIT_BACKOFF,                0,    2000) \
+  X(sensor_budget_min,   14,  "budget_min",  uint16_t, SENSOR_BUDGET_MIN,           20,    1000) \
+  X(sensor_budget_max,   15,  "budget_max",  uint16_t, SENSOR_BUDGET_MAX,           20,    1000) \
+  X(sample_spacing,      16,  "spacing",     uint16_t, SENSOR_SAMPLE_SPACING,        1,     100) \
+  X(sensor_pitch,        17,  "pitch",       uint16_t, SENSOR_PITCH,                10,    2000) \
+  X(estop_input,         18,  "estop_in",    uint8_t,  ESTOP_INPUT,                  0,       1) \
+  X(flow_direction,      19,  "flow",        uint8_t,  FLOW_DIRECTION,               0,       1) \
+  X(prestart,            20,  "prestart",    uint8_t,  PRESTART,                     0,       1) \
+  X(y_steps_per_m,       21,  "steps_per_m", uint32_t, Y_STEPS_PER_METRE,         1000, 1000000) \
+  X(y_backlash,          22,  "backlash",    uint16_t, Y_BACKLASH,                   0,     500)
+
+#define PARAMETER_NAMESPACE   "conveyor"     // NVS namespace
+#define NVS_KEY_LENGTH        15             // Longest key NVS takes
+
+// Longest M503 report line: a two digit number, a value as long as %g
+// makes it and the longest key
+#define PARAMETER_REPORT_LINE (sizeof("M510 P99 S-1.23457e+06 ; \n") - 1 + NVS_KEY_LENGTH)
+
+#define PARAMETER_FIELD(name, number, key, type, value, low, high)    type name;
+#define PARAMETER_DEFAULT(name, number, key, type, value, low, high)  value,
+#define PARAMETER_NUMBER(name, number, key, type, value, low, high)   PARAM_##name = number,
+#define PARAMETER_ONE(name, number, key, type, value, low, high)      + 1
+#define PARAMETER_CHECK(name, number, key, type, value, low, high)                    \
+  static_assert(number > 0 && number < 100 && sizeof(key) - 1 <= NVS_KEY_LENGTH,      \
+                "Parameter " #name " needs a number from 1 to 99 and a key NVS takes");   \
+  static_assert((type)(high) == (high) && (type)(low) == (low),                       \
+                "Parameter " #name "'s range doesn't fit its type");
+
+struct parameters_t
+{
+  PARAMETERS(PARAMETER_FIELD)
+};
+
+enum parameter_number_t { PARAMETERS(PARAMETER_NUMBER) };   // eg PARAM_trigger_height
+enum { PARAMETER_COUNT = 0 PARAMETERS(PARAMETER_ONE) };
+PARAMETERS(PARAMETER_CHECK)
+
+const parameters_t g_param_defaults = { PARAMETERS(PARAMETER_DEFAULT) };
+parameters_t       g_params         = g_param_defaults;
+
+#undef PARAMETER_FIELD
+#undef PARAMETER_DEFAULT
+#undef PARAMETER_NUMBER
+#undef PARAMETER_ONE
+#undef PARAMETER_CHECK
+
+Preferences g_preferences;
+char        g_mqtt_config_topic[50];      // MQTT topic for parameter reports
+char        g_param_report[PARAMETER_COUNT * PARAMETER_REPORT_LINE + 1];   // Also used by the other reports
+
+// A publish also carries up to 5 bytes of header and the topic with its length
+static_assert(sizeof(g_param_report) + sizeof(g_mqtt_config_topic) + 7 <= MQTT_BUFFER_SIZE,
+              "The parameter report has to go in one MQTT publish");
+
+/**
+  Check the limits that involve more than one parameter
+*/
+bool parametersConsistent(const parameters_t &params)
+{
+  return params.minimum_speed    <  params.maximum_speed
+      && params.pwm_at_min       <= params.pwm_at_max
+      && params.minimum_position <  params.maximum_position
+      && params.sensor_budget_min <= params.sensor_budget_max;
+}
+
+/**
+  @return true if /value/ is within the range of parameter /number/
+*/
+bool parameterInRange(int16_t number, float value)
+{
+  switch (number)
+  {
+#define PARAMETER_RANGE(name, number, key, type, value_default, low, high) \
+    case number:                                                           \
+      return value >= low && value <= high;
+    PARAMETERS(PARAMETER_RANGE)
+#undef PARAMETER_RANGE
+  }
+  return false;
+}
+
+/**
+  Set parameter /number/ to /value/.
+  @return false if there's no such parameter or the value isn't allowed.
+*/
+bool setParameter(int16_t number, float value)
+{
+  parameters_t updated = g_params;
+
+  switch (number)
+  {
+#define PARAMETER_SET(name, number, key, type, value_default, low, high) \
+    case number:                                                         \
+      if (value < low || value > high)                                   \
+      {                                                                  \
+        LOG_WARN(LOG_PARAMETER_RANGE, number, (float)low, (float)high);  \
+        return false;                                                    \
+      }                                                                  \
+      updated.name = (type)value;                                        \
+      break;
+    PARAMETERS(PARAMETER_SET)
+#undef PARAMETER_SET
+
+    default:
+      LOG_WARN(LOG_PARAMETER_UNKNOWN, number);
+      return false;
+  }
+
+  if (!parametersConsistent(updated))
+  {
+    LOG_WARN(LOG_PARAMETER_CONFLICT, number);
+    return false;
+  }
+  g_params = updated;
+  return true;
+}
+
+/**
+  Save every parameter to NVS
+*/
+bool saveParameters()
+{
+  bool ok = g_preferences.begin(PARAMETER_NAMESPACE, false);
+  if (ok)
+  {
+#define PARAMETER_SAVE(name, number, key, type, value, low, high) \
+    ok = (sizeof(type) == g_preferences.putBytes(key, &g_params.name, sizeof(type))) && ok;
+    PARAMETERS(PARAMETER_SAVE)
+#undef PARAMETER_SAVE
+    g_preferences.end();
+  }
+  LOG_INFO(LOG_PARAMETERS_SAVED, ok);
+  return ok;
+}
+
+/**
+  Load the saved parameters from NVS. Anything not saved, or saved with a
+  different size by another firmware version, keeps its current value. If
+  the saved set doesn't make sense as a whole we go back to the defaults.
+*/
+bool loadParameters()
+{
+  parameters_t loaded = g_params;
+  uint8_t      count  = 0;
+
+  if (!g_preferences.begin(PARAMETER_NAMESPACE, true))
+  {
+    LOG_INFO(LOG_PARAMETERS_LOADED, count);
+    return false;
+  }
+#define PARAMETER_LOAD(name, number, key, type, value, low, high)         \
+  {                                                                       \
+    type saved;                                                           \
+    if (sizeof(type) == g_preferences.getBytesLength(key)                 \
+        && sizeof(type) == g_preferences.getBytes(key, &saved, sizeof(type)) \
+        && saved >= low && saved <= high)                                 \
+    {                                                                     \
+      loaded.name = saved;                                                \
+      count++;                                                            \
+    }                                                                     \
+  }
+  PARAMETERS(PARAMETER_LOAD)
+#undef PARAMETER_LOAD
+  g_preferences.end();
+
+  if (!parametersConsistent(loaded))
+  {
+    LOG_WARN(LOG_PARAMETERS_INVALID);
+    g_params = g_param_defaults;
+    return false;
+  }
+  g_params = loaded;
+  LOG_INFO(LOG_PARAMETERS_LOADED, count);
+  return true;
+}
+
+/**
+  Report every parameter as an M510 command
+*/
+void reportParameters()
+{
+  size_t length = 0;
+  g_param_report[0] = '\0';
+#define PARAMETER_REPORT(name, number, key, type, value, low, high)                                \
+  LOG_INFO(LOG_PARAMETER, number, (float)g_params.name, key);                                      \
+  if (length < sizeof(g_param_report))                                                             \
+  {                                                                                                \
+    int written = snprintf(&g_param_report[length], sizeof(g_param_report) - length,               \
+                           "M510 P%d S%g ; %s\n", number, (double)g_params.name, key);             \
+    length += written > 0 ? written : 0;                                                           \
+  }
+  PARAMETERS(PARAMETER_REPORT)
+#undef PARAMETER_REPORT
+
+  if (features_t::mqtt)
+  {
+    mqttPublish(g_mqtt_config_topic, g_param_report);
+  }
+}
+
+#endif H_PARAMETERS
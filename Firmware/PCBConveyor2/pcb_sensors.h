@@ -1,6 +1,78 @@
 #ifndef H_PCB_SENSORS
 #define H_PCB_SENSORS
 
+#define  SENSOR_BOOT_TIME    2    // ms. VL53L0X needs 1.2 ms after XSHUT goes high
+
+/*
+  Timing budget
+
+  The VL53L0X trades time for accuracy. The budget is set from the belt
+  speed so each sensor gets a reading every g_params.sample_spacing mm of
+  belt travel, kept between sensor_budget_min and sensor_budget_max. With
+  the belt stopped they use the longest budget.
+
+  The sensors range continuously, all three at once, and read_pcb_sensors()
+  only collects a reading from a sensor that says it has a new one, so
+  loop() never waits for a measurement. g_sensor_fresh says which roles
+  got a new reading this pass. Anything that counts readings, like the
+  debounce, counts those rather than passes of loop().
+
+  Calibration
+
+  M530 takes SENSOR_CALIBRATION_SAMPLES readings from each sensor and
+  saves what it finds to NVS:
+
+    offset     Set by M530 S<mm>, with a target at a known distance S over
+               every sensor. Subtracted from every reading so all three
+               sensors agree
+    baseline   Set by M530 on the empty belt, after the offset. What the
+               sensor sees with no board
+    threshold  Readings at or above this never count as a board, so the
+               background can't trip the sensor. It sits at least
+               SENSOR_CALIBRATION_MARGIN mm, or twice the spread of the
+               readings, below the baseline
+
+  So with a target, M530 S<mm> first, then take the target away and M530.
+  A baseline within the margin of the sensor would leave a threshold of 0,
+  which nothing can get below, so that calibration is rejected.
+
+  A board is seen when the corrected reading is below both
+  g_params.trigger_height and the sensor's threshold. A sensor that saw
+  nothing in range during calibration has no threshold of its own.
+  M531 reports the calibration and the budget in use.
+*/
+
+#define  SENSOR_COUNT        3
+#define  ENTRANCE_SENSOR     0          // Roles, which sensor is which depends on the flow, see flow.h
+#define  MIDDLE_SENSOR       1
+#define  EXIT_SENSOR         2
+#define  SENSOR_NAMESPACE    "sensors"  // NVS namespace
+#define  SENSOR_NO_LIMIT     0xFFFF     // Threshold of an uncalibrated sensor
+#define  SENSOR_MAX_RANGE    2000       // mm. Readings beyond this are treated as nothing seen
+
+struct sensor_calibration_t
+{
+  int16_t  offset;                      // mm, subtracted from every reading
+  uint16_t baseline;                    // mm, empty belt reading after the offset
+  uint16_t threshold;                   // mm
+};
+
+sensor_calibration_t g_sensor_calibration[SENSOR_COUNT] =
+{
+  { 0, SENSOR_NO_LIMIT, SENSOR_NO_LIMIT },
+  { 0, SENSOR_NO_LIMIT, SENSOR_NO_LIMIT },
+  { 0, SENSOR_NO_LIMIT, SENSOR_NO_LIMIT }
+};
+uint16_t g_sensor_budget = 0;           // ms, the timing budget in use. 0 until set
+uint32_t g_sensor_read_at[SENSOR_COUNT];  // millis() of each role's latest reading
+bool     g_sensor_fresh[SENSOR_COUNT];    // Each role got a new reading this pass
+
+// By position, left to right, kept between readings
+uint32_t g_sensor_position_read_at[SENSOR_COUNT];
+bool     g_sensor_position_tripped[SENSOR_COUNT];
+
+Adafruit_VL53L0X* const g_pcb_sensors[SENSOR_COUNT] = { &pcb_sensor_l, &pcb_sensor_m, &pcb_sensor_r };
+
 void initialise_pcb_sensors()
 {
   // At this point all the XSHUT pins should be pulled low from setup,
@@ -8,118 +80,309 @@ void initialise_pcb_sensors()
   mcp23017.digitalWrite(PCB_SENSOR_L_XSHUT, LOW);
   mcp23017.digitalWrite(PCB_SENSOR_M_XSHUT, LOW);
   mcp23017.digitalWrite(PCB_SENSOR_R_XSHUT, LOW);
-  delay(10);
+  delay(SENSOR_BOOT_TIME);
 
-  // Bring them all up:
+  // Bring them up one at a time, giving each its own address
   mcp23017.digitalWrite(PCB_SENSOR_L_XSHUT, HIGH);
-  mcp23017.digitalWrite(PCB_SENSOR_M_XSHUT, HIGH);
-  mcp23017.digitalWrite(PCB_SENSOR_R_XSHUT, HIGH);
-  delay(10);
-
-  // Disable all but L sensor:
-  mcp23017.digitalWrite(PCB_SENSOR_M_XSHUT, LOW);
-  mcp23017.digitalWrite(PCB_SENSOR_R_XSHUT, LOW);
-  delay(10);
+  delay(SENSOR_BOOT_TIME);
 
   // Initialise the L sensor:
   if (!pcb_sensor_l.begin(PCB_SENSOR_L_ADDR))
   {
-    Serial.println("Failed to initialise left PCB sensor.");
+    LOG_ERROR(LOG_SENSOR_INIT_FAILED, "left");
   } else {
-    Serial.println("Initialised left PCB sensor.");
+    LOG_INFO(LOG_SENSOR_INIT, "left");
   }
 
   // Bring up the M sensor:
   mcp23017.digitalWrite(PCB_SENSOR_M_XSHUT, HIGH);
-  delay(10);
+  delay(SENSOR_BOOT_TIME);
   if (!pcb_sensor_m.begin(PCB_SENSOR_M_ADDR))
   {
-    Serial.println("Failed to initialise middle PCB sensor.");
+    LOG_ERROR(LOG_SENSOR_INIT_FAILED, "middle");
   } else {
-    Serial.println("Initialised middle PCB sensor.");
+    LOG_INFO(LOG_SENSOR_INIT, "middle");
   }
   //
   // Bring up the R sensor:
   mcp23017.digitalWrite(PCB_SENSOR_R_XSHUT, HIGH);
-  delay(10);
+  delay(SENSOR_BOOT_TIME);
   if (!pcb_sensor_r.begin(PCB_SENSOR_R_ADDR))
   {
-    Serial.println("Failed to initialise right PCB sensor.");
+    LOG_ERROR(LOG_SENSOR_INIT_FAILED, "right");
   } else {
-    Serial.println("Initialised right PCB sensor.");
+    LOG_INFO(LOG_SENSOR_INIT, "right");
   }
 }
 
+/**
+  Set the timing budget of every sensor to suit the belt speed
+*/
+void updateSensorBudget()
+{
+  uint32_t budget = g_params.sensor_budget_max;
+  if (STOP != g_x_direction && g_x_requested_speed > 0)
+  {
+    // ms for the belt to move sample_spacing. The sensors range side by side
+    budget = (uint32_t)g_params.sample_spacing * 60000UL / g_x_requested_speed;
+    budget = constrain(budget, g_params.sensor_budget_min, g_params.sensor_budget_max);
+  }
+  if (budget == g_sensor_budget)
+  {
+    return;
+  }
+  g_sensor_budget = budget;
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    // The budget can only be changed while the sensor is idle
+    g_pcb_sensors[i]->stopRangeContinuous();
+    g_pcb_sensors[i]->setMeasurementTimingBudgetMicroSeconds(budget * 1000UL);
+    g_pcb_sensors[i]->startRangeContinuous(budget);
+  }
+  LOG_DEBUG(LOG_SENSOR_BUDGET, g_sensor_budget);
+}
+
+/**
+  @return true if /reading/ from sensor /index/ means a board is there
+*/
+bool sensorTripped(uint8_t index, uint16_t reading)
+{
+  if (OUT_OF_RANGE == reading)
+  {
+    return false;
+  }
+  int32_t corrected = (int32_t)reading - g_sensor_calibration[index].offset;
+  return corrected < g_params.trigger_height && corrected < g_sensor_calibration[index].threshold;
+}
+
 void read_pcb_sensors()
 {
   // ​​TODO: Add hysteresis logic to OUT OF RANGE tests near line 72,
   // and remove it from the state machine
 
-  // NOTE: We need to account for direction of travel, and map l/r
-  // to entrance / exit positions
-  //  uint8_t entrance_sensor = 1;
-  //  uint8_t middle_sensor = 2;
-  //  uint8_t exit_sensor   = 3;
+  updateSensorBudget();
 
-  //  uint16_t l_sensor_reading = g_pcb_sensor_l_reading.RangeMilliMeter;
-  //  uint16_t m_sensor_reading = g_pcb_sensor_m_reading.RangeMilliMeter;
+  // Collect whichever sensors have a new reading, left to right.
+  // Calibration and traces go by position
+  VL53L0X_RangingMeasurementData_t* const readings[SENSOR_COUNT] =
+    { &g_pcb_sensor_l_reading, &g_pcb_sensor_m_reading, &g_pcb_sensor_r_reading };
+  bool fresh[SENSOR_COUNT];
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    fresh[i] = g_pcb_sensors[i]->isRangeComplete();
+    if (!fresh[i])
+    {
+      continue;
+    }
+    readings[i]->RangeMilliMeter = g_pcb_sensors[i]->readRangeResult();   // Also clears the sensor's flag
+    readings[i]->RangeStatus     = g_pcb_sensors[i]->readRangeStatus();
+    g_sensor_position_read_at[i] = millis();
+    traceSensor(i, readings[i]->RangeMilliMeter);
+    g_sensor_position_tripped[i] = sensorTripped(i, readings[i]->RangeMilliMeter);
+  }
 
-  pcb_sensor_l.rangingTest(&g_pcb_sensor_l_reading, false);
-  uint16_t l_sensor_reading = g_pcb_sensor_l_reading.RangeMilliMeter;
-  pcb_sensor_m.rangingTest(&g_pcb_sensor_m_reading, false);
-  uint16_t m_sensor_reading = g_pcb_sensor_m_reading.RangeMilliMeter;
-  pcb_sensor_r.rangingTest(&g_pcb_sensor_r_reading, false);
-  uint16_t r_sensor_reading = g_pcb_sensor_r_reading.RangeMilliMeter;
+  // Then give them their roles for the direction of flow
+  const uint8_t positions[SENSOR_COUNT] = { entranceSensorIndex(), 1, exitSensorIndex() };
+  for (uint8_t role = 0; role < SENSOR_COUNT; role++)
+  {
+    g_sensor_read_at[role] = g_sensor_position_read_at[positions[role]];
+    g_sensor_fresh[role]   = fresh[positions[role]];
+  }
+  g_entrance_sensor = g_sensor_position_tripped[positions[ENTRANCE_SENSOR]] ? TRIPPED : UNTRIPPED;
+  g_middle_sensor   = g_sensor_position_tripped[positions[MIDDLE_SENSOR]]   ? TRIPPED : UNTRIPPED;
+  g_exit_sensor     = g_sensor_position_tripped[positions[EXIT_SENSOR]]     ? TRIPPED : UNTRIPPED;
+}
 
-  if (OUT_OF_RANGE != l_sensor_reading && l_sensor_reading < PCB_TRIGGER_HEIGHT)
+/**
+  Debounce the exit sensor for the state machine.
+  @return true once it has given more than g_params.debounce_count new
+  readings of /state/ in a row. Counting then starts again.
+*/
+bool exitSensorSettled(bool state)
+{
+  if (state != g_exit_sensor)
   {
-    g_entrance_sensor = TRIPPED;
-  } else {
-    g_entrance_sensor = UNTRIPPED;
+    g_exit_sensor_count = 0;
+    return false;
+  }
+  if (g_sensor_fresh[EXIT_SENSOR] && ++g_exit_sensor_count > g_params.debounce_count)
+  {
+    g_exit_sensor_count = 0;
+    return true;
   }
+  return false;
+}
 
-  if (OUT_OF_RANGE != m_sensor_reading && m_sensor_reading < PCB_TRIGGER_HEIGHT)
+void debug_sensor_values()
+{
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  // The latest readings, out of range shown as 0
+  const VL53L0X_RangingMeasurementData_t* const readings[SENSOR_COUNT] =
+    { &g_pcb_sensor_l_reading, &g_pcb_sensor_m_reading, &g_pcb_sensor_r_reading };
+  uint16_t ranges[SENSOR_COUNT];
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
   {
-    g_middle_sensor = TRIPPED;
-  } else {
-    g_middle_sensor = UNTRIPPED;
+    ranges[i] = OUT_OF_RANGE == readings[i]->RangeStatus ? 0 : readings[i]->RangeMilliMeter;
   }
+  LOG_DEBUG(LOG_SENSOR_VALUES, ranges[0], ranges[1], ranges[2]);
+#endif
+}
 
-  if (OUT_OF_RANGE != r_sensor_reading && r_sensor_reading < PCB_TRIGGER_HEIGHT)
+/**
+  Load the sensor calibration saved by M530. Call once at boot.
+*/
+void loadSensorCalibration()
+{
+  sensor_calibration_t saved[SENSOR_COUNT];
+  if (!g_preferences.begin(SENSOR_NAMESPACE, true))
   {
-    g_exit_sensor = TRIPPED;
-  } else {
-    g_exit_sensor = UNTRIPPED;
+    return;
   }
+  if (sizeof(saved) == g_preferences.getBytesLength("calibration")
+      && sizeof(saved) == g_preferences.getBytes("calibration", saved, sizeof(saved)))
+  {
+    memcpy(g_sensor_calibration, saved, sizeof(saved));
+    LOG_INFO(LOG_SENSOR_CALIBRATION_LOADED);
+  }
+  g_preferences.end();
 }
 
-void debug_sensor_values()
+/**
+  Report the calibration and timing budget of every sensor
+*/
+void reportSensors()
 {
-  pcb_sensor_l.rangingTest(&g_pcb_sensor_l_reading, false);
-  if (g_pcb_sensor_l_reading.RangeStatus != 4)
+  size_t length = 0;
+  g_param_report[0] = '\0';     // Shared with the parameter report
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
   {
-    Serial.print("1: ");
-    Serial.println(g_pcb_sensor_l_reading.RangeMilliMeter);
-  } else {
-    //Serial.println("Ranging error");
+    const sensor_calibration_t &calibration = g_sensor_calibration[i];
+    LOG_INFO(LOG_SENSOR_CALIBRATION, i, calibration.baseline, calibration.offset, calibration.threshold);
+    if (length < sizeof(g_param_report))
+    {
+      int written = snprintf(&g_param_report[length], sizeof(g_param_report) - length,
+                             "sensor=%u baseline=%u offset=%d threshold=%u budget=%u\n", i,
+                             calibration.baseline, calibration.offset, calibration.threshold, g_sensor_budget);
+      length += written > 0 ? written : 0;
+    }
   }
-  pcb_sensor_m.rangingTest(&g_pcb_sensor_m_reading, false);
-  if (g_pcb_sensor_m_reading.RangeStatus != 4)
+
+  if (features_t::mqtt)
   {
-    Serial.print("               2: ");
-    Serial.println(g_pcb_sensor_m_reading.RangeMilliMeter);
-  } else {
-    //Serial.println("Ranging error");
+    mqttPublish(g_mqtt_config_topic, g_param_report);
+  }
+}
+
+/**
+  Average SENSOR_CALIBRATION_SAMPLES readings from sensor /index/.
+  @return false if too few of them saw anything in range
+*/
+bool sampleSensor(uint8_t index, uint16_t &mean, uint16_t &spread)
+{
+  VL53L0X_RangingMeasurementData_t reading;
+  uint32_t total   = 0;
+  uint16_t lowest  = SENSOR_NO_LIMIT;
+  uint16_t highest = 0;
+  uint8_t  count   = 0;
+
+  for (uint8_t sample = 0; sample < SENSOR_CALIBRATION_SAMPLES; sample++)
+  {
+    g_pcb_sensors[index]->rangingTest(&reading, false);
+    if (4 == reading.RangeStatus || OUT_OF_RANGE == reading.RangeMilliMeter
+        || reading.RangeMilliMeter > SENSOR_MAX_RANGE)
+    {
+      continue;
+    }
+    total  += reading.RangeMilliMeter;
+    lowest  = min(lowest, reading.RangeMilliMeter);
+    highest = max(highest, reading.RangeMilliMeter);
+    count++;
   }
-  pcb_sensor_r.rangingTest(&g_pcb_sensor_r_reading, false);
-  if (g_pcb_sensor_r_reading.RangeStatus != 4)
+  if (count < SENSOR_CALIBRATION_SAMPLES / 2)
   {
-    Serial.print("                                3: ");
-    Serial.println(g_pcb_sensor_r_reading.RangeMilliMeter);
-  } else {
-    //Serial.println("Ranging error");
+    return false;
+  }
+  mean   = total / count;
+  spread = highest - lowest;
+  return true;
+}
+
+/**
+  M530 without S: calibrate every sensor's baseline and threshold against
+  the empty belt, keeping the offsets. M530 S<mm>: there is a target that
+  distance from every sensor, and only the offsets are set from it. The
+  baselines and thresholds stay where they were on the belt. Nothing
+  changes if any sensor would end up with a threshold it can't trip below.
+  Blocks for a few seconds.
+  @return false if the belt isn't empty and stopped, or the calibration
+  was rejected.
+*/
+bool calibrateSensors(float reference)
+{
+  if (g_board_count > 0 || STOP != g_x_direction || changeoverActive())
+  {
+    LOG_WARN(LOG_SENSOR_CALIBRATION_BUSY);
+    return false;
+  }
+
+  // Single readings at the longest budget, for the most accurate readings
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    g_pcb_sensors[i]->stopRangeContinuous();
+    g_pcb_sensors[i]->setMeasurementTimingBudgetMicroSeconds(g_params.sensor_budget_max * 1000UL);
+  }
+  g_sensor_budget = 0;          // Back to ranging at the budget for the belt speed on the next read
+
+  sensor_calibration_t calibrated[SENSOR_COUNT];
+  memcpy(calibrated, g_sensor_calibration, sizeof(calibrated));
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    sensor_calibration_t &calibration = calibrated[i];
+    uint16_t mean;
+    uint16_t spread;
+    bool     seen = sampleSensor(i, mean, spread);
+
+    if (reference > 0)
+    {
+      // The baseline and threshold were taken with the old offset
+      int16_t offset = seen ? (int16_t)(mean - reference) : 0;
+      if (SENSOR_NO_LIMIT != calibration.baseline)
+      {
+        calibration.baseline  += calibration.offset - offset;
+        calibration.threshold += calibration.offset - offset;
+      }
+      calibration.offset = offset;
+    } else if (!seen) {
+      // Nothing there to trip on, so no threshold of its own
+      calibration.baseline  = SENSOR_NO_LIMIT;
+      calibration.threshold = SENSOR_NO_LIMIT;
+    } else {
+      uint16_t margin = max((uint16_t)SENSOR_CALIBRATION_MARGIN, (uint16_t)(2 * spread));
+      calibration.baseline = mean - calibration.offset;
+      if (calibration.baseline <= margin)
+      {
+        // The threshold would be 0, and nothing is ever closer than that
+        LOG_WARN(LOG_SENSOR_CALIBRATION_UNUSABLE, i, calibration.baseline, margin);
+        return false;
+      }
+      calibration.threshold = calibration.baseline - margin;
+    }
+    LOG_INFO(LOG_SENSOR_CALIBRATION, i, calibration.baseline, calibration.offset, calibration.threshold);
+  }
+  memcpy(g_sensor_calibration, calibrated, sizeof(calibrated));
+
+  bool ok = g_preferences.begin(SENSOR_NAMESPACE, false);
+  if (ok)
+  {
+    ok = sizeof(g_sensor_calibration) == g_preferences.putBytes("calibration", g_sensor_calibration,
+                                                                sizeof(g_sensor_calibration));
+    g_preferences.end();
+  }
+  if (!ok)
+  {
+    LOG_WARN(LOG_SENSOR_CALIBRATION_NOT_SAVED);
   }
-  delay(50);
+  return ok;
 }
 
 #endif H_PCB_SENSORS
@@ -0,0 +1,138 @@
+#ifndef H_POSITION
+#define H_POSITION
+
+/*
+  Y axis position
+
+  The rail's position is kept in g_y_steps, a whole number of steps from
+  zero width. Every step taken is counted into it and moves go to an
+  absolute step, so rounding never builds up however many moves there are.
+  mm only come in at the edges: commands, reports and the range checks. The
+  y_steps_per_m parameter (M510 P21) is the calibration, in steps per metre
+  so it stays a whole number. Home again with G28 after changing it.
+
+  The position is saved to NVS after every move, along with a flag that is
+  set while the stepper is moving. At boot:
+
+    - Flag clear: the last move finished, so the rail is where we left it.
+      The position is restored and G0 works straight away without homing.
+    - Flag set: power went while the rail was moving, so we don't know
+      where it stopped. G28 is needed as before.
+
+  The position is also thrown away if it's out of range, or if the limit
+  switch is tripped when the saved width is short of the homed position.
+
+    G28     Full home, as before
+    G28 O   Home only if the position isn't known, otherwise do nothing
+    G28 V   Check the position: home, compare the steps it took with the
+            steps we expected, then go back to the same width
+
+  The stepper is open loop, so if something pushed the rail while the power
+  was off only G28 V or G28 will notice.
+*/
+
+#define POSITION_NAMESPACE      "position"   // NVS namespace
+#define POSITION_KEY            "y_steps"    // Was "y_axis" when it was saved in mm
+#define HOME_VERIFY_TOLERANCE   20           // Steps, about 0.5 mm
+
+struct saved_position_t
+{
+  int32_t y_steps;              // Steps from zero width
+  uint8_t moving;               // Set while the stepper is moving
+};
+
+// In double, as a float only has 24 bits for mm * steps per metre
+int32_t mmToYSteps(float mm)
+{
+  return lround((double)mm * g_params.y_steps_per_m / 1000.0);
+}
+
+float yStepsToMm(int32_t steps)
+{
+  return (float)(steps * 1000.0 / g_params.y_steps_per_m);
+}
+
+/**
+  @return the width in mm, for reports
+*/
+float yPosition()
+{
+  return yStepsToMm(g_y_steps);
+}
+
+/**
+  Write the position and moving flag to NVS
+*/
+bool savePosition(int32_t y_steps, bool moving)
+{
+  saved_position_t saved = { y_steps, moving };
+  if (!g_preferences.begin(POSITION_NAMESPACE, false))
+  {
+    return false;
+  }
+  bool ok = sizeof(saved) == g_preferences.putBytes(POSITION_KEY, &saved, sizeof(saved));
+  g_preferences.end();
+  return ok;
+}
+
+/**
+  Call before the stepper moves. If power goes before endYMove() the
+  position won't be trusted at the next boot.
+*/
+void beginYMove()
+{
+  savePosition(g_y_steps, true);
+}
+
+/**
+  Call when the stepper has stopped
+*/
+void endYMove()
+{
+  savePosition(g_y_steps, false);
+}
+
+/**
+  Restore the position saved by the last move. Call once at boot, after the
+  parameters are loaded and the limit switch pin is set up.
+  @return true if the position is known and the axis counts as homed.
+*/
+bool restorePosition()
+{
+  saved_position_t saved;
+
+  if (!g_preferences.begin(POSITION_NAMESPACE, true))
+  {
+    LOG_INFO(LOG_POSITION_NONE);
+    return false;
+  }
+  bool found = sizeof(saved) == g_preferences.getBytesLength(POSITION_KEY)
+            && sizeof(saved) == g_preferences.getBytes(POSITION_KEY, &saved, sizeof(saved));
+  g_preferences.end();
+
+  if (!found)
+  {
+    LOG_INFO(LOG_POSITION_NONE);
+    return false;
+  }
+  if (saved.moving)
+  {
+    LOG_WARN(LOG_POSITION_LOST);
+    return false;
+  }
+  float y_position = yStepsToMm(saved.y_steps);
+  if (y_position < g_params.minimum_position
+      || y_position > g_params.maximum_position
+      || (HIGH == digitalRead(LIMIT_SENSOR_Y_PIN) && y_position <= g_params.home_switch_offset))
+  {
+    LOG_WARN(LOG_POSITION_INVALID, y_position);
+    return false;
+  }
+
+  g_y_steps = saved.y_steps;
+  g_homed = true;
+  LOG_INFO(LOG_POSITION_RESTORED, y_position);
+  return true;
+}
+
+#endif H_POSITION
@@ -0,0 +1,139 @@
+#ifndef H_PRESTART
+#define H_PRESTART
+
+/*
+  Starting M56 boards early
+
+  In M56 the belt used to wait for ready-in before it moved, so every
+  handoff paid for the board getting from wherever it sat to the exit after
+  the downstream machine was already waiting for it. With the prestart
+  parameter set (M510 P20 S1) the conveyor learns two things:
+
+    cycle    How long ready-in stays off once it drops, ie how long the
+             downstream machine takes over each board
+    travel   How long a board takes to get from a standstill to the exit
+             sensor
+
+  Once ready-in drops, it's expected back after the cycle time. The belt
+  starts that long less the travel time less PRESTART_MARGIN after the
+  drop, so the board gets to the exit just before it's wanted. If ready-in
+  is on by then the board carries straight on. If not, the belt stops
+  with the board at the exit sensor and waits, as SPACED_HOLD does, so a
+  board still never leaves without ready-in.
+
+  Both times are running averages, updated with every new sample. Nothing
+  starts early until there have been PRESTART_MIN_SAMPLES cycles. Drops
+  longer than PRESTART_MAX_CYCLE, eg the downstream machine being stopped,
+  aren't learnt from. Changing the direction of flow starts learning
+  again, as it's a different machine.
+*/
+
+#define PRESTART_MARGIN        300   // ms. Aim to reach the exit this much before ready-in
+#define PRESTART_MIN_SAMPLES     3   // Cycles seen before starting early
+#define PRESTART_MAX_CYCLE   60000   // ms. Longer drops in ready-in aren't learnt from
+
+struct prestart_t
+{
+  uint8_t  direction;        // Downstream direction the learning is for
+  bool     ready_in;         // Last ready-in seen
+  uint32_t ready_fell_at;    // millis() ready-in last went off, 0 if it's on
+  uint32_t cycle;            // ms, average time ready-in stays off
+  uint8_t  cycle_samples;
+  uint32_t travel;           // ms, average time from a standstill to the exit
+  uint8_t  travel_samples;
+  uint32_t travel_began;     // millis() the belt started for this board, 0 if not timing
+};
+
+prestart_t g_prestart = { RIGHT, false, 0, 0, 0, 0, 0, 0 };
+
+/**
+  Fold /sample/ into a running average
+*/
+uint32_t prestartAverage(uint32_t average, uint8_t &samples, uint32_t sample)
+{
+  if (samples < 255)
+  {
+    samples++;
+  }
+  return 1 == samples ? sample : (average * 3 + sample) / 4;
+}
+
+/**
+  True when a board waiting in STATE_UNLOAD_RIRO_BEGIN should start for
+  the exit without ready-in
+*/
+bool prestartDue()
+{
+  if (!g_params.prestart || g_ready_in_downstream || 0 == g_prestart.ready_fell_at
+      || g_prestart.cycle_samples < PRESTART_MIN_SAMPLES || 0 == g_prestart.travel_samples)
+  {
+    return false;
+  }
+  uint32_t lead = g_prestart.travel + PRESTART_MARGIN;
+  uint32_t off  = millis() - g_prestart.ready_fell_at;
+  if (off + lead < g_prestart.cycle)
+  {
+    return false;
+  }
+  LOG_DEBUG(LOG_PRESTART, off < g_prestart.cycle ? g_prestart.cycle - off : 0);
+  return true;
+}
+
+/**
+  The belt has started moving a board that was standing still
+*/
+void prestartTravelBegan()
+{
+  g_prestart.travel_began = 0 == millis() ? 1 : millis();
+}
+
+/**
+  The board has reached the exit sensor. Only learnt from if the belt ran
+  all the way.
+*/
+void prestartTravelEnded()
+{
+  if (0 == g_prestart.travel_began)
+  {
+    return;
+  }
+  g_prestart.travel = prestartAverage(g_prestart.travel, g_prestart.travel_samples,
+                                      millis() - g_prestart.travel_began);
+  g_prestart.travel_began = 0;
+}
+
+/**
+  Time the downstream machine's ready-in. Call once per pass of loop(),
+  after check_ready_in().
+*/
+void servicePrestart()
+{
+  if (downstreamDirection() != g_prestart.direction)
+  {
+    g_prestart = { downstreamDirection(), g_ready_in_downstream, 0, 0, 0, 0, 0, 0 };
+    return;
+  }
+  if (g_ready_in_downstream == g_prestart.ready_in)
+  {
+    return;
+  }
+  g_prestart.ready_in = g_ready_in_downstream;
+
+  if (!g_ready_in_downstream)
+  {
+    g_prestart.ready_fell_at = 0 == millis() ? 1 : millis();
+    return;
+  }
+  if (0 != g_prestart.ready_fell_at)
+  {
+    uint32_t off = millis() - g_prestart.ready_fell_at;
+    if (off <= PRESTART_MAX_CYCLE)
+    {
+      g_prestart.cycle = prestartAverage(g_prestart.cycle, g_prestart.cycle_samples, off);
+      LOG_DEBUG(LOG_PRESTART_LEARNT, g_prestart.cycle, g_prestart.travel);
+    }
+  }
+  g_prestart.ready_fell_at = 0;
+}
+
+#endif H_PRESTART
@@ -0,0 +1,432 @@
+#ifndef H_RECIPES
+#define H_RECIPES
+
+/*
+  Product recipes
+
+  A recipe is everything that changes between products: rail width, belt
+  speed, unload mode and dwell, and the two sensor settings. Up to
+  RECIPE_COUNT of them are stored in NVS, and one command changes over to
+  any of them.
+
+    M520 R<n> "<name>" Y<width> S<speed> U<55|56|57|60|61> [P<dwell>] [D<debounce>] [T<trigger>]
+                        Store recipe n. P is seconds for M57 and mm for M60
+                        and M61. D and T default to the current values
+    M521 R<n>           Change over to recipe n
+    M521 "<name>"       Change over to the recipe with this name
+    M522                Report the stored recipes, to serial and stat/<id>/CONFIG
+    M523 R<n>           Delete recipe n
+
+  The M522 report is a list of M520 commands, like the M503 report.
+
+  A changeover is a job (see jobs.h), so the line controller gets accepted,
+  unloaded, completed, timeout and aborted events for it. The steps overlap
+  where that's safe:
+
+    1. Boards already on the belt are cleared. If an unload mode is running
+       it keeps going, otherwise M56 is started to clear them. No new boards
+       are accepted from upstream until the changeover is done.
+    2. If the new width is wider the rail starts moving straight away,
+       while the old boards are still clearing. A narrower rail would
+       squeeze the old boards, so it waits for the belt to be clear.
+    3. Once the belt is clear the new sensor settings are applied and the
+       rail moves to the new width, a step per pass of loop() like any
+       other move, so CAN, serial and the e-stop are still serviced.
+    4. When the rail is at the new width the recipe's unload mode starts
+       as a new job.
+
+  The rail must have been homed, or its position restored at boot. The
+  changeover stops with a timeout event if the belt drops back to idle
+  with boards still on it after the M56 we started to clear them, or if
+  no board has left for CHANGEOVER_TIMEOUT seconds, eg because M05 left
+  them sitting on the belt. Any other unload command
+  cancels it.
+*/
+
+#define CHANGEOVER_NONE         0
+#define CHANGEOVER_CLEARING     1     // Old boards leaving, rail moving if it's getting wider
+#define CHANGEOVER_WIDTH        2     // Belt clear, rail moving to the new width
+
+#define RECIPE_NAMESPACE   "recipes"  // NVS namespace
+#define RECIPE_EMPTY            0     // mode of an unused slot
+
+struct recipe_t
+{
+  char     name[RECIPE_NAME_LENGTH + 1];
+  float    width;                     // mm
+  uint16_t speed;                     // mm/min
+  int16_t  mode;                      // MCODE_UNLOAD_NOW ... MCODE_UNLOAD_TIMED, or MCODE_UNLOAD_GAP or _PITCH
+  int16_t  dwell;                     // Seconds for M57, mm for M60 and M61
+  uint8_t  debounce_count;
+  uint16_t trigger_height;
+};
+
+struct changeover_t
+{
+  uint8_t  phase;
+  uint8_t  number;
+  uint32_t job;
+  bool     clearing;                  // We started M56 to clear the belt
+  uint8_t  boards;                    // g_board_count when a board last left...
+  uint32_t progress_at;               // ...and millis() then
+  recipe_t recipe;                    // Copied, so M520 and M523 can't change it underneath us
+};
+
+recipe_t     g_recipes[RECIPE_COUNT];
+changeover_t g_changeover = {};   // phase CHANGEOVER_NONE
+
+bool changeoverActive()
+{
+  return CHANGEOVER_NONE != g_changeover.phase;
+}
+
+/**
+  @return true if /mode/ is an unload mode a recipe can start
+*/
+bool recipeModeValid(int16_t mode)
+{
+  return (mode >= MCODE_UNLOAD_NOW && mode <= MCODE_UNLOAD_TIMED)
+      || MCODE_UNLOAD_GAP == mode || MCODE_UNLOAD_PITCH == mode;
+}
+
+/**
+  NVS key for recipe /number/, eg "r3"
+*/
+void recipeKey(uint8_t number, char* key, size_t key_size)
+{
+  snprintf(key, key_size, "r%u", number);
+}
+
+/**
+  @return the recipe with this number, or NULL if there's no such recipe
+*/
+recipe_t* findRecipe(int16_t number)
+{
+  if (number < 1 || number > RECIPE_COUNT || RECIPE_EMPTY == g_recipes[number - 1].mode)
+  {
+    return NULL;
+  }
+  return &g_recipes[number - 1];
+}
+
+/**
+  @return the number of the recipe called /name/, or -1
+*/
+int16_t findRecipeByName(const char* name)
+{
+  for (uint8_t i = 0; i < RECIPE_COUNT; i++)
+  {
+    if (RECIPE_EMPTY != g_recipes[i].mode && 0 == strncmp(g_recipes[i].name, name, sizeof(g_recipes[i].name)))
+    {
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+/**
+  Load the stored recipes from NVS. Call once at boot.
+*/
+void loadRecipes()
+{
+  uint8_t count = 0;
+  char    key[4];
+
+  memset(g_recipes, 0, sizeof(g_recipes));
+  if (!g_preferences.begin(RECIPE_NAMESPACE, true))
+  {
+    LOG_INFO(LOG_RECIPES_LOADED, count);
+    return;
+  }
+  for (uint8_t i = 0; i < RECIPE_COUNT; i++)
+  {
+    recipeKey(i + 1, key, sizeof(key));
+    recipe_t saved;
+    if (sizeof(saved) == g_preferences.getBytesLength(key)
+        && sizeof(saved) == g_preferences.getBytes(key, &saved, sizeof(saved))
+        && recipeModeValid(saved.mode))
+    {
+      saved.name[RECIPE_NAME_LENGTH] = '\0';
+      g_recipes[i] = saved;
+      count++;
+    }
+  }
+  g_preferences.end();
+  LOG_INFO(LOG_RECIPES_LOADED, count);
+}
+
+/**
+  Store a recipe from an M520 command
+*/
+bool defineRecipe(const gcode_command_t &command)
+{
+  recipe_t recipe;
+  int16_t  number = command.r_value;
+
+  if (number < 1 || number > RECIPE_COUNT)
+  {
+    LOG_WARN(LOG_RECIPE_NUMBER, number, RECIPE_COUNT);
+    return false;
+  }
+
+  memset(&recipe, 0, sizeof(recipe));
+  if (command.name[0])
+  {
+    snprintf(recipe.name, sizeof(recipe.name), "%s", command.name);
+  } else {
+    snprintf(recipe.name, sizeof(recipe.name), "recipe%d", number);
+  }
+  float debounce_count = command.d_value < 0 ? g_params.debounce_count : command.d_value;
+  float trigger_height = command.t_value < 0 ? g_params.trigger_height : command.t_value;
+
+  const char* problem = NULL;
+  int16_t     other   = findRecipeByName(recipe.name);
+  if (other != -1 && other != number)
+  {
+    problem = "name already used";
+  } else if (command.y_value < g_params.minimum_position || command.y_value > g_params.maximum_position) {
+    problem = "width";
+  } else if (command.s_value < g_params.minimum_speed || command.s_value > g_params.maximum_speed) {
+    problem = "speed";
+  } else if (!recipeModeValid(command.u_value)) {
+    problem = "unload mode";
+  } else if (!parameterInRange(PARAM_debounce_count, debounce_count)) {
+    problem = "debounce";
+  } else if (!parameterInRange(PARAM_trigger_height, trigger_height)) {
+    problem = "trigger height";
+  }
+  if (problem)
+  {
+    LOG_WARN(LOG_RECIPE_INVALID, number, problem);
+    return false;
+  }
+
+  recipe.width          = command.y_value;
+  recipe.speed          = command.s_value;
+  recipe.mode           = command.u_value;
+  recipe.dwell          = command.p_value < 0 ? 0 : command.p_value;
+  recipe.debounce_count = debounce_count;
+  recipe.trigger_height = trigger_height;
+
+  char key[4];
+  recipeKey(number, key, sizeof(key));
+  bool ok = g_preferences.begin(RECIPE_NAMESPACE, false);
+  if (ok)
+  {
+    ok = sizeof(recipe) == g_preferences.putBytes(key, &recipe, sizeof(recipe));
+    g_preferences.end();
+  }
+  if (!ok)
+  {
+    LOG_WARN(LOG_RECIPE_NOT_SAVED, number);
+    return false;
+  }
+  g_recipes[number - 1] = recipe;
+  LOG_INFO(LOG_RECIPE_SAVED, number, recipe.name);
+  return true;
+}
+
+/**
+  Delete a recipe from an M523 command
+*/
+bool deleteRecipe(const gcode_command_t &command)
+{
+  if (NULL == findRecipe(command.r_value))
+  {
+    LOG_WARN(LOG_RECIPE_NOT_FOUND, command.r_value);
+    return false;
+  }
+  char key[4];
+  recipeKey(command.r_value, key, sizeof(key));
+  if (g_preferences.begin(RECIPE_NAMESPACE, false))
+  {
+    g_preferences.remove(key);
+    g_preferences.end();
+  }
+  memset(&g_recipes[command.r_value - 1], 0, sizeof(recipe_t));
+  LOG_INFO(LOG_RECIPE_DELETED, command.r_value);
+  return true;
+}
+
+/**
+  Report every stored recipe as an M520 command
+*/
+void reportRecipes()
+{
+  size_t length = 0;
+  g_param_report[0] = '\0';     // Shared with the parameter report
+  for (uint8_t i = 0; i < RECIPE_COUNT; i++)
+  {
+    const recipe_t &recipe = g_recipes[i];
+    if (RECIPE_EMPTY == recipe.mode)
+    {
+      continue;
+    }
+    LOG_INFO(LOG_RECIPE, i + 1, recipe.width, recipe.speed, recipe.name);
+    if (length < sizeof(g_param_report))
+    {
+      int written = snprintf(&g_param_report[length], sizeof(g_param_report) - length,
+                             "M520 R%u \"%s\" Y%g S%u U%d P%d D%u T%u\n", i + 1, recipe.name,
+                             (double)recipe.width, recipe.speed, recipe.mode, recipe.dwell,
+                             recipe.debounce_count, recipe.trigger_height);
+      length += written > 0 ? written : 0;
+    }
+  }
+
+  if (features_t::mqtt)
+  {
+    mqttPublish(g_mqtt_config_topic, g_param_report);
+  }
+}
+
+/**
+  Start a changeover from an M521 command. The work is done by
+  serviceChangeover().
+*/
+bool startChangeover(const gcode_command_t &command)
+{
+  int16_t number = command.name[0] ? findRecipeByName(command.name) : command.r_value;
+  recipe_t* recipe = findRecipe(number);
+  if (NULL == recipe)
+  {
+    LOG_WARN(LOG_RECIPE_NOT_FOUND, number);
+    return false;
+  }
+  if (!g_homed)
+  {
+    LOG_WARN(LOG_NOT_HOMED);
+    return false;
+  }
+  if (recipe->width < g_params.minimum_position || recipe->width > g_params.maximum_position)
+  {
+    LOG_WARN(LOG_RECIPE_INVALID, number, "width");
+    return false;
+  }
+
+  jobAccepted(MCODE_CHANGEOVER);
+  g_job.changeover = true;
+  g_job.started    = true;      // The belt may already be moving for the old product
+
+  g_changeover.phase       = CHANGEOVER_CLEARING;
+  g_changeover.number      = number;
+  g_changeover.job         = g_job.id;
+  g_changeover.clearing    = false;
+  g_changeover.boards      = g_board_count;
+  g_changeover.progress_at = millis();
+  g_changeover.recipe      = *recipe;
+  LOG_INFO(LOG_CHANGEOVER_START, number, recipe->name);
+  return true;
+}
+
+/**
+  True once every board has left and the belt has finished running on
+*/
+bool beltClear()
+{
+  return 0 == g_board_count
+      && STATE_UNLOAD_NOW_RUNON  != g_state
+      && STATE_UNLOAD_RIRO_RUNON != g_state;
+}
+
+/**
+  Move the changeover along. Call once per pass of loop(), after the state
+  machine.
+*/
+void serviceChangeover()
+{
+  if (!changeoverActive())
+  {
+    return;
+  }
+
+  // Replaced by another unload command, or aborted by STATE_ERROR. Any rail
+  // move in progress still finishes, so the position stays right.
+  if (g_job.id != g_changeover.job)
+  {
+    LOG_WARN(LOG_CHANGEOVER_CANCELLED, g_changeover.number);
+    g_changeover.phase = CHANGEOVER_NONE;
+    return;
+  }
+
+  const recipe_t &recipe = g_changeover.recipe;
+
+  if (CHANGEOVER_CLEARING == g_changeover.phase)
+  {
+    // Getting wider can't hurt the boards still on the belt
+    if (!yAxisMoving() && mmToYSteps(recipe.width) > g_y_steps)
+    {
+      startYMove(recipe.width);
+    }
+
+    if (!beltClear())
+    {
+      if (g_board_count != g_changeover.boards)
+      {
+        g_changeover.boards      = g_board_count;
+        g_changeover.progress_at = millis();
+      }
+      if (millis() - g_changeover.progress_at > CHANGEOVER_TIMEOUT * 1000UL)
+      {
+        // Nothing is clearing them, eg the belt was stopped with M05
+        LOG_WARN(LOG_CHANGEOVER_TIMEOUT, g_changeover.number);
+        endJob("timeout");
+        g_changeover.phase = CHANGEOVER_NONE;
+        return;
+      }
+      if (STATE_IDLE == g_state || STATE_BEGIN == g_state)
+      {
+        if (g_changeover.clearing)
+        {
+          // Our M56 timed out with boards still on the belt
+          LOG_WARN(LOG_CHANGEOVER_TIMEOUT, g_changeover.number);
+          endJob("timeout");
+          g_changeover.phase = CHANGEOVER_NONE;
+          return;
+        }
+        if (0 == g_x_requested_speed)
+        {
+          setRequestedSpeed(recipe.speed);
+        }
+        g_changeover.clearing = true;
+        perform_state_transition(STATE_UNLOAD_RIRO_BEGIN);
+      }
+      return;
+    }
+
+    // Belt is clear. Stop the old mode and use the new sensor settings
+    g_x_direction = STOP;
+    if (STATE_IDLE != g_state)
+    {
+      perform_state_transition(STATE_IDLE);
+    }
+    setParameter(PARAM_debounce_count, recipe.debounce_count);
+    setParameter(PARAM_trigger_height, recipe.trigger_height);
+
+    // A wider move may already be on its way there
+    if (!yAxisMoving() && mmToYSteps(recipe.width) != g_y_steps)
+    {
+      startYMove(recipe.width);
+    }
+    g_changeover.phase = CHANGEOVER_WIDTH;
+  }
+
+  if (CHANGEOVER_WIDTH == g_changeover.phase)
+  {
+    if (yAxisMoving())
+    {
+      return;
+    }
+
+    LOG_INFO(LOG_CHANGEOVER_COMPLETE, g_changeover.number, millis() - g_job.accepted_at);
+    endJob("completed");
+    g_changeover.phase = CHANGEOVER_NONE;
+
+    gcode_command_t start;
+    start.m_code  = recipe.mode;
+    start.s_value = recipe.speed;
+    start.p_value = recipe.dwell;
+    executeGCodeCommand(start);
+  }
+}
+
+#endif H_RECIPES
@@ -0,0 +1,68 @@
+#ifndef H_RIRO
+#define H_RIRO
+
+/*
+  Ready-in / ready-out handshaking with the neighbouring machines
+
+  Ready-in tells us the next machine can take a board. It can come from the
+  wired SMEMA input, from a CAN handoff message, or both, depending on
+  HANDOFF_SMEMA and HANDOFF_CAN in config.h.
+
+  Ready-out tells the previous machine that we can take a board. It is
+  driven from conveyorReadyToReceive() in can_handoff.h.
+
+  Which side is which follows the direction of flow (see flow.h): ready-in
+  is read on the downstream side and ready-out is driven on the upstream
+  side. The ready-out on the downstream side is held inactive.
+*/
+
+void initialise_riro()
+{
+  mcp23017.pinMode(READY_IN_LEFT_PIN,   INPUT);
+  mcp23017.pinMode(READY_IN_RIGHT_PIN,  INPUT);
+  mcp23017.pinMode(READY_OUT_LEFT_PIN,  OUTPUT);
+  mcp23017.pinMode(READY_OUT_RIGHT_PIN, OUTPUT);
+  mcp23017.digitalWrite(READY_OUT_LEFT_PIN,  !READY_ACTIVE_LEVEL);
+  mcp23017.digitalWrite(READY_OUT_RIGHT_PIN, !READY_ACTIVE_LEVEL);
+}
+
+void check_ready_in()
+{
+  bool ready_in_left  = false;
+  bool ready_in_right = false;
+
+#if HANDOFF_SMEMA
+  ready_in_left  = (READY_ACTIVE_LEVEL == mcp23017.digitalRead(READY_IN_LEFT_PIN));
+  ready_in_right = (READY_ACTIVE_LEVEL == mcp23017.digitalRead(READY_IN_RIGHT_PIN));
+  traceReadyIn(ready_in_left, ready_in_right);
+#endif
+
+  bool &downstream = RIGHT == downstreamDirection() ? ready_in_right : ready_in_left;
+#if HANDOFF_CAN
+  downstream = downstream || g_can_ready_in_downstream;
+#endif
+
+  g_ready_in_left       = ready_in_left;
+  g_ready_in_right      = ready_in_right;
+  g_ready_in_downstream = downstream;
+
+#if HANDOFF_SMEMA
+  // Only write to the expander when an output actually changes
+  static bool ready_out_left  = false;
+  static bool ready_out_right = false;
+  bool left  = g_ready_to_receive && RIGHT == downstreamDirection();
+  bool right = g_ready_to_receive && LEFT  == downstreamDirection();
+  if (left != ready_out_left)
+  {
+    ready_out_left = left;
+    mcp23017.digitalWrite(READY_OUT_LEFT_PIN, ready_out_left ? READY_ACTIVE_LEVEL : !READY_ACTIVE_LEVEL);
+  }
+  if (right != ready_out_right)
+  {
+    ready_out_right = right;
+    mcp23017.digitalWrite(READY_OUT_RIGHT_PIN, ready_out_right ? READY_ACTIVE_LEVEL : !READY_ACTIVE_LEVEL);
+  }
+#endif
+}
+
+#endif H_RIRO
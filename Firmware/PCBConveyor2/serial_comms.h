@@ -2,26 +2,123 @@
 #define H_SERIAL_COMMS
 
 /*
+  G-code from the USB serial console, one command per line
+*/
+conveyor_core::LineFramer<MAX_SERIAL_INPUT> g_serial_framer;
+bool     g_serial_line_waiting = false;   // Read during a blocking move, not run yet
+uint32_t g_serial_line_at      = 0;       // micros() the line in g_serial_framer was read
+
+// Read after the waiting line, and framed separately only to look for M112
+conveyor_core::LineFramer<MAX_SERIAL_INPUT> g_serial_scan_framer;
+char     g_serial_pending[SERIAL_PENDING_SIZE];
+uint16_t g_serial_pending_length = 0;
+uint16_t g_serial_pending_read   = 0;     // Replayed up to here
+uint16_t g_serial_dropped        = 0;     // Didn't fit in g_serial_pending
 
+void runSerialLine()
+{
+  if (g_serial_framer.overflowed())
+  {
+    LOG_WARN(LOG_SERIAL_TOO_LONG, MAX_SERIAL_INPUT);
+  } else {
+    traceSerialLine(g_serial_framer.line());
+    g_command_received_us = g_serial_line_at;
+    processGCodeMessage(g_serial_framer.line());
+  }
+}
+
+/**
+  Add a received character to the line being built, and run the line if it
+  completes one
 */
+void addSerialChar(char receivedChar)
+{
+#if SERIAL_DEBUGGING
+  Serial.print(receivedChar);
+#endif
+
+  if (g_serial_framer.add(receivedChar))
+  {
+    g_serial_line_at = micros();
+    runSerialLine();
+  }
+}
+
 void listenToSerialStream()
 {
+  if (g_serial_line_waiting)
+  {
+    g_serial_line_waiting = false;
+    runSerialLine();
+  }
+
+  // A line run from here can start another move, which adds to the end
+  while (g_serial_pending_read < g_serial_pending_length)
+  {
+    addSerialChar(g_serial_pending[g_serial_pending_read++]);
+  }
+  g_serial_pending_length = 0;
+  g_serial_pending_read   = 0;
+  if (g_serial_dropped > 0)
+  {
+    LOG_WARN(LOG_SERIAL_DROPPED, g_serial_dropped);
+    g_serial_dropped = 0;
+  }
+
   while (Serial.available())
   {
-    // Get the received byte, convert to char for adding to buffer
-    char receivedChar = (char)Serial.read();
+    addSerialChar((char)Serial.read());
+  }
+}
 
-#if SERIAL_DEBUGGING
-    Serial.print(receivedChar);
-#endif
+/**
+  Stop if a line just framed is M112
+*/
+void checkSerialEmergencyStop(const char* line, bool overflowed)
+{
+  gcode_command_t command;
+  parseGCodeCommand(line, command);
+  if (MCODE_EMERGENCY_STOP == command.m_code && !overflowed)
+  {
+    emergencyStop(ESTOP_SOURCE_COMMAND, micros());
+  }
+}
 
-    g_input_buffer += receivedChar;
+/**
+  Read serial during a blocking move, which may itself be running a serial
+  command, so nothing is run here: M112 stops straight away, and everything
+  else waits for listenToSerialStream() once the move is over. The first
+  line is held in g_serial_framer. After that the characters are kept in
+  g_serial_pending, in order, and a scratch framer keeps looking for M112
+  so a command queued in front of it can't hold the stop up. If that fills
+  the rest is dropped, but still checked for M112.
+*/
+void pollSerialEmergencyStop()
+{
+  while (Serial.available())
+  {
+    char receivedChar = (char)Serial.read();
+    if (!g_serial_line_waiting && 0 == g_serial_pending_length)
+    {
+      if (g_serial_framer.add(receivedChar))
+      {
+        g_serial_line_at      = micros();
+        g_serial_line_waiting = true;
+        g_serial_scan_framer  = conveyor_core::LineFramer<MAX_SERIAL_INPUT>();
+        checkSerialEmergencyStop(g_serial_framer.line(), g_serial_framer.overflowed());
+      }
+      continue;
+    }
 
-    // If the received character is a newline, processGCodeMessage
-    if (receivedChar == '\n')
+    if (g_serial_pending_length < SERIAL_PENDING_SIZE)
+    {
+      g_serial_pending[g_serial_pending_length++] = receivedChar;
+    } else {
+      g_serial_dropped++;
+    }
+    if (g_serial_scan_framer.add(receivedChar))
     {
-      processGCodeMessage();
-      g_input_buffer = "";
+      checkSerialEmergencyStop(g_serial_scan_framer.line(), g_serial_scan_framer.overflowed());
     }
   }
 }
@@ -0,0 +1,384 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+/*
+  Input traces, for replaying a problem from the line on a desk
+
+  A trace records everything the control loop takes in, with the millis()
+  it arrived at:
+
+    - Time of flight readings, whenever one changes
+    - SMEMA ready-in levels, whenever they change
+    - Command lines from serial, and MQTT command batches
+    - CAN frames addressed to us. CAN commands and handoff messages are
+      decoded again from these on replay
+    - State machine transitions, so the replay can check it went the same way
+
+  The parameters, sensor calibration, recipes and rail position are written
+  first, so the replay starts with the same settings. Start a trace while
+  the conveyor is idle, before the unload command, so it also starts from
+  the same state.
+
+    M550 S1   Record into RAM, stopping when TRACE_BUFFER_SIZE is full
+    M550 S2   Stream out over serial while recording
+    M550 S0   Stop
+    M551      Stop, and write out what was recorded
+
+  Trace data goes out on the serial console as lines of hex between the log
+  messages, eg "TRACE:01e8030000380101...". Give a capture of the console to
+  LineSimulator/tracereplay to run it through the firmware on the host.
+
+  Records are [type] [time] [data], little-endian. The time is ms since the
+  previous record as a varint: 7 bits per byte, low bits first, top bit set
+  when another byte follows. So a sensor reading usually takes 4 bytes.
+
+    TRACE_START     [millis u32, not a varint] [state u16] [TRACE_VERSION u8]
+    TRACE_NVS       [namespace, NUL] [key, NUL] [length u8] [bytes]
+    TRACE_SENSOR+n  [range mm u16] from sensor n
+    TRACE_READY_IN+ bit 0 left active, bit 1 right active
+    TRACE_SERIAL    [length u16] [line]
+    TRACE_MQTT      [length u16] [payload], a command batch from MQTT or a WebSocket
+    TRACE_CAN+dlc   [id u32] [dlc bytes]
+    TRACE_STATE     [new state u16]
+    TRACE_STOP      [records dropped u16]
+
+  The recorders cost one compare while no trace is running.
+*/
+
+#define TRACE_VERSION           2
+#define TRACE_LINE_BYTES       32     // Bytes of trace per line of hex
+#define TRACE_FLUSH_INTERVAL  250     // ms. Longest a part line waits while streaming
+#define TRACE_RECORD_MAX       (1 + 5 + 2 + MQTT_BUFFER_SIZE)   // Type, longest time, length, the largest batch
+#define TRACE_STOP_RESERVE     10     // Bytes kept free for the TRACE_STOP record
+
+#define TRACE_START          0x01
+#define TRACE_NVS            0x02
+#define TRACE_SENSOR         0x10
+#define TRACE_READY_IN       0x20
+#define TRACE_SERIAL         0x30
+#define TRACE_MQTT           0x31
+#define TRACE_CAN            0x40
+#define TRACE_STATE          0x50
+#define TRACE_STOP           0x60
+
+static_assert(0 == (TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) && TRACE_BUFFER_SIZE <= 32768,
+              "TRACE_BUFFER_SIZE must be a power of 2 that fits the uint16_t indexes");
+
+#define TRACE_OFF               0
+#define TRACE_RECORD            1
+#define TRACE_STREAM            2
+
+uint8_t  g_trace_mode     = TRACE_OFF;
+bool     g_trace_dumping  = false;    // M551 is writing out the buffer
+uint8_t  g_trace_buffer[TRACE_BUFFER_SIZE];
+uint16_t g_trace_head     = 0;        // Next byte to write
+uint16_t g_trace_tail     = 0;        // Next byte to send
+uint32_t g_trace_last     = 0;        // millis() of the last record written
+uint32_t g_trace_flushed  = 0;        // millis() a trace line was last sent
+uint32_t g_trace_records  = 0;
+uint16_t g_trace_dropped  = 0;
+uint16_t g_trace_range[SENSOR_COUNT]; // Last reading recorded from each sensor
+uint8_t  g_trace_ready_in = 0xFF;     // Last ready-in levels recorded
+
+/*
+  One record being put together before it goes into the buffer
+*/
+struct trace_record_t
+{
+  uint16_t length;
+  uint8_t  data[TRACE_RECORD_MAX];
+
+  void add(uint8_t value)
+  {
+    if (length < sizeof(data))
+    {
+      data[length++] = value;
+    }
+  }
+  void add16(uint16_t value)  { add(value & 0xFF); add(value >> 8); }
+  void add32(uint32_t value)  { add16(value & 0xFFFF); add16(value >> 16); }
+  void addBytes(const void* bytes, uint16_t count)
+  {
+    for (uint16_t i = 0; i < count; i++)
+    {
+      add(((const uint8_t*)bytes)[i]);
+    }
+  }
+};
+
+trace_record_t g_trace_record;        // Too big for the stack with an MQTT batch in it
+
+uint16_t traceUsed()
+{
+  return (g_trace_head - g_trace_tail) & (TRACE_BUFFER_SIZE - 1);
+}
+
+/**
+  Start a record of /type/ at the current time
+*/
+trace_record_t &beginTraceRecord(uint8_t type)
+{
+  uint32_t now   = millis();
+  uint32_t delta = now - g_trace_last;
+  g_trace_record.length = 0;
+  g_trace_record.add(type);
+  do
+  {
+    g_trace_record.add((delta & 0x7F) | (delta > 0x7F ? 0x80 : 0));
+    delta >>= 7;
+  } while (delta > 0);
+  return g_trace_record;
+}
+
+void stopTrace();
+
+/**
+  Put the record into the buffer, or count it as dropped if it doesn't fit.
+  A recording that fills up is stopped.
+*/
+void endTraceRecord()
+{
+  uint16_t reserve = TRACE_STOP == g_trace_record.data[0] ? 1 : TRACE_STOP_RESERVE;
+  if (TRACE_BUFFER_SIZE - traceUsed() < g_trace_record.length + reserve)
+  {
+    g_trace_dropped++;
+    if (TRACE_RECORD == g_trace_mode)
+    {
+      LOG_WARN(LOG_TRACE_FULL);
+      stopTrace();
+    }
+    return;
+  }
+
+  for (uint16_t i = 0; i < g_trace_record.length; i++)
+  {
+    g_trace_buffer[g_trace_head] = g_trace_record.data[i];
+    g_trace_head = (g_trace_head + 1) & (TRACE_BUFFER_SIZE - 1);
+  }
+  g_trace_last = millis();
+  g_trace_records++;
+}
+
+void traceNvs(const char* name_space, const char* key, const void* value, uint8_t length)
+{
+  trace_record_t &record = beginTraceRecord(TRACE_NVS);
+  record.addBytes(name_space, strlen(name_space) + 1);
+  record.addBytes(key, strlen(key) + 1);
+  record.add(length);
+  record.addBytes(value, length);
+  endTraceRecord();
+}
+
+/**
+  Record the settings a replay needs, in the form they're saved to NVS
+*/
+void traceSettings()
+{
+#define PARAMETER_TRACE(name, number, key, type, value, low, high) \
+  traceNvs(PARAMETER_NAMESPACE, key, &g_params.name, sizeof(type));
+  PARAMETERS(PARAMETER_TRACE)
+#undef PARAMETER_TRACE
+
+  traceNvs(SENSOR_NAMESPACE, "calibration", g_sensor_calibration, sizeof(g_sensor_calibration));
+
+  char key[4];
+  for (uint8_t i = 0; i < RECIPE_COUNT; i++)
+  {
+    if (RECIPE_EMPTY != g_recipes[i].mode)
+    {
+      recipeKey(i + 1, key, sizeof(key));
+      traceNvs(RECIPE_NAMESPACE, key, &g_recipes[i], sizeof(recipe_t));
+    }
+  }
+
+  // Not homed is saved as a move that never finished, so the replay won't trust it either
+  saved_position_t position = { g_y_steps, !g_homed };
+  traceNvs(POSITION_NAMESPACE, POSITION_KEY, &position, sizeof(position));
+}
+
+/**
+  Start a trace. /mode/ is TRACE_RECORD or TRACE_STREAM.
+  @return false if /mode/ isn't one of those
+*/
+bool startTrace(uint8_t mode)
+{
+  if (TRACE_RECORD != mode && TRACE_STREAM != mode)
+  {
+    return false;
+  }
+  g_trace_head     = 0;
+  g_trace_tail     = 0;
+  g_trace_records  = 0;
+  g_trace_dropped  = 0;
+  g_trace_dumping  = false;
+  g_trace_ready_in = 0xFF;
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    g_trace_range[i] = SENSOR_NO_LIMIT;
+  }
+  g_trace_mode = mode;
+
+  trace_record_t &record = g_trace_record;
+  record.length = 0;
+  record.add(TRACE_START);
+  record.add32(millis());
+  record.add16(g_state);
+  record.add(TRACE_VERSION);
+  endTraceRecord();
+  traceSettings();
+
+  LOG_INFO(LOG_TRACE_STARTED, TRACE_STREAM == mode ? "streaming" : "recording");
+  return true;
+}
+
+void stopTrace()
+{
+  if (TRACE_OFF == g_trace_mode)
+  {
+    return;
+  }
+  // Off first, so a full buffer can't come back round to here
+  bool streaming = TRACE_STREAM == g_trace_mode;
+  g_trace_mode = TRACE_OFF;
+  beginTraceRecord(TRACE_STOP).add16(g_trace_dropped);
+  endTraceRecord();
+  // Finish sending what's left of a stream
+  g_trace_dumping = streaming && traceUsed() > 0;
+  LOG_INFO(LOG_TRACE_STOPPED, g_trace_records, traceUsed(), g_trace_dropped);
+}
+
+/**
+  Stop recording and write the trace out over serial
+*/
+void dumpTrace()
+{
+  stopTrace();
+  g_trace_dumping = traceUsed() > 0;
+}
+
+void traceSensor(uint8_t index, uint16_t range)
+{
+  if (TRACE_OFF == g_trace_mode || range == g_trace_range[index])
+  {
+    return;
+  }
+  g_trace_range[index] = range;
+  beginTraceRecord(TRACE_SENSOR + index).add16(range);
+  endTraceRecord();
+}
+
+void traceReadyIn(bool left, bool right)
+{
+  uint8_t levels = (left ? 0x01 : 0) | (right ? 0x02 : 0);
+  if (TRACE_OFF == g_trace_mode || levels == g_trace_ready_in)
+  {
+    return;
+  }
+  g_trace_ready_in = levels;
+  beginTraceRecord(TRACE_READY_IN + levels);
+  endTraceRecord();
+}
+
+/**
+  Record a command line (TRACE_SERIAL) or command batch (TRACE_MQTT)
+*/
+void traceText(uint8_t type, const char* text, uint16_t length)
+{
+  if (TRACE_OFF == g_trace_mode)
+  {
+    return;
+  }
+  trace_record_t &record = beginTraceRecord(type);
+  record.add16(length);
+  record.addBytes(text, length);
+  endTraceRecord();
+}
+
+void traceSerialLine(const char* line)
+{
+  traceText(TRACE_SERIAL, line, strlen(line));
+}
+
+void traceMqttBatch(const char* payload, uint16_t length)
+{
+  traceText(TRACE_MQTT, payload, length);
+}
+
+void traceCanFrame(uint32_t id, uint8_t dlc, const uint8_t* data)
+{
+  if (TRACE_OFF == g_trace_mode)
+  {
+    return;
+  }
+  trace_record_t &record = beginTraceRecord(TRACE_CAN + dlc);
+  record.add32(id);
+  record.addBytes(data, dlc);
+  endTraceRecord();
+}
+
+void traceState(uint16_t state)
+{
+  if (TRACE_OFF == g_trace_mode)
+  {
+    return;
+  }
+  beginTraceRecord(TRACE_STATE).add16(state);
+  endTraceRecord();
+}
+
+/**
+  Send trace lines while streaming or dumping. Shares the UART with the log,
+  so only whole lines go out, never in the middle of a log message, and
+  only one per pass of loop() while a board is moving. Call once per pass
+  of loop(), after serviceLog().
+*/
+void serviceTrace()
+{
+  if (TRACE_STREAM != g_trace_mode && !g_trace_dumping)
+  {
+    return;
+  }
+
+  uint8_t lines_left = logSystemIdle() ? 8 : 1;
+  while (lines_left-- > 0)
+  {
+    uint16_t used = traceUsed();
+    if (0 == used)
+    {
+      g_trace_dumping = false;
+      return;
+    }
+    // While streaming, wait for a full line unless it's been a while
+    if (used < TRACE_LINE_BYTES && TRACE_STREAM == g_trace_mode
+        && millis() - g_trace_flushed < TRACE_FLUSH_INTERVAL)
+    {
+      return;
+    }
+    if (g_log_line_sent < g_log_line_length)
+    {
+      return;
+    }
+
+    char     line[8 + TRACE_LINE_BYTES * 2];
+    uint16_t count  = used < TRACE_LINE_BYTES ? used : TRACE_LINE_BYTES;
+    uint8_t  length = 0;
+    memcpy(line, "TRACE:", 6);
+    length = 6;
+    for (uint16_t i = 0; i < count; i++)
+    {
+      uint8_t value = g_trace_buffer[(g_trace_tail + i) & (TRACE_BUFFER_SIZE - 1)];
+      line[length++] = "0123456789abcdef"[value >> 4];
+      line[length++] = "0123456789abcdef"[value & 0x0F];
+    }
+    line[length++] = '\n';
+    if (Serial.availableForWrite() < length)
+    {
+      return;
+    }
+    Serial.write((const uint8_t*)line, length);
+    g_trace_tail    = (g_trace_tail + count) & (TRACE_BUFFER_SIZE - 1);
+    g_trace_flushed = millis();
+  }
+}
+
+#endif H_TRACE
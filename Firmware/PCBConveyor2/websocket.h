@@ -0,0 +1,174 @@
+#ifndef H_WEBSOCKET
+#define H_WEBSOCKET
+
+/*
+  Local WebSocket endpoint
+
+  With ENABLE_WEBSOCKET, HMIs and test rigs on the same network can connect
+  to ws://<device>:WEBSOCKET_PORT/ and drive the conveyor directly, without
+  the extra hop and latency of the broker. Several can be connected at
+  once, up to the library's WEBSOCKETS_SERVER_CLIENT_MAX (5 by default).
+
+  Each text message a client sends is a command batch, run just as if it
+  had come in on the MQTT command topic (see mqtt_comms.h). The result
+  goes back to that client only:
+
+    RESULT 3 lines, 1 failed: 1 OK, 2 OK job=7, 3 UNKNOWN
+
+  Batches longer than MQTT_BUFFER_SIZE aren't run at all. Every client is
+  sent, as it happens:
+
+    STATE <new> from=<old> boards=<n> at=<ms>   Every state transition
+    TELE <message>                              Everything published to the
+    JOB <event>                                 MQTT topic of the same name,
+    CONFIG <report>                             whether or not the broker is
+    RESULT <result>                             there
+
+  Each frame is formatted once into g_websocket_frame, after room for the
+  WebSocket header, and the library writes the header into that room and
+  sends the one buffer to every client. Nothing is copied or allocated per
+  client. WEBSOCKET_FRAME_SIZE is worked out from the longest message,
+  a report in g_param_report with its "CONFIG " in front, so nothing the
+  firmware sends is cut short.
+
+  The server is polled from loop() like the MQTT client, so commands run
+  between passes of the state machine, never alongside it. Sends go
+  straight into lwIP's buffers and return at once, unless a client has
+  stopped reading and its buffer is full. The library does use the heap
+  for handshakes and incoming messages, which memory.h will show.
+
+  WARNING: there's no authentication or TLS. Anyone who can reach the port
+  can run any command, including M112, M999, width moves and M500, and
+  read everything the conveyor reports. ENABLE_WEBSOCKET is off by
+  default. Only turn it on for a network you trust, eg an isolated line
+  network, and never where the port can be reached from outside it.
+*/
+
+#if ENABLE_WEBSOCKET && !ENABLE_WIFI
+#error "ENABLE_WEBSOCKET needs ENABLE_WIFI"
+#endif
+
+#define WEBSOCKET_ALL   -1   // Send to every client
+
+// Bytes of text in a frame, with its NUL. The reports are the longest
+#define WEBSOCKET_FRAME_SIZE  (sizeof("CONFIG ") - 1 + sizeof(g_param_report))
+
+static_assert(WEBSOCKET_FRAME_SIZE >= sizeof("RESULT ") - 1 + MQTT_RESULT_SIZE
+              && WEBSOCKET_FRAME_SIZE >= sizeof("TELE ") - 1 + sizeof(g_mqtt_message_buffer),
+              "Every message the firmware sends has to fit in one WebSocket frame");
+
+bool    g_websocket_started = false;
+uint8_t g_websocket_clients = 0;
+#if ENABLE_WEBSOCKET
+char    g_websocket_frame[WEBSOCKETS_MAX_HEADER_SIZE + WEBSOCKET_FRAME_SIZE];
+char*   g_websocket_text = &g_websocket_frame[WEBSOCKETS_MAX_HEADER_SIZE];
+
+/**
+  Send the text in g_websocket_text, formatted with snprintf() into
+  WEBSOCKET_FRAME_SIZE bytes, to /client/ or WEBSOCKET_ALL
+*/
+void sendWebSocketFrame(int16_t client, int written)
+{
+  if (written <= 0)
+  {
+    return;
+  }
+  size_t length = written < WEBSOCKET_FRAME_SIZE ? written : WEBSOCKET_FRAME_SIZE - 1;
+  // true: the header goes in the room in front, so it's one write per client
+  if (WEBSOCKET_ALL == client)
+  {
+    g_websocket.broadcastTXT((uint8_t*)g_websocket_frame, length, true);
+  } else {
+    g_websocket.sendTXT((uint8_t)client, (uint8_t*)g_websocket_frame, length, true);
+  }
+}
+
+void webSocketEvent(uint8_t client, WStype_t type, uint8_t* payload, size_t length)
+{
+  switch (type)
+  {
+    case WStype_CONNECTED:
+      g_websocket_clients = g_websocket.connectedClients();
+      LOG_INFO(LOG_WEBSOCKET_CONNECTED, client, g_websocket_clients);
+      break;
+
+    case WStype_DISCONNECTED:
+      g_websocket_clients = g_websocket.connectedClients();
+      LOG_INFO(LOG_WEBSOCKET_CLOSED, client, g_websocket_clients);
+      break;
+
+    case WStype_TEXT:
+      if (length > MQTT_BUFFER_SIZE)
+      {
+        sendWebSocketFrame(client, snprintf(g_websocket_text, WEBSOCKET_FRAME_SIZE,
+                                            "RESULT Batch longer than %u bytes, not run", MQTT_BUFFER_SIZE));
+        break;
+      }
+      runCommandBatch(payload, length);
+      sendWebSocketFrame(client, snprintf(g_websocket_text, WEBSOCKET_FRAME_SIZE, "RESULT %s",
+                                          g_mqtt_result_buffer));
+      break;
+
+    default:
+      // Binary, fragments and pings aren't used
+      break;
+  }
+}
+#endif
+
+/**
+  Send a message published to MQTT to every client, named after the last
+  part of its topic
+*/
+void publishWebSocket(const char* topic, const char* payload)
+{
+#if ENABLE_WEBSOCKET
+  if (0 == g_websocket_clients)
+  {
+    return;
+  }
+  const char* kind = strrchr(topic, '/');
+  kind = NULL == kind ? topic : kind + 1;
+  sendWebSocketFrame(WEBSOCKET_ALL, snprintf(g_websocket_text, WEBSOCKET_FRAME_SIZE, "%s %s", kind, payload));
+#endif
+}
+
+/**
+  Tell every client about a state transition. Called before g_state changes.
+*/
+void publishWebSocketState(uint16_t new_state)
+{
+#if ENABLE_WEBSOCKET
+  if (0 == g_websocket_clients)
+  {
+    return;
+  }
+  sendWebSocketFrame(WEBSOCKET_ALL, snprintf(g_websocket_text, WEBSOCKET_FRAME_SIZE,
+                                             "STATE %u from=%u boards=%u at=%lu", new_state, g_state,
+                                             g_board_count, (unsigned long)millis()));
+#endif
+}
+
+/**
+  Start the server once WiFi is up, then handle clients. Call once per pass
+  of loop().
+*/
+void serviceWebSocket()
+{
+#if ENABLE_WEBSOCKET
+  if (!g_websocket_started)
+  {
+    if (!g_wifi_connected)
+    {
+      return;
+    }
+    g_websocket.onEvent(webSocketEvent);
+    g_websocket.begin();
+    g_websocket_started = true;
+    LOG_INFO(LOG_WEBSOCKET_STARTED, WEBSOCKET_PORT);
+  }
+  g_websocket.loop();
+#endif
+}
+
+#endif H_WEBSOCKET
@@ -53,6 +53,7 @@
 #include <ESPmDNS.h>                  // For OTA
 #include <WiFiUdp.h>                  // For OTA
 #include <ArduinoOTA.h>               // For OTA
+#include <ConveyorCore.h>             // Parser, speed limits and framing shared with the other variants
 
 /*--------------------------- Global Variables ------------------------------*/
 #define  STOP   0
@@ -66,7 +67,7 @@ float    g_current_y_position = 0.0;
 uint8_t  g_y_direction        = STOP;  //
 uint16_t g_y_speed            = 0;     // mm/min
 
-#define  MAX_SERIAL_INPUT             50
+#define  MAX_SERIAL_INPUT             96  // Longer serial lines are ignored
 
 // Wifi
 #define  WIFI_CONNECT_INTERVAL       500   // Wait 500ms intervals for wifi connection
@@ -79,6 +80,7 @@ char g_mqtt_tele_topic[50];           // MQTT topic for telemetry
 
 // General
 char g_device_id[23];                 // Unique ID from ESP chip ID
+typedef conveyor_core::Features<ENABLE_WIFI, ENABLE_MQTT> features_t;
 
 /*--------------------------- Function Signatures ---------------------------*/
 
@@ -115,7 +117,6 @@ void setup()
   ledcAttachPin(DRIVER_Y_A_PIN, 0);      // Pin, channel
   ledcAttachPin(DRIVER_Y_B_PIN, 1);      // Pin, channel
 
-  g_input_buffer.reserve(MAX_SERIAL_INPUT);
   yAxisStepper.setSpeed(15);  // RPM. Experiment with setting this higher.
 
   WiFi.mode(WIFI_STA);
@@ -23,8 +23,7 @@ void homeYAxis()
 
 void setRequestedSpeed(uint16_t requested_speed)
 {
-  if ((requested_speed >= MINIMUM_SPEED && requested_speed <= MAXIMUM_SPEED)
-      || 0 == requested_speed)
+  if (conveyor_core::speedAllowed(requested_speed, MINIMUM_SPEED, MAXIMUM_SPEED))
   {
     // Set global speed
     g_y_speed = requested_speed;
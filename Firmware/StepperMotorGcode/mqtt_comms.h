@@ -53,8 +53,19 @@ void callback(char* topic, byte* message, unsigned int length)
   }
   Serial.println();
 
-  g_input_buffer = (char *)message;
-  processGCodeMessage();
+  // Too long to be one command, and running the start of it could do the wrong thing
+  if (length > MAX_SERIAL_INPUT)
+  {
+    Serial.println("TOO_LONG: command ignored");
+    client.publish(g_mqtt_tele_topic, "TOO_LONG: command ignored");
+    return;
+  }
+
+  // The payload isn't NUL-terminated
+  char line[MAX_SERIAL_INPUT + 1];
+  memcpy(line, message, length);
+  line[length] = '\0';
+  processGCodeMessage(line);
 }
 
 #endif H_MQTT_COMMS
@@ -2,8 +2,10 @@
 #define H_SERIAL_COMMS
 
 /*
-
+  G-code from the USB serial console, one command per line
 */
+conveyor_core::LineFramer<MAX_SERIAL_INPUT> g_serial_framer;
+
 void listenToSerialStream()
 {
   while (Serial.available())
@@ -16,15 +18,10 @@ void listenToSerialStream()
     Serial.print(receivedChar);
     //#endif
 
-    // Add character to buffer
-    g_input_buffer += receivedChar;
-
-    // If the received character is a newline, processGCodeMessage
-    if (receivedChar == '\n')
+    // Add character to buffer. Complete lines are processed, too long ones dropped
+    if (g_serial_framer.add(receivedChar) && !g_serial_framer.overflowed())
     {
-      processGCodeMessage();
-      //clear buffer
-      g_input_buffer = "";
+      processGCodeMessage(g_serial_framer.line());
     }
   }
 }
@@ -0,0 +1,32 @@
+#ifndef H_CONVEYOR_CORE
+#define H_CONVEYOR_CORE
+
+/*
+  PCB conveyor core
+
+  The parts of the conveyor firmware that don't touch hardware, shared by
+  PCBConveyor, PCBConveyor2 and StepperMotorGcode so a fix only has to be
+  made once:
+
+    features.h      Compile time feature selection (WiFi, MQTT)
+    gcode_words.h   G-code word parser, no heap allocation
+    speed.h         Belt speed limits and speed to PWM mapping
+    line_framer.h   Assembles received characters into command lines, and
+                    splits a batch of lines
+    j1939.h         J1939 identifier packing and unpacking
+
+  Everything is header only, inline or templated, so each sketch only
+  compiles what it calls. Nothing here uses Arduino.h, so the same headers
+  build on the host (see CMakeLists.txt) and in the line simulator.
+
+  Install by copying or linking this directory into the Arduino sketchbook
+  "libraries" folder, or point the sketchbook at Firmware/.
+*/
+
+#include "conveyor_core/features.h"
+#include "conveyor_core/gcode_words.h"
+#include "conveyor_core/speed.h"
+#include "conveyor_core/line_framer.h"
+#include "conveyor_core/j1939.h"
+
+#endif H_CONVEYOR_CORE
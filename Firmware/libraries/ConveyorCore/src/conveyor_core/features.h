@@ -0,0 +1,33 @@
+#ifndef H_CONVEYOR_CORE_FEATURES
+#define H_CONVEYOR_CORE_FEATURES
+
+namespace conveyor_core {
+
+/*
+  The network services a firmware variant has, fixed at compile time.
+  A sketch describes itself once from its config.h:
+
+    typedef conveyor_core::Features<ENABLE_WIFI, ENABLE_MQTT> features_t;
+
+  and tests the members with plain if statements. They're constant
+  expressions, so a disabled branch is dropped by the compiler, but unlike
+  an #if it's still type checked in every variant.
+
+  Hardware that needs its own library headers (the LCD, for one) stays
+  behind #if, since a plain if can't leave out an #include.
+*/
+template <bool Wifi, bool Mqtt>
+struct Features
+{
+  static constexpr bool wifi = Wifi;
+  static constexpr bool mqtt = Mqtt;
+
+  static_assert(!Mqtt || Wifi, "MQTT needs WiFi");
+};
+
+template <bool Wifi, bool Mqtt> constexpr bool Features<Wifi, Mqtt>::wifi;
+template <bool Wifi, bool Mqtt> constexpr bool Features<Wifi, Mqtt>::mqtt;
+
+} // namespace conveyor_core
+
+#endif H_CONVEYOR_CORE_FEATURES
@@ -0,0 +1,160 @@
+#ifndef H_CONVEYOR_CORE_GCODE_WORDS
+#define H_CONVEYOR_CORE_GCODE_WORDS
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace conveyor_core {
+
+/*
+  The words in one line of G-code, eg "M56 S800 P5".
+
+  parse() walks the line once and keeps the value of every letter A to Z,
+  so looking a parameter up afterwards is just an array read. Nothing is
+  copied or allocated, and it doesn't matter whether words are separated by
+  spaces, so "G0Y120" reads the same as "G0 Y120".
+
+    - Only upper case letters are words. Anything else between words is
+      skipped.
+    - A letter with no number after it reads as 0, so "G28 O" has O.
+    - If a letter appears more than once the first one counts.
+    - Text in double quotes, eg a recipe name, isn't read as words. The
+      first quoted string is kept and can be copied out with quoted().
+    - A ';' outside quotes starts a comment, which runs to the end.
+
+  Numbers are read as [-+]digits[.digits]. There are no exponents or hex,
+  so the letters E and X can follow a number without being swallowed.
+*/
+class GCodeWords
+{
+  public:
+    GCodeWords() : m_present(0), m_quoted(NULL), m_quoted_length(0) {}
+
+    /**
+      Read the words in /line/, which must stay valid while quoted() is used
+    */
+    void parse(const char* line)
+    {
+      m_present       = 0;
+      m_quoted        = NULL;
+      m_quoted_length = 0;
+
+      const char* position = line;
+      while ('\0' != *position && ';' != *position)
+      {
+        char c = *position;
+        if ('"' == c)
+        {
+          const char* start = ++position;
+          while ('\0' != *position && '"' != *position)
+          {
+            position++;
+          }
+          if (NULL == m_quoted)
+          {
+            m_quoted        = start;
+            m_quoted_length = position - start;
+          }
+          if ('"' == *position)
+          {
+            position++;
+          }
+        } else if (c >= 'A' && c <= 'Z') {
+          float value = readNumber(++position);
+          uint8_t index = c - 'A';
+          if (0 == (m_present & (1UL << index)))
+          {
+            m_present       |= 1UL << index;
+            m_values[index]  = value;
+          }
+        } else {
+          position++;
+        }
+      }
+    }
+
+    /**
+      @return true if /letter/ was in the line
+    */
+    bool has(char letter) const
+    {
+      return letter >= 'A' && letter <= 'Z' && 0 != (m_present & (1UL << (letter - 'A')));
+    }
+
+    /**
+      @return the number after /letter/, or /default_value/ if it wasn't in the line
+    */
+    float value(char letter, float default_value) const
+    {
+      return has(letter) ? m_values[letter - 'A'] : default_value;
+    }
+
+    /**
+      Copy the quoted string into /buffer/, cut short to fit if needed.
+      @return false if the line didn't have one
+    */
+    bool quoted(char* buffer, size_t size) const
+    {
+      if (0 == size)
+      {
+        return NULL != m_quoted;
+      }
+      size_t length = m_quoted_length < size - 1 ? m_quoted_length : size - 1;
+      for (size_t i = 0; i < length; i++)
+      {
+        buffer[i] = m_quoted[i];
+      }
+      buffer[length] = '\0';
+      return NULL != m_quoted;
+    }
+
+    /**
+      @return true if the line had no words at all
+    */
+    bool empty() const
+    {
+      return 0 == m_present;
+    }
+
+  private:
+    /**
+      Read a number starting at /position/ and leave /position/ after it
+    */
+    static float readNumber(const char* &position)
+    {
+      bool negative = false;
+      if ('-' == *position || '+' == *position)
+      {
+        negative = '-' == *position;
+        position++;
+      }
+
+      float value = 0;
+      while (*position >= '0' && *position <= '9')
+      {
+        value = value * 10 + (*position - '0');
+        position++;
+      }
+      if ('.' == *position)
+      {
+        position++;
+        float scale = 0.1f;
+        while (*position >= '0' && *position <= '9')
+        {
+          value += (*position - '0') * scale;
+          scale *= 0.1f;
+          position++;
+        }
+      }
+      return negative ? -value : value;
+    }
+
+    uint32_t    m_present;                      // Bit n set if letter 'A' + n was seen
+    float       m_values[26];
+    const char* m_quoted;
+    size_t      m_quoted_length;
+};
+
+} // namespace conveyor_core
+
+#endif H_CONVEYOR_CORE_GCODE_WORDS
@@ -0,0 +1,49 @@
+#ifndef H_CONVEYOR_CORE_J1939
+#define H_CONVEYOR_CORE_J1939
+
+#include <stdint.h>
+
+namespace conveyor_core {
+
+/*
+  J1939 29 bit identifiers:
+
+    bits 26-28  priority
+    bit  24     data page
+    bits 16-23  PDU format (PF)
+    bits 8-15   PDU specific (PS): destination address if PF < 240, else
+                group extension
+    bits 0-7    source address
+*/
+
+/**
+  @return true if /pgn/ is PDU1, ie peer-to-peer with a destination address
+*/
+constexpr bool j1939PeerToPeer(uint32_t pgn)
+{
+  return ((pgn >> 8) & 0xFF) < 240;
+}
+
+/**
+  Build a 29 bit J1939 identifier
+*/
+constexpr uint32_t j1939Id(uint8_t priority, uint32_t pgn, uint8_t destination_address, uint8_t source_address)
+{
+  return ((uint32_t)(priority & 0x07) << 26)
+         | (j1939PeerToPeer(pgn) ? ((pgn & 0x3FF00) << 8) | ((uint32_t)destination_address << 8)
+                                 : (pgn & 0x3FFFF) << 8)
+         | source_address;
+}
+
+constexpr uint8_t j1939DataPage(uint32_t id)           { return (id >> 24) & 0x01; }
+constexpr uint8_t j1939PduFormat(uint32_t id)          { return (id >> 16) & 0xFF; }
+constexpr uint8_t j1939PduSpecific(uint32_t id)        { return (id >> 8) & 0xFF; }
+constexpr uint8_t j1939SourceAddress(uint32_t id)      { return id & 0xFF; }
+
+static_assert(j1939Id(6, 0xEF00, 0x21, 0x20) == 0x18EF2120, "j1939Id PDU1");
+static_assert(j1939Id(6, 0xFF10, 0x21, 0x20) == 0x18FF1020, "j1939Id PDU2");
+static_assert(j1939Id(6, 0x1EF00, 0x21, 0x20) == 0x19EF2120, "j1939Id data page");
+
+} // namespace conveyor_core
+
+#endif H_CONVEYOR_CORE_J1939
@@ -0,0 +1,138 @@
+#ifndef H_CONVEYOR_CORE_LINE_FRAMER
+#define H_CONVEYOR_CORE_LINE_FRAMER
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace conveyor_core {
+
+/*
+  Builds command lines from a stream of characters, eg a serial port, in a
+  fixed buffer of Capacity characters.
+
+    while (Serial.available())
+    {
+      if (framer.add(Serial.read()))
+      {
+        run(framer.line());
+      }
+    }
+
+  A line ends at '\n'. '\r' is dropped, so CR LF line endings work too. A
+  line longer than Capacity is cut short and overflowed() says so, and the
+  rest of it up to the newline is thrown away rather than being run as a
+  command of its own.
+*/
+template <size_t Capacity>
+class LineFramer
+{
+  public:
+    LineFramer() : m_length(0), m_overflowed(false), m_complete(false)
+    {
+      m_buffer[0] = '\0';
+    }
+
+    /**
+      Add one received character.
+      @return true if it finished a line, which line() then holds until the next add()
+    */
+    bool add(char c)
+    {
+      if (m_complete)
+      {
+        m_length     = 0;
+        m_overflowed = false;
+        m_complete   = false;
+      }
+
+      if ('\n' == c)
+      {
+        m_buffer[m_length] = '\0';
+        m_complete = true;
+        return true;
+      }
+      if ('\r' == c)
+      {
+        return false;
+      }
+      if (m_length < Capacity)
+      {
+        m_buffer[m_length++] = c;
+      } else {
+        m_overflowed = true;
+      }
+      return false;
+    }
+
+    /**
+      @return the last complete line, without its newline
+    */
+    const char* line() const
+    {
+      return m_buffer;
+    }
+
+    size_t length() const
+    {
+      return m_length;
+    }
+
+    /**
+      @return true if the last line was longer than Capacity and got cut short
+    */
+    bool overflowed() const
+    {
+      return m_overflowed;
+    }
+
+  private:
+    char   m_buffer[Capacity + 1];
+    size_t m_length;
+    bool   m_overflowed;
+    bool   m_complete;
+};
+
+/**
+  Call /handler/(char* line) for each line in /buffer/, which holds /length/
+  characters followed by a NUL and is changed in place. Lines end at '\n'
+  or a stray NUL, so a NUL can't hide the lines after it. Leading white
+  space is skipped, and blank lines and ';' comment lines are left out.
+  @return the number of lines passed to /handler/
+*/
+template <typename Handler>
+uint16_t forEachLine(char* buffer, size_t length, Handler handler)
+{
+  uint16_t line_count = 0;
+  size_t   line_start = 0;
+  while (line_start < length)
+  {
+    size_t line_end = line_start;
+    while (line_end < length && '\n' != buffer[line_end] && '\0' != buffer[line_end])
+    {
+      line_end++;
+    }
+    if (line_end < length)
+    {
+      buffer[line_end] = '\0';
+    }
+    char* line = &buffer[line_start];
+    line_start = line_end + 1;
+
+    while (' ' == *line || '\t' == *line || '\r' == *line)
+    {
+      line++;
+    }
+    if ('\0' == *line || ';' == *line)
+    {
+      continue;
+    }
+
+    line_count++;
+    handler(line);
+  }
+  return line_count;
+}
+
+} // namespace conveyor_core
+
+#endif H_CONVEYOR_CORE_LINE_FRAMER
@@ -0,0 +1,45 @@
+#ifndef H_CONVEYOR_CORE_SPEED
+#define H_CONVEYOR_CORE_SPEED
+
+#include <stdint.h>
+
+namespace conveyor_core {
+
+/**
+  @return true if /speed/ mm/min can be requested. 0 (stopped) always can.
+*/
+constexpr bool speedAllowed(uint16_t speed, uint16_t minimum_speed, uint16_t maximum_speed)
+{
+  return 0 == speed || (speed >= minimum_speed && speed <= maximum_speed);
+}
+
+/**
+  Keep /value/ between /low/ and /high/, the same way Arduino's constrain() does
+*/
+constexpr int32_t constrainValue(int32_t value, int32_t low, int32_t high)
+{
+  return value < low ? low : (value > high ? high : value);
+}
+
+/**
+  Motor PWM duty for a belt speed. Linear between (/minimum_speed/, /pwm_at_min/)
+  and (/maximum_speed/, /pwm_at_max/), the same as Arduino's map(), then held
+  to that range. Integer only, and a constant expression when the arguments are.
+*/
+constexpr int32_t speedToPwm(int32_t speed, int32_t minimum_speed, int32_t maximum_speed,
+                             int32_t pwm_at_min, int32_t pwm_at_max)
+{
+  return maximum_speed == minimum_speed
+         ? pwm_at_min
+         : constrainValue((speed - minimum_speed) * (pwm_at_max - pwm_at_min) / (maximum_speed - minimum_speed) + pwm_at_min,
+                          pwm_at_min, pwm_at_max);
+}
+
+static_assert(speedToPwm(600, 600, 2200, 100, 255) == 100, "speedToPwm minimum");
+static_assert(speedToPwm(2200, 600, 2200, 100, 255) == 255, "speedToPwm maximum");
+static_assert(speedToPwm(5000, 600, 2200, 100, 255) == 255, "speedToPwm above maximum");
+static_assert(speedAllowed(0, 600, 2200) && !speedAllowed(500, 600, 2200), "speedAllowed");
+
+} // namespace conveyor_core
+
+#endif H_CONVEYOR_CORE_SPEED
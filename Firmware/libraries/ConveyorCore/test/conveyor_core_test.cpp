@@ -0,0 +1,202 @@
+/*
+  Host tests for the conveyor core parser and line framer. Built and run
+  by CMakeLists.txt when this library is built on its own:
+
+    cmake -S Firmware/libraries/ConveyorCore -B build
+    cmake --build build && ctest --test-dir build
+
+  Exits with the number of failed checks.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <ConveyorCore.h>
+
+using conveyor_core::GCodeWords;
+using conveyor_core::LineFramer;
+
+static int s_failures = 0;
+
+#define CHECK(condition)                                                       \
+  do                                                                           \
+  {                                                                            \
+    if (!(condition))                                                          \
+    {                                                                          \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition);  \
+      s_failures++;                                                            \
+    }                                                                          \
+  } while (0)
+
+/**
+  Feed /text/ to /framer/ and copy out each line it finishes
+  @return the number of lines finished
+*/
+template <size_t Capacity>
+static int feed(LineFramer<Capacity> &framer, const char* text, char lines[][128], bool* overflowed = NULL)
+{
+  int count = 0;
+  for (const char* c = text; '\0' != *c; c++)
+  {
+    if (framer.add(*c))
+    {
+      strncpy(lines[count], framer.line(), 127);
+      lines[count][127] = '\0';
+      if (NULL != overflowed)
+      {
+        overflowed[count] = framer.overflowed();
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+static void testWords()
+{
+  GCodeWords words;
+
+  words.parse("M56 S800 P5");
+  CHECK(words.has('M') && 56 == words.value('M', 0));
+  CHECK(800 == words.value('S', 0));
+  CHECK(5 == words.value('P', 0));
+  CHECK(!words.has('X'));
+  CHECK(-1 == words.value('X', -1));
+
+  // Compressed words and a number straight before a letter
+  words.parse("G0Y120.5X-3");
+  CHECK(0 == words.value('G', -1));
+  CHECK(120.5f == words.value('Y', 0));
+  CHECK(-3 == words.value('X', 0));
+
+  // A letter with no number reads as 0
+  words.parse("G28 O");
+  CHECK(words.has('O') && 0 == words.value('O', -1));
+}
+
+static void testFirstWins()
+{
+  GCodeWords words;
+  words.parse("M60 S100 S200");
+  CHECK(100 == words.value('S', 0));
+
+  words.parse("G0 Y10 G1 Y20");
+  CHECK(0 == words.value('G', -1));
+  CHECK(10 == words.value('Y', 0));
+}
+
+static void testLowercase()
+{
+  GCodeWords words;
+
+  // Only upper case letters are words
+  words.parse("m56 s800");
+  CHECK(words.empty());
+  CHECK(!words.has('M') && !words.has('S'));
+  CHECK(!words.has('m'));
+
+  words.parse("M56 s800 P5");
+  CHECK(56 == words.value('M', 0));
+  CHECK(!words.has('S'));
+  CHECK(5 == words.value('P', 0));
+}
+
+static void testQuoted()
+{
+  GCodeWords words;
+  char name[16];
+
+  // Letters, numbers and ';' inside quotes aren't words or a comment
+  words.parse("M520 P3 \"Big;Board X9\" S2");
+  CHECK(3 == words.value('P', 0));
+  CHECK(2 == words.value('S', 0));
+  CHECK(!words.has('B') && !words.has('X'));
+  CHECK(words.quoted(name, sizeof(name)));
+  CHECK(0 == strcmp("Big;Board X9", name));
+
+  // Only the first quoted string is kept, cut short to fit
+  words.parse("M520 \"A long recipe name\" \"Second\"");
+  CHECK(words.quoted(name, 7));
+  CHECK(0 == strcmp("A long", name));
+
+  // An unterminated quote runs to the end of the line
+  words.parse("M520 P1 \"Open S5");
+  CHECK(!words.has('S'));
+  CHECK(words.quoted(name, sizeof(name)));
+  CHECK(0 == strcmp("Open S5", name));
+
+  words.parse("M520 P1 ; \"comment\"");
+  CHECK(!words.quoted(name, sizeof(name)));
+}
+
+static void testOverlongLine()
+{
+  LineFramer<8> framer;
+  char lines[4][128];
+  bool overflowed[4];
+
+  // The rest of a long line is dropped, not run as a line of its own
+  int count = feed(framer, "M56 S800 P5\nM57\n", lines, overflowed);
+  CHECK(2 == count);
+  CHECK(overflowed[0]);
+  CHECK(0 == strcmp("M56 S800", lines[0]));
+  CHECK(!overflowed[1]);
+  CHECK(0 == strcmp("M57", lines[1]));
+
+  // Exactly Capacity characters still fits
+  count = feed(framer, "G0 Y1234\n", lines, overflowed);
+  CHECK(1 == count);
+  CHECK(!overflowed[0]);
+  CHECK(0 == strcmp("G0 Y1234", lines[0]));
+}
+
+static void testLineEndingSplit()
+{
+  LineFramer<96> framer;
+  char lines[4][128];
+
+  // CR at the end of one read and LF at the start of the next make one line end
+  int count = feed(framer, "M56 S8", lines);
+  CHECK(0 == count);
+  count = feed(framer, "00\r", lines);
+  CHECK(0 == count);
+  count = feed(framer, "\nM57\r", lines);
+  CHECK(1 == count);
+  CHECK(0 == strcmp("M56 S800", lines[0]));
+  count = feed(framer, "\n", lines);
+  CHECK(1 == count);
+  CHECK(0 == strcmp("M57", lines[0]));
+}
+
+static void testForEachLine()
+{
+  char batch[] = "M56\r\n  ; comment\n\nG0 Y100\nM57";
+  char lines[4][128];
+  int  count = 0;
+
+  uint16_t run = conveyor_core::forEachLine(batch, strlen(batch), [&](char* line)
+  {
+    strncpy(lines[count], line, 127);
+    lines[count][127] = '\0';
+    count++;
+  });
+  CHECK(3 == run && 3 == count);
+  CHECK(0 == strncmp("M56", lines[0], 3));
+  CHECK(0 == strcmp("G0 Y100", lines[1]));
+  CHECK(0 == strcmp("M57", lines[2]));
+}
+
+int main()
+{
+  testWords();
+  testFirstWins();
+  testLowercase();
+  testQuoted();
+  testOverlongLine();
+  testLineEndingSplit();
+  testForEachLine();
+
+  if (0 == s_failures)
+  {
+    printf("All conveyor core tests passed\n");
+  }
+  return s_failures;
+}